@@ -23,11 +23,20 @@ const char *usage_opt =
 	"Options:\n"
 	"    -h --help            Display this message\n"
 	"    -b --block-size SIZE Set the block size of the filesystem in bytes.\n"
-	"                         If omitted, '4096' is assumed.\n"
+	"                         If omitted, '4096' is assumed; at most 65536.\n"
+	"    -e --extents         Describe files with extents (runs of contiguous\n"
+	"                         blocks) instead of chains of data blocks.\n"
+	"    -i --bytes-per-inode SIZE\n"
+	"                         Make one inode for every SIZE bytes of the\n"
+	"                         filesystem, suffixed like --fs-size. If\n"
+	"                         omitted, the block size is assumed; at least that.\n"
+	"    -p --populate DIR    Copy the files and directories under DIR into\n"
+	"                         the new filesystem's root directory.\n"
 	"    -s --fs-size SIZE    Set the size of the filesystem.\n"
-	"                         If SIZE is suffixed by 'k', 'm', or 'g' (either\n"
+	"                         If SIZE is suffixed by 'k', 'm', 'g', or 't' (either\n"
 	"                         upper-case or lower-case), then it is interpreted in\n"
-	"                         kibibytes, mebibytes, or gibibytes, respectively.\n"
+	"                         kibibytes, mebibytes, gibibytes, or tebibytes,\n"
+	"                         respectively.\n"
 	"                         If omitted, and FILE exists, then FILE's size is used.\n"
 	"                         Otherwise, '1G' is assumed.";
 
@@ -52,6 +61,9 @@ enum flag_opt {
 	_NONE,
 	HELP,
 	BLK_SIZE,
+	EXTENTS,
+	BYTES_PER_INODE,
+	POPULATE,
 	FS_SIZE,
 };
 
@@ -64,6 +76,13 @@ enum flag_opt parse_opt(char *arg)
 		return HELP;
 	} else if (strcmp(arg, "-b") == 0 || strcmp(arg, "--block-size") == 0) {
 		return BLK_SIZE;
+	} else if (strcmp(arg, "-e") == 0 || strcmp(arg, "--extents") == 0) {
+		return EXTENTS;
+	} else if (strcmp(arg, "-i") == 0
+		   || strcmp(arg, "--bytes-per-inode") == 0) {
+		return BYTES_PER_INODE;
+	} else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--populate") == 0) {
+		return POPULATE;
 	} else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--fs-size") == 0) {
 		return FS_SIZE;
 	}
@@ -78,6 +97,8 @@ usize parse_size(char *size_arg)
 	// Falls through to multiply the ending bytes nicely
 	usize multiplier = 1;
 	switch (tolower(last)) {
+	case 't':
+		multiplier *= 1024;
 	case 'g':
 		multiplier *= 1024;
 	case 'm':
@@ -86,12 +107,13 @@ usize parse_size(char *size_arg)
 		multiplier *= 1024;
 	default:;
 		// Remove the last character if it was a unit
-		char digits[size_arg_len];
+		char digits[size_arg_len + 1];
 		usize num_digits = isalpha(last)
 			? size_arg_len - 1
 			: size_arg_len;
 		// TODO: kinda dumb, should err handle strtol
 		memcpy(digits, size_arg, num_digits);
+		digits[num_digits] = '\0';
 		for (int i = 0; i < num_digits; ++i) {
 			assert(isdigit(digits[i]));
 		}
@@ -109,6 +131,10 @@ int main(int argc, char *argv[])
 	bool fs_size_spec = false;
 	usize blk_size = DEFAULT_BLK_SIZE;
 	char *fs_size = DEFAULT_FS_SIZE;
+	// Defaults to the block size once that is known
+	usize bytes_per_inode = 0;
+	usize features = 0;
+	char *populate_dir = NULL;
 
 	// Parse OPTIONS
 	for (int i = 1; i < argc - 1; ++i) {
@@ -121,6 +147,8 @@ int main(int argc, char *argv[])
 			exit_invalid_args(argv[0], err_msg);
 		} else if (flag_opt == HELP) {
 			exit_print_usage(argv[0], 0);
+		} else if (flag_opt == EXTENTS) {
+			features |= FEATURE_EXTENTS;
 		} else {
 			i += 1;
 			assert(i < argc - 1);
@@ -128,6 +156,12 @@ int main(int argc, char *argv[])
 			case BLK_SIZE:
 				blk_size = strtol(argv[i], NULL, 10);
 				break;
+			case BYTES_PER_INODE:
+				bytes_per_inode = parse_size(argv[i]);
+				break;
+			case POPULATE:
+				populate_dir = argv[i];
+				break;
 			case FS_SIZE:
 				fs_size_spec = true;
 				fs_size = argv[i];
@@ -138,16 +172,34 @@ int main(int argc, char *argv[])
 		}
 	}
 	char *filename = argv[argc - 1];
+	if (blk_size == 0 || blk_size > MAX_BLK_SIZE) {
+		char err_msg[MAX_ARG_LEN];
+		sprintf(err_msg, "Invalid block size: %lu, must be 1 to %d",
+			blk_size, MAX_BLK_SIZE);
+		exit_invalid_args(argv[0], err_msg);
+	}
+	if (bytes_per_inode == 0) {
+		bytes_per_inode = blk_size;
+	} else if (bytes_per_inode < blk_size) {
+		char err_msg[MAX_ARG_LEN];
+		sprintf(err_msg,
+			"Invalid bytes per inode: %lu, must be at least the "
+			"block size (%lu)",
+			bytes_per_inode, blk_size);
+		exit_invalid_args(argv[0], err_msg);
+	}
 
 	u8 ret = 0;
 	if (fexists(filename) && !fs_size_spec) {
 		// Reformat the file, using its current size
-		ret = fs_format(filename, blk_size);
+		ret = fs_format(filename, blk_size, bytes_per_inode, features,
+				populate_dir);
 	} else {
 		usize fs_size_in_bytes = parse_size(fs_size);
 
 		// Create / overwrite the file
-		ret = fs_init(filename, fs_size_in_bytes, blk_size);
+		ret = fs_init(filename, fs_size_in_bytes, blk_size,
+			      bytes_per_inode, features, populate_dir);
 	}
 
 	return ret;
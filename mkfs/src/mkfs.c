@@ -1,19 +1,90 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <tberry/err.h>
 #include <tberry/futils.h>
 #include <tberry/types.h>
 #include <tberry/debug.h>
 
 #include "mkfs.h"
 
-#define INODE_SIZE 4
+// A `struct _inode` and room for a size and a few extents in later versions
+#define INODE_SIZE 32
+// Directory records hold `u32` inode nums
+#define MAX_NUM_INODES UINT32_MAX
 
 #define SUPER_BLK_OFFSET 0
 #define INODE_TBL_OFFSET 1
 
-// Flags `dir`, `read`, `write`, and `data_blk` 0
-#define ROOT_INODE_VAL 0x80600000
+#define NEXT_AVL_INODE_OFFSET (5 * sizeof(usize))
+
+// Images made before the super block had a magic number are version 1
+#define SUPER_MAGIC 0x5254465353555052
+#define FS_VERSION 5
+
+// The journal gets 1/64th of the disk, within these bounds
+#define JOURNAL_FRACTION 64
+#define MIN_JOURNAL_BLKS 8
+#define MAX_JOURNAL_BLKS 1024
+
+// But always room for two calls that each change every bitmap and refcount
+// block, the super block and this many more blocks of metadata, as in `fs.c`,
+// unless that takes more than a quarter of the disk
+#define OP_META_BLKS 128
+#define MAX_JOURNAL_SHARE 4
+// Each transaction also takes a commit block, and a descriptor of `usize
+// magic`, `usize seq`, `usize num_blks` and a `usize` per block
+#define JOURNAL_DESC_HDR_LEN 3
+
+// Flags of `struct _inode`
+#define INODE_DIR 0x80000000
+#define INODE_READ 0x00400000
+#define INODE_WRITE 0x00200000
+
+// A directory block holds a `usize` next ptr, its `u16` free length and `u16`
+// hash buckets, one per 32 bytes of block, then its records; offsets into it
+// are `u16`s
+#define DIR_BLK_FREE_LEN_OFFSET sizeof(usize)
+#define DIR_BLK_BUCKETS_OFFSET (DIR_BLK_FREE_LEN_OFFSET + sizeof(u16))
+#define DIR_BLK_BUCKET_SPAN 32
+#define NULL_REC 0
+
+// A directory of more than one block starts with index blocks: a mark where
+// the free length would be, the `u16` number of entries, then entries of a
+// `u32` hash and the `usize` block holding the names hashed from there on
+#define DIR_IDX_MARK 0xffff
+#define DIR_IDX_LEN_OFFSET (DIR_BLK_FREE_LEN_OFFSET + sizeof(u16))
+#define DIR_IDX_ENTRIES_OFFSET (DIR_IDX_LEN_OFFSET + sizeof(u16))
+#define DIR_IDX_ENTRY_LEN (sizeof(u32) + sizeof(usize))
+
+// A record is a `struct _dir_rec`, then the name (with no '\0'), then the
+// bytes of a regular file kept inline
+#define DIR_REC_HDR_LEN (sizeof(u32) + 2 * sizeof(u16) + 2 * sizeof(u8))
+#define MAX_FILENAME_LEN 255
+#define MAX_INLINE_LEN 255
+
+// Chained blocks start with the `usize` number of the next one, 0 for none
+#define DATA_BLK_NEXT_BLK_NUM_LEN sizeof(usize)
+
+// An extent block is `usize size`, `usize num_extents`, then the extents
+#define EXT_BLK_TBL_OFFSET (2 * sizeof(usize))
+
+// Files are copied in by this many threads at most, each moving this many bytes
+// at a time
+#define MAX_POPULATE_THREADS 16
+#define POPULATE_CHUNK_LEN (1 << 20)
+
+// With extents, data block 0 is the root's extent block, mapping its one
+// directory block
+#define ROOT_EXT_BLK_NUM 0
+#define ROOT_DIR_EXT_BLK_NUM 1
 
 /*
  * Essentially gets written to the super block
@@ -24,34 +95,200 @@ struct _layout {
 	usize num_blks;
 	usize num_inode_blks;
 	usize num_data_blks;
+	usize features;
+	usize num_inode_bitmap_blks;
+	usize num_blk_bitmap_blks;
+	usize num_journal_blks;
+	usize inode_size;
+	usize num_refcount_blks;
+};
+
+/*
+ * An inode, as laid out at the start of each inode table entry
+ */
+struct _inode {
+	// `INODE_*` bits, and an 8 bit owner from bit 23
+	u32 flags;
+	u32 reserved;
+	usize data_ptr;
+};
+
+/*
+ * The fixed part of a directory record, as laid out on disk
+ */
+struct _dir_rec {
+	u32 inode_num;
+	// Bytes from the record to the next one, including whatever it leaves
+	// unused at its end
+	u16 rec_len;
+	// The next record in the same bucket
+	u16 next;
+	u8 name_len;
+	u8 inline_len;
 };
 
-struct _layout calc_layout(usize disk_size, usize blk_size)
+/*
+ * A file or directory of the host tree copied in by `--populate`. Its inode
+ * num is its index in `struct _populate.nodes`.
+ */
+struct _pop_node {
+	char *host_path;
+	char *name;
+	bool is_dir;
+	bool read;
+	bool write;
+	usize size;
+	// A directory's children are the @num_children nodes from @first_child
+	usize first_child;
+	usize num_children;
+	// The inode data ptr, then the @num_blks contiguous blocks of contents;
+	// with extents, @data_ptr is the extent block just before them
+	usize data_ptr;
+	usize first_blk;
+	usize num_blks;
+};
+
+struct _populate {
+	int fd;
+	struct _layout layout;
+	struct _pop_node *nodes;
+	usize num_nodes;
+	usize nodes_cap;
+	// Data blocks taken, all of them from block 0 on
+	usize num_blks;
+	// The copy threads take the regular files in turn
+	pthread_mutex_t lock;
+	usize next_node;
+	u8 ret;
+};
+
+usize _div_ceil(usize x, usize y)
+{
+	return (x + y - 1) / y;
+}
+
+/*
+ * The bitmaps, the refcount table and then the journal sit between the inode
+ * table and the data blocks
+ */
+usize _inode_bitmap_offset(struct _layout layout)
+{
+	return INODE_TBL_OFFSET + layout.num_inode_blks;
+}
+
+usize _blk_bitmap_offset(struct _layout layout)
+{
+	return _inode_bitmap_offset(layout) + layout.num_inode_bitmap_blks;
+}
+
+usize _refcount_offset(struct _layout layout)
+{
+	return _blk_bitmap_offset(layout) + layout.num_blk_bitmap_blks;
+}
+
+usize _journal_offset(struct _layout layout)
+{
+	return _refcount_offset(layout) + layout.num_refcount_blks;
+}
+
+usize _data_blks_offset(struct _layout layout)
+{
+	return _journal_offset(layout) + layout.num_journal_blks;
+}
+
+/*
+ * Gives the image one inode per @bytes_per_inode bytes of disk, which is at
+ * least @blk_size
+ */
+struct _layout calc_layout(usize disk_size, usize blk_size,
+			   usize bytes_per_inode, usize features)
 {
 	usize inodes_per_blk = blk_size / INODE_SIZE;
-	usize data_blks_per_inode_blk = inodes_per_blk;
 
 	usize num_blks = disk_size / blk_size;
 	// Subtract one for the super block
 	usize num_usable_blks = num_blks - 1;
+
+	usize num_journal_blks = num_blks / JOURNAL_FRACTION;
+	if (num_journal_blks < MIN_JOURNAL_BLKS) {
+		num_journal_blks = MIN_JOURNAL_BLKS;
+	}
+	if (num_journal_blks > MAX_JOURNAL_BLKS) {
+		num_journal_blks = MAX_JOURNAL_BLKS;
+	}
+	num_usable_blks -= num_journal_blks;
 	usize num_inode_blks =
-		1 + (num_usable_blks / (1 + data_blks_per_inode_blk));
-	usize num_data_blks = num_usable_blks - num_inode_blks;
+		_div_ceil(disk_size / bytes_per_inode, inodes_per_blk);
+	if (num_inode_blks == 0) {
+		num_inode_blks = 1;
+	}
+	if (num_inode_blks > MAX_NUM_INODES / inodes_per_blk) {
+		num_inode_blks = MAX_NUM_INODES / inodes_per_blk;
+	}
+
+	// One bit per inode and one bit per data block. The block bitmap is
+	// sized before taking its own blocks out, so it may have spare bits.
+	usize bits_per_blk = blk_size * 8;
+	usize num_inode_bitmap_blks =
+		_div_ceil(num_inode_blks * inodes_per_blk, bits_per_blk);
+	usize num_blk_bitmap_blks = _div_ceil(
+		num_usable_blks - num_inode_blks - num_inode_bitmap_blks,
+		bits_per_blk);
+	// With extents, files can share blocks, each counted by a `u16`. The
+	// table is sized the same way.
+	usize num_refcount_blks = 0;
+	if (features & FEATURE_EXTENTS) {
+		num_refcount_blks = _div_ceil(
+			(num_usable_blks - num_inode_blks
+			 - num_inode_bitmap_blks - num_blk_bitmap_blks)
+				* sizeof(u16),
+			blk_size);
+	}
+
+	usize num_data_blks = num_usable_blks - num_inode_blks
+		- num_inode_bitmap_blks - num_blk_bitmap_blks
+		- num_refcount_blks;
+
+	usize txn_len = 2
+		* (num_inode_bitmap_blks + num_blk_bitmap_blks
+		   + num_refcount_blks + 1 + OP_META_BLKS);
+	usize min_journal_blks = txn_len + 1
+		+ _div_ceil((JOURNAL_DESC_HDR_LEN + txn_len) * sizeof(usize),
+			    blk_size);
+	if (min_journal_blks > num_blks / MAX_JOURNAL_SHARE) {
+		min_journal_blks = num_blks / MAX_JOURNAL_SHARE;
+	}
+	if (num_journal_blks < min_journal_blks) {
+		usize extra = min_journal_blks - num_journal_blks;
+		num_journal_blks += extra;
+		// The bitmaps and the table keep their spare entries
+		num_data_blks = num_data_blks > extra ? num_data_blks - extra
+						      : 0;
+	}
 	struct _layout fs_l = {
 		.disk_size = disk_size,
 		.blk_size = blk_size,
 		.num_blks = num_blks,
 		.num_inode_blks = num_inode_blks,
 		.num_data_blks = num_data_blks,
+		.features = features,
+		.num_inode_bitmap_blks = num_inode_bitmap_blks,
+		.num_blk_bitmap_blks = num_blk_bitmap_blks,
+		.num_journal_blks = num_journal_blks,
+		.inode_size = INODE_SIZE,
+		.num_refcount_blks = num_refcount_blks,
 	};
 	return fs_l;
 }
 
 u8 _write_super_blk(FILE *f, struct _layout layout)
 {
-	// First available is 1 because 0 is reserved for ROOT_DIR
+	// Where the allocators start searching the bitmaps; 0 is reserved for
+	// ROOT_DIR
 	usize next_avl_inode = 1;
-	usize next_avl_blk = 1;
+	usize next_avl_blk = layout.features & FEATURE_EXTENTS
+		? ROOT_DIR_EXT_BLK_NUM + 1
+		: 1;
 
 	DEBUG("Formatting...");
 	DEBUG_VAL("%d", layout.disk_size);
@@ -61,6 +298,12 @@ u8 _write_super_blk(FILE *f, struct _layout layout)
 	DEBUG_VAL("%d", layout.num_data_blks);
 	DEBUG_VAL("%d", next_avl_inode);
 	DEBUG_VAL("%d", next_avl_blk);
+	DEBUG_VAL("%lu", layout.features);
+	DEBUG_VAL("%lu", layout.num_inode_bitmap_blks);
+	DEBUG_VAL("%lu", layout.num_blk_bitmap_blks);
+	DEBUG_VAL("%lu", layout.num_journal_blks);
+	DEBUG_VAL("%lu", layout.inode_size);
+	DEBUG_VAL("%lu", layout.num_refcount_blks);
 
 	usize to_write[] = {
 		layout.disk_size,
@@ -70,59 +313,927 @@ u8 _write_super_blk(FILE *f, struct _layout layout)
 		layout.num_data_blks,
 		next_avl_inode,
 		next_avl_blk,
+		layout.features,
+		layout.num_inode_bitmap_blks,
+		layout.num_blk_bitmap_blks,
+		layout.num_journal_blks,
+		SUPER_MAGIC,
+		FS_VERSION,
+		layout.inode_size,
+		layout.num_refcount_blks,
 	};
 	fseek(f, 0, SEEK_SET);
-	fwrite(&to_write, 8, 7, f);
+	fwrite(&to_write, 8, 15, f);
+
+	return 0;
+}
+
+/*
+ * Zeroes @num_blks blocks starting at @blk_num
+ */
+u8 _zero_blks(FILE *f, usize blk_num, usize num_blks, usize blk_size)
+{
+	// Punching a hole zeroes the range without writing it, once whatever is
+	// still buffered for it has landed
+	fflush(f);
+	if (fallocate(fileno(f), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      blk_num * blk_size, num_blks * blk_size) == 0) {
+		return 0;
+	}
+
+	// Not supported by the file system holding @f
+	u8 *zero_blk = calloc(1, blk_size);
+	fseek(f, blk_num * blk_size, SEEK_SET);
+	for (usize i = 0; i < num_blks; ++i) {
+		fwrite(zero_blk, blk_size, 1, f);
+	}
+	free(zero_blk);
+	return 0;
+}
+
+/*
+ * Clears both bitmaps, then marks the root directory's inode and data blocks as
+ * in use
+ */
+u8 _write_bitmaps(FILE *f, struct _layout layout)
+{
+	usize num_bitmap_blks =
+		layout.num_inode_bitmap_blks + layout.num_blk_bitmap_blks;
+	_zero_blks(f, _inode_bitmap_offset(layout), num_bitmap_blks,
+		   layout.blk_size);
+
+	// Bit 0 is the root inode
+	u8 inode_bits = 0x1;
+	fseek(f, _inode_bitmap_offset(layout) * layout.blk_size, SEEK_SET);
+	fwrite(&inode_bits, 1, 1, f);
+
+	// Bit 0 is the root's directory (or extent) block, bit 1 the directory
+	// block it maps
+	u8 blk_bits = layout.features & FEATURE_EXTENTS ? 0x3 : 0x1;
+	fseek(f, _blk_bitmap_offset(layout) * layout.blk_size, SEEK_SET);
+	fwrite(&blk_bits, 1, 1, f);
+
+	return 0;
+}
+
+/*
+ * Nothing is shared yet, so every block has no owner beyond the first
+ */
+u8 _write_refcounts(FILE *f, struct _layout layout)
+{
+	return _zero_blks(f, _refcount_offset(layout),
+			  layout.num_refcount_blks, layout.blk_size);
+}
+
+/*
+ * An empty journal is all zeros; a stale transaction from a previous format
+ * would otherwise be replayed
+ */
+u8 _write_journal(FILE *f, struct _layout layout)
+{
+	return _zero_blks(f, _journal_offset(layout), layout.num_journal_blks,
+			  layout.blk_size);
+}
+
+/*
+ * Reformatting doesn't truncate the file, so the root directory must be
+ * emptied explicitly. An empty directory block is one free record spanning
+ * everything after the buckets: `u32 inode` 0, `u16 rec_len`, `u16 next` 0,
+ * and zero-length name and inline data. All of it is free.
+ */
+u8 _write_root_dir(FILE *f, struct _layout layout)
+{
+	usize root_dir_blk = layout.features & FEATURE_EXTENTS
+		? ROOT_DIR_EXT_BLK_NUM
+		: 0;
+	usize addr = (_data_blks_offset(layout) + root_dir_blk)
+		* layout.blk_size;
+	u8 ret = _zero_blks(f, _data_blks_offset(layout) + root_dir_blk, 1,
+			    layout.blk_size);
+	if (ret) {
+		return ret;
+	}
+
+	usize recs_offset = DIR_BLK_BUCKETS_OFFSET
+		+ layout.blk_size / DIR_BLK_BUCKET_SPAN * sizeof(u16);
+	u16 rec_len = layout.blk_size - recs_offset;
+	fseek(f, addr + DIR_BLK_FREE_LEN_OFFSET, SEEK_SET);
+	fwrite(&rec_len, sizeof(rec_len), 1, f);
+	fseek(f, addr + recs_offset + sizeof(u32), SEEK_SET);
+	fwrite(&rec_len, sizeof(rec_len), 1, f);
 
 	return 0;
 }
 
+/*
+ * Same as `_new_inode` in rtfs, with owner 0 like the root
+ */
+struct _inode _new_inode(bool is_dir, bool read, bool write, usize data_ptr)
+{
+	struct _inode inode = {
+		.flags = 0,
+		.reserved = 0,
+		.data_ptr = data_ptr,
+	};
+	if (is_dir) {
+		inode.flags |= INODE_DIR;
+	}
+	if (read) {
+		inode.flags |= INODE_READ;
+	}
+	if (write) {
+		inode.flags |= INODE_WRITE;
+	}
+	return inode;
+}
+
 u8 _write_root_inode(FILE *f, usize blk_size)
 {
 	usize addr = INODE_TBL_OFFSET * blk_size;
 	fseek(f, addr, SEEK_SET);
 
-	u32 root_inode = ROOT_INODE_VAL;
+	struct _inode root_inode = _new_inode(true, true, true, 0);
 	fwrite(&root_inode, sizeof(root_inode), 1, f);
 
 	return 0;
 }
 
+/*
+ * Maps the root directory's first (and only) block through its extent block:
+ * `size`, `num_extents`, then the extent {logical 0, phys, len 1}
+ */
+u8 _write_root_extents(FILE *f, struct _layout layout)
+{
+	usize addr = (_data_blks_offset(layout) + ROOT_EXT_BLK_NUM)
+		* layout.blk_size;
+	fseek(f, addr, SEEK_SET);
+
+	usize to_write[] = {
+		layout.blk_size,
+		1,
+		0,
+		ROOT_DIR_EXT_BLK_NUM,
+		1,
+	};
+	fwrite(&to_write, 8, 5, f);
+
+	return 0;
+}
+
+u8 _write_at(int fd, void *buf, usize len, usize offset)
+{
+	return pwrite(fd, buf, len, offset) != (ssize_t) len;
+}
+
+/*
+ * Reads up to @len bytes at @offset of @fd into @buf, stopping early only at
+ * the end of the file. Returns how many were read, or -1 on error.
+ */
+ssize_t _read_full(int fd, u8 *buf, usize len, usize offset)
+{
+	usize num_read = 0;
+	while (num_read < len) {
+		ssize_t n = pread(fd, buf + num_read, len - num_read,
+				  offset + num_read);
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		num_read += n;
+	}
+	return num_read;
+}
+
+/*
+ * 32 bit FNV-1a, as rtfs hashes directory entries
+ */
+u32 _hash_name(char *name)
+{
+	u32 hash = 2166136261u;
+	for (usize i = 0; name[i] != '\0'; ++i) {
+		hash ^= (u8) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+usize _dir_recs_offset(struct _layout layout)
+{
+	return DIR_BLK_BUCKETS_OFFSET
+		+ layout.blk_size / DIR_BLK_BUCKET_SPAN * sizeof(u16);
+}
+
+usize _push_node(struct _populate *p, char *host_path, struct stat *st)
+{
+	if (p->num_nodes == p->nodes_cap) {
+		p->nodes_cap = p->nodes_cap == 0 ? 64 : 2 * p->nodes_cap;
+		p->nodes = realloc(p->nodes,
+				   p->nodes_cap * sizeof(*p->nodes));
+	}
+	struct _pop_node *node = &p->nodes[p->num_nodes];
+	node->host_path = host_path;
+	char *last_delim = strrchr(host_path, '/');
+	node->name = last_delim == NULL ? host_path : last_delim + 1;
+	node->is_dir = S_ISDIR(st->st_mode);
+	node->read = st->st_mode & S_IRUSR;
+	node->write = st->st_mode & S_IWUSR;
+	node->size = node->is_dir ? 0 : st->st_size;
+	node->first_child = 0;
+	node->num_children = 0;
+	p->num_nodes += 1;
+	return p->num_nodes - 1;
+}
+
+/*
+ * Lists the tree under @host_dir breadth first, so that the children of each
+ * directory are next to each other. Anything but regular files and directories
+ * is left out, as are names too long for a directory entry.
+ */
+u8 _scan_tree(struct _populate *p, char *host_dir)
+{
+	struct stat st;
+	if (stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		eprintf("%s: not a directory\n", host_dir);
+		return 1;
+	}
+	_push_node(p, strdup(host_dir), &st);
+
+	for (usize i = 0; i < p->num_nodes; ++i) {
+		if (!p->nodes[i].is_dir) {
+			continue;
+		}
+		char *dir_path = p->nodes[i].host_path;
+		DIR *dir = opendir(dir_path);
+		if (dir == NULL) {
+			eprintf("%s: cannot be read\n", dir_path);
+			return 1;
+		}
+		usize first_child = p->num_nodes;
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL) {
+			if (strcmp(ent->d_name, ".") == 0
+			    || strcmp(ent->d_name, "..") == 0) {
+				continue;
+			}
+			char *path = malloc(strlen(dir_path)
+					    + strlen(ent->d_name) + 2);
+			sprintf(path, "%s/%s", dir_path, ent->d_name);
+			if (strlen(ent->d_name) > MAX_FILENAME_LEN
+			    || lstat(path, &st) != 0
+			    || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+				eprintf("%s: skipped\n", path);
+				free(path);
+				continue;
+			}
+			_push_node(p, path, &st);
+		}
+		closedir(dir);
+		p->nodes[i].first_child = first_child;
+		p->nodes[i].num_children = p->num_nodes - first_child;
+	}
+	return 0;
+}
+
+/*
+ * Whether @node goes in its directory entry, as rtfs keeps small regular files
+ */
+bool _is_inline(struct _layout layout, struct _pop_node *node)
+{
+	return !node->is_dir && node->size <= MAX_INLINE_LEN
+		&& DIR_REC_HDR_LEN + strlen(node->name) + node->size
+			<= layout.blk_size - _dir_recs_offset(layout);
+}
+
+usize _rec_used_len(struct _layout layout, struct _pop_node *node)
+{
+	usize len = DIR_REC_HDR_LEN + strlen(node->name);
+	if (_is_inline(layout, node)) {
+		len += node->size;
+	}
+	return len;
+}
+
+/*
+ * Ends the directory block @blk, whose records reach @end, the last one being
+ * at @last_offset: the last record takes the rest of the block, or, if there
+ * is none, a free record spans all of it
+ */
+void _close_dir_blk(struct _layout layout, u8 *blk, usize last_offset,
+		    usize end)
+{
+	u16 free_len = layout.blk_size - end;
+	struct _dir_rec rec = {0};
+	if (last_offset == NULL_REC) {
+		last_offset = _dir_recs_offset(layout);
+		free_len = layout.blk_size - last_offset;
+	} else {
+		memcpy(&rec, blk + last_offset, DIR_REC_HDR_LEN);
+	}
+	rec.rec_len = layout.blk_size - last_offset;
+	memcpy(blk + last_offset, &rec, DIR_REC_HDR_LEN);
+	memcpy(blk + DIR_BLK_FREE_LEN_OFFSET, &free_len, sizeof(free_len));
+}
+
+/*
+ * A child of a directory being packed, sorted by the hash of its name
+ */
+struct _hashed_child {
+	u32 hash;
+	usize child_num;
+};
+
+int _cmp_hashed_children(const void *a, const void *b)
+{
+	const struct _hashed_child *child_a = a;
+	const struct _hashed_child *child_b = b;
+	if (child_a->hash != child_b->hash) {
+		return (child_a->hash > child_b->hash)
+			- (child_a->hash < child_b->hash);
+	}
+	return (child_a->child_num > child_b->child_num)
+		- (child_a->child_num < child_b->child_num);
+}
+
+/*
+ * Writes the records of the @num_children @children into the directory block
+ * @blk, reading in the inline files
+ */
+void _pack_recs(struct _populate *p, struct _hashed_child *children,
+		usize num_children, u8 *blk)
+{
+	struct _layout layout = p->layout;
+	usize num_buckets = layout.blk_size / DIR_BLK_BUCKET_SPAN;
+	usize offset = _dir_recs_offset(layout);
+	usize last_offset = NULL_REC;
+	for (usize i = 0; i < num_children; ++i) {
+		usize child_num = children[i].child_num;
+		struct _pop_node *child = &p->nodes[child_num];
+		usize len = _rec_used_len(layout, child);
+		usize name_len = strlen(child->name);
+		usize inline_len = _is_inline(layout, child) ? child->size : 0;
+		u16 *bucket = (u16 *) (blk + DIR_BLK_BUCKETS_OFFSET)
+			+ children[i].hash % num_buckets;
+		struct _dir_rec rec = {
+			.inode_num = child_num,
+			.rec_len = len,
+			.next = *bucket,
+			.name_len = name_len,
+			.inline_len = inline_len,
+		};
+		memcpy(blk + offset, &rec, DIR_REC_HDR_LEN);
+		memcpy(blk + offset + DIR_REC_HDR_LEN, child->name, name_len);
+		*bucket = offset;
+		if (inline_len > 0) {
+			// A file that shrank since it was listed keeps zeros at
+			// its end
+			int src = open(child->host_path, O_RDONLY);
+			if (src < 0
+			    || _read_full(src, blk + offset + DIR_REC_HDR_LEN
+						       + name_len,
+					  inline_len, 0) < 0) {
+				eprintf("%s: cannot be read\n",
+					child->host_path);
+				p->ret = 1;
+			}
+			if (src >= 0) {
+				close(src);
+			}
+		}
+		last_offset = offset;
+		offset += len;
+	}
+	_close_dir_blk(layout, blk, last_offset, offset);
+}
+
+/*
+ * Returns how many index blocks index @num_leaves blocks of records, at most
+ * @cap entries to a block, and sets @num_levels to how many levels of them
+ * there are, the first block of the directory being the top one
+ */
+usize _num_idx_blks(usize cap, usize num_leaves, usize *num_levels)
+{
+	*num_levels = 0;
+	if (num_leaves <= 1) {
+		return 0;
+	}
+	usize num_blks = 1;
+	*num_levels = 1;
+	for (usize span = cap; span < num_leaves; span *= cap) {
+		num_blks += _div_ceil(num_leaves, span);
+		*num_levels += 1;
+	}
+	return num_blks;
+}
+
+/*
+ * Writes the @num_levels levels of index blocks at the front of @blks, which
+ * start at data block @first_blk, over the @num_leaves blocks of records after
+ * them, the names of each hashed from its hash in @leaf_hashes on
+ */
+void _write_dir_idx(struct _layout layout, u32 *leaf_hashes,
+		    usize num_leaves, usize num_levels, usize first_blk,
+		    u8 *blks)
+{
+	usize cap = (layout.blk_size - DIR_IDX_ENTRIES_OFFSET)
+		/ DIR_IDX_ENTRY_LEN;
+	// Blocks of records under each block of the level being written
+	usize span = 1;
+	for (usize i = 0; i < num_levels; ++i) {
+		span *= cap;
+	}
+	usize base = 0;
+	usize num_blks = 1;
+	for (usize level = num_levels; level > 0; --level) {
+		usize child_span = span / cap;
+		usize child_base = base + num_blks;
+		usize num_children = _div_ceil(num_leaves, child_span);
+		for (usize i = 0; i < num_blks; ++i) {
+			u8 *blk = blks + (base + i) * layout.blk_size;
+			usize first = i * cap;
+			u16 len = num_children - first < cap
+				? num_children - first
+				: cap;
+			u16 mark = DIR_IDX_MARK;
+			memcpy(blk + DIR_BLK_FREE_LEN_OFFSET, &mark,
+			       sizeof(mark));
+			memcpy(blk + DIR_IDX_LEN_OFFSET, &len, sizeof(len));
+			for (usize j = 0; j < len; ++j) {
+				u8 *entry = blk + DIR_IDX_ENTRIES_OFFSET
+					+ j * DIR_IDX_ENTRY_LEN;
+				usize child = first + j;
+				u32 hash = leaf_hashes[child * child_span];
+				usize blk_num = first_blk + child_base + child;
+				memcpy(entry, &hash, sizeof(hash));
+				memcpy(entry + sizeof(hash), &blk_num,
+				       sizeof(blk_num));
+			}
+		}
+		base = child_base;
+		num_blks = num_children;
+		span = child_span;
+	}
+}
+
+/*
+ * Lays the entries of the directory @dir_num out in blocks as rtfs indexes
+ * them, and returns how many blocks that takes: in hash order, each block of
+ * records taking entries until the next doesn't fit, behind index blocks if
+ * there is more than one. If @blks is not NULL, the blocks are written to it,
+ * with the inline files read in.
+ */
+usize _pack_dir(struct _populate *p, usize dir_num, u8 *blks)
+{
+	struct _layout layout = p->layout;
+	struct _pop_node *dir = &p->nodes[dir_num];
+	usize num_children = dir->num_children;
+	usize recs_offset = _dir_recs_offset(layout);
+
+	struct _hashed_child *children =
+		malloc((num_children + 1) * sizeof(*children));
+	for (usize i = 0; i < num_children; ++i) {
+		usize child_num = dir->first_child + i;
+		children[i].hash = _hash_name(p->nodes[child_num].name);
+		children[i].child_num = child_num;
+	}
+	qsort(children, num_children, sizeof(*children),
+	      _cmp_hashed_children);
+
+	// The child each block of records starts with, and the hash it is
+	// indexed by; the first one takes every hash below the second's
+	usize *leaf_starts = malloc((num_children + 2) * sizeof(*leaf_starts));
+	u32 *leaf_hashes = malloc((num_children + 1) * sizeof(*leaf_hashes));
+	usize num_leaves = 1;
+	leaf_starts[0] = 0;
+	leaf_hashes[0] = 0;
+	usize offset = recs_offset;
+	for (usize i = 0; i < num_children; ++i) {
+		usize len = _rec_used_len(layout,
+					  &p->nodes[children[i].child_num]);
+		if (offset + len > layout.blk_size) {
+			leaf_starts[num_leaves] = i;
+			leaf_hashes[num_leaves] = children[i].hash;
+			num_leaves += 1;
+			offset = recs_offset;
+		}
+		offset += len;
+	}
+	leaf_starts[num_leaves] = num_children;
+
+	usize cap = (layout.blk_size - DIR_IDX_ENTRIES_OFFSET)
+		/ DIR_IDX_ENTRY_LEN;
+	usize num_levels;
+	usize num_idx_blks = _num_idx_blks(cap, num_leaves, &num_levels);
+	if (blks != NULL) {
+		for (usize i = 0; i < num_leaves; ++i) {
+			_pack_recs(p, children + leaf_starts[i],
+				   leaf_starts[i + 1] - leaf_starts[i],
+				   blks + (num_idx_blks + i) * layout.blk_size);
+		}
+		_write_dir_idx(layout, leaf_hashes, num_leaves, num_levels,
+			       dir->first_blk, blks);
+	}
+	free(leaf_hashes);
+	free(leaf_starts);
+	free(children);
+	return num_idx_blks + num_leaves;
+}
+
+/*
+ * Gives every node its blocks, one contiguous run each, handed out in the
+ * order the nodes were listed
+ */
+u8 _plan_blks(struct _populate *p)
+{
+	struct _layout layout = p->layout;
+	bool extents = layout.features & FEATURE_EXTENTS;
+	usize usable_len = extents
+		? layout.blk_size
+		: layout.blk_size - DATA_BLK_NEXT_BLK_NUM_LEN;
+
+	usize next_blk = 0;
+	for (usize i = 0; i < p->num_nodes; ++i) {
+		struct _pop_node *node = &p->nodes[i];
+		if (_is_inline(layout, node)) {
+			// No blocks: the data ptr of a file kept inline is 0
+			node->data_ptr = 0;
+			node->first_blk = 0;
+			node->num_blks = 0;
+			continue;
+		}
+		node->num_blks = node->is_dir
+			? _pack_dir(p, i, NULL)
+			: _div_ceil(node->size, usable_len);
+		node->data_ptr = next_blk;
+		if (extents) {
+			next_blk += 1;
+		}
+		node->first_blk = next_blk;
+		next_blk += node->num_blks;
+	}
+	if (next_blk > layout.num_data_blks) {
+		eprintf("Needs %lu data blocks, but only has %lu\n",
+			next_blk, layout.num_data_blks);
+		return 1;
+	}
+	usize num_inodes =
+		layout.num_inode_blks * (layout.blk_size / INODE_SIZE);
+	if (p->num_nodes > num_inodes) {
+		eprintf("Needs %lu inodes, but only has %lu\n", p->num_nodes,
+			num_inodes);
+		return 1;
+	}
+	p->num_blks = next_blk;
+	return 0;
+}
+
+/*
+ * Writes the extent block of @node, mapping its run of blocks. @size is
+ * the length of the file in bytes.
+ */
+u8 _write_node_extents(struct _populate *p, struct _pop_node *node,
+		       usize size)
+{
+	usize blk_size = p->layout.blk_size;
+	usize to_write[] = {
+		size,
+		1,
+		0,
+		node->first_blk,
+		node->num_blks,
+	};
+	usize addr = (_data_blks_offset(p->layout) + node->data_ptr) * blk_size;
+	return _write_at(p->fd, to_write, sizeof(to_write), addr);
+}
+
+/*
+ * Points each of the @num_blks chained blocks in @blks, the first being data
+ * block @first_blk, at the block after it, unless @ends_chain and it is the
+ * last
+ */
+void _link_blks(u8 *blks, usize blk_size, usize first_blk, usize num_blks,
+		bool ends_chain)
+{
+	for (usize i = 0; i < num_blks; ++i) {
+		usize next_blk_num = ends_chain && i + 1 == num_blks
+			? 0
+			: first_blk + i + 1;
+		memcpy(blks + i * blk_size, &next_blk_num,
+		       DATA_BLK_NEXT_BLK_NUM_LEN);
+	}
+}
+
+u8 _write_dirs(struct _populate *p)
+{
+	struct _layout layout = p->layout;
+	bool extents = layout.features & FEATURE_EXTENTS;
+	u8 ret = 0;
+	for (usize i = 0; i < p->num_nodes && !ret; ++i) {
+		struct _pop_node *node = &p->nodes[i];
+		if (!node->is_dir) {
+			continue;
+		}
+		usize len = node->num_blks * layout.blk_size;
+		u8 *blks = calloc(1, len);
+		_pack_dir(p, i, blks);
+		if (extents) {
+			ret |= _write_node_extents(p, node, len);
+		} else {
+			_link_blks(blks, layout.blk_size, node->first_blk,
+				   node->num_blks, true);
+		}
+		usize addr = (_data_blks_offset(layout) + node->first_blk)
+			* layout.blk_size;
+		ret |= _write_at(p->fd, blks, len, addr);
+		free(blks);
+	}
+	return ret | p->ret;
+}
+
+/*
+ * Copies the contents of the regular file @node into its blocks, a chunk of
+ * @chunk_blks blocks at a time through @buf, reading into @src_buf first when
+ * the blocks are chained
+ */
+u8 _copy_file(struct _populate *p, struct _pop_node *node, u8 *buf,
+	      u8 *src_buf, usize chunk_blks)
+{
+	struct _layout layout = p->layout;
+	usize blk_size = layout.blk_size;
+	bool extents = layout.features & FEATURE_EXTENTS;
+	usize usable_len = extents
+		? blk_size
+		: blk_size - DATA_BLK_NEXT_BLK_NUM_LEN;
+
+	int src = open(node->host_path, O_RDONLY);
+	if (src < 0) {
+		return 1;
+	}
+	u8 ret = extents ? _write_node_extents(p, node, node->size) : 0;
+	for (usize blk_idx = 0; blk_idx < node->num_blks && !ret;
+	     blk_idx += chunk_blks) {
+		usize num_blks = node->num_blks - blk_idx;
+		if (num_blks > chunk_blks) {
+			num_blks = chunk_blks;
+		}
+		// Stops short of the planned size if the file shrank; the
+		// rest reads as zeros
+		usize len = num_blks * usable_len;
+		usize offset = blk_idx * usable_len;
+		if (offset + len > node->size) {
+			len = node->size - offset;
+		}
+		memset(buf, 0, num_blks * blk_size);
+		ssize_t num_read = _read_full(src, extents ? buf : src_buf,
+					      len, offset);
+		if (num_read < 0) {
+			ret = 1;
+			break;
+		}
+		if (!extents) {
+			for (usize i = 0; i * usable_len < (usize) num_read;
+			     ++i) {
+				usize cpy_len = num_read - i * usable_len;
+				if (cpy_len > usable_len) {
+					cpy_len = usable_len;
+				}
+				memcpy(buf + i * blk_size
+					       + DATA_BLK_NEXT_BLK_NUM_LEN,
+				       src_buf + i * usable_len, cpy_len);
+			}
+			bool ends_chain = blk_idx + num_blks == node->num_blks;
+			_link_blks(buf, blk_size, node->first_blk + blk_idx,
+				   num_blks, ends_chain);
+		}
+		usize addr = (_data_blks_offset(layout) + node->first_blk
+			      + blk_idx) * blk_size;
+		ret = _write_at(p->fd, buf, num_blks * blk_size, addr);
+	}
+	close(src);
+	return ret;
+}
+
+/*
+ * Runs on each copy thread: takes the next regular file with blocks until none
+ * are left. Reading one file overlaps with writing another on the other
+ * threads.
+ */
+void *_copy_files(void *arg)
+{
+	struct _populate *p = arg;
+	usize blk_size = p->layout.blk_size;
+	usize chunk_blks = POPULATE_CHUNK_LEN / blk_size;
+	if (chunk_blks == 0) {
+		chunk_blks = 1;
+	}
+	u8 *buf = malloc(chunk_blks * blk_size);
+	u8 *src_buf = malloc(chunk_blks * blk_size);
+
+	while (true) {
+		pthread_mutex_lock(&p->lock);
+		while (p->next_node < p->num_nodes
+		       && (p->nodes[p->next_node].is_dir
+			   || p->nodes[p->next_node].num_blks == 0)) {
+			p->next_node += 1;
+		}
+		usize node_num = p->next_node;
+		p->next_node += 1;
+		pthread_mutex_unlock(&p->lock);
+		if (node_num >= p->num_nodes) {
+			break;
+		}
+
+		struct _pop_node *node = &p->nodes[node_num];
+		if (_copy_file(p, node, buf, src_buf, chunk_blks)) {
+			eprintf("%s: cannot be copied\n", node->host_path);
+			pthread_mutex_lock(&p->lock);
+			p->ret = 1;
+			pthread_mutex_unlock(&p->lock);
+		}
+	}
+	free(src_buf);
+	free(buf);
+	return NULL;
+}
+
+u8 _copy_files_parallel(struct _populate *p)
+{
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	if (num_threads > MAX_POPULATE_THREADS) {
+		num_threads = MAX_POPULATE_THREADS;
+	}
+	pthread_t threads[num_threads];
+	pthread_mutex_init(&p->lock, NULL);
+	p->next_node = 0;
+	for (long i = 0; i < num_threads; ++i) {
+		pthread_create(&threads[i], NULL, _copy_files, p);
+	}
+	for (long i = 0; i < num_threads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&p->lock);
+	return p->ret;
+}
+
+/*
+ * Sets the first @num_bits bits of the bitmap at block @blk_num
+ */
+u8 _write_bitmap_prefix(struct _populate *p, usize blk_num, usize num_bits)
+{
+	usize len = _div_ceil(num_bits, 8);
+	u8 *bits = malloc(len);
+	memset(bits, 0xFF, len);
+	if (num_bits % 8 != 0) {
+		bits[len - 1] = (1 << (num_bits % 8)) - 1;
+	}
+	u8 ret = _write_at(p->fd, bits, len, blk_num * p->layout.blk_size);
+	free(bits);
+	return ret;
+}
+
+u8 _write_inodes(struct _populate *p)
+{
+	usize tbl_len = p->num_nodes * INODE_SIZE;
+	u8 *tbl = calloc(1, tbl_len);
+	for (usize i = 0; i < p->num_nodes; ++i) {
+		struct _pop_node *node = &p->nodes[i];
+		// The root keeps its permissions
+		struct _inode inode = i == 0
+			? _new_inode(true, true, true, 0)
+			: _new_inode(node->is_dir, node->read, node->write,
+				     node->data_ptr);
+		memcpy(tbl + i * INODE_SIZE, &inode, sizeof(inode));
+	}
+	u8 ret = _write_at(p->fd, tbl, tbl_len,
+			   INODE_TBL_OFFSET * p->layout.blk_size);
+	free(tbl);
+
+	ret |= _write_bitmap_prefix(p, _inode_bitmap_offset(p->layout),
+				    p->num_nodes);
+	ret |= _write_bitmap_prefix(p, _blk_bitmap_offset(p->layout),
+				    p->num_blks);
+	usize next_avl[] = {
+		p->num_nodes,
+		p->num_blks,
+	};
+	return ret | _write_at(p->fd, next_avl, sizeof(next_avl),
+			       NEXT_AVL_INODE_OFFSET);
+}
+
+/*
+ * Copies the tree under @host_dir into the freshly formatted @f, writing the
+ * directories, inodes and bitmaps directly rather than through rtfs. The root
+ * directory becomes @host_dir, and every file is given one contiguous run of
+ * blocks.
+ */
+u8 _populate(FILE *f, struct _layout layout, char *host_dir)
+{
+	// Everything from here on is written with `pwrite`
+	fflush(f);
+	struct _populate p = {
+		.fd = fileno(f),
+		.layout = layout,
+		.nodes = NULL,
+		.num_nodes = 0,
+		.nodes_cap = 0,
+		.num_blks = 0,
+		.ret = 0,
+	};
+	u8 ret = _scan_tree(&p, host_dir);
+	if (!ret) {
+		ret = _plan_blks(&p);
+	}
+	if (!ret) {
+		ret = _write_dirs(&p);
+	}
+	if (!ret) {
+		ret = _copy_files_parallel(&p);
+	}
+	if (!ret) {
+		ret = _write_inodes(&p);
+	}
+	for (usize i = 0; i < p.num_nodes; ++i) {
+		free(p.nodes[i].host_path);
+	}
+	free(p.nodes);
+	return ret;
+}
+
 /*
  * @f must be open for writing in binary mode
+ *
+ * The inode table is left as it is: rtfs only reads an inode once its bit is
+ * set, which happens after the inode is written.
  */
-u8 _format(FILE *f, usize blk_size)
+u8 _format(FILE *f, usize blk_size, usize bytes_per_inode, usize features,
+	   char *populate_dir)
 {
 	u8 ret = 0;
 
+	if (blk_size > MAX_BLK_SIZE || bytes_per_inode < blk_size) {
+		return 1;
+	}
 	usize disk_size = fsizeof(f);
-	struct _layout layout = calc_layout(disk_size, blk_size);
+	struct _layout layout =
+		calc_layout(disk_size, blk_size, bytes_per_inode, features);
 
 	ret = _write_super_blk(f, layout);
 	if (ret) {
 		return ret;
 	}
 	ret = _write_root_inode(f, blk_size);
+	if (ret) {
+		return ret;
+	}
+	ret = _write_bitmaps(f, layout);
+	if (ret) {
+		return ret;
+	}
+	ret = _write_refcounts(f, layout);
+	if (ret) {
+		return ret;
+	}
+	ret = _write_journal(f, layout);
+	if (ret) {
+		return ret;
+	}
+	ret = _write_root_dir(f, layout);
+	if (ret) {
+		return ret;
+	}
+	if (features & FEATURE_EXTENTS) {
+		ret = _write_root_extents(f, layout);
+	}
+	if (!ret && populate_dir != NULL) {
+		ret = _populate(f, layout, populate_dir);
+	}
 	return ret;
 }
 
 u8 _extend_file_len(FILE *f, usize len)
 {
-	// Set the file size to @len
-	fseek(f, len - 1, SEEK_SET);
-	u8 blank_byte = 0;
-	fwrite(&blank_byte, 1, 1, f);
-	return 0;
+	// Set the file size to @len, leaving it sparse: blocks only take up
+	// space once they are written
+	return ftruncate(fileno(f), len) != 0;
 }
 
-u8 fs_init(char *path, usize len, usize blk_size)
+u8 fs_init(char *path, usize len, usize blk_size, usize bytes_per_inode,
+	   usize features, char *populate_dir)
 {
 	u8 ret = 0;
 	FILE *f = fopen(path, "wb");
-	_extend_file_len(f, len);
+	if (_extend_file_len(f, len)) {
+		fclose(f);
+		return 1;
+	}
 
 	// TODO: use `errno` to see the err
-	bool err = _format(f, blk_size);
+	bool err = _format(f, blk_size, bytes_per_inode, features,
+			   populate_dir);
 	if (err) {
 		ret = 1;
 	}
@@ -130,10 +1241,11 @@ u8 fs_init(char *path, usize len, usize blk_size)
 	return ret;
 }
 
-u8 fs_format(char *path, usize blk_size)
+u8 fs_format(char *path, usize blk_size, usize bytes_per_inode,
+	      usize features, char *populate_dir)
 {
-	FILE *f = fopen(path, "w+b");
-	u8 ret = _format(f, blk_size);
+	FILE *f = fopen(path, "r+b");
+	u8 ret = _format(f, blk_size, bytes_per_inode, features, populate_dir);
 	fclose(f);
 	return ret;
 }
@@ -4,15 +4,34 @@
 #include <tberry/types.h>
 
 /*
- * Creates (or overwrites) a file at @path of size @len bytes, then formats it
+ * Bits of the super block `features` field
  */
-u8 fs_init(char *path, usize len, usize blk_size);
+// Files are described by an extent block rather than a chain of data blocks
+#define FEATURE_EXTENTS 0x1
+
+// Offsets into a block are `u16`s
+#define MAX_BLK_SIZE 65536
+
+/*
+ * Creates (or overwrites) a file at @path of size @len bytes, then formats it.
+ * The file is sparse, so this takes no time whatever its size.
+ *
+ * There is one inode per @bytes_per_inode bytes of disk, which must be at least
+ * @blk_size. @features is a mask of `FEATURE_*` bits.
+ *
+ * If @populate_dir is not NULL, the tree under that host directory is copied
+ * in as the root directory, each file laid out contiguously
+ */
+u8 fs_init(char *path, usize len, usize blk_size, usize bytes_per_inode,
+	   usize features, char *populate_dir);
 
 /*
- * Formats the file at @path to be in the ext4holdtheextra filesystem.
+ * Formats the file at @path to be in the ext4holdtheextra filesystem,
+ * populating it from @populate_dir as `fs_init` does.
  *
  * Warning: Destructive. This will destroy all bytes in the file.
  */
-u8 fs_format(char *path, usize blk_size);
+u8 fs_format(char *path, usize blk_size, usize bytes_per_inode,
+	      usize features, char *populate_dir);
 
 #endif /* _MKFS_H */
@@ -5,17 +5,55 @@
 
 #define MAX_FILENAME_LEN 255
 
+/*
+ * A loaded image. Several can be loaded at once, and each can be used from
+ * several threads: calls on different files run in parallel, while calls that
+ * change a file (or a directory's entries) exclude other calls on it.
+ */
+typedef struct fs fs_t;
+
 /*
  * Warning: modifying any of the values in this structure will certainly mess
  * up the filesystem
  */
 struct fs_file_desc {
 	char *path;
+	usize inode_num;
 
+	// The first data block, or the extent block when files are
+	// extent-mapped
 	usize head_blk_num;
 	usize curr_blk_num;
+	// How many blocks into the file `curr_blk_num` is
+	usize curr_blk_idx;
 	usize curr_offset;
 
+	// Data block of each block index seen so far, for chained files
+	usize *blk_map;
+	usize blk_map_len;
+	usize blk_map_cap;
+
+	// Blocks reserved right after the end of the file for its next appends,
+	// given back by `fs_close`
+	usize prealloc_blk_num;
+	usize prealloc_len;
+	// Length of the next reservation
+	usize prealloc_window;
+
+	// Block index a read continuing the last one starts at, the index of
+	// the first block past those already read ahead, and how many blocks
+	// the next readahead adds
+	usize ra_next_idx;
+	usize ra_end_idx;
+	usize ra_window;
+
+	// A regular file with no head block keeps its bytes in its directory
+	// entry, guarded by the directory's lock: the entry named @name, last
+	// found in directory block @inline_blk_num
+	usize parent_inode_num;
+	char name[MAX_FILENAME_LEN + 1];
+	usize inline_blk_num;
+
 	bool is_dir;
 	u8 owner;
 	bool has_read;
@@ -23,47 +61,330 @@ struct fs_file_desc {
 };
 
 /*
- * Loads the layout of @backing_file into memory. THIS MUST BE CALLED BEFORE ANY
- * OTHER FUNCTIONS.
+ * A range of a file for `fs_readv` / `fs_writev`: @len bytes at byte @offset,
+ * to or from @buf
+ */
+struct fs_io_vec {
+	usize offset;
+	u8 *buf;
+	usize len;
+};
+
+/*
+ * A range of the file opened as @f, for `fs_read_batch`
+ */
+struct fs_batch_req {
+	struct fs_file_desc *f;
+	struct fs_io_vec vec;
+};
+
+/*
+ * @len bytes of a file, read in place from the block they live in, as made by
+ * `fs_read_view`
+ */
+struct fs_view {
+	const u8 *data;
+	usize len;
+	// The block kept in memory for @data, for `fs_release_views`
+	usize blk_num;
+};
+
+enum fs_load_mode {
+	// Blocks are read into a fixed-size cache and written back on sync
+	FS_LOAD_CACHED,
+	// The whole backing file is `mmap`ed privately. Syncs write back the
+	// blocks written to the mapping, metadata through the journal, as
+	// `FS_LOAD_CACHED` does.
+	FS_LOAD_MMAP,
+};
+
+/*
+ * Zero-initialized options select the defaults
+ */
+struct fs_load_opts {
+	enum fs_load_mode mode;
+	// Number of blocks kept in memory by `FS_LOAD_CACHED`; 0 picks a
+	// default
+	usize cache_len;
+	// Number of path components whose lookups are remembered; 0 picks a
+	// default
+	usize dcache_len;
+	// Flush every call that changes the image (`fs_write`, `fs_create`,
+	// `fs_delete`) before returning, instead of leaving it in the cache
+	// until `fs_fsync`, `fs_sync` or `fs_close`
+	bool write_through;
+	// Number of threads serving `fs_submit_read` / `fs_submit_write`; 0
+	// picks a default
+	usize aio_threads;
+	// Serve them all from those threads, even where the kernel has io_uring
+	// to carry requests on images with extents
+	bool no_io_uring;
+};
+
+/*
+ * A finished request from `fs_submit_read` / `fs_submit_write`
+ */
+struct fs_completion {
+	// As passed when it was submitted
+	void *user_data;
+	// What `fs_readv` / `fs_writev` would have returned
+	u8 ret;
+};
+
+/*
+ * Loads the layout of @backing_file into memory, returning the handle every
+ * other call takes, or NULL if it could not be loaded
  *
  * @backing_file should have been made through `mkfs.ext4holdtheextra`
  */
-u8 fs_load(char *backing_file);
+fs_t *fs_load(char *backing_file, struct fs_load_opts opts);
 
 /*
- * Creates an empty file at @path
+ * Syncs @fs, then releases it. Every file must have been closed, and every
+ * submitted request reaped.
+ */
+u8 fs_unload(fs_t *fs);
+
+/*
+ * Creates an empty file at @path. Like `fs_delete`, it is only durable after
+ * the next sync, which commits it through the journal together with the other
+ * changes made since the last one.
  * Note: @path must be an absolute path (i.e. it must start with '/')
+ *
+ * A regular file takes no blocks while it is small: up to 255 bytes, as room
+ * in its directory's block allows, are kept in its directory entry, and it is
+ * only given blocks once it outgrows that.
+ *
+ * Returns 1 if the parent directory doesn't exist, if @path already exists, or
+ * if the disk is full
+ */
+u8 fs_create(fs_t *fs, char *path, bool is_dir, u8 owner);
+
+/*
+ * `fs_create` for each of the @num_names entries in @names (plain names, not
+ * paths) of the directory at @dir_path, 32 at a time. Each 32 are one
+ * operation, committed (and surviving a crash) as a whole: the directory is
+ * looked up and locked once for them, their inodes, and blocks for new
+ * directories, are reserved together, and each block of the directory is
+ * checked and updated once for all of them whose names hash to it.
+ *
+ * If @rets is not NULL, it gets what `fs_create` would have returned for each
+ * name. Returns 1 if any of them failed, in which case the rest are still made.
  */
-u8 fs_create(char *path, bool is_dir, u8 owner);
+u8 fs_create_many(fs_t *fs, char *dir_path, char **names, usize num_names,
+		  bool is_dir, u8 owner, u8 *rets);
 
 /*
  * Opens a file at path, returning info about the opened file
+ *
+ * If there is no file at @path, the descriptor returned has an `inode_num` of
+ * 0, which no opened file has, and every call given it fails without touching
+ * the image: `fs_read_view` makes no views, the rest return 1.
+ *
+ * A descriptor belongs to the thread that uses it; threads each open their own.
  */
-struct fs_file_desc fs_open(char *path);
+struct fs_file_desc fs_open(fs_t *fs, char *path);
 
 /*
- * Closes the opened file described by @f
+ * Closes the opened file described by @f, freeing the blocks reserved for its
+ * appends and making what was written through it durable
  */
-u8 fs_close(struct fs_file_desc *f);
+u8 fs_close(fs_t *fs, struct fs_file_desc *f);
 
 /*
  * Writes @len bytes from @buf to the file at the current seek position
+ *
+ * The data stays in the block cache, so small writes to the same block cost a
+ * single write back; long writes skip the cache for the blocks they cover
+ * whole. It is only durable after `fs_fsync`, `fs_sync` or `fs_close`, unless
+ * loaded with `write_through`.
+ *
+ * Returns 1 if the disk is full, or on images with extents if the file's
+ * extent index is (see design.md: a few hundred to tens of thousands of
+ * extents, depending on the block size).
  */
-u8 fs_write(struct fs_file_desc *f, u8 *buf, usize len);
+u8 fs_write(fs_t *fs, struct fs_file_desc *f, u8 *buf, usize len);
 
 /*
  * Reads @len bytes into @buf from the file at the current seek position
  */
-u8 fs_read(struct fs_file_desc *f, u8 *buf, usize len);
+u8 fs_read(fs_t *fs, struct fs_file_desc *f, u8 *buf, usize len);
+
+/*
+ * Like `fs_read`, but rather than copying, fills @views with pointers to the
+ * file's bytes in the block cache (or the mapped image), one view per block,
+ * and returns how many it made. The position of @f moves past the bytes
+ * viewed, which fall short of @len only when @max_views runs out.
+ *
+ * Each view stays valid, with its block kept in memory, until it is given to
+ * `fs_release_views`; later writes to the bytes it covers show through it,
+ * unless they fill in a hole, move a small file's bytes or copy a block shared
+ * with a clone. The cache must be left some blocks that aren't held this way,
+ * and a file's views must be released before it is deleted.
+ */
+usize fs_read_view(fs_t *fs, struct fs_file_desc *f, usize len,
+		   struct fs_view *views, usize max_views);
 
 /*
- * Moves the position of @f to be @offset bytes into the file
+ * Lets go of the @num_views views in @views
  */
-u8 fs_seek(struct fs_file_desc *f, usize offset);
+void fs_release_views(fs_t *fs, struct fs_view *views, usize num_views);
+
+/*
+ * Reads each of the @num_vecs ranges in @vecs from the file. The blocks they
+ * touch are read in the order they lie on disk, with nearby ones merged into a
+ * single read, and without going through the cache.
+ *
+ * The position of @f is left where it was.
+ */
+u8 fs_readv(fs_t *fs, struct fs_file_desc *f, struct fs_io_vec *vecs,
+	    usize num_vecs);
+
+/*
+ * Writes each of the @num_vecs ranges in @vecs to the file, merging writes to
+ * adjacent bytes on disk like `fs_readv`. Ranges reaching blocks that don't
+ * exist yet are written as by `fs_write`. The ranges must not overlap.
+ *
+ * The position of @f is left where it was.
+ */
+u8 fs_writev(fs_t *fs, struct fs_file_desc *f, struct fs_io_vec *vecs,
+	     usize num_vecs);
+
+/*
+ * `fs_readv` over the @num_reqs ranges in @reqs, which may come from any
+ * number of open files; they are all sorted and merged together
+ */
+u8 fs_read_batch(fs_t *fs, struct fs_batch_req *reqs, usize num_reqs);
+
+/*
+ * Queues a read of @vec from the file opened as @f, returning at once; the
+ * read is collected with `fs_reap`. Any number may be in flight. On a cached
+ * image with extents, where the kernel has io_uring, the caller looks up the
+ * blocks and copies the cached ones, and the rest are read by the kernel
+ * straight into @vec.buf; otherwise the whole read happens on one of the
+ * load's I/O threads, which does its own lookups.
+ *
+ * @f may be used (or closed) again straight away, but @vec.buf must stay
+ * valid until the request is reaped, and the range must not be written,
+ * punched or deleted meanwhile.
+ *
+ * Returns 1 if @f is not open on a file, or if there is no memory for the
+ * request
+ */
+u8 fs_submit_read(fs_t *fs, struct fs_file_desc *f, struct fs_io_vec vec,
+		  void *user_data);
+
+/*
+ * Like `fs_submit_read`, but writes @vec as `fs_writev` would. Requests in
+ * flight together land in no particular order. Only writes over blocks the
+ * file already has to itself, within its length, go through io_uring; the
+ * rest allocate on the I/O threads.
+ */
+u8 fs_submit_write(fs_t *fs, struct fs_file_desc *f, struct fs_io_vec vec,
+		   void *user_data);
+
+/*
+ * Moves up to @max finished requests into @out, first waiting until at least
+ * @min_complete of them have finished (or nothing more is in flight). Returns
+ * how many were moved.
+ */
+usize fs_reap(fs_t *fs, struct fs_completion *out, usize max,
+	      usize min_complete);
+
+/*
+ * Moves the position of @f to be @offset bytes into the file. Never allocates;
+ * seeking past the end leaves a gap before the next write. On images with
+ * extents the gap stays a hole that reads as zeros; chained files get zeroed
+ * blocks for it.
+ */
+u8 fs_seek(fs_t *fs, struct fs_file_desc *f, usize offset);
+
+/*
+ * Moves the position of @f to the first byte at or after @offset that is
+ * stored in a block, like `lseek` with `SEEK_DATA`, and sets @pos to it. Holes
+ * are found a block at a time.
+ *
+ * Returns 1 if @offset is at or past the end of the file, or only holes follow
+ * it.
+ */
+u8 fs_seek_data(fs_t *fs, struct fs_file_desc *f, usize offset, usize *pos);
+
+/*
+ * Like `fs_seek_data`, but to the first byte at or after @offset that is in a
+ * hole, as with `SEEK_HOLE`. The end of the file counts as one, so this only
+ * fails if @offset is at or past it.
+ */
+u8 fs_seek_hole(fs_t *fs, struct fs_file_desc *f, usize offset, usize *pos);
+
+/*
+ * Turns the @len bytes from @offset of the file into a hole that reads as
+ * zeros, giving back the blocks wholly inside it; the size of the file is left
+ * as is. Blocks shared with a clone are kept for the clone.
+ *
+ * Only images with extents have holes: on others, and for files small enough to
+ * be kept in their directory entry, the bytes are zeroed in place.
+ *
+ * Returns 1 if @f is a directory, or if an extent would have to be split while
+ * the file's extents fill its extent index.
+ */
+u8 fs_punch_hole(fs_t *fs, struct fs_file_desc *f, usize offset, usize len);
+
+/*
+ * Writes back everything written through @f and waits for it to reach the disk.
+ * Other files' writes are currently made durable along with it.
+ */
+u8 fs_fsync(fs_t *fs, struct fs_file_desc *f);
+
+/*
+ * Writes back everything written so far and waits for it to reach the disk
+ */
+u8 fs_sync(fs_t *fs);
 
 /*
  * Deletes the file at @path
+ *
+ * Returns 1 if @path doesn't exist
+ */
+u8 fs_delete(fs_t *fs, char *path);
+
+/*
+ * `fs_delete` for each of the @num_names entries in @names of the directory at
+ * @dir_path, finding every 32 of them in a single pass over the entries of the
+ * blocks their names hash to, as an operation of their own
+ *
+ * If @rets is not NULL, it gets what `fs_delete` would have returned for each
+ * name. Returns 1 if any of them didn't exist.
+ */
+u8 fs_delete_many(fs_t *fs, char *dir_path, char **names, usize num_names,
+		  u8 *rets);
+
+/*
+ * Makes a new file at @dst_path holding what the regular file at @src_path
+ * holds, without copying it: the two share their blocks, each block counting
+ * the files that own it, until either file writes to it. The writer then gets
+ * a copy of its own, so neither file ever sees the other's writes. Views made
+ * by `fs_read_view` keep showing the shared block after that.
+ *
+ * Only images made with extents (`mkfs -e`) can share blocks. A small file
+ * kept in its directory entry is copied.
+ *
+ * Returns 1 if the image has no extents, if @src_path is missing or a
+ * directory, if @dst_path can't be created, or if a block of @src_path already
+ * has 65536 owners
+ */
+u8 fs_clone(fs_t *fs, char *src_path, char *dst_path);
+
+/*
+ * Makes a new directory at @dst_dir holding a copy of the tree under the
+ * directory at @src_dir (which may be "/"), with every regular file in it
+ * made by `fs_clone`. @dst_dir may lie inside that tree; it is left out of
+ * the copy.
+ *
+ * Files are cloned one at a time as they are reached, each by an operation of
+ * its own, so the copy is only a consistent image of the tree if nothing writes
+ * to it meanwhile, and a crash part way leaves part of it. Returns 1 if
+ * anything couldn't be copied, in which case the rest still is.
  */
-u8 fs_delete(char *path);
+u8 fs_snapshot(fs_t *fs, char *src_dir, char *dst_dir);
 
 #endif /* _FILE_H */
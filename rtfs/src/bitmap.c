@@ -0,0 +1,169 @@
+#include <string.h>
+
+#include <tberry/types.h>
+
+#include "bitmap.h"
+
+#define WORD_BITS (sizeof(usize) * 8)
+#define ALL_SET ((usize) -1)
+
+usize _word_of(struct bitmap *bm, usize word_num)
+{
+	usize words_per_blk = bm->blk_size / sizeof(usize);
+	usize blk_num = bm->first_blk + word_num / words_per_blk;
+	cache_lock(bm->cache);
+	usize *blk = (usize *) cache_get(bm->cache, blk_num, true);
+	// A block the cache had no frame for is as good as full
+	usize word = blk != NULL ? blk[word_num % words_per_blk] : ALL_SET;
+	cache_unlock(bm->cache);
+
+	// Bits past the end are never free
+	usize first_bit = word_num * WORD_BITS;
+	if (first_bit + WORD_BITS > bm->num_bits) {
+		usize num_valid = bm->num_bits - first_bit;
+		word |= ALL_SET << num_valid;
+	}
+	return word;
+}
+
+bool bitmap_get(struct bitmap *bm, usize bit)
+{
+	return (_word_of(bm, bit / WORD_BITS) >> (bit % WORD_BITS)) & 1;
+}
+
+void bitmap_set_range(struct bitmap *bm, usize first, usize len, bool val)
+{
+	usize bits_per_blk = bm->blk_size * 8;
+	while (len > 0) {
+		usize blk_num = bm->first_blk + first / bits_per_blk;
+		cache_lock(bm->cache);
+		u8 *blk = cache_get(bm->cache, blk_num, true);
+		usize bit = first % bits_per_blk;
+		usize chunk_len = bits_per_blk - bit;
+		if (chunk_len > len) {
+			chunk_len = len;
+		}
+		if (blk == NULL) {
+			// The cache has failed, and flushes nothing more
+			cache_unlock(bm->cache);
+			first += chunk_len;
+			len -= chunk_len;
+			continue;
+		}
+
+		// Ragged bits one at a time, whole bytes with memset
+		usize end = bit + chunk_len;
+		while (bit < end && bit % 8 != 0) {
+			blk[bit / 8] = val
+				? blk[bit / 8] | (1 << (bit % 8))
+				: blk[bit / 8] & ~(1 << (bit % 8));
+			bit += 1;
+		}
+		usize num_bytes = (end - bit) / 8;
+		memset(blk + bit / 8, val ? 0xFF : 0, num_bytes);
+		bit += num_bytes * 8;
+		while (bit < end) {
+			blk[bit / 8] = val
+				? blk[bit / 8] | (1 << (bit % 8))
+				: blk[bit / 8] & ~(1 << (bit % 8));
+			bit += 1;
+		}
+		cache_mark_meta(bm->cache, blk_num);
+		cache_unlock(bm->cache);
+
+		first += chunk_len;
+		len -= chunk_len;
+	}
+}
+
+/*
+ * Scans words [@from, @to) for @want clear bits, ignoring bits below @min_bit.
+ * Tracks the longest run in @best_start / @best_len, returning true once it
+ * reaches @want.
+ */
+bool _scan(struct bitmap *bm, usize from, usize to, usize min_bit, usize want,
+	   usize *best_start, usize *best_len)
+{
+	usize run_start = 0;
+	usize run_len = 0;
+	for (usize word_num = from; word_num < to; ++word_num) {
+		usize word = _word_of(bm, word_num);
+		usize base = word_num * WORD_BITS;
+		if (base < min_bit) {
+			word |= ~(ALL_SET << (min_bit - base));
+		}
+
+		if (word == ALL_SET) {
+			run_len = 0;
+			continue;
+		}
+		if (word == 0) {
+			if (run_len == 0) {
+				run_start = base;
+			}
+			run_len += WORD_BITS;
+		} else {
+			usize bit = 0;
+			while (bit < WORD_BITS) {
+				usize free_bits = ~word >> bit;
+				if (free_bits == 0) {
+					run_len = 0;
+					break;
+				}
+				usize num_used = __builtin_ctzl(free_bits);
+				if (num_used > 0) {
+					run_len = 0;
+					bit += num_used;
+				}
+				usize used_bits = word >> bit;
+				usize num_free = used_bits == 0
+					? WORD_BITS - bit
+					: (usize) __builtin_ctzl(used_bits);
+				if (run_len == 0) {
+					run_start = base + bit;
+				}
+				run_len += num_free;
+				bit += num_free;
+
+				if (run_len > *best_len) {
+					*best_start = run_start;
+					*best_len = run_len;
+				}
+				if (run_len >= want) {
+					return true;
+				}
+			}
+			continue;
+		}
+
+		if (run_len > *best_len) {
+			*best_start = run_start;
+			*best_len = run_len;
+		}
+		if (run_len >= want) {
+			return true;
+		}
+	}
+	return false;
+}
+
+usize bitmap_find_free(struct bitmap *bm, usize goal, usize want,
+		       usize *run_len)
+{
+	usize num_words = (bm->num_bits + WORD_BITS - 1) / WORD_BITS;
+	if (goal >= bm->num_bits) {
+		goal = 0;
+	}
+	usize goal_word = goal / WORD_BITS;
+
+	usize best_start = BITMAP_NONE;
+	usize best_len = 0;
+	bool found = _scan(bm, goal_word, num_words, goal, want, &best_start,
+			   &best_len)
+		|| _scan(bm, 0, goal_word + 1, 0, want, &best_start, &best_len);
+	if (!found && best_len == 0) {
+		return BITMAP_NONE;
+	}
+	*run_len = best_len < want ? best_len : want;
+	return best_start;
+}
@@ -0,0 +1,42 @@
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include <tberry/types.h>
+
+#include "cache.h"
+
+// Returned by `bitmap_find_free` when every bit is set
+#define BITMAP_NONE ((usize) -1)
+
+/*
+ * A run of @num_bits bits stored in consecutive blocks starting at block
+ * @first_blk, read and written through @cache. Bit i is bit (i % 8) of byte
+ * (i / 8); a set bit means "in use".
+ */
+struct bitmap {
+	struct blk_cache *cache;
+	usize first_blk;
+	usize blk_size;
+	usize num_bits;
+};
+
+bool bitmap_get(struct bitmap *bm, usize bit);
+
+/*
+ * Sets (or clears, if not @val) the @len bits starting at @first
+ */
+void bitmap_set_range(struct bitmap *bm, usize first, usize len, bool val);
+
+/*
+ * Looks for @want consecutive clear bits, starting from @goal and wrapping
+ * around to the start once. Whole words are skipped at a time when they are
+ * completely set or completely clear.
+ *
+ * Returns the first bit of the first run of @want, or if there is none, of the
+ * longest shorter run. @run_len is set to the length found (capped at @want).
+ * Returns `BITMAP_NONE` if every bit is set.
+ */
+usize bitmap_find_free(struct bitmap *bm, usize goal, usize want,
+		       usize *run_len);
+
+#endif /* _BITMAP_H */
@@ -0,0 +1,1042 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <tberry/types.h>
+
+#include "cache.h"
+#include "journal.h"
+
+#define NO_FRAME ((usize) -1)
+
+// Longest run of blocks `cache_flush` hands to a single write
+#define MAX_WRITE_BACK_RUN 64
+
+struct _frame {
+	usize blk_num;
+	// Next frame in the same hash bucket
+	usize hash_next;
+	u8 *mem;
+
+	bool valid;
+	bool dirty;
+	// Dirty metadata, held here until the journal commits it
+	bool meta;
+	// Number of `cache_pin`s not yet undone; pinned frames are never
+	// evicted
+	usize pins;
+	// CLOCK reference bit
+	bool ref;
+};
+
+struct blk_cache {
+	// Recursive, so a caller can hold it across calls with `cache_lock`
+	pthread_mutex_t lock;
+
+	// The backing file, only ever accessed at explicit offsets
+	int fd;
+	usize blk_size;
+
+	usize num_frames;
+	struct _frame *frames;
+	// The frames' memory, one allocation per time the cache grew
+	u8 **mems;
+	usize num_mems;
+
+	// Power of two, so the bucket is a mask of the block number
+	usize num_buckets;
+	usize *buckets;
+
+	usize clock_hand;
+
+	// Metadata goes through it when set
+	struct journal *journal;
+	usize num_meta;
+
+	// Set when the whole file is mapped privately. Frames then only track
+	// the blocks written to the mapping since the last flush, the first
+	// @num_tracked of them, and point into it.
+	u8 *map;
+	usize map_len;
+	usize num_tracked;
+
+	// Set once a block could not be given a frame because the cache
+	// couldn't grow. Whatever was done to it is lost, so nothing more is
+	// flushed, and the image stays as the last flush left it.
+	bool failed;
+};
+
+void _init_lock(struct blk_cache *c)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&c->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * Frees the memory of @c, and @c itself
+ */
+void _free_mem(struct blk_cache *c)
+{
+	free(c->buckets);
+	for (usize i = 0; i < c->num_mems; ++i) {
+		free(c->mems[i]);
+	}
+	free(c->mems);
+	free(c->frames);
+	free(c);
+}
+
+struct blk_cache *cache_new(int fd, usize blk_size, usize num_frames)
+{
+	if (num_frames == 0) {
+		num_frames = CACHE_DEFAULT_LEN;
+	}
+	struct blk_cache *c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->fd = fd;
+	c->blk_size = blk_size;
+	c->num_frames = num_frames;
+	c->frames = calloc(num_frames, sizeof(*c->frames));
+	c->mems = calloc(1, sizeof(*c->mems));
+	if (c->mems != NULL) {
+		c->mems[0] = malloc(num_frames * blk_size);
+		c->num_mems = 1;
+	}
+	c->num_buckets = 1;
+	while (c->num_buckets < 2 * num_frames) {
+		c->num_buckets <<= 1;
+	}
+	c->buckets = malloc(c->num_buckets * sizeof(*c->buckets));
+	if (c->frames == NULL || c->mems == NULL || c->mems[0] == NULL
+	    || c->buckets == NULL) {
+		_free_mem(c);
+		return NULL;
+	}
+
+	for (usize i = 0; i < num_frames; ++i) {
+		c->frames[i].mem = c->mems[0] + i * blk_size;
+	}
+	for (usize i = 0; i < c->num_buckets; ++i) {
+		c->buckets[i] = NO_FRAME;
+	}
+	c->clock_hand = 0;
+	c->journal = NULL;
+	c->num_meta = 0;
+	c->map = NULL;
+	_init_lock(c);
+	return c;
+}
+
+u8 _rehash(struct blk_cache *c);
+
+struct blk_cache *cache_new_mmap(int fd, usize blk_size, usize disk_size)
+{
+	// Private, so nothing reaches the file before the journal has it
+	u8 *map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		       fd, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	struct blk_cache *c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		munmap(map, disk_size);
+		return NULL;
+	}
+	c->fd = fd;
+	c->blk_size = blk_size;
+	c->num_frames = CACHE_DEFAULT_LEN;
+	c->frames = calloc(c->num_frames, sizeof(*c->frames));
+	if (c->frames == NULL) {
+		munmap(map, disk_size);
+		_free_mem(c);
+		return NULL;
+	}
+	c->map = map;
+	c->map_len = disk_size;
+	if (_rehash(c)) {
+		munmap(map, disk_size);
+		_free_mem(c);
+		return NULL;
+	}
+	_init_lock(c);
+	return c;
+}
+
+usize cache_num_frames(struct blk_cache *c)
+{
+	return c->map != NULL ? 0 : c->num_frames;
+}
+
+void cache_free(struct blk_cache *c)
+{
+	cache_flush(c);
+	if (c->map != NULL) {
+		munmap(c->map, c->map_len);
+	}
+	pthread_mutex_destroy(&c->lock);
+	_free_mem(c);
+}
+
+u8 *_frame_mem(struct blk_cache *c, usize frame_num)
+{
+	return c->frames[frame_num].mem;
+}
+
+usize *_bucket_of(struct blk_cache *c, usize blk_num)
+{
+	return &c->buckets[blk_num & (c->num_buckets - 1)];
+}
+
+usize _lookup(struct blk_cache *c, usize blk_num)
+{
+	usize frame_num = *_bucket_of(c, blk_num);
+	while (frame_num != NO_FRAME
+	       && c->frames[frame_num].blk_num != blk_num) {
+		frame_num = c->frames[frame_num].hash_next;
+	}
+	return frame_num;
+}
+
+void _unhash(struct blk_cache *c, usize frame_num)
+{
+	usize *link = _bucket_of(c, c->frames[frame_num].blk_num);
+	while (*link != frame_num) {
+		link = &c->frames[*link].hash_next;
+	}
+	*link = c->frames[frame_num].hash_next;
+}
+
+/*
+ * Reads @len bytes at byte @offset of the backing file into @dest. Whatever
+ * lies past the end of a short backing file reads as zeros.
+ */
+void _read_at(struct blk_cache *c, usize offset, u8 *dest, usize len)
+{
+	ssize_t num_read = pread(c->fd, dest, len, offset);
+	if (num_read < 0) {
+		num_read = 0;
+	}
+	memset(dest + num_read, 0, len - num_read);
+}
+
+u8 _write_back(struct blk_cache *c, usize frame_num)
+{
+	struct _frame *fr = &c->frames[frame_num];
+	ssize_t num_written = pwrite(c->fd, _frame_mem(c, frame_num),
+				     c->blk_size, fr->blk_num * c->blk_size);
+	fr->dirty = false;
+	return num_written != (ssize_t) c->blk_size;
+}
+
+/*
+ * Sizes the buckets for the frames and hashes every valid frame into them
+ * afresh. If there's no memory for more buckets, the ones there are take
+ * longer chains.
+ *
+ * Returns 1 if there are no buckets at all.
+ */
+u8 _rehash(struct blk_cache *c)
+{
+	usize num_buckets = 1;
+	while (num_buckets < 2 * c->num_frames) {
+		num_buckets <<= 1;
+	}
+	usize *buckets = realloc(c->buckets, num_buckets * sizeof(*buckets));
+	if (buckets != NULL) {
+		c->buckets = buckets;
+		c->num_buckets = num_buckets;
+	} else if (c->buckets == NULL) {
+		return 1;
+	}
+	for (usize i = 0; i < c->num_buckets; ++i) {
+		c->buckets[i] = NO_FRAME;
+	}
+	for (usize i = 0; i < c->num_frames; ++i) {
+		if (c->frames[i].valid) {
+			usize *bucket = _bucket_of(c, c->frames[i].blk_num);
+			c->frames[i].hash_next = *bucket;
+			*bucket = i;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Doubles the number of frames, returning the first of the new (free) ones, or
+ * `NO_FRAME` if there's no memory for them, in which case the cache has failed.
+ * Frame memory never moves. A mapped cache's frames get theirs when they are
+ * put to use.
+ */
+usize _grow(struct blk_cache *c)
+{
+	usize old_len = c->num_frames;
+	usize new_len = 2 * old_len;
+	struct _frame *frames = realloc(c->frames, new_len * sizeof(*frames));
+	if (frames == NULL) {
+		c->failed = true;
+		return NO_FRAME;
+	}
+	c->frames = frames;
+	memset(c->frames + old_len, 0,
+	       (new_len - old_len) * sizeof(*c->frames));
+	if (c->map == NULL) {
+		u8 *mem = malloc((new_len - old_len) * c->blk_size);
+		u8 **mems = mem == NULL
+			? NULL
+			: realloc(c->mems,
+				  (c->num_mems + 1) * sizeof(*c->mems));
+		if (mems == NULL) {
+			free(mem);
+			c->failed = true;
+			return NO_FRAME;
+		}
+		c->mems = mems;
+		c->mems[c->num_mems] = mem;
+		c->num_mems += 1;
+		for (usize i = old_len; i < new_len; ++i) {
+			c->frames[i].mem = mem + (i - old_len) * c->blk_size;
+		}
+	}
+	c->num_frames = new_len;
+	_rehash(c);
+	return old_len;
+}
+
+/*
+ * Returns the frame tracking block @blk_num of a mapped cache, putting the next
+ * free one to use if there is none yet, or `NO_FRAME` if the cache couldn't
+ * grow to make one
+ */
+usize _track(struct blk_cache *c, usize blk_num)
+{
+	usize frame_num = _lookup(c, blk_num);
+	if (frame_num != NO_FRAME) {
+		return frame_num;
+	}
+	if (c->num_tracked == c->num_frames
+	    && _grow(c) == NO_FRAME) {
+		return NO_FRAME;
+	}
+	frame_num = c->num_tracked;
+	c->num_tracked += 1;
+	struct _frame *fr = &c->frames[frame_num];
+	fr->blk_num = blk_num;
+	fr->mem = c->map + blk_num * c->blk_size;
+	fr->valid = true;
+	usize *bucket = _bucket_of(c, blk_num);
+	fr->hash_next = *bucket;
+	*bucket = frame_num;
+	return frame_num;
+}
+
+/*
+ * Sweeps the clock hand until it finds a frame that hasn't been referenced
+ * since the last sweep, writing it back if needed
+ *
+ * Frames held for the journal and pinned frames are passed over. Metadata is
+ * only committed between calls, never halfway through one, so if nothing else
+ * is left the cache grows instead, returning `NO_FRAME` if it can't.
+ */
+usize _evict(struct blk_cache *c)
+{
+	// Two sweeps clear every reference bit
+	for (usize i = 0; i < 2 * c->num_frames; ++i) {
+		usize frame_num = c->clock_hand;
+		struct _frame *fr = &c->frames[frame_num];
+		c->clock_hand = (c->clock_hand + 1) % c->num_frames;
+
+		if (!fr->valid) {
+			return frame_num;
+		}
+		if (fr->meta || fr->pins > 0) {
+			continue;
+		}
+		if (fr->ref) {
+			fr->ref = false;
+			continue;
+		}
+		if (fr->dirty) {
+			_write_back(c, frame_num);
+		}
+		_unhash(c, frame_num);
+		fr->valid = false;
+		return frame_num;
+	}
+	return _grow(c);
+}
+
+u8 *_get(struct blk_cache *c, usize blk_num, bool fill)
+{
+	if (c->map != NULL) {
+		assert((blk_num + 1) * c->blk_size <= c->map_len);
+		return c->map + blk_num * c->blk_size;
+	}
+
+	usize frame_num = _lookup(c, blk_num);
+	if (frame_num != NO_FRAME) {
+		c->frames[frame_num].ref = true;
+		return _frame_mem(c, frame_num);
+	}
+
+	frame_num = _evict(c);
+	if (frame_num == NO_FRAME) {
+		return NULL;
+	}
+	struct _frame *fr = &c->frames[frame_num];
+	u8 *mem = _frame_mem(c, frame_num);
+	if (fill) {
+		_read_at(c, blk_num * c->blk_size, mem, c->blk_size);
+	}
+	fr->blk_num = blk_num;
+	fr->valid = true;
+	fr->dirty = false;
+	fr->meta = false;
+	fr->pins = 0;
+	fr->ref = true;
+
+	usize *bucket = _bucket_of(c, blk_num);
+	fr->hash_next = *bucket;
+	*bucket = frame_num;
+	return mem;
+}
+
+/*
+ * Reads the uncached blocks from @blk_num on, up to @num_blks of them, with a
+ * single read, and caches them in order for as long as @keep (if not NULL)
+ * approves of them. Returns how many were cached.
+ */
+usize _prefetch(struct blk_cache *c, usize blk_num, usize num_blks,
+		bool keep(void *, usize, const u8 *), void *arg)
+{
+	if (c->map != NULL) {
+		madvise(c->map + blk_num * c->blk_size, num_blks * c->blk_size,
+			MADV_WILLNEED);
+		usize num_kept = 0;
+		while (num_kept < num_blks) {
+			usize blk = blk_num + num_kept;
+			if (keep != NULL
+			    && !keep(arg, blk, c->map + blk * c->blk_size)) {
+				break;
+			}
+			num_kept += 1;
+		}
+		return num_kept;
+	}
+
+	// Leave room so the run doesn't evict itself
+	if (num_blks > c->num_frames / 2) {
+		num_blks = c->num_frames / 2;
+	}
+	usize run_len = 0;
+	while (run_len < num_blks
+	       && _lookup(c, blk_num + run_len) == NO_FRAME) {
+		run_len += 1;
+	}
+	if (run_len == 0) {
+		return 0;
+	}
+
+	// Reading ahead is only ever a hint, so it just stops short without
+	// the memory for it
+	u8 *run = malloc(run_len * c->blk_size);
+	if (run == NULL) {
+		return 0;
+	}
+	_read_at(c, blk_num * c->blk_size, run, run_len * c->blk_size);
+	usize num_kept = 0;
+	while (num_kept < run_len) {
+		u8 *src = run + num_kept * c->blk_size;
+		if (keep != NULL && !keep(arg, blk_num + num_kept, src)) {
+			break;
+		}
+		u8 *mem = _get(c, blk_num + num_kept, false);
+		if (mem == NULL) {
+			break;
+		}
+		memcpy(mem, src, c->blk_size);
+		num_kept += 1;
+	}
+	free(run);
+	return num_kept;
+}
+
+void _mark_dirty(struct blk_cache *c, usize blk_num)
+{
+	usize frame_num = c->map != NULL ? _track(c, blk_num)
+					 : _lookup(c, blk_num);
+	// Only a mapped cache that couldn't grow loses track of a block
+	assert(frame_num != NO_FRAME || c->failed);
+	if (frame_num != NO_FRAME) {
+		c->frames[frame_num].dirty = true;
+	}
+}
+
+void _mark_meta(struct blk_cache *c, usize blk_num)
+{
+	_mark_dirty(c, blk_num);
+	usize frame_num = _lookup(c, blk_num);
+	if (c->journal == NULL || frame_num == NO_FRAME) {
+		return;
+	}
+	struct _frame *fr = &c->frames[frame_num];
+	if (!fr->meta) {
+		fr->meta = true;
+		c->num_meta += 1;
+	}
+}
+
+void cache_set_journal(struct blk_cache *c, struct journal *j)
+{
+	c->journal = j;
+}
+
+bool cache_needs_commit(struct blk_cache *c, usize reserve)
+{
+	if (c->journal == NULL) {
+		return false;
+	}
+	usize cap = journal_capacity(c->journal);
+	usize limit = cap > reserve ? cap - reserve : 0;
+	// A mapped cache never runs out of room
+	if (c->map == NULL && limit > c->num_frames / 2) {
+		limit = c->num_frames / 2;
+	}
+	cache_lock(c);
+	bool needs_commit = c->num_meta > 0 && c->num_meta >= limit;
+	cache_unlock(c);
+	return needs_commit;
+}
+
+struct _dirty_frame {
+	usize blk_num;
+	usize frame_num;
+};
+
+int _cmp_dirty_frame(const void *a, const void *b)
+{
+	usize blk_a = ((struct _dirty_frame *) a)->blk_num;
+	usize blk_b = ((struct _dirty_frame *) b)->blk_num;
+	return (blk_a > blk_b) - (blk_a < blk_b);
+}
+
+/*
+ * Writes back the @len dirty frames in @run, which hold consecutive blocks,
+ * with a single `pwritev`
+ */
+u8 _write_back_run(struct blk_cache *c, struct _dirty_frame *run, usize len)
+{
+	struct iovec iov[len];
+	for (usize i = 0; i < len; ++i) {
+		iov[i].iov_base = _frame_mem(c, run[i].frame_num);
+		iov[i].iov_len = c->blk_size;
+		c->frames[run[i].frame_num].dirty = false;
+	}
+	off_t offset = run[0].blk_num * c->blk_size;
+	ssize_t num_written = pwritev(c->fd, iov, len, offset);
+	return num_written != (ssize_t) (len * c->blk_size);
+}
+
+/*
+ * Collects the dirty frames that are (or, if not @meta, aren't) held for the
+ * journal, in block order. Returns how many there are.
+ */
+usize _collect_dirty(struct blk_cache *c, bool meta, struct _dirty_frame *dirty)
+{
+	usize num_dirty = 0;
+	for (usize i = 0; i < c->num_frames; ++i) {
+		struct _frame *fr = &c->frames[i];
+		if (fr->valid && fr->dirty && fr->meta == meta) {
+			dirty[num_dirty].blk_num = fr->blk_num;
+			dirty[num_dirty].frame_num = i;
+			num_dirty += 1;
+		}
+	}
+	qsort(dirty, num_dirty, sizeof(*dirty), _cmp_dirty_frame);
+	return num_dirty;
+}
+
+/*
+ * Writes back the @num_dirty frames of @dirty, with runs of consecutive blocks
+ * going out as one write
+ */
+u8 _write_back_sorted(struct blk_cache *c, struct _dirty_frame *dirty,
+		      usize num_dirty)
+{
+	u8 ret = 0;
+	usize run_start = 0;
+	for (usize i = 1; i <= num_dirty; ++i) {
+		bool run_ends = i == num_dirty
+			|| i - run_start == MAX_WRITE_BACK_RUN
+			|| dirty[i].blk_num != dirty[i - 1].blk_num + 1;
+		if (run_ends) {
+			ret |= _write_back_run(c, dirty + run_start,
+					       i - run_start);
+			run_start = i;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Logs every frame held for the journal as one transaction, then writes them in
+ * place and releases them
+ *
+ * A transaction is all or nothing, so if they don't fit, nothing is written and
+ * they stay held.
+ */
+u8 _commit(struct blk_cache *c)
+{
+	if (c->num_meta > journal_capacity(c->journal)) {
+		return 1;
+	}
+	struct _dirty_frame *dirty = malloc(c->num_frames * sizeof(*dirty));
+	usize num_dirty = dirty == NULL ? 0 : _collect_dirty(c, true, dirty);
+	usize *blk_nums = malloc(num_dirty * sizeof(*blk_nums));
+	u8 **blks = malloc(num_dirty * sizeof(*blks));
+	if (dirty == NULL || blk_nums == NULL || blks == NULL) {
+		free(blks);
+		free(blk_nums);
+		free(dirty);
+		return 1;
+	}
+	for (usize i = 0; i < num_dirty; ++i) {
+		blk_nums[i] = dirty[i].blk_num;
+		blks[i] = _frame_mem(c, dirty[i].frame_num);
+	}
+
+	// Nothing may be written in place without its transaction
+	u8 ret = journal_commit(c->journal, blk_nums, blks, num_dirty);
+	if (!ret) {
+		ret = _write_back_sorted(c, dirty, num_dirty);
+		for (usize i = 0; i < num_dirty; ++i) {
+			c->frames[dirty[i].frame_num].meta = false;
+		}
+		c->num_meta = 0;
+	}
+	free(blks);
+	free(blk_nums);
+	free(dirty);
+	return ret;
+}
+
+/*
+ * Drops the mapping's private copies of the pages holding the @num_blks sorted
+ * blocks of @blks, which have all been written back, so they read from the
+ * file again. Runs of consecutive blocks are dropped together.
+ */
+void _drop_pages(struct blk_cache *c, struct _dirty_frame *blks,
+		 usize num_blks)
+{
+	usize page_len = sysconf(_SC_PAGESIZE);
+	usize run_start = 0;
+	for (usize i = 1; i <= num_blks; ++i) {
+		bool run_ends = i == num_blks
+			|| blks[i].blk_num != blks[i - 1].blk_num + 1;
+		if (!run_ends) {
+			continue;
+		}
+		usize lo = blks[run_start].blk_num * c->blk_size;
+		usize hi = (blks[i - 1].blk_num + 1) * c->blk_size;
+		lo = lo / page_len * page_len;
+		hi = (hi + page_len - 1) / page_len * page_len;
+		if (hi > c->map_len) {
+			hi = c->map_len;
+		}
+		madvise(c->map + lo, hi - lo, MADV_DONTNEED);
+		run_start = i;
+	}
+}
+
+/*
+ * Stops tracking the blocks of a mapped cache that have been written back, and
+ * drops their pages, unless one may still be shared with a block held for the
+ * journal
+ */
+void _untrack_clean(struct blk_cache *c)
+{
+	struct _dirty_frame *blks = c->num_meta == 0
+		? malloc(c->num_tracked * sizeof(*blks))
+		: NULL;
+	if (blks != NULL) {
+		for (usize i = 0; i < c->num_tracked; ++i) {
+			blks[i].blk_num = c->frames[i].blk_num;
+			blks[i].frame_num = i;
+		}
+		qsort(blks, c->num_tracked, sizeof(*blks), _cmp_dirty_frame);
+		_drop_pages(c, blks, c->num_tracked);
+		free(blks);
+	}
+
+	usize num_kept = 0;
+	for (usize i = 0; i < c->num_tracked; ++i) {
+		if (c->frames[i].dirty) {
+			c->frames[num_kept] = c->frames[i];
+			num_kept += 1;
+		}
+	}
+	memset(c->frames + num_kept, 0,
+	       (c->num_tracked - num_kept) * sizeof(*c->frames));
+	c->num_tracked = num_kept;
+	_rehash(c);
+}
+
+/*
+ * Dirty frames are written in block order, and runs of consecutive blocks go
+ * out as one write. Data is written before the metadata transaction that may
+ * point at it, which `journal_commit` syncs before logging anything; if that
+ * fails, the metadata stays held.
+ */
+u8 _flush_frames(struct blk_cache *c)
+{
+	struct _dirty_frame *dirty = malloc(c->num_frames * sizeof(*dirty));
+	if (c->failed || dirty == NULL) {
+		free(dirty);
+		return 1;
+	}
+	usize num_dirty = _collect_dirty(c, false, dirty);
+	u8 ret = _write_back_sorted(c, dirty, num_dirty);
+	free(dirty);
+
+	if (c->num_meta > 0) {
+		// Committing would point at data that never got written
+		ret = ret ? 1 : _commit(c);
+	}
+	if (c->map != NULL) {
+		_untrack_clean(c);
+	}
+	return ret;
+}
+
+u8 *cache_pin(struct blk_cache *c, usize blk_num)
+{
+	cache_lock(c);
+	u8 *mem = _get(c, blk_num, true);
+	if (c->map == NULL && mem != NULL) {
+		c->frames[_lookup(c, blk_num)].pins += 1;
+	}
+	cache_unlock(c);
+	return mem;
+}
+
+void cache_unpin(struct blk_cache *c, usize blk_num)
+{
+	if (c->map != NULL) {
+		return;
+	}
+	cache_lock(c);
+	struct _frame *fr = &c->frames[_lookup(c, blk_num)];
+	assert(fr->pins > 0);
+	fr->pins -= 1;
+	cache_unlock(c);
+}
+
+void cache_lock(struct blk_cache *c)
+{
+	pthread_mutex_lock(&c->lock);
+}
+
+void cache_unlock(struct blk_cache *c)
+{
+	pthread_mutex_unlock(&c->lock);
+}
+
+u8 *cache_get(struct blk_cache *c, usize blk_num, bool fill)
+{
+	cache_lock(c);
+	u8 *mem = _get(c, blk_num, fill);
+	cache_unlock(c);
+	return mem;
+}
+
+void cache_prefetch(struct blk_cache *c, usize blk_num, usize num_blks)
+{
+	cache_lock(c);
+	_prefetch(c, blk_num, num_blks, NULL, NULL);
+	cache_unlock(c);
+}
+
+usize cache_prefetch_if(struct blk_cache *c, usize blk_num, usize num_blks,
+			bool keep(void *, usize, const u8 *), void *arg)
+{
+	cache_lock(c);
+	usize num_kept = _prefetch(c, blk_num, num_blks, keep, arg);
+	cache_unlock(c);
+	return num_kept;
+}
+
+void cache_mark_dirty(struct blk_cache *c, usize blk_num)
+{
+	cache_lock(c);
+	_mark_dirty(c, blk_num);
+	cache_unlock(c);
+}
+
+void cache_mark_meta(struct blk_cache *c, usize blk_num)
+{
+	cache_lock(c);
+	_mark_meta(c, blk_num);
+	cache_unlock(c);
+}
+
+/*
+ * Transfers the @len bytes at byte @offset of the backing file, all of them
+ * uncached, between there and @buf. Shaped to be `cache_split_direct`'s issue,
+ * with the cache as @arg.
+ */
+u8 _direct_io(void *arg, usize offset, u8 *buf, usize len, bool write)
+{
+	struct blk_cache *c = arg;
+	if (!write) {
+		_read_at(c, offset, buf, len);
+		return 0;
+	}
+	return pwrite(c->fd, buf, len, offset) != (ssize_t) len;
+}
+
+u8 cache_split_direct(struct blk_cache *c, usize blk_num, usize offset,
+		      usize len, u8 *buf, bool write,
+		      u8 issue(void *, usize, u8 *, usize, bool), void *arg)
+{
+	usize start = blk_num * c->blk_size + offset;
+	usize end = start + len;
+	if (c->map != NULL) {
+		assert(end <= c->map_len);
+		if (!write) {
+			memcpy(buf, c->map + start, len);
+			return 0;
+		}
+		// A flush may be dropping the mapping's copies of the pages
+		cache_lock(c);
+		memcpy(c->map + start, buf, len);
+		for (usize blk = start / c->blk_size; blk * c->blk_size < end;
+		     ++blk) {
+			_mark_dirty(c, blk);
+		}
+		cache_unlock(c);
+		return 0;
+	}
+
+	u8 ret = 0;
+	// Start of the stretch of uncached blocks not yet transferred
+	usize uncached = start;
+	usize pos = start;
+	while (pos < end) {
+		usize blk = pos / c->blk_size;
+		usize chunk_end = (blk + 1) * c->blk_size;
+		if (chunk_end > end) {
+			chunk_end = end;
+		}
+
+		cache_lock(c);
+		usize frame_num = _lookup(c, blk);
+		if (frame_num != NO_FRAME) {
+			u8 *mem = _frame_mem(c, frame_num) + pos % c->blk_size;
+			u8 *user = buf + (pos - start);
+			if (write) {
+				memcpy(mem, user, chunk_end - pos);
+				_mark_dirty(c, blk);
+			} else {
+				memcpy(user, mem, chunk_end - pos);
+			}
+		}
+		cache_unlock(c);
+
+		if (frame_num != NO_FRAME) {
+			if (pos > uncached) {
+				ret |= issue(arg, uncached,
+					     buf + (uncached - start),
+					     pos - uncached, write);
+			}
+			uncached = chunk_end;
+		}
+		pos = chunk_end;
+	}
+	if (end > uncached) {
+		ret |= issue(arg, uncached, buf + (uncached - start),
+			     end - uncached, write);
+	}
+	return ret;
+}
+
+/*
+ * Moves @len bytes between @buf and the file, starting @offset bytes into
+ * block @blk_num. The cache's lock is only held to look up and copy each
+ * cached block, never across a transfer with the file.
+ */
+u8 _direct(struct blk_cache *c, usize blk_num, usize offset, usize len,
+	   u8 *buf, bool write)
+{
+	return cache_split_direct(c, blk_num, offset, len, buf, write,
+				  _direct_io, c);
+}
+
+u8 cache_read_direct(struct blk_cache *c, usize blk_num, usize offset,
+		     usize len, u8 *dest)
+{
+	return _direct(c, blk_num, offset, len, dest, false);
+}
+
+u8 cache_write_direct(struct blk_cache *c, usize blk_num, usize offset,
+		      usize len, const u8 *src)
+{
+	return _direct(c, blk_num, offset, len, (u8 *) src, true);
+}
+
+void cache_update_clean(struct blk_cache *c, usize offset, const u8 *src,
+			usize len)
+{
+	if (c->map != NULL) {
+		return;
+	}
+	usize end = offset + len;
+	cache_lock(c);
+	for (usize pos = offset; pos < end;) {
+		usize blk = pos / c->blk_size;
+		usize chunk_end = (blk + 1) * c->blk_size;
+		if (chunk_end > end) {
+			chunk_end = end;
+		}
+		usize frame_num = _lookup(c, blk);
+		if (frame_num != NO_FRAME && !c->frames[frame_num].dirty) {
+			memcpy(_frame_mem(c, frame_num) + pos % c->blk_size,
+			       src + (pos - offset), chunk_end - pos);
+		}
+		pos = chunk_end;
+	}
+	cache_unlock(c);
+}
+
+int _cmp_vec(const void *a, const void *b)
+{
+	const struct cache_vec *vec_a = a;
+	const struct cache_vec *vec_b = b;
+	if (vec_a->blk_num != vec_b->blk_num) {
+		return (vec_a->blk_num > vec_b->blk_num)
+			- (vec_a->blk_num < vec_b->blk_num);
+	}
+	return (vec_a->offset > vec_b->offset)
+		- (vec_a->offset < vec_b->offset);
+}
+
+/*
+ * Issues the @num_iov buffers of @iov as one transfer of @len bytes at byte
+ * @offset of the backing file
+ */
+u8 _vec_io(struct blk_cache *c, struct iovec *iov, usize num_iov, usize offset,
+	   usize len, bool write)
+{
+	if (num_iov == 0) {
+		return 0;
+	}
+	ssize_t num_done = write
+		? pwritev(c->fd, iov, num_iov, offset)
+		: preadv(c->fd, iov, num_iov, offset);
+	return num_done != (ssize_t) len;
+}
+
+u8 _transfer_vecs(struct blk_cache *c, struct cache_vec *vecs, usize num_vecs,
+		  bool write)
+{
+	if (num_vecs == 0) {
+		return 0;
+	}
+	qsort(vecs, num_vecs, sizeof(*vecs), _cmp_vec);
+	if (c->map != NULL) {
+		u8 ret = 0;
+		for (usize i = 0; i < num_vecs; ++i) {
+			ret |= _direct(c, vecs[i].blk_num, vecs[i].offset,
+				       vecs[i].len, vecs[i].buf, write);
+		}
+		return ret;
+	}
+
+	// Reading what lies between two nearby pieces beats a second read
+	usize max_gap = write ? 0 : 2 * c->blk_size;
+	u8 *scratch = write ? NULL : malloc(max_gap);
+	usize iov_max = sysconf(_SC_IOV_MAX);
+	struct iovec *iov = malloc(iov_max * sizeof(*iov));
+	usize num_iov = 0;
+	// The transfer being built covers [io_start, io_end) of the file
+	usize io_start = 0;
+	usize io_end = 0;
+
+	u8 ret = 0;
+	for (usize i = 0; i < num_vecs; ++i) {
+		struct cache_vec *vec = &vecs[i];
+		cache_lock(c);
+		usize frame_num = _lookup(c, vec->blk_num);
+		if (frame_num != NO_FRAME) {
+			u8 *mem = _frame_mem(c, frame_num) + vec->offset;
+			if (write) {
+				memcpy(mem, vec->buf, vec->len);
+				_mark_dirty(c, vec->blk_num);
+			} else {
+				memcpy(vec->buf, mem, vec->len);
+			}
+		}
+		cache_unlock(c);
+		if (frame_num != NO_FRAME) {
+			continue;
+		}
+
+		usize start = vec->blk_num * c->blk_size + vec->offset;
+		bool joins = num_iov > 0 && num_iov + 2 <= iov_max
+			&& start >= io_end && start - io_end <= max_gap;
+		if (!joins) {
+			ret |= _vec_io(c, iov, num_iov, io_start,
+				       io_end - io_start, write);
+			num_iov = 0;
+			io_start = start;
+			io_end = start;
+		}
+		if (start > io_end) {
+			iov[num_iov].iov_base = scratch;
+			iov[num_iov].iov_len = start - io_end;
+			num_iov += 1;
+		}
+		iov[num_iov].iov_base = vec->buf;
+		iov[num_iov].iov_len = vec->len;
+		num_iov += 1;
+		io_end = start + vec->len;
+	}
+	ret |= _vec_io(c, iov, num_iov, io_start, io_end - io_start, write);
+
+	free(iov);
+	free(scratch);
+	return ret;
+}
+
+u8 cache_readv(struct blk_cache *c, struct cache_vec *vecs, usize num_vecs)
+{
+	return _transfer_vecs(c, vecs, num_vecs, false);
+}
+
+u8 cache_writev(struct blk_cache *c, struct cache_vec *vecs, usize num_vecs)
+{
+	return _transfer_vecs(c, vecs, num_vecs, true);
+}
+
+bool cache_failed(struct blk_cache *c)
+{
+	cache_lock(c);
+	bool failed = c->failed;
+	cache_unlock(c);
+	return failed;
+}
+
+u8 cache_flush(struct blk_cache *c)
+{
+	cache_lock(c);
+	u8 ret = _flush_frames(c);
+	cache_unlock(c);
+	return ret;
+}
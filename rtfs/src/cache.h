@@ -0,0 +1,206 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <tberry/types.h>
+
+#include "journal.h"
+
+/*
+ * Used when `fs_load` is asked for a cache of 0 blocks
+ */
+#define CACHE_DEFAULT_LEN 64
+
+/*
+ * Block-sized frames over the backing file, keyed by the absolute block number.
+ * Frames are evicted in CLOCK order and dirty frames are written back on
+ * eviction or on `cache_flush`. When every frame is pinned or holds metadata
+ * not yet committed, the cache grows instead, for good. If it can't, the block
+ * asked for gets no frame and the cache has failed: see `cache_failed`.
+ *
+ * The backing file is only accessed with `pread` / `pwrite` at explicit
+ * offsets, so there is no shared file position between threads.
+ */
+struct blk_cache;
+
+/*
+ * Allocates a cache of @num_frames frames, each @blk_size bytes, over the file
+ * @fd, which must be open for reading and writing
+ *
+ * Returns NULL if the frames could not be allocated.
+ */
+struct blk_cache *cache_new(int fd, usize blk_size, usize num_frames);
+
+/*
+ * Maps all @disk_size bytes of @fd into memory, privately, instead of keeping
+ * frames; every block is then always "cached". The blocks marked dirty are
+ * written back by `cache_flush` as they would be from frames, metadata going
+ * through the journal first.
+ *
+ * Returns NULL if the file could not be mapped, or the frames allocated.
+ */
+struct blk_cache *cache_new_mmap(int fd, usize blk_size, usize disk_size);
+
+/*
+ * Returns how many blocks @c keeps in memory at once, or 0 if it maps the whole
+ * file
+ */
+usize cache_num_frames(struct blk_cache *c);
+
+/*
+ * Writes back any dirty frames, then releases the cache
+ */
+void cache_free(struct blk_cache *c);
+
+/*
+ * Returns the memory of the frame holding block @blk_num, reading it in from
+ * the backing file if it is not yet cached.
+ *
+ * If @fill is false, the caller promises to overwrite the whole block, so a
+ * missing block is not read in first.
+ *
+ * Returns NULL if the block had no frame and the cache couldn't grow to give it
+ * one.
+ *
+ * The returned pointer is only valid until the next call into the cache, from
+ * any thread; hold `cache_lock` for as long as it is used.
+ */
+u8 *cache_get(struct blk_cache *c, usize blk_num, bool fill);
+
+/*
+ * Like `cache_get`, but the block stays cached and the returned pointer valid
+ * until a matching `cache_unpin`. Nothing is pinned if NULL is returned.
+ */
+u8 *cache_pin(struct blk_cache *c, usize blk_num);
+
+void cache_unpin(struct blk_cache *c, usize blk_num);
+
+/*
+ * Excludes every other thread from @c until `cache_unlock`. The holder may
+ * still call into the cache, and may take it more than once.
+ */
+void cache_lock(struct blk_cache *c);
+
+void cache_unlock(struct blk_cache *c);
+
+/*
+ * Reads the @num_blks blocks starting at @blk_num into the cache with a single
+ * read, stopping early at the first block that is already cached
+ */
+void cache_prefetch(struct blk_cache *c, usize blk_num, usize num_blks);
+
+/*
+ * Like `cache_prefetch`, but hands each block read to @keep, along with @arg,
+ * and only caches blocks up to the first one it turns down. Returns how many
+ * were cached.
+ *
+ * The whole read is done under the cache's lock, so blocks @keep turns down
+ * are never seen by anyone else.
+ */
+usize cache_prefetch_if(struct blk_cache *c, usize blk_num, usize num_blks,
+			bool keep(void *, usize, const u8 *), void *arg);
+
+/*
+ * Copies the @len bytes starting @offset bytes into block @blk_num (running on
+ * into the blocks after it) into @dest. Blocks that are cached are copied from
+ * their frames; the rest are read straight into @dest, each stretch of them
+ * with a single read, and are not cached.
+ *
+ * The caller keeps the uncached blocks from being written meanwhile.
+ */
+u8 cache_read_direct(struct blk_cache *c, usize blk_num, usize offset,
+		     usize len, u8 *dest);
+
+/*
+ * Like `cache_read_direct`, but writes @src. Cached blocks are updated in their
+ * frames and marked dirty, while the rest are written straight to the backing
+ * file.
+ */
+u8 cache_write_direct(struct blk_cache *c, usize blk_num, usize offset,
+		      usize len, const u8 *src);
+
+/*
+ * Splits a transfer like `cache_read_direct` / `cache_write_direct`'s, copying
+ * cached blocks to or from their frames at once, but hands each stretch of
+ * uncached blocks to @issue instead of transferring it: @arg, the byte offset
+ * in the backing file, where in @buf it goes, its length and @write. Returns
+ * the OR of what @issue returned.
+ */
+u8 cache_split_direct(struct blk_cache *c, usize blk_num, usize offset,
+		      usize len, u8 *buf, bool write,
+		      u8 issue(void *, usize, u8 *, usize, bool), void *arg);
+
+/*
+ * Copies the @len bytes of @src, just written at byte @offset of the backing
+ * file behind the cache's back, into the clean frames caching any of them, so
+ * none of them goes stale. Dirty frames are left alone.
+ */
+void cache_update_clean(struct blk_cache *c, usize offset, const u8 *src,
+			usize len);
+
+/*
+ * A piece of a vectored transfer, lying within a single block: @len bytes
+ * starting @offset bytes into block @blk_num, to or from @buf
+ */
+struct cache_vec {
+	usize blk_num;
+	usize offset;
+	usize len;
+	u8 *buf;
+};
+
+/*
+ * Reads the @num_vecs pieces in @vecs, sorting them by position in the backing
+ * file. Cached blocks are copied from their frames; pieces of uncached blocks
+ * that lie close together are read with a single `preadv`, the bytes between
+ * them going to a scratch buffer. Nothing new is cached.
+ *
+ * The caller keeps the uncached blocks from being written meanwhile.
+ */
+u8 cache_readv(struct blk_cache *c, struct cache_vec *vecs, usize num_vecs);
+
+/*
+ * Like `cache_readv`, but writes the pieces. Only pieces that are exactly
+ * adjacent share a `pwritev`. Overlapping pieces land in no particular order.
+ */
+u8 cache_writev(struct blk_cache *c, struct cache_vec *vecs, usize num_vecs);
+
+/*
+ * Marks the (cached) block @blk_num as needing to be written back
+ */
+void cache_mark_dirty(struct blk_cache *c, usize blk_num);
+
+/*
+ * Marks the (cached) block @blk_num as dirty metadata. With a journal, it then
+ * stays cached until a flush commits it, and only then is written in place.
+ */
+void cache_mark_meta(struct blk_cache *c, usize blk_num);
+
+/*
+ * Sends metadata through @j from now on
+ */
+void cache_set_journal(struct blk_cache *c, struct journal *j);
+
+/*
+ * Returns true once the metadata held for the journal leaves room for fewer
+ * than @reserve more blocks in its transaction, or takes up half the cache
+ */
+bool cache_needs_commit(struct blk_cache *c, usize reserve);
+
+/*
+ * Returns whether a block has been left without a frame since @c was made, so
+ * whatever was done to it was lost. A failed cache flushes nothing more.
+ */
+bool cache_failed(struct blk_cache *c);
+
+/*
+ * Writes back every dirty frame, then flushes the backing file. Frames holding
+ * consecutive blocks are written together, and metadata is committed through
+ * the journal, as one transaction, before being written in place.
+ *
+ * Returns 1 without writing any metadata if it doesn't fit in a transaction; it
+ * then stays held. Returns 1 without writing anything once the cache has
+ * failed.
+ */
+u8 cache_flush(struct blk_cache *c);
+
+#endif /* _CACHE_H */
@@ -0,0 +1,158 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tberry/types.h>
+
+#include "dcache.h"
+
+#define WAYS_PER_SET 4
+
+struct _dentry {
+	usize parent;
+	usize child;
+	u32 hash;
+	bool valid;
+	// CLOCK reference bit
+	bool ref;
+	char name[MAX_FILENAME_LEN + 1];
+};
+
+struct dcache {
+	pthread_mutex_t lock;
+
+	usize num_sets;
+	struct _dentry *entries;
+	// Per-set CLOCK hands
+	u8 *hands;
+};
+
+struct dcache *dcache_new(usize num_entries)
+{
+	if (num_entries == 0) {
+		num_entries = DCACHE_DEFAULT_LEN;
+	}
+	struct dcache *dc = malloc(sizeof(*dc));
+	if (dc == NULL) {
+		return NULL;
+	}
+	dc->num_sets = (num_entries + WAYS_PER_SET - 1) / WAYS_PER_SET;
+	dc->entries = calloc(dc->num_sets * WAYS_PER_SET, sizeof(*dc->entries));
+	dc->hands = calloc(dc->num_sets, sizeof(*dc->hands));
+	if (dc->entries == NULL || dc->hands == NULL) {
+		free(dc->hands);
+		free(dc->entries);
+		free(dc);
+		return NULL;
+	}
+	pthread_mutex_init(&dc->lock, NULL);
+	return dc;
+}
+
+void dcache_free(struct dcache *dc)
+{
+	pthread_mutex_destroy(&dc->lock);
+	free(dc->hands);
+	free(dc->entries);
+	free(dc);
+}
+
+/*
+ * 32 bit FNV-1a over the parent inode num, then the name
+ */
+u32 _dentry_hash(usize parent, char *name)
+{
+	u32 hash = 2166136261u;
+	for (usize i = 0; i < sizeof(parent); ++i) {
+		hash ^= (u8) (parent >> (8 * i));
+		hash *= 16777619u;
+	}
+	for (usize i = 0; name[i] != '\0'; ++i) {
+		hash ^= (u8) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+struct _dentry *_set_of(struct dcache *dc, u32 hash)
+{
+	return &dc->entries[(hash % dc->num_sets) * WAYS_PER_SET];
+}
+
+struct _dentry *_find(struct dcache *dc, u32 hash, usize parent, char *name)
+{
+	struct _dentry *set = _set_of(dc, hash);
+	for (usize i = 0; i < WAYS_PER_SET; ++i) {
+		struct _dentry *d = &set[i];
+		if (d->valid && d->hash == hash && d->parent == parent
+		    && strcmp(d->name, name) == 0) {
+			return d;
+		}
+	}
+	return NULL;
+}
+
+bool dcache_lookup(struct dcache *dc, usize parent, char *name, usize *child)
+{
+	pthread_mutex_lock(&dc->lock);
+	struct _dentry *d = _find(dc, _dentry_hash(parent, name), parent, name);
+	if (d != NULL) {
+		d->ref = true;
+		*child = d->child;
+	}
+	pthread_mutex_unlock(&dc->lock);
+	return d != NULL;
+}
+
+/*
+ * Picks an empty way of the set, or else the first unreferenced one
+ */
+struct _dentry *_victim(struct dcache *dc, u32 hash)
+{
+	struct _dentry *set = _set_of(dc, hash);
+	for (usize i = 0; i < WAYS_PER_SET; ++i) {
+		if (!set[i].valid) {
+			return &set[i];
+		}
+	}
+	u8 *hand = &dc->hands[hash % dc->num_sets];
+	while (set[*hand].ref) {
+		set[*hand].ref = false;
+		*hand = (*hand + 1) % WAYS_PER_SET;
+	}
+	struct _dentry *d = &set[*hand];
+	*hand = (*hand + 1) % WAYS_PER_SET;
+	return d;
+}
+
+void dcache_insert(struct dcache *dc, usize parent, char *name, usize child)
+{
+	if (strlen(name) > MAX_FILENAME_LEN) {
+		return;
+	}
+	u32 hash = _dentry_hash(parent, name);
+	pthread_mutex_lock(&dc->lock);
+	struct _dentry *d = _find(dc, hash, parent, name);
+	if (d == NULL) {
+		d = _victim(dc, hash);
+		d->hash = hash;
+		d->parent = parent;
+		strcpy(d->name, name);
+		d->valid = true;
+	}
+	d->child = child;
+	d->ref = true;
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_purge_parent(struct dcache *dc, usize parent)
+{
+	usize num_entries = dc->num_sets * WAYS_PER_SET;
+	pthread_mutex_lock(&dc->lock);
+	for (usize i = 0; i < num_entries; ++i) {
+		if (dc->entries[i].parent == parent) {
+			dc->entries[i].valid = false;
+		}
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
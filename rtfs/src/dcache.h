@@ -0,0 +1,45 @@
+#ifndef _DCACHE_H
+#define _DCACHE_H
+
+#include <tberry/types.h>
+
+#include "fs.h"
+
+/*
+ * Used when `fs_load` is asked for a dentry cache of 0 entries
+ */
+#define DCACHE_DEFAULT_LEN 4096
+
+/*
+ * Remembers which inode each (parent directory inode, name) pair resolved to,
+ * including names that resolved to nothing. Entries are grouped into small
+ * sets by hash and replaced in CLOCK order within a set.
+ */
+struct dcache;
+
+/*
+ * Allocates room for (about) @num_entries entries, returning NULL if it
+ * couldn't
+ */
+struct dcache *dcache_new(usize num_entries);
+
+void dcache_free(struct dcache *dc);
+
+/*
+ * Returns true and sets @child if (@parent, @name) is cached. @child may be the
+ * value inserted to mean "does not exist".
+ */
+bool dcache_lookup(struct dcache *dc, usize parent, char *name, usize *child);
+
+/*
+ * Caches (@parent, @name) -> @child, replacing any existing entry for the pair
+ */
+void dcache_insert(struct dcache *dc, usize parent, char *name, usize child);
+
+/*
+ * Forgets every entry under @parent, for when that directory is deleted and its
+ * inode may be reused
+ */
+void dcache_purge_parent(struct dcache *dc, usize parent);
+
+#endif /* _DCACHE_H */
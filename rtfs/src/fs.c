@@ -1,650 +1,5391 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include <tberry/futils.h>
 #include <tberry/types.h>
 
+#include "bitmap.h"
+#include "cache.h"
+#include "dcache.h"
 #include "fs.h"
-
-#define INODE_SIZE 4
-#define INODES_PER_BLK (BLK_SIZE / INODE_SIZE)
-#define DATA_BLKS_PER_INODE_BLK INODES_PER_BLK
+#include "journal.h"
+#include "refcount.h"
+#include "uring.h"
+#include "workq.h"
 
 #define SUPER_BLK_OFFSET 0
 #define INODE_TBL_OFFSET 1
 
+#define DISK_SIZE_OFFSET 0
+#define BLK_SIZE_OFFSET sizeof(usize)
+#define NUM_BLKS_OFFSET (2 * sizeof(usize))
+#define NUM_INODE_BLKS_OFFSET (3 * sizeof(usize))
+#define NUM_DATA_BLKS_OFFSET (4 * sizeof(usize))
 #define NEXT_AVL_INODE_OFFSET (5 * sizeof(usize))
 #define NEXT_AVL_BLK_OFFSET (6 * sizeof(usize))
+#define FEATURES_OFFSET (7 * sizeof(usize))
+#define NUM_INODE_BITMAP_BLKS_OFFSET (8 * sizeof(usize))
+#define NUM_BLK_BITMAP_BLKS_OFFSET (9 * sizeof(usize))
+#define NUM_JOURNAL_BLKS_OFFSET (10 * sizeof(usize))
+#define MAGIC_OFFSET (11 * sizeof(usize))
+#define VERSION_OFFSET (12 * sizeof(usize))
+#define INODE_SIZE_OFFSET (13 * sizeof(usize))
+#define NUM_REFCOUNT_BLKS_OFFSET (14 * sizeof(usize))
+
+// Images made before the super block had a magic number are version 1
+#define SUPER_MAGIC 0x5254465353555052
+#define FS_VERSION 5
+
+// Flags of `struct _inode`
+#define INODE_DIR 0x80000000
+#define INODE_OWNER_SHIFT 23
+#define INODE_READ 0x00400000
+#define INODE_WRITE 0x00200000
+
+/*
+ * Bits of the super block `features` field
+ */
+// Files are described by an extent block rather than a chain of data blocks
+#define FEATURE_EXTENTS 0x1
 
 #define DATA_BLK_NEXT_BLK_NUM_OFFSET 0
 #define DATA_BLK_NEXT_BLK_NUM_LEN sizeof(usize)
 #define DATA_BLK_USABLE_OFFSET DATA_BLK_NEXT_BLK_NUM_LEN
 
 #define ROOT_DIR_BLK_NUM 0
+// Data block 0 always belongs to the root directory, so no file ever points to
+// it and it doubles as "no block"
+#define NULL_DATA_BLK_NUM ROOT_DIR_BLK_NUM
+
+// An extent block is `usize size`, `usize num_extents`, then the extents sorted
+// by logical block number. Once a file has more than fit, its extent block
+// indexes leaves laid out the same way, each entry an extent of length 0.
+#define EXT_BLK_SIZE_OFFSET 0
+#define EXT_BLK_NUM_EXTENTS_OFFSET sizeof(usize)
+#define EXT_BLK_TBL_OFFSET (2 * sizeof(usize))
+#define EXT_LEN sizeof(struct _extent)
+#define EXTS_PER_BLK ((fs->layout.blk_size - EXT_BLK_TBL_OFFSET) / EXT_LEN)
+
+// Reads going through a file front to back bring a window of blocks past them
+// into the cache, from this many blocks and doubling each time the reader
+// catches up, to at most a quarter of the cache
+#define MIN_READAHEAD_LEN 4
+#define MAX_READAHEAD_LEN 128
 
-// The first header item is `usize next_blk_ptr`
-#define DIR_BLK_NEXT_AVL_ENTRY_OFFSET sizeof(usize)
-#define DIR_BLK_HEADER_LEN (sizeof(usize) + sizeof(u32))
-#define DIR_BLK_ENTRY_TBL_OFFSET DIR_BLK_HEADER_LEN
+// Reads and writes at least this many blocks long move the blocks they cover
+// whole straight between the caller's buffer and the backing file
+#define MIN_DIRECT_LEN 4
 
-#define DIR_BLK_ENTRY_LEN (sizeof(bool) + MAX_FILENAME_LEN + sizeof(u32))
-// Offsets into the entry
-#define DIR_BLK_ENTRY_IN_USE_OFFSET 0
-#define DIR_BLK_FILENAME_OFFSET (DIR_BLK_ENTRY_IN_USE_OFFSET + sizeof(bool))
-#define DIR_BLK_INODE_OFFSET (DIR_BLK_FILENAME_OFFSET + MAX_FILENAME_LEN)
+// Blocks reserved past the end of a file for its next appends; the reservation
+// doubles each time one runs out
+#define MIN_PREALLOC_LEN 8
+#define MAX_PREALLOC_LEN 256
+
+// Finished requests `fs_reap` collects from the pool at a time
+#define REAP_CHUNK 64
+
+// The super block is never viewed, so a view of it is one with nothing pinned
+#define NO_VIEW_BLK SUPER_BLK_OFFSET
+
+// A directory block starts with `usize next_blk_ptr` (unused with extents), the
+// `u16` number of bytes its records leave unused, and the hash buckets, then
+// holds records laid end to end up to the end of the block. Records are
+// addressed by their offset in the block, so 0 means "no record".
+#define DIR_BLK_FREE_LEN_OFFSET sizeof(usize)
+#define DIR_BLK_BUCKETS_OFFSET (DIR_BLK_FREE_LEN_OFFSET + sizeof(u16))
+#define DIR_BLK_NUM_BUCKETS (fs->layout.blk_size / 32)
+#define DIR_BLK_RECS_OFFSET \
+	(DIR_BLK_BUCKETS_OFFSET + DIR_BLK_NUM_BUCKETS * sizeof(u16))
+#define NULL_REC 0
+// Offsets into a directory block must fit in a `u16`
+#define MAX_BLK_SIZE 65536
+
+// A record is a `struct _dir_rec`, then the name (with no '\0'), then the
+// bytes of a regular file still kept inline
+#define DIR_REC_HDR_LEN (sizeof(u32) + 2 * sizeof(u16) + 2 * sizeof(u8))
+#define DIR_REC_NEXT_OFFSET (sizeof(u32) + sizeof(u16))
+#define MAX_INLINE_LEN 255
+
+// A directory of more than one block is indexed by name hash. Its first block
+// then holds no records: after the next ptr, a mark where the free length
+// would be and the `u16` number of entries, it holds entries of a `u32` hash
+// and the `usize` block holding the names hashed from there on, in hash order.
+// Blocks too many for one index block are split among more of them, which the
+// first indexes in turn.
+#define DIR_IDX_MARK 0xffff
+#define DIR_IDX_LEN_OFFSET (DIR_BLK_FREE_LEN_OFFSET + sizeof(u16))
+#define DIR_IDX_ENTRIES_OFFSET (DIR_IDX_LEN_OFFSET + sizeof(u16))
+#define DIR_IDX_ENTRY_LEN (sizeof(u32) + sizeof(usize))
+#define DIR_IDX_CAP \
+	((fs->layout.blk_size - DIR_IDX_ENTRIES_OFFSET) / DIR_IDX_ENTRY_LEN)
+#define MAX_DIR_IDX_DEPTH 16
+
+#define ROOT_DIR_INODE_NUM 0
+// The root directory is never anyone's child, so its inode num doubles as "no
+// inode"
+#define NULL_INODE_NUM ROOT_DIR_INODE_NUM
+// Returned when a path does not lead to a directory
+#define NULL_DIR_BLK_NUM ((usize) -1)
 
 #define PATH_DELIM "/"
 
+#define NUM_INODE_LOCKS 64
+
+// The most blocks of metadata, beyond the bitmaps, the refcount table and the
+// super block, that one call changes. `fs_create_many` / `fs_delete_many` make
+// a call of each BATCH_LEN names to stay within it.
+#define OP_META_BLKS 128
+#define BATCH_LEN 32
+
 struct _layout {
 	usize disk_size;
 	usize blk_size;
+	usize data_blk_usable_offset;
 	usize data_blk_usable_len;
 	usize num_blks;
 	usize num_inode_blks;
 	usize num_data_blks;
-} layout;
+	usize features;
+	usize num_inode_bitmap_blks;
+	usize num_blk_bitmap_blks;
+	usize num_journal_blks;
+	usize inode_size;
+	usize num_refcount_blks;
+	// Derived: the bitmaps, the refcount table and then the journal sit
+	// between the inode table and the data blocks
+	usize num_inodes;
+	usize inode_bitmap_offset;
+	usize blk_bitmap_offset;
+	usize refcount_offset;
+	usize journal_offset;
+	usize data_blks_offset;
+};
+
+/*
+ * Where the allocators start searching the bitmaps. They are only read from
+ * disk by `fs_load` and only written back by `_checkpoint`.
+ */
+struct _super {
+	usize next_avl_inode;
+	usize next_avl_blk;
+	bool dirty;
+};
+
+/*
+ * A run of @len data blocks starting at @phys, holding the file's blocks
+ * starting at block @logical
+ */
+struct _extent {
+	usize logical;
+	usize phys;
+	usize len;
+};
+
+/*
+ * An inode, as laid out at the start of each entry of the inode table; entries
+ * are the super block's inode size apart, which may leave room after it
+ */
+struct _inode {
+	// `INODE_*` bits, and the owner
+	u32 flags;
+	u32 reserved;
+	// The first data block, or the extent block when files are
+	// extent-mapped
+	usize data_ptr;
+};
+
+/*
+ * The fixed part of a directory record, as laid out on disk. A record with no
+ * inode is free; only the first one in a block can be.
+ */
+struct _dir_rec {
+	u32 inode_num;
+	// Bytes from the record to the next one, including whatever it leaves
+	// unused at its end
+	u16 rec_len;
+	// The next record in the same bucket
+	u16 next;
+	u8 name_len;
+	u8 inline_len;
+};
+
+/*
+ * Where the record of a file kept inline is
+ */
+struct _inline_loc {
+	usize dir_blk_num;
+	usize offset;
+	struct _dir_rec rec;
+};
+
+/*
+ * One loaded image
+ *
+ * Locks are always taken in the order: `op_lock`, an inode lock, `alloc_lock`,
+ * then the cache's own lock. At most one inode lock is held at a time, except
+ * by `fs_read_batch`, which read-locks all of its own in ascending order.
+ */
+struct fs {
+	// The opened backing file, only read and written at explicit offsets
+	int bk_fd;
+	struct _layout layout;
+	struct _super super;
+
+	// Set by `fs_load`: every call that changes the image is flushed before
+	// it returns
+	bool write_through;
+
+	// NULL if the image has no journal
+	struct journal *journal;
+
+	// Block frames over `bk_fd`; every metadata and data access goes
+	// through here
+	struct blk_cache *cache;
+
+	// One bit per inode / data block, set while in use
+	struct bitmap inode_bitmap;
+	struct bitmap blk_bitmap;
+	// How many files beyond the first share each data block, with extents
+	struct refcount_tbl refcounts;
+
+	// (parent inode num, name) -> inode num, for path walks
+	struct dcache *dcache;
+
+	// Runs the requests from `fs_submit_read` / `fs_submit_write`, and
+	// collects them as they finish
+	struct workq *aio;
+	// Carries the requests on extent-mapped files straight to the backing
+	// file, where the kernel has io_uring; NULL otherwise
+	struct uring *ring;
+
+	// A block of zeros, viewed in place of the holes in a file
+	u8 *zero_blk;
+
+	// Longest readahead window, 0 if the cache is too small for one
+	usize max_readahead;
+
+	// Read-held by each call that changes the image, from before it takes
+	// its first inode lock until after it drops its last; write-held to
+	// commit, so no transaction ever holds half of a call
+	pthread_rwlock_t op_lock;
+	// Room left in a transaction for the call that ends next, which may
+	// change every bitmap and refcount block
+	usize op_reserve;
+
+	// Guards the bitmaps, the refcount table and `super`
+	pthread_mutex_t alloc_lock;
+	// Inode i is guarded by lock (i % NUM_INODE_LOCKS): read-held while
+	// reading the file (or looking up names in the directory), write-held
+	// while changing it. A directory's lock is taken before its entries'.
+	pthread_rwlock_t inode_locks[NUM_INODE_LOCKS];
+};
+
+/*
+ * Where the next `_read_*` / `_write_*` call lands, set by `_seek_to_*`. Each
+ * thread has its own.
+ */
+struct _cursor {
+	usize blk_num;
+	usize offset;
+	// Writes here are metadata, committed through the journal
+	bool meta;
+};
+_Thread_local struct _cursor cursor;
+
+/*
+ * Releases whatever of @fs has been set up
+ */
+void _free_fs(struct fs *fs)
+{
+	free(fs->zero_blk);
+	// Its requests finish into the pool's queue
+	if (fs->ring != NULL) {
+		uring_free(fs->ring);
+	}
+	if (fs->aio != NULL) {
+		workq_free(fs->aio);
+	}
+	if (fs->dcache != NULL) {
+		dcache_free(fs->dcache);
+	}
+	if (fs->cache != NULL) {
+		cache_free(fs->cache);
+	}
+	if (fs->journal != NULL) {
+		journal_free(fs->journal);
+	}
+	if (fs->bk_fd >= 0) {
+		close(fs->bk_fd);
+	}
+	pthread_rwlock_destroy(&fs->op_lock);
+	pthread_mutex_destroy(&fs->alloc_lock);
+	for (usize i = 0; i < NUM_INODE_LOCKS; ++i) {
+		pthread_rwlock_destroy(&fs->inode_locks[i]);
+	}
+	free(fs);
+}
+
+/*
+ * Reads the word at byte @offset of the super block, which starts the backing
+ * file, into @word before the cache exists
+ *
+ * Returns 1 if the file ends before the word does.
+ */
+u8 _load_super_word(struct fs *fs, usize offset, usize *word)
+{
+	return pread(fs->bk_fd, word, sizeof(*word), offset) != sizeof(*word);
+}
 
 /*
- * The opened backing file
+ * Returns whether a block of @fs holds the super block, a directory record of
+ * the longest name, two index entries and two extents
  */
-FILE *bk_f;
+bool _blk_size_fits(struct fs *fs)
+{
+	usize blk_size = fs->layout.blk_size;
+	return blk_size >= NUM_REFCOUNT_BLKS_OFFSET + sizeof(usize)
+		&& blk_size >= DIR_BLK_RECS_OFFSET + DIR_REC_HDR_LEN
+			+ MAX_FILENAME_LEN
+		&& DIR_IDX_CAP >= 2
+		&& EXTS_PER_BLK >= 2
+		&& blk_size <= MAX_BLK_SIZE;
+}
 
 /*
- * Loads the layout of @backing_file into memory. THIS MUST BE CALLED BEFORE ANY
- * OTHER FUNCTIONS.
+ * Loads the layout of @backing_file into memory, returning the handle every
+ * other call takes, or NULL if it could not be loaded
  *
  * @backing_file should have been made through `mkfs.ext4holdtheextra`
  */
-u8 fs_load(char *backing_file)
+fs_t *fs_load(char *backing_file, struct fs_load_opts opts)
 {
-	bk_f = fopen(backing_file, "r+b");
-	assert(fsizeof(bk_f) > 0);
-	fread(&layout.disk_size, sizeof(usize), 1, bk_f);
-	fread(&layout.blk_size, sizeof(usize), 1, bk_f);
-	fread(&layout.num_blks, sizeof(usize), 1, bk_f);
-	fread(&layout.num_inode_blks, sizeof(usize), 1, bk_f);
-	fread(&layout.num_data_blks, sizeof(usize), 1, bk_f);
-	layout.data_blk_usable_len = layout.blk_size - sizeof(usize);
-	return 0;
+	struct fs *fs = calloc(1, sizeof(*fs));
+	if (fs == NULL) {
+		return NULL;
+	}
+	fs->bk_fd = -1;
+	// A commit waiting for the calls in progress holds back new ones
+	pthread_rwlockattr_t op_lock_attr;
+	pthread_rwlockattr_init(&op_lock_attr);
+	pthread_rwlockattr_setkind_np(
+		&op_lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&fs->op_lock, &op_lock_attr);
+	pthread_rwlockattr_destroy(&op_lock_attr);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	for (usize i = 0; i < NUM_INODE_LOCKS; ++i) {
+		pthread_rwlock_init(&fs->inode_locks[i], NULL);
+	}
+	fs->bk_fd = open(backing_file, O_RDWR);
+	struct stat st;
+	if (fs->bk_fd < 0 || fstat(fs->bk_fd, &st) != 0 || st.st_size == 0) {
+		_free_fs(fs);
+		return NULL;
+	}
+
+	struct _layout *l = &fs->layout;
+	usize magic;
+	usize version;
+	u8 ret = _load_super_word(fs, DISK_SIZE_OFFSET, &l->disk_size);
+	ret |= _load_super_word(fs, BLK_SIZE_OFFSET, &l->blk_size);
+	ret |= _load_super_word(fs, NUM_BLKS_OFFSET, &l->num_blks);
+	ret |= _load_super_word(fs, NUM_INODE_BLKS_OFFSET, &l->num_inode_blks);
+	ret |= _load_super_word(fs, NUM_DATA_BLKS_OFFSET, &l->num_data_blks);
+	ret |= _load_super_word(fs, NEXT_AVL_INODE_OFFSET,
+				&fs->super.next_avl_inode);
+	ret |= _load_super_word(fs, NEXT_AVL_BLK_OFFSET,
+				&fs->super.next_avl_blk);
+	fs->super.dirty = false;
+	fs->write_through = opts.write_through;
+	ret |= _load_super_word(fs, FEATURES_OFFSET, &l->features);
+	ret |= _load_super_word(fs, NUM_INODE_BITMAP_BLKS_OFFSET,
+				&l->num_inode_bitmap_blks);
+	ret |= _load_super_word(fs, NUM_BLK_BITMAP_BLKS_OFFSET,
+				&l->num_blk_bitmap_blks);
+	ret |= _load_super_word(fs, NUM_JOURNAL_BLKS_OFFSET,
+				&l->num_journal_blks);
+	ret |= _load_super_word(fs, INODE_SIZE_OFFSET, &l->inode_size);
+	ret |= _load_super_word(fs, NUM_REFCOUNT_BLKS_OFFSET,
+				&l->num_refcount_blks);
+	ret |= _load_super_word(fs, MAGIC_OFFSET, &magic);
+	ret |= _load_super_word(fs, VERSION_OFFSET, &version);
+	if (ret || magic != SUPER_MAGIC || version != FS_VERSION
+	    || !_blk_size_fits(fs)
+	    || l->inode_size < sizeof(struct _inode)
+	    || l->blk_size % l->inode_size != 0) {
+		_free_fs(fs);
+		return NULL;
+	}
+	l->num_inodes = l->num_inode_blks * (l->blk_size / l->inode_size);
+	l->inode_bitmap_offset = INODE_TBL_OFFSET + l->num_inode_blks;
+	l->blk_bitmap_offset =
+		l->inode_bitmap_offset + l->num_inode_bitmap_blks;
+	l->refcount_offset = l->blk_bitmap_offset + l->num_blk_bitmap_blks;
+	l->journal_offset = l->refcount_offset + l->num_refcount_blks;
+	l->data_blks_offset = l->journal_offset + l->num_journal_blks;
+	// Extent-mapped blocks have no next pointer to skip over
+	l->data_blk_usable_offset = l->features & FEATURE_EXTENTS
+		? 0
+		: DATA_BLK_USABLE_OFFSET;
+	l->data_blk_usable_len = l->blk_size - l->data_blk_usable_offset;
+	fs->op_reserve = l->num_inode_bitmap_blks + l->num_blk_bitmap_blks
+		+ l->num_refcount_blks + 1 + OP_META_BLKS;
+
+	// Finish whatever was committed before the last crash, before anything
+	// is read
+	fs->journal = journal_new(fs->bk_fd, l->blk_size, l->journal_offset,
+				  l->num_journal_blks);
+	if (fs->journal != NULL && journal_replay(fs->journal)) {
+		_free_fs(fs);
+		return NULL;
+	}
+	if (opts.mode == FS_LOAD_MMAP) {
+		fs->cache = cache_new_mmap(fs->bk_fd, l->blk_size,
+					   l->disk_size);
+	} else {
+		fs->cache = cache_new(fs->bk_fd, l->blk_size, opts.cache_len);
+	}
+	if (fs->cache == NULL) {
+		_free_fs(fs);
+		return NULL;
+	}
+	if (fs->journal != NULL) {
+		cache_set_journal(fs->cache, fs->journal);
+	}
+	fs->dcache = dcache_new(opts.dcache_len);
+	fs->aio = workq_new(opts.aio_threads);
+	fs->zero_blk = calloc(1, l->blk_size);
+	if (fs->dcache == NULL || fs->aio == NULL || fs->zero_blk == NULL) {
+		_free_fs(fs);
+		return NULL;
+	}
+	// Mapped images are read and written in memory anyway
+	if (opts.mode == FS_LOAD_CACHED && !opts.no_io_uring
+	    && l->features & FEATURE_EXTENTS) {
+		fs->ring = uring_new(fs->bk_fd, URING_DEFAULT_ENTRIES);
+	}
+
+	// Blocks read ahead must stay cached until their reader gets to them,
+	// next to other readers' and the metadata
+	fs->max_readahead = MAX_READAHEAD_LEN;
+	usize num_frames = cache_num_frames(fs->cache);
+	if (num_frames != 0 && num_frames / 4 < fs->max_readahead) {
+		fs->max_readahead = num_frames / 4 < MIN_READAHEAD_LEN
+			? 0
+			: num_frames / 4;
+	}
+
+	fs->inode_bitmap = (struct bitmap) {
+		.cache = fs->cache,
+		.first_blk = l->inode_bitmap_offset,
+		.blk_size = l->blk_size,
+		.num_bits = l->num_inodes,
+	};
+	fs->blk_bitmap = (struct bitmap) {
+		.cache = fs->cache,
+		.first_blk = l->blk_bitmap_offset,
+		.blk_size = l->blk_size,
+		.num_bits = l->num_data_blks,
+	};
+	fs->refcounts = (struct refcount_tbl) {
+		.cache = fs->cache,
+		.first_blk = l->refcount_offset,
+		.blk_size = l->blk_size,
+		.num_entries = l->num_refcount_blks == 0
+			? 0
+			: l->num_data_blks,
+	};
+	return fs;
 }
 
-u32 _new_inode(bool is_dir, u8 owner, bool read, bool write, usize data_ptr)
+struct _inode _new_inode(bool is_dir, u8 owner, bool read, bool write,
+			 usize data_ptr)
 {
-	u32 inode = 0;
+	struct _inode inode = {
+		.flags = (u32) owner << INODE_OWNER_SHIFT,
+		.reserved = 0,
+		.data_ptr = data_ptr,
+	};
 	if (is_dir) {
-		inode += 0x80000000;
+		inode.flags |= INODE_DIR;
 	}
-	inode += owner << 23;
 	if (read) {
-		inode += 0x00400000;
+		inode.flags |= INODE_READ;
 	}
 	if (write) {
-		inode += 0x00200000;
+		inode.flags |= INODE_WRITE;
 	}
-	inode += data_ptr & 0x001FFFFF;
 	return inode;
 }
 
-bool _inode_is_dir(u32 inode)
+bool _inode_is_dir(struct _inode inode)
 {
-	return (inode >> 31) & 1;
+	return inode.flags & INODE_DIR;
 }
 
 /*
- * Returns the 8 bit owner field of &inode
+ * Returns the 8 bit owner field of @inode
  */
-u8 _inode_owner(u32 inode)
+u8 _inode_owner(struct _inode inode)
 {
-	return (u8) (inode >> 23);
+	return (u8) (inode.flags >> INODE_OWNER_SHIFT);
 }
 
-bool _inode_has_read_perm(u32 inode)
+bool _inode_has_read_perm(struct _inode inode)
 {
-	return (inode >> 22) & 1;
+	return inode.flags & INODE_READ;
 }
 
-bool _inode_has_write_perm(u32 inode)
+bool _inode_has_write_perm(struct _inode inode)
 {
-	return (inode >> 21) & 1;
+	return inode.flags & INODE_WRITE;
 }
 
-/*
- * Returns the data ptr field of @inode; only the last 21 bits should be active
- */
-u32 _inode_data_ptr(u32 inode)
+usize _inode_data_ptr(struct _inode inode)
 {
-	u32 mask = (1 << 21) - 1;
-	return inode & mask;
+	return inode.data_ptr;
 }
 
-void _seek_to_blk_offset(usize blk_num, usize offset)
+void _seek_to_blk_offset(struct fs *fs, usize blk_num, usize offset)
 {
-	assert(blk_num < layout.num_blks);
-	assert(offset < layout.blk_size);
+	assert(blk_num < fs->layout.num_blks);
+	assert(offset < fs->layout.blk_size);
 
-	usize base_addr = blk_num * layout.blk_size;
-	usize addr = base_addr + offset;
-	fseek(bk_f, addr, SEEK_SET);
+	cursor.blk_num = blk_num;
+	cursor.offset = offset;
+	cursor.meta = true;
 }
 
-void _seek_to_inode(usize inode_num)
+void _seek_to_inode(struct fs *fs, usize inode_num)
 {
-	usize num_inodes = layout.num_inode_blks * layout.blk_size * INODE_SIZE;
-	assert(inode_num < num_inodes);
+	assert(inode_num < fs->layout.num_inodes);
 
-	usize num_inodes_per_blk = layout.blk_size / INODE_SIZE;
+	usize num_inodes_per_blk = fs->layout.blk_size / fs->layout.inode_size;
 	usize inode_blk_num = inode_num / num_inodes_per_blk;
 	usize inode_offset = inode_num % num_inodes_per_blk;
 	usize abs_blk_num = INODE_TBL_OFFSET + inode_blk_num;
-	usize abs_offset = inode_offset * INODE_SIZE;
-	_seek_to_blk_offset(abs_blk_num, abs_offset);
+	usize abs_offset = inode_offset * fs->layout.inode_size;
+	_seek_to_blk_offset(fs, abs_blk_num, abs_offset);
 }
 
-void _seek_to_data_addr(usize blk_num, usize offset)
+void _seek_to_data_addr(struct fs *fs, usize blk_num, usize offset)
 {
-	assert(blk_num < layout.num_data_blks);
+	assert(blk_num < fs->layout.num_data_blks);
 
-	usize base_of_data_blks = 1 + layout.num_inode_blks;
-	usize abs_blk_num = base_of_data_blks + blk_num;
-	_seek_to_blk_offset(abs_blk_num, offset);
+	usize abs_blk_num = fs->layout.data_blks_offset + blk_num;
+	_seek_to_blk_offset(fs, abs_blk_num, offset);
 }
 
-void _seek_to_data_usable_addr(usize blk_num, usize offset)
+/*
+ * File contents are data, not metadata
+ */
+void _seek_to_data_usable_addr(struct fs *fs, usize blk_num, usize offset)
 {
-	_seek_to_data_addr(blk_num, DATA_BLK_USABLE_OFFSET + offset);
+	_seek_to_data_addr(fs, blk_num,
+			   fs->layout.data_blk_usable_offset + offset);
+	cursor.meta = false;
 }
 
-usize _read_usize()
+/*
+ * Next pointers are written along with the file contents around them rather
+ * than through the journal
+ */
+void _seek_to_next_blk_ptr(struct fs *fs, usize blk_num)
 {
-	usize x;
-	fread(&x, sizeof(usize), 1, bk_f);
-	return x;
+	_seek_to_data_addr(fs, blk_num, DATA_BLK_NEXT_BLK_NUM_OFFSET);
+	cursor.meta = false;
 }
 
-void _write_usize(usize x)
+/*
+ * Copies @len bytes at the cursor into @dest, then advances the cursor. Blocks
+ * a failed cache has no frame for read as zeros.
+ */
+void _read_bytes(struct fs *fs, usize len, void *dest)
+{
+	u8 *out = dest;
+	while (len > 0) {
+		usize chunk_len = fs->layout.blk_size - cursor.offset;
+		if (chunk_len > len) {
+			chunk_len = len;
+		}
+		cache_lock(fs->cache);
+		u8 *blk = cache_get(fs->cache, cursor.blk_num, true);
+		if (blk != NULL) {
+			memcpy(out, blk + cursor.offset, chunk_len);
+		} else {
+			memset(out, 0, chunk_len);
+		}
+		cache_unlock(fs->cache);
+
+		out += chunk_len;
+		len -= chunk_len;
+		cursor.offset += chunk_len;
+		if (cursor.offset == fs->layout.blk_size) {
+			cursor.blk_num += 1;
+			cursor.offset = 0;
+		}
+	}
+}
+
+/*
+ * Copies @len bytes from @src to the cursor, then advances the cursor. Blocks a
+ * failed cache has no frame for are left as they were.
+ */
+void _write_bytes(struct fs *fs, usize len, const void *src)
 {
-	fwrite(&x, 1, 1, bk_f);
+	const u8 *in = src;
+	while (len > 0) {
+		usize chunk_len = fs->layout.blk_size - cursor.offset;
+		if (chunk_len > len) {
+			chunk_len = len;
+		}
+		// Whole blocks are overwritten, so there's no need to read them
+		bool fill = chunk_len != fs->layout.blk_size;
+		cache_lock(fs->cache);
+		u8 *blk = cache_get(fs->cache, cursor.blk_num, fill);
+		if (blk != NULL) {
+			memcpy(blk + cursor.offset, in, chunk_len);
+			if (cursor.meta) {
+				cache_mark_meta(fs->cache, cursor.blk_num);
+			} else {
+				cache_mark_dirty(fs->cache, cursor.blk_num);
+			}
+		}
+		cache_unlock(fs->cache);
+
+		in += chunk_len;
+		len -= chunk_len;
+		cursor.offset += chunk_len;
+		if (cursor.offset == fs->layout.blk_size) {
+			cursor.blk_num += 1;
+			cursor.offset = 0;
+		}
+	}
 }
 
-u32 _read_u32()
+usize _read_usize(struct fs *fs)
 {
-	u32 x;
-	fread(&x, sizeof(u32), 1, bk_f);
+	usize x;
+	_read_bytes(fs, sizeof(usize), &x);
 	return x;
 }
 
-void _write_u32(u32 x)
+void _write_usize(struct fs *fs, usize x)
 {
-	fwrite(&x, 1, 1, bk_f);
+	_write_bytes(fs, sizeof(usize), &x);
 }
 
-void _read_str(usize len, char *dest)
+void _read_str(struct fs *fs, usize len, char *dest)
 {
-	fread(dest, sizeof(char), len, bk_f);
+	_read_bytes(fs, len, dest);
 }
 
-void _write_str(usize len, char *src)
+void _write_str(struct fs *fs, usize len, char *src)
 {
-	fwrite(src, len, 1, bk_f);
+	_write_bytes(fs, len, src);
 }
 
-bool _read_bool()
+bool _read_bool(struct fs *fs)
 {
 	bool b;
-	fread(&b, sizeof(bool), 1, bk_f);
+	_read_bytes(fs, sizeof(bool), &b);
 	return b;
 }
 
-void _write_bool(bool b)
+void _write_bool(struct fs *fs, bool b)
 {
-	fwrite(&b, 1, 1, bk_f);
+	_write_bytes(fs, sizeof(bool), &b);
 }
 
-usize _read_next_avl_inode()
+usize _read_next_avl_inode(struct fs *fs)
 {
-	_seek_to_blk_offset(SUPER_BLK_OFFSET, NEXT_AVL_INODE_OFFSET);
-	return _read_usize();
+	return fs->super.next_avl_inode;
 }
 
-void _write_next_avl_inode(usize next_avl_inode)
+void _write_next_avl_inode(struct fs *fs, usize next_avl_inode)
 {
-	_seek_to_blk_offset(SUPER_BLK_OFFSET, NEXT_AVL_INODE_OFFSET);
-	_write_usize(next_avl_inode);
+	fs->super.next_avl_inode = next_avl_inode;
+	fs->super.dirty = true;
 }
 
-usize _read_next_avl_blk()
+usize _read_next_avl_blk(struct fs *fs)
 {
-	_seek_to_blk_offset(SUPER_BLK_OFFSET, NEXT_AVL_BLK_OFFSET);
-	return _read_usize();
+	return fs->super.next_avl_blk;
 }
 
-void _write_next_avl_blk(usize next_avl_blk)
+void _write_next_avl_blk(struct fs *fs, usize next_avl_blk)
 {
-	_seek_to_blk_offset(SUPER_BLK_OFFSET, NEXT_AVL_BLK_OFFSET);
-	_write_usize(next_avl_blk);
+	fs->super.next_avl_blk = next_avl_blk;
+	fs->super.dirty = true;
 }
 
-u32 _get_inode(usize inode_num)
+/*
+ * Writes the in-memory allocator heads into the super block, if they changed
+ */
+void _checkpoint(struct fs *fs)
 {
-	_seek_to_inode(inode_num);
-	return _read_u32();
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (fs->super.dirty) {
+		_seek_to_blk_offset(fs, SUPER_BLK_OFFSET,
+				    NEXT_AVL_INODE_OFFSET);
+		_write_usize(fs, fs->super.next_avl_inode);
+		_seek_to_blk_offset(fs, SUPER_BLK_OFFSET, NEXT_AVL_BLK_OFFSET);
+		_write_usize(fs, fs->super.next_avl_blk);
+		fs->super.dirty = false;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
 }
 
-void _set_inode(usize inode_num, u32 inode)
+/*
+ * Checkpoints the super block, then writes every dirty cached block back to the
+ * backing file
+ */
+u8 _flush(struct fs *fs)
 {
-	_seek_to_inode(inode_num);
-	_write_u32(inode);
+	_checkpoint(fs);
+	return cache_flush(fs->cache);
 }
 
 /*
- * Returns the `inode_num` that is next available
+ * Flushes once no call is halfway through changing the image, then waits for
+ * the backing file to reach the disk
  */
-usize _alloc_inode()
+u8 _sync(struct fs *fs)
 {
-	usize next_avl_inode = _read_next_avl_inode();
-
-	u32 next_addr = _get_inode(next_avl_inode);
-
-	usize next_next_avl_inode = next_addr == 0
-		? next_avl_inode + 1
-		: next_addr;
-	_write_next_avl_inode(next_next_avl_inode);
-
-	return next_avl_inode;
+	pthread_rwlock_wrlock(&fs->op_lock);
+	u8 ret = _flush(fs);
+	if (fs->journal == NULL) {
+		ret |= fsync(fs->bk_fd) != 0;
+	} else {
+		// Commits happen under the cache's lock, so none is half done
+		// here
+		cache_lock(fs->cache);
+		ret |= journal_checkpoint(fs->journal);
+		cache_unlock(fs->cache);
+	}
+	pthread_rwlock_unlock(&fs->op_lock);
+	return ret;
 }
 
 /*
- * Returns the deleted inode
+ * Starts a call that changes the image. Nothing it changes is committed before
+ * its `_end_op`.
  */
-u32 _dealloc_inode(usize inode_num)
+void _begin_op(struct fs *fs)
 {
-	// TODO: would usually be usize, but since this is written in, must be
-	//       u32 to prevent overflow
-	u32 next_avl_inode = _read_next_avl_inode();
+	pthread_rwlock_rdlock(&fs->op_lock);
+}
 
-	u32 deleted = _get_inode(inode_num);
-	_set_inode(inode_num, next_avl_inode);
+/*
+ * Ends a call that changed the image. Its metadata joins the transaction that
+ * the next sync commits, unless that is filling up first.
+ *
+ * Returns 1 if a commit it leads to fails, or doesn't fit in the journal, or if
+ * the cache has failed, losing some change.
+ */
+u8 _end_op(struct fs *fs)
+{
+	pthread_rwlock_unlock(&fs->op_lock);
+	if (cache_failed(fs->cache)) {
+		return 1;
+	}
+	if (!fs->write_through
+	    && !cache_needs_commit(fs->cache, fs->op_reserve)) {
+		return 0;
+	}
+	pthread_rwlock_wrlock(&fs->op_lock);
+	u8 ret = _flush(fs);
+	pthread_rwlock_unlock(&fs->op_lock);
+	return ret;
+}
 
-	_write_next_avl_inode(inode_num);
+void _lock_inode(struct fs *fs, usize inode_num, bool write)
+{
+	pthread_rwlock_t *lock = &fs->inode_locks[inode_num % NUM_INODE_LOCKS];
+	if (write) {
+		pthread_rwlock_wrlock(lock);
+	} else {
+		pthread_rwlock_rdlock(lock);
+	}
+}
 
-	return deleted;
+void _unlock_inode(struct fs *fs, usize inode_num)
+{
+	pthread_rwlock_unlock(&fs->inode_locks[inode_num % NUM_INODE_LOCKS]);
 }
 
-void _clear_blk(usize blk_num)
+struct _inode _get_inode(struct fs *fs, usize inode_num)
 {
-	_seek_to_blk_offset(blk_num, 0);
-	u8 zero_buf[layout.blk_size];
-	memset(zero_buf, 0, layout.blk_size);
-	fwrite(zero_buf, sizeof(u8), layout.blk_size, bk_f);
+	struct _inode inode;
+	_seek_to_inode(fs, inode_num);
+	_read_bytes(fs, sizeof(inode), &inode);
+	return inode;
 }
 
-void _clear_data_blk(usize blk_num)
+void _set_inode(struct fs *fs, usize inode_num, struct _inode inode)
 {
-	usize data_blks_offset = 1 + layout.num_inode_blks;
-	_clear_blk(data_blks_offset + blk_num);
+	_seek_to_inode(fs, inode_num);
+	_write_bytes(fs, sizeof(inode), &inode);
 }
 
 /*
- * Returns the `data_blk_num` that is next available
+ * Reserves up to @want inodes in one go, writing their nums to @inode_nums
+ *
+ * Returns how many were reserved, fewer than @want if the inode table fills up
  */
-usize _alloc_data_blk()
+usize _alloc_inodes(struct fs *fs, usize want, usize *inode_nums)
 {
-	usize next_avl_blk = _read_next_avl_blk();
-
-	_seek_to_data_addr(next_avl_blk, 0);
-	usize next_addr = _read_usize();
-
-	usize next_next_avl_blk = next_addr == 0
-		? next_avl_blk + 1
-		: next_addr;
-	_write_next_avl_blk(next_next_avl_blk);
-
-	_clear_data_blk(next_avl_blk);
+	usize got = 0;
+	pthread_mutex_lock(&fs->alloc_lock);
+	while (got < want) {
+		usize run_len;
+		usize first = bitmap_find_free(&fs->inode_bitmap,
+					       _read_next_avl_inode(fs),
+					       want - got, &run_len);
+		if (first == BITMAP_NONE) {
+			break;
+		}
+		bitmap_set_range(&fs->inode_bitmap, first, run_len, true);
+		_write_next_avl_inode(fs, first + run_len);
+		for (usize i = 0; i < run_len; ++i) {
+			inode_nums[got + i] = first + i;
+		}
+		got += run_len;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return got;
+}
 
-	return next_avl_blk;
+/*
+ * Returns the `inode_num` that is next available, or `NULL_INODE_NUM` if the
+ * inode table is full
+ */
+usize _alloc_inode(struct fs *fs)
+{
+	usize inode_num;
+	if (_alloc_inodes(fs, 1, &inode_num) == 0) {
+		return NULL_INODE_NUM;
+	}
+	return inode_num;
 }
 
 /*
- * Recursively deallocates the "linked-list" of blocks after this one as well
+ * Returns the deleted inode
  */
-void _dealloc_data_blk(usize data_blk_num)
+struct _inode _dealloc_inode(struct fs *fs, usize inode_num)
 {
-	_seek_to_data_addr(data_blk_num, 0);
-	usize next_blk = _read_usize();
+	struct _inode deleted = _get_inode(fs, inode_num);
+	_set_inode(fs, inode_num, (struct _inode) {0});
+	pthread_mutex_lock(&fs->alloc_lock);
+	bitmap_set_range(&fs->inode_bitmap, inode_num, 1, false);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return deleted;
+}
 
-	usize next_avl_blk = _read_next_avl_blk();
-	_seek_to_data_addr(data_blk_num, 0);
-	_write_usize(next_avl_blk);
-	_write_next_avl_blk(data_blk_num);
+/*
+ * Zeroes the data block @blk_num, which will hold metadata if @meta
+ */
+void _clear_data_blk(struct fs *fs, usize blk_num, bool meta)
+{
+	usize abs_blk_num = fs->layout.data_blks_offset + blk_num;
+	cache_lock(fs->cache);
+	u8 *blk = cache_get(fs->cache, abs_blk_num, false);
+	if (blk != NULL) {
+		memset(blk, 0, fs->layout.blk_size);
+		if (meta) {
+			cache_mark_meta(fs->cache, abs_blk_num);
+		} else {
+			cache_mark_dirty(fs->cache, abs_blk_num);
+		}
+	}
+	cache_unlock(fs->cache);
+}
 
-	if (next_blk != ROOT_DIR_BLK_NUM) {
-		_dealloc_data_blk(next_blk);
+/*
+ * Allocates up to @want contiguous data blocks, preferably starting at @goal
+ * (or wherever the last allocation left off, if @goal is `NULL_DATA_BLK_NUM`)
+ *
+ * Returns the first block and sets @got to how many were allocated, or returns
+ * `NULL_DATA_BLK_NUM` if the disk is full. The blocks are left as they were on
+ * disk; the caller initializes them.
+ */
+usize _alloc_data_run(struct fs *fs, usize goal, usize want, usize *got)
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (goal == NULL_DATA_BLK_NUM) {
+		goal = _read_next_avl_blk(fs);
+	}
+	usize first_blk = bitmap_find_free(&fs->blk_bitmap, goal, want, got);
+	if (first_blk == BITMAP_NONE) {
+		first_blk = NULL_DATA_BLK_NUM;
+	} else {
+		bitmap_set_range(&fs->blk_bitmap, first_blk, *got, true);
+		_write_next_avl_blk(fs, first_blk + *got);
 	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return first_blk;
 }
 
 /*
- * "/hello/me" -> "/hello"
+ * Returns a zeroed free data block, preferably @goal, or `NULL_DATA_BLK_NUM`
+ * if the disk is full. It heads a file, or holds a directory or extents, so it
+ * is zeroed as metadata.
  */
-void _get_parent_dir_path(char *path, char *dest)
+usize _alloc_data_blk(struct fs *fs, usize goal)
 {
-	int last_delim = 0;
-	for (int i = 0; path[i] != '\0'; ++i) {
-		if (path[i] == '/') {
-			last_delim = i;
-		}
+	usize got;
+	usize data_blk_num = _alloc_data_run(fs, goal, 1, &got);
+	if (data_blk_num != NULL_DATA_BLK_NUM) {
+		_clear_data_blk(fs, data_blk_num, true);
 	}
-	// TODO: likely bug here, off by 1
-	memcpy(dest, path, last_delim);
-	dest[last_delim] = '\0';
+	return data_blk_num;
 }
 
 /*
- * "/hello/me" -> "me"
+ * `_alloc_data_blk` for up to @want blocks at once, taken in runs, writing them
+ * to @blk_nums
+ *
+ * Returns how many were allocated, fewer than @want if the disk fills up
  */
-void _get_end_filename(char *path, char *dest)
+usize _alloc_data_blks(struct fs *fs, usize want, usize *blk_nums)
 {
-	int j = 0;
-	for (int i = 0; path[i] != '\0'; ++i) {
-		if (path[i] == '/') {
-			j = 0;
-		} else {
-			dest[j] = path[i];
-			j += 1;
+	usize got = 0;
+	usize goal = NULL_DATA_BLK_NUM;
+	while (got < want) {
+		usize run_len;
+		usize first_blk = _alloc_data_run(fs, goal, want - got,
+						  &run_len);
+		if (first_blk == NULL_DATA_BLK_NUM) {
+			break;
 		}
+		for (usize i = 0; i < run_len; ++i) {
+			_clear_data_blk(fs, first_blk + i, true);
+			blk_nums[got + i] = first_blk + i;
+		}
+		got += run_len;
+		goal = first_blk + run_len;
 	}
-	dest[j] = '\0';
+	return got;
 }
 
-void _seek_to_dir_entry_num(usize dir_blk_num, usize entry_num)
+void _free_data_run(struct fs *fs, usize first_blk, usize len)
 {
-	usize tbl_base_addr = DIR_BLK_ENTRY_TBL_OFFSET;
-	usize entry_offset = entry_num * DIR_BLK_ENTRY_LEN;
-	usize entry_addr = tbl_base_addr + entry_offset;
-	_seek_to_data_addr(dir_blk_num, entry_addr);
+	pthread_mutex_lock(&fs->alloc_lock);
+	bitmap_set_range(&fs->blk_bitmap, first_blk, len, false);
+	pthread_mutex_unlock(&fs->alloc_lock);
 }
 
-usize _get_entry_num(usize dir_blk_num, char *entry_name)
+void _free_data_blk(struct fs *fs, usize data_blk_num)
 {
-	usize entry_num = 0;
-	char curr_entry[MAX_FILENAME_LEN];
-	do {
-		_seek_to_dir_entry_num(dir_blk_num, entry_num);
-		bool in_use = _read_bool();
-		if (in_use) {
-			_read_str(MAX_FILENAME_LEN, curr_entry);
-		}
-		entry_num += 1;
-		// TODO: need to give up at some point
-		//       either end of dir indicator or num_entries
-	} while (strcmp(entry_name, curr_entry) != 0);
-	return entry_num - 1;
+	_free_data_run(fs, data_blk_num, 1);
 }
 
 /*
- * Linear searches through dir blk for a matching name, then returns the inode
- * num associated with it
+ * Lets go of a file's @len data blocks from @first_blk: those still shared with
+ * other files lose an owner, and the rest are freed
  */
-usize _get_inode_num_of_name(usize dir_blk_num, char *name)
+void _put_data_run(struct fs *fs, usize first_blk, usize len)
 {
-	_seek_to_dir_entry_num(dir_blk_num, _get_entry_num(dir_blk_num, name));
-
-	_read_bool(); // skip forward one byte
-	char entry_name[MAX_FILENAME_LEN];
-	_read_str(MAX_FILENAME_LEN, entry_name);
-	assert(strcmp(name, entry_name) == 0);
-	u32 entry_num = _read_u32();
-	return entry_num;
+	pthread_mutex_lock(&fs->alloc_lock);
+	while (len > 0) {
+		bool shared = false;
+		usize run_len = fs->refcounts.num_entries == 0
+			? len
+			: refcount_run(&fs->refcounts, first_blk, len, &shared);
+		if (shared) {
+			refcount_adjust_range(&fs->refcounts, first_blk,
+					      run_len, false);
+		} else {
+			bitmap_set_range(&fs->blk_bitmap, first_blk, run_len,
+					 false);
+		}
+		first_blk += run_len;
+		len -= run_len;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
 }
 
 /*
- * Recursively traverses until reaching the parent directory of the end file in
- * @path, the returns the of the data block representing said directory.
+ * Copies data block @from over data block @to, which need not be read first
  */
-usize _get_parent_dir_blk_num(char *path)
+void _copy_data_blk(struct fs *fs, usize from, usize to)
 {
-	usize path_len = strlen(path);
-
-	char path_cpy[path_len];
-	strcpy(path_cpy, path);
-
-	usize dir_blk_num = ROOT_DIR_BLK_NUM;
-	// TODO: unix would allow escaping of '/' with '\/'
-	char *sub_dir = strtok(path_cpy, PATH_DELIM);
-	char *next;
-	// read up until the last token (i.e. the parent dir)
-	while ((next = strtok(NULL, PATH_DELIM)) != NULL) {
-		// search for sub_dir in dir_blk
-		u32 inode_num = _get_inode_num_of_name(dir_blk_num, sub_dir);
-		u32 inode = _get_inode(inode_num);
-		dir_blk_num = _inode_data_ptr(inode);
-		sub_dir = next;
+	usize abs_from = fs->layout.data_blks_offset + from;
+	usize abs_to = fs->layout.data_blks_offset + to;
+	const u8 *src = cache_pin(fs->cache, abs_from);
+	if (src == NULL) {
+		return;
 	}
-	return dir_blk_num;
+	cache_lock(fs->cache);
+	u8 *dest = cache_get(fs->cache, abs_to, false);
+	if (dest != NULL) {
+		memcpy(dest, src, fs->layout.blk_size);
+		cache_mark_dirty(fs->cache, abs_to);
+	}
+	cache_unlock(fs->cache);
+	cache_unpin(fs->cache, abs_from);
 }
 
-u32 _get_inode_of_path(char *path)
+/*
+ * Deallocates the "linked-list" of blocks after this one as well
+ */
+void _dealloc_data_blk(struct fs *fs, usize data_blk_num)
 {
-	usize parent_dir_blk_num = _get_parent_dir_blk_num(path);
-	char filename[MAX_FILENAME_LEN];
-	_get_end_filename(path, filename);
-	usize inode_num = _get_inode_num_of_name(parent_dir_blk_num, filename);
-	u32 inode = _get_inode(inode_num);
-	return inode;
+	while (data_blk_num != NULL_DATA_BLK_NUM) {
+		_seek_to_next_blk_ptr(fs, data_blk_num);
+		usize next_blk = _read_usize(fs);
+		_free_data_blk(fs, data_blk_num);
+		data_blk_num = next_blk;
+	}
 }
 
-void _add_dir_entry(usize dir_blk_num, char *entry_name, u32 entry_num)
+usize _get_ext_blk_size(struct fs *fs, usize ext_blk_num)
 {
-	_seek_to_data_addr(dir_blk_num, 0);
-	/*usize next_blk =*/ _read_usize();
-
-	u32 next_avl_entry = _read_u32();
-	_seek_to_dir_entry_num(dir_blk_num, next_avl_entry);
-
-	bool in_use = _read_bool();
-	assert(!in_use);
-	u32 next_addr = _read_u32();
-	u32 next_next_avl_entry = next_addr == 0
-		? next_avl_entry + 1
-		: next_addr;
-
-	_seek_to_data_addr(dir_blk_num, DIR_BLK_NEXT_AVL_ENTRY_OFFSET);
-	_write_u32(next_next_avl_entry);
-
-	_seek_to_dir_entry_num(dir_blk_num, next_avl_entry);
-	_write_bool(true);
-	_write_str(MAX_FILENAME_LEN, entry_name);
-	_write_u32(entry_num);
+	_seek_to_data_addr(fs, ext_blk_num, EXT_BLK_SIZE_OFFSET);
+	return _read_usize(fs);
 }
 
-u32 _del_dir_entry(usize dir_blk_num, char *entry_name)
+void _set_ext_blk_size(struct fs *fs, usize ext_blk_num, usize size)
 {
-	_seek_to_data_addr(dir_blk_num, DIR_BLK_NEXT_AVL_ENTRY_OFFSET);
-	u32 next_avl_entry = _read_u32();
+	_seek_to_data_addr(fs, ext_blk_num, EXT_BLK_SIZE_OFFSET);
+	_write_usize(fs, size);
+}
 
-	usize dir_entry_num = _get_entry_num(dir_blk_num, entry_name);
-	_seek_to_dir_entry_num(dir_blk_num, dir_entry_num);
-	_write_bool(false);
-	_write_u32(next_avl_entry);
+usize _get_num_extents(struct fs *fs, usize ext_blk_num)
+{
+	_seek_to_data_addr(fs, ext_blk_num, EXT_BLK_NUM_EXTENTS_OFFSET);
+	return _read_usize(fs);
+}
 
-	usize dir_entry_inode_offset = DIR_BLK_ENTRY_TBL_OFFSET
-		+ (dir_entry_num * DIR_BLK_ENTRY_LEN)
-		+ DIR_BLK_INODE_OFFSET;
-	_seek_to_data_addr(dir_blk_num, dir_entry_inode_offset);
-	u32 inode_num = _read_u32();
+void _set_num_extents(struct fs *fs, usize ext_blk_num, usize num_extents)
+{
+	_seek_to_data_addr(fs, ext_blk_num, EXT_BLK_NUM_EXTENTS_OFFSET);
+	_write_usize(fs, num_extents);
+}
 
-	_seek_to_data_addr(dir_blk_num, DIR_BLK_NEXT_AVL_ENTRY_OFFSET);
-	_write_u32(dir_entry_num);
+struct _extent _get_extent(struct fs *fs, usize ext_blk_num, usize ext_num)
+{
+	struct _extent ext;
+	_seek_to_data_addr(fs, ext_blk_num,
+			   EXT_BLK_TBL_OFFSET + ext_num * EXT_LEN);
+	_read_bytes(fs, EXT_LEN, &ext);
+	return ext;
+}
 
-	return inode_num;
+void _set_extent(struct fs *fs, usize ext_blk_num, usize ext_num,
+		 struct _extent ext)
+{
+	_seek_to_data_addr(fs, ext_blk_num,
+			   EXT_BLK_TBL_OFFSET + ext_num * EXT_LEN);
+	_write_bytes(fs, EXT_LEN, &ext);
 }
 
 /*
- * Note: the parent directory must exist
+ * Binary searches for the last extent starting at or before @blk_idx. Returns
+ * the number of extents if there is none.
  */
-void _create_path(char *path, usize inode_num)
+usize _find_extent(struct fs *fs, usize ext_blk_num, usize blk_idx)
 {
-	assert(path[0] == '/');
-
-	usize parent_dir_blk_num = _get_parent_dir_blk_num(path);
-
-	char filename[MAX_FILENAME_LEN];
-	_get_end_filename(path, filename);
-
-	_add_dir_entry(parent_dir_blk_num, filename, inode_num);
+	usize num_extents = _get_num_extents(fs, ext_blk_num);
+	usize lo = 0;
+	usize hi = num_extents;
+	while (lo < hi) {
+		usize mid = lo + (hi - lo) / 2;
+		if (_get_extent(fs, ext_blk_num, mid).logical <= blk_idx) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo == 0 ? num_extents : lo - 1;
 }
 
 /*
- * Note: the parent directory must exist
- * Returns the inode entry of the deleted path
+ * Whether the file's extent block @ext_blk_num indexes leaves of extents
+ * rather than holding them itself. Index entries are extents of length 0, the
+ * first starting at block 0, whose @phys is the leaf.
  */
-u32 _del_path(char *path)
+bool _ext_indirect(struct fs *fs, usize ext_blk_num)
 {
-	assert(path[0] == '/');
-
-	usize parent_dir_blk_num = _get_parent_dir_blk_num(path);
+	return _get_num_extents(fs, ext_blk_num) > 0
+		&& _get_extent(fs, ext_blk_num, 0).len == 0;
+}
 
-	char filename[MAX_FILENAME_LEN];
-	_get_end_filename(path, filename);
+/*
+ * Returns the extent block holding the extent of the file's @blk_idx'th block:
+ * the file's extent block @ext_blk_num, or the leaf its index lists for it. If
+ * @end is not NULL, it is set to the first block past those the leaf maps.
+ */
+usize _ext_leaf(struct fs *fs, usize ext_blk_num, usize blk_idx, usize *end)
+{
+	usize leaf = ext_blk_num;
+	usize leaf_end = (usize) -1;
+	if (_ext_indirect(fs, ext_blk_num)) {
+		usize num_leaves = _get_num_extents(fs, ext_blk_num);
+		usize idx_num = _find_extent(fs, ext_blk_num, blk_idx);
+		leaf = _get_extent(fs, ext_blk_num, idx_num).phys;
+		if (idx_num + 1 < num_leaves) {
+			leaf_end = _get_extent(fs, ext_blk_num, idx_num + 1)
+				.logical;
+		}
+	}
+	if (end != NULL) {
+		*end = leaf_end;
+	}
+	return leaf;
+}
 
-	return _del_dir_entry(parent_dir_blk_num, filename);
+usize _num_ext_leaves(struct fs *fs, usize ext_blk_num)
+{
+	return _ext_indirect(fs, ext_blk_num)
+		? _get_num_extents(fs, ext_blk_num)
+		: 1;
 }
 
-void _del_inode(usize inode_num)
+usize _nth_ext_leaf(struct fs *fs, usize ext_blk_num, usize n)
 {
-	u32 deleted_inode = _dealloc_inode(inode_num);
-	usize data_blk_num = _inode_data_ptr(deleted_inode);
-	_dealloc_data_blk(data_blk_num);
+	return _ext_indirect(fs, ext_blk_num)
+		? _get_extent(fs, ext_blk_num, n).phys
+		: ext_blk_num;
 }
 
 /*
- * Creates an empty file at @path
+ * Copies the size and entries of the extent block @from to @to
  */
-u8 fs_create(char *path, bool is_dir, u8 owner)
+void _copy_extents(struct fs *fs, usize from, usize to)
 {
-	usize inode_num = _alloc_inode();
-	usize data_blk = _alloc_data_blk();
-	u32 inode = _new_inode(is_dir, owner, true, true, data_blk);
-	_set_inode(inode_num, inode);
-	_create_path(path, inode_num);
-	fflush(bk_f);
-	return 0;
+	usize num_extents = _get_num_extents(fs, from);
+	for (usize i = 0; i < num_extents; ++i) {
+		_set_extent(fs, to, i, _get_extent(fs, from, i));
+	}
+	_set_ext_blk_size(fs, to, _get_ext_blk_size(fs, from));
+	_set_num_extents(fs, to, num_extents);
 }
 
 /*
- * Deletes the file at @path
+ * Frees the file's extent block and the leaves it lists, leaving the blocks
+ * they map alone
  */
-u8 fs_delete(char *path)
+void _free_ext_blks(struct fs *fs, usize ext_blk_num)
 {
-	usize inode_num = _del_path(path);
-	_del_inode(inode_num);
-	fflush(bk_f);
-	return 0;
+	if (_ext_indirect(fs, ext_blk_num)) {
+		usize num_leaves = _get_num_extents(fs, ext_blk_num);
+		for (usize i = 0; i < num_leaves; ++i) {
+			_free_data_blk(fs,
+				       _get_extent(fs, ext_blk_num, i).phys);
+		}
+	}
+	_free_data_blk(fs, ext_blk_num);
 }
 
 /*
- * Opens a file at path, returning info about the opened file
+ * Makes room in the full leaf holding the file's @blk_idx'th block, moving the
+ * upper half of its extents to a new leaf listed right after it. A file's
+ * extent block that still holds its extents first moves them all to a leaf of
+ * their own and becomes the index.
+ *
+ * Returns 1 if the disk or the index is full.
  */
-struct fs_file_desc fs_open(char *path)
+u8 _split_ext_leaf(struct fs *fs, usize ext_blk_num, usize blk_idx)
 {
-	u32 inode = _get_inode_of_path(path);
-	usize data_blk_num = _inode_data_ptr(inode);
-	struct fs_file_desc fd = {
-		.path = path,
-		.head_blk_num = data_blk_num,
-		.curr_blk_num = data_blk_num,
-		.curr_offset = 0,
-		.is_dir = _inode_is_dir(inode),
-		.owner = _inode_owner(inode),
-		.has_read = _inode_has_read_perm(inode),
-		.has_write = _inode_has_write_perm(inode),
+	if (!_ext_indirect(fs, ext_blk_num)) {
+		usize leaf = _alloc_data_blk(fs, ext_blk_num);
+		if (leaf == NULL_DATA_BLK_NUM) {
+			return 1;
+		}
+		_copy_extents(fs, ext_blk_num, leaf);
+		_set_ext_blk_size(fs, leaf, 0);
+		struct _extent idx = { .logical = 0, .phys = leaf, .len = 0 };
+		_set_extent(fs, ext_blk_num, 0, idx);
+		_set_num_extents(fs, ext_blk_num, 1);
+	}
+	usize num_leaves = _get_num_extents(fs, ext_blk_num);
+	if (num_leaves == EXTS_PER_BLK) {
+		return 1;
+	}
+	usize idx_num = _find_extent(fs, ext_blk_num, blk_idx);
+	usize leaf = _get_extent(fs, ext_blk_num, idx_num).phys;
+	usize new_leaf = _alloc_data_blk(fs, leaf);
+	if (new_leaf == NULL_DATA_BLK_NUM) {
+		return 1;
+	}
+
+	usize num_extents = _get_num_extents(fs, leaf);
+	usize half = num_extents / 2;
+	for (usize i = half; i < num_extents; ++i) {
+		_set_extent(fs, new_leaf, i - half, _get_extent(fs, leaf, i));
+	}
+	_set_num_extents(fs, new_leaf, num_extents - half);
+	_set_num_extents(fs, leaf, half);
+	for (usize i = num_leaves; i > idx_num + 1; --i) {
+		_set_extent(fs, ext_blk_num, i,
+			    _get_extent(fs, ext_blk_num, i - 1));
+	}
+	struct _extent idx = {
+		.logical = _get_extent(fs, new_leaf, 0).logical,
+		.phys = new_leaf,
+		.len = 0,
 	};
-	return fd;
+	_set_extent(fs, ext_blk_num, idx_num + 1, idx);
+	_set_num_extents(fs, ext_blk_num, num_leaves + 1);
+	return 0;
+}
+
+/*
+ * Adds the @len freshly allocated blocks from @phys as the file's blocks from
+ * @blk_idx on, growing the extent before them if the two are contiguous. The
+ * blocks lie within the range of a single leaf.
+ *
+ * Returns 1 if the leaf is full and can't be split.
+ */
+u8 _insert_extent(struct fs *fs, usize ext_blk_num, usize blk_idx, usize phys,
+		  usize len)
+{
+	usize end;
+	usize leaf = _ext_leaf(fs, ext_blk_num, blk_idx, &end);
+	assert(len <= end - blk_idx);
+	usize num_extents = _get_num_extents(fs, leaf);
+	usize ext_num = _find_extent(fs, leaf, blk_idx);
+	if (ext_num != num_extents) {
+		struct _extent prev = _get_extent(fs, leaf, ext_num);
+		if (prev.logical + prev.len == blk_idx
+		    && prev.phys + prev.len == phys) {
+			prev.len += len;
+			_set_extent(fs, leaf, ext_num, prev);
+			return 0;
+		}
+	}
+	if (num_extents == EXTS_PER_BLK) {
+		if (_split_ext_leaf(fs, ext_blk_num, blk_idx)) {
+			return 1;
+		}
+		return _insert_extent(fs, ext_blk_num, blk_idx, phys, len);
+	}
+
+	usize insert_at = ext_num == num_extents ? 0 : ext_num + 1;
+	for (usize i = num_extents; i > insert_at; --i) {
+		_set_extent(fs, leaf, i, _get_extent(fs, leaf, i - 1));
+	}
+	struct _extent ext = {
+		.logical = blk_idx,
+		.phys = phys,
+		.len = len,
+	};
+	_set_extent(fs, leaf, insert_at, ext);
+	_set_num_extents(fs, leaf, num_extents + 1);
+	return 0;
+}
+
+/*
+ * Maps the file's @len blocks from @blk_idx, which lie in one extent, to the
+ * @len data blocks from @phys instead. The extent is split around them, and
+ * whatever ends up contiguous with the extents on either side in its leaf is
+ * merged in.
+ *
+ * Returns 1 if the leaf has no room for the pieces and can't be split.
+ */
+u8 _remap_extent(struct fs *fs, usize ext_blk_num, usize blk_idx, usize len,
+		 usize phys)
+{
+	usize leaf = _ext_leaf(fs, ext_blk_num, blk_idx, NULL);
+	usize num_extents = _get_num_extents(fs, leaf);
+	usize ext_num = _find_extent(fs, leaf, blk_idx);
+	struct _extent ext = _get_extent(fs, leaf, ext_num);
+	usize ext_end = ext.logical + ext.len;
+	usize end = blk_idx + len;
+	assert(ext.logical <= blk_idx && end <= ext_end);
+
+	// Extents [lo, hi) are replaced by the pieces
+	usize lo = ext_num;
+	usize hi = ext_num + 1;
+	struct _extent pieces[5];
+	usize num_pieces = 0;
+	if (lo > 0) {
+		lo -= 1;
+		pieces[num_pieces++] = _get_extent(fs, leaf, lo);
+	}
+	if (ext.logical < blk_idx) {
+		pieces[num_pieces++] = (struct _extent) {
+			.logical = ext.logical,
+			.phys = ext.phys,
+			.len = blk_idx - ext.logical,
+		};
+	}
+	pieces[num_pieces++] = (struct _extent) {
+		.logical = blk_idx,
+		.phys = phys,
+		.len = len,
+	};
+	if (end < ext_end) {
+		pieces[num_pieces++] = (struct _extent) {
+			.logical = end,
+			.phys = ext.phys + (end - ext.logical),
+			.len = ext_end - end,
+		};
+	}
+	if (hi < num_extents) {
+		pieces[num_pieces++] = _get_extent(fs, leaf, hi);
+		hi += 1;
+	}
+
+	usize num_merged = 1;
+	for (usize i = 1; i < num_pieces; ++i) {
+		struct _extent *last = &pieces[num_merged - 1];
+		if (last->logical + last->len == pieces[i].logical
+		    && last->phys + last->len == pieces[i].phys) {
+			last->len += pieces[i].len;
+		} else {
+			pieces[num_merged++] = pieces[i];
+		}
+	}
+	usize new_hi = lo + num_merged;
+	if (num_extents - hi + new_hi > EXTS_PER_BLK) {
+		if (_split_ext_leaf(fs, ext_blk_num, blk_idx)) {
+			return 1;
+		}
+		return _remap_extent(fs, ext_blk_num, blk_idx, len, phys);
+	}
+
+	// Move the extents after them up or down to where the pieces end
+	for (usize i = num_extents; new_hi > hi && i > hi; --i) {
+		_set_extent(fs, leaf, i - 1 + (new_hi - hi),
+			    _get_extent(fs, leaf, i - 1));
+	}
+	for (usize i = hi; new_hi < hi && i < num_extents; ++i) {
+		_set_extent(fs, leaf, i - (hi - new_hi),
+			    _get_extent(fs, leaf, i));
+	}
+	for (usize i = 0; i < num_merged; ++i) {
+		_set_extent(fs, leaf, lo + i, pieces[i]);
+	}
+	_set_num_extents(fs, leaf, num_extents - hi + new_hi);
+	return 0;
+}
+
+/*
+ * Returns the data block holding the file's @blk_idx'th block, or
+ * `NULL_DATA_BLK_NUM` if it has none. If @alloc, a missing block is allocated.
+ *
+ * If @run_len is not NULL, it is set to the number of blocks that follow
+ * contiguously on disk (including the returned one).
+ */
+usize _extent_map(struct fs *fs, usize ext_blk_num, usize blk_idx, bool alloc,
+		  usize *run_len)
+{
+	usize leaf = _ext_leaf(fs, ext_blk_num, blk_idx, NULL);
+	usize num_extents = _get_num_extents(fs, leaf);
+	usize ext_num = _find_extent(fs, leaf, blk_idx);
+	if (ext_num != num_extents) {
+		struct _extent ext = _get_extent(fs, leaf, ext_num);
+		if (blk_idx < ext.logical + ext.len) {
+			if (run_len != NULL) {
+				*run_len = ext.logical + ext.len - blk_idx;
+			}
+			return ext.phys + (blk_idx - ext.logical);
+		}
+	}
+	if (!alloc) {
+		return NULL_DATA_BLK_NUM;
+	}
+
+	// Aim right after the block before this one, to keep the extent growing
+	usize goal = NULL_DATA_BLK_NUM;
+	if (ext_num != num_extents) {
+		struct _extent prev = _get_extent(fs, leaf, ext_num);
+		goal = prev.phys + (blk_idx - prev.logical);
+	}
+	usize phys = _alloc_data_blk(fs, goal);
+	if (phys == NULL_DATA_BLK_NUM) {
+		return NULL_DATA_BLK_NUM;
+	}
+	if (_insert_extent(fs, ext_blk_num, blk_idx, phys, 1)) {
+		_free_data_blk(fs, phys);
+		return NULL_DATA_BLK_NUM;
+	}
+	if (run_len != NULL) {
+		*run_len = 1;
+	}
+	return phys;
+}
+
+/*
+ * Lets go of every block mapped by the extent block and its leaves, then
+ * frees them
+ */
+void _dealloc_extents(struct fs *fs, usize ext_blk_num)
+{
+	usize num_leaves = _num_ext_leaves(fs, ext_blk_num);
+	for (usize l = 0; l < num_leaves; ++l) {
+		usize leaf = _nth_ext_leaf(fs, ext_blk_num, l);
+		usize num_extents = _get_num_extents(fs, leaf);
+		for (usize i = 0; i < num_extents; ++i) {
+			struct _extent ext = _get_extent(fs, leaf, i);
+			_put_data_run(fs, ext.phys, ext.len);
+		}
+	}
+	_free_ext_blks(fs, ext_blk_num);
+}
+
+/*
+ * `_unmap_extents` within the single leaf @leaf
+ *
+ * Returns 1 if an extent would be split in two while @leaf is full, in which
+ * case the blocks before that extent are still let go of.
+ */
+u8 _unmap_leaf_extents(struct fs *fs, usize leaf, usize blk_idx,
+		       usize end_idx)
+{
+	usize num_extents = _get_num_extents(fs, leaf);
+	usize ext_num = _find_extent(fs, leaf, blk_idx);
+	if (ext_num == num_extents) {
+		ext_num = 0;
+	}
+	u8 ret = 0;
+	while (ext_num < num_extents) {
+		struct _extent ext = _get_extent(fs, leaf, ext_num);
+		usize ext_end = ext.logical + ext.len;
+		if (ext.logical >= end_idx) {
+			break;
+		}
+		if (ext_end <= blk_idx) {
+			ext_num += 1;
+			continue;
+		}
+		usize from = ext.logical > blk_idx ? ext.logical : blk_idx;
+		usize to = ext_end < end_idx ? ext_end : end_idx;
+		bool keep_head = ext.logical < from;
+		bool keep_tail = to < ext_end;
+		if (keep_head && keep_tail && num_extents == EXTS_PER_BLK) {
+			ret = 1;
+			break;
+		}
+		_put_data_run(fs, ext.phys + (from - ext.logical), to - from);
+
+		struct _extent head = {
+			.logical = ext.logical,
+			.phys = ext.phys,
+			.len = from - ext.logical,
+		};
+		struct _extent tail = {
+			.logical = to,
+			.phys = ext.phys + (to - ext.logical),
+			.len = ext_end - to,
+		};
+		if (keep_head && keep_tail) {
+			for (usize i = num_extents; i > ext_num + 1; --i) {
+				_set_extent(fs, leaf, i,
+					    _get_extent(fs, leaf, i - 1));
+			}
+			_set_extent(fs, leaf, ext_num, head);
+			_set_extent(fs, leaf, ext_num + 1, tail);
+			num_extents += 1;
+			break;
+		}
+		if (keep_head || keep_tail) {
+			_set_extent(fs, leaf, ext_num, keep_head ? head : tail);
+			ext_num += 1;
+			continue;
+		}
+		for (usize i = ext_num; i + 1 < num_extents; ++i) {
+			_set_extent(fs, leaf, i, _get_extent(fs, leaf, i + 1));
+		}
+		num_extents -= 1;
+	}
+	_set_num_extents(fs, leaf, num_extents);
+	return ret;
+}
+
+/*
+ * Lets go of the extent-mapped file's blocks from @blk_idx up to @end_idx,
+ * leaving a hole there. Leaves emptied by it stay listed in the index, to be
+ * filled again.
+ *
+ * Returns 1 if that would split an extent in two while its leaf is full and
+ * can't be split, in which case the blocks before that extent are still let go
+ * of.
+ */
+u8 _unmap_extents(struct fs *fs, usize ext_blk_num, usize blk_idx,
+		  usize end_idx)
+{
+	while (blk_idx < end_idx) {
+		usize leaf_end;
+		usize leaf = _ext_leaf(fs, ext_blk_num, blk_idx, &leaf_end);
+		usize to = leaf_end < end_idx ? leaf_end : end_idx;
+		if (_unmap_leaf_extents(fs, leaf, blk_idx, to)) {
+			if (_split_ext_leaf(fs, ext_blk_num, blk_idx)) {
+				return 1;
+			}
+			continue;
+		}
+		blk_idx = to;
+	}
+	return 0;
+}
+
+/*
+ * `_next_extent_blk` within the single leaf @leaf
+ */
+usize _next_leaf_blk(struct fs *fs, usize leaf, usize blk_idx, bool data,
+		     usize end_idx)
+{
+	usize num_extents = _get_num_extents(fs, leaf);
+	usize ext_num = _find_extent(fs, leaf, blk_idx);
+	if (ext_num == num_extents) {
+		ext_num = 0;
+	}
+	for (; ext_num < num_extents && blk_idx < end_idx; ++ext_num) {
+		struct _extent ext = _get_extent(fs, leaf, ext_num);
+		if (ext.logical + ext.len <= blk_idx) {
+			continue;
+		}
+		if (ext.logical > blk_idx) {
+			// In a hole
+			blk_idx = data ? ext.logical : blk_idx;
+			break;
+		}
+		if (data) {
+			break;
+		}
+		blk_idx = ext.logical + ext.len;
+	}
+	if (data && ext_num == num_extents) {
+		blk_idx = end_idx;
+	}
+	return blk_idx < end_idx ? blk_idx : end_idx;
+}
+
+/*
+ * Returns the first of the extent-mapped file's blocks from @blk_idx on that
+ * is mapped (if @data) or is a hole (if not), or @end_idx if none comes before
+ * it
+ */
+usize _next_extent_blk(struct fs *fs, usize ext_blk_num, usize blk_idx,
+		       bool data, usize end_idx)
+{
+	while (true) {
+		usize leaf_end;
+		usize leaf = _ext_leaf(fs, ext_blk_num, blk_idx, &leaf_end);
+		usize to = leaf_end < end_idx ? leaf_end : end_idx;
+		blk_idx = _next_leaf_blk(fs, leaf, blk_idx, data, to);
+		if (blk_idx < to || to == end_idx) {
+			return blk_idx;
+		}
+	}
+}
+
+/*
+ * Returns a new extent block mapping the same blocks as @ext_blk_num, with
+ * copies of its leaves, each block gaining an owner. Returns
+ * `NULL_DATA_BLK_NUM` if the disk is full or one of them already has as many
+ * owners as it can.
+ */
+usize _share_extents(struct fs *fs, usize ext_blk_num)
+{
+	usize copy_blk_num = _alloc_data_blk(fs, NULL_DATA_BLK_NUM);
+	if (copy_blk_num == NULL_DATA_BLK_NUM) {
+		return NULL_DATA_BLK_NUM;
+	}
+	_copy_extents(fs, ext_blk_num, copy_blk_num);
+	bool indirect = _ext_indirect(fs, ext_blk_num);
+	usize num_leaves = _num_ext_leaves(fs, ext_blk_num);
+	for (usize l = 0; indirect && l < num_leaves; ++l) {
+		struct _extent idx = _get_extent(fs, copy_blk_num, l);
+		usize leaf_copy = _alloc_data_blk(fs, idx.phys);
+		if (leaf_copy == NULL_DATA_BLK_NUM) {
+			// Only the leaves copied so far are listed
+			_set_num_extents(fs, copy_blk_num, l);
+			_free_ext_blks(fs, copy_blk_num);
+			return NULL_DATA_BLK_NUM;
+		}
+		_copy_extents(fs, idx.phys, leaf_copy);
+		idx.phys = leaf_copy;
+		_set_extent(fs, copy_blk_num, l, idx);
+	}
+
+	bool full = false;
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (usize l = 0; l < num_leaves && !full; ++l) {
+		usize leaf = _nth_ext_leaf(fs, ext_blk_num, l);
+		usize num_extents = _get_num_extents(fs, leaf);
+		for (usize i = 0; i < num_extents && !full; ++i) {
+			struct _extent ext = _get_extent(fs, leaf, i);
+			full = refcount_max(&fs->refcounts, ext.phys, ext.len)
+				== REFCOUNT_MAX;
+		}
+	}
+	for (usize l = 0; l < num_leaves && !full; ++l) {
+		usize leaf = _nth_ext_leaf(fs, ext_blk_num, l);
+		usize num_extents = _get_num_extents(fs, leaf);
+		for (usize i = 0; i < num_extents; ++i) {
+			struct _extent ext = _get_extent(fs, leaf, i);
+			refcount_adjust_range(&fs->refcounts, ext.phys,
+					      ext.len, true);
+		}
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (full) {
+		_free_ext_blks(fs, copy_blk_num);
+		return NULL_DATA_BLK_NUM;
+	}
+	return copy_blk_num;
+}
+
+/*
+ * The inode data ptr of a directory names its first block directly, or its
+ * extent block when files are extent-mapped
+ */
+usize _dir_blk_of_data_ptr(struct fs *fs, usize data_ptr)
+{
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		return _extent_map(fs, data_ptr, 0, false, NULL);
+	}
+	return data_ptr;
+}
+
+/*
+ * "/hello/me" -> "/hello"
+ */
+void _get_parent_dir_path(char *path, char *dest)
+{
+	int last_delim = 0;
+	for (int i = 0; path[i] != '\0'; ++i) {
+		if (path[i] == '/') {
+			last_delim = i;
+		}
+	}
+	// TODO: likely bug here, off by 1
+	memcpy(dest, path, last_delim);
+	dest[last_delim] = '\0';
+}
+
+/*
+ * "/hello/me" -> "me"
+ */
+void _get_end_filename(char *path, char *dest)
+{
+	int j = 0;
+	for (int i = 0; path[i] != '\0'; ++i) {
+		if (path[i] == '/') {
+			j = 0;
+		} else {
+			dest[j] = path[i];
+			j += 1;
+		}
+	}
+	dest[j] = '\0';
+}
+
+/*
+ * 32 bit FNV-1a
+ */
+u32 _hash_name(char *name)
+{
+	u32 hash = 2166136261u;
+	for (usize i = 0; name[i] != '\0'; ++i) {
+		hash ^= (u8) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+usize _dir_bucket_offset(struct fs *fs, u32 hash)
+{
+	return DIR_BLK_BUCKETS_OFFSET
+		+ (hash % DIR_BLK_NUM_BUCKETS) * sizeof(u16);
+}
+
+u16 _read_dir_u16(struct fs *fs, usize dir_blk_num, usize offset)
+{
+	u16 x;
+	_seek_to_data_addr(fs, dir_blk_num, offset);
+	_read_bytes(fs, sizeof(x), &x);
+	return x;
+}
+
+void _write_dir_u16(struct fs *fs, usize dir_blk_num, usize offset, u16 x)
+{
+	_seek_to_data_addr(fs, dir_blk_num, offset);
+	_write_bytes(fs, sizeof(x), &x);
+}
+
+struct _dir_rec _get_rec(struct fs *fs, usize dir_blk_num, usize offset)
+{
+	struct _dir_rec rec;
+	_seek_to_data_addr(fs, dir_blk_num, offset);
+	_read_bytes(fs, DIR_REC_HDR_LEN, &rec);
+	return rec;
+}
+
+void _set_rec(struct fs *fs, usize dir_blk_num, usize offset,
+	      struct _dir_rec rec)
+{
+	_seek_to_data_addr(fs, dir_blk_num, offset);
+	_write_bytes(fs, DIR_REC_HDR_LEN, &rec);
+}
+
+/*
+ * How much of @rec is taken up; the rest, up to the next record, is free
+ */
+usize _rec_used_len(struct _dir_rec rec)
+{
+	if (rec.inode_num == NULL_INODE_NUM) {
+		return 0;
+	}
+	return DIR_REC_HDR_LEN + rec.name_len + rec.inline_len;
+}
+
+/*
+ * How many bytes the records of @dir_blk_num leave unused in all. Free space
+ * is gathered up when a block fills, so a record of up to this length fits.
+ */
+usize _get_dir_free_len(struct fs *fs, usize dir_blk_num)
+{
+	return _read_dir_u16(fs, dir_blk_num, DIR_BLK_FREE_LEN_OFFSET);
+}
+
+void _set_dir_free_len(struct fs *fs, usize dir_blk_num, usize len)
+{
+	_write_dir_u16(fs, dir_blk_num, DIR_BLK_FREE_LEN_OFFSET, len);
+}
+
+/*
+ * Makes the freshly zeroed @dir_blk_num an empty directory block: one free
+ * record spanning all of it
+ */
+void _init_dir_blk(struct fs *fs, usize dir_blk_num)
+{
+	struct _dir_rec rec = {
+		.inode_num = NULL_INODE_NUM,
+		.rec_len = fs->layout.blk_size - DIR_BLK_RECS_OFFSET,
+		.next = NULL_REC,
+		.name_len = 0,
+		.inline_len = 0,
+	};
+	_set_rec(fs, dir_blk_num, DIR_BLK_RECS_OFFSET, rec);
+	_set_dir_free_len(fs, dir_blk_num, rec.rec_len);
+}
+
+/*
+ * Follows the hash chain of @entry_name, returning its record or `NULL_REC`
+ *
+ * If @link_offset is not NULL, it is set to the offset of whatever points at
+ * the returned record (the bucket, or the previous record in the chain).
+ */
+usize _find_rec(struct fs *fs, usize dir_blk_num, char *entry_name,
+		usize *link_offset)
+{
+	usize name_len = strlen(entry_name);
+	usize link = _dir_bucket_offset(fs, _hash_name(entry_name));
+	usize offset = _read_dir_u16(fs, dir_blk_num, link);
+	char curr_entry[MAX_FILENAME_LEN];
+	while (offset != NULL_REC) {
+		struct _dir_rec rec = _get_rec(fs, dir_blk_num, offset);
+		if (rec.name_len == name_len) {
+			_read_str(fs, name_len, curr_entry);
+			if (memcmp(entry_name, curr_entry, name_len) == 0) {
+				break;
+			}
+		}
+		link = offset + DIR_REC_NEXT_OFFSET;
+		offset = rec.next;
+	}
+	if (link_offset != NULL) {
+		*link_offset = link;
+	}
+	return offset;
+}
+
+/*
+ * Returns the block after @dir_blk_num, the @blk_idx'th of the directory whose
+ * inode data ptr is @dir_data_ptr, or `NULL_DIR_BLK_NUM` if it is the last
+ */
+usize _next_dir_blk(struct fs *fs, usize dir_data_ptr, usize dir_blk_num,
+		    usize blk_idx)
+{
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		usize num_blks = _get_ext_blk_size(fs, dir_data_ptr)
+			/ fs->layout.blk_size;
+		return blk_idx + 1 < num_blks
+			? _extent_map(fs, dir_data_ptr, blk_idx + 1, false,
+				      NULL)
+			: NULL_DIR_BLK_NUM;
+	}
+	_seek_to_data_addr(fs, dir_blk_num, DATA_BLK_NEXT_BLK_NUM_OFFSET);
+	usize next_blk_num = _read_usize(fs);
+	return next_blk_num == NULL_DATA_BLK_NUM
+		? NULL_DIR_BLK_NUM
+		: next_blk_num;
+}
+
+/*
+ * Whether @dir_blk_num is an index block rather than a block of records
+ */
+bool _is_dir_idx(struct fs *fs, usize dir_blk_num)
+{
+	return _get_dir_free_len(fs, dir_blk_num) == DIR_IDX_MARK;
+}
+
+usize _get_idx_len(struct fs *fs, usize idx_blk_num)
+{
+	return _read_dir_u16(fs, idx_blk_num, DIR_IDX_LEN_OFFSET);
+}
+
+void _set_idx_len(struct fs *fs, usize idx_blk_num, usize len)
+{
+	_write_dir_u16(fs, idx_blk_num, DIR_IDX_LEN_OFFSET, len);
+}
+
+/*
+ * An entry of an index block: names hashed from @hash up to the hash of the
+ * next entry (inclusive) are under @blk_num
+ */
+struct _idx_entry {
+	u32 hash;
+	usize blk_num;
+};
+
+struct _idx_entry _get_idx_entry(struct fs *fs, usize idx_blk_num, usize idx)
+{
+	struct _idx_entry entry;
+	_seek_to_data_addr(fs, idx_blk_num,
+			   DIR_IDX_ENTRIES_OFFSET + idx * DIR_IDX_ENTRY_LEN);
+	_read_bytes(fs, sizeof(entry.hash), &entry.hash);
+	entry.blk_num = _read_usize(fs);
+	return entry;
+}
+
+void _set_idx_entry(struct fs *fs, usize idx_blk_num, usize idx,
+		    struct _idx_entry entry)
+{
+	_seek_to_data_addr(fs, idx_blk_num,
+			   DIR_IDX_ENTRIES_OFFSET + idx * DIR_IDX_ENTRY_LEN);
+	_write_bytes(fs, sizeof(entry.hash), &entry.hash);
+	_write_usize(fs, entry.blk_num);
+}
+
+/*
+ * Returns how many entries of @idx_blk_num hash below @hash, or to at most
+ * @hash if @inclusive
+ */
+usize _count_idx_entries(struct fs *fs, usize idx_blk_num, u32 hash,
+			 bool inclusive)
+{
+	usize lo = 0;
+	usize hi = _get_idx_len(fs, idx_blk_num);
+	while (lo < hi) {
+		usize mid = lo + (hi - lo) / 2;
+		u32 mid_hash = _get_idx_entry(fs, idx_blk_num, mid).hash;
+		if (mid_hash < hash || (inclusive && mid_hash == hash)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * `_find_rec` under @dir_blk_num, following each index entry whose range
+ * holds @hash, the hash of @entry_name
+ */
+usize _find_idx_rec(struct fs *fs, usize dir_blk_num, char *entry_name,
+		    u32 hash, usize *rec_blk_num, usize *link_offset)
+{
+	if (!_is_dir_idx(fs, dir_blk_num)) {
+		usize offset = _find_rec(fs, dir_blk_num, entry_name,
+					 link_offset);
+		*rec_blk_num = dir_blk_num;
+		return offset;
+	}
+	// The last entry below the hash, then any starting at it: names of
+	// one hash only end up in more than one block when they collide
+	usize len = _get_idx_len(fs, dir_blk_num);
+	usize first = _count_idx_entries(fs, dir_blk_num, hash, false);
+	first = first > 0 ? first - 1 : 0;
+	for (usize i = first; i < len; ++i) {
+		struct _idx_entry entry = _get_idx_entry(fs, dir_blk_num, i);
+		if (i > first && entry.hash > hash) {
+			break;
+		}
+		usize offset = _find_idx_rec(fs, entry.blk_num, entry_name,
+					     hash, rec_blk_num, link_offset);
+		if (offset != NULL_REC) {
+			return offset;
+		}
+	}
+	return NULL_REC;
+}
+
+/*
+ * Looks @entry_name up through the index of the directory whose inode data ptr
+ * is @dir_data_ptr, also setting @dir_blk_num to the block the record is in
+ */
+usize _find_dir_rec(struct fs *fs, usize dir_data_ptr, char *entry_name,
+		    usize *dir_blk_num, usize *link_offset)
+{
+	usize rec_blk_num;
+	usize offset = _find_idx_rec(fs, _dir_blk_of_data_ptr(fs, dir_data_ptr),
+				     entry_name, _hash_name(entry_name),
+				     &rec_blk_num, link_offset);
+	if (offset != NULL_REC) {
+		*dir_blk_num = rec_blk_num;
+	}
+	return offset;
+}
+
+/*
+ * Returns the inode num of the entry @name in the directory whose inode data
+ * ptr is @dir_data_ptr, or `NULL_INODE_NUM` if there is none
+ */
+usize _get_inode_num_of_name(struct fs *fs, usize dir_data_ptr, char *name)
+{
+	usize dir_blk_num;
+	usize offset = _find_dir_rec(fs, dir_data_ptr, name, &dir_blk_num,
+				     NULL);
+	if (offset == NULL_REC) {
+		return NULL_INODE_NUM;
+	}
+	return _get_rec(fs, dir_blk_num, offset).inode_num;
+}
+
+/*
+ * Returns the inode data ptr of the directory @inode_num, or `NULL_DIR_BLK_NUM`
+ * if it isn't a directory
+ */
+usize _dir_data_ptr_of_inode_num(struct fs *fs, usize inode_num)
+{
+	struct _inode inode = _get_inode(fs, inode_num);
+	if (!_inode_is_dir(inode)) {
+		return NULL_DIR_BLK_NUM;
+	}
+	return _inode_data_ptr(inode);
+}
+
+/*
+ * Returns the inode num of @name in the directory @parent_inode_num, or
+ * `NULL_INODE_NUM` if there is none. Whatever is found on disk (including
+ * nothing) is remembered in the dentry cache.
+ *
+ * The caller holds the directory's lock.
+ */
+usize _lookup_child_locked(struct fs *fs, usize parent_inode_num, char *name)
+{
+	usize inode_num;
+	if (dcache_lookup(fs->dcache, parent_inode_num, name, &inode_num)) {
+		return inode_num;
+	}
+	usize dir_data_ptr = _dir_data_ptr_of_inode_num(fs, parent_inode_num);
+	inode_num = dir_data_ptr == NULL_DIR_BLK_NUM
+		? NULL_INODE_NUM
+		: _get_inode_num_of_name(fs, dir_data_ptr, name);
+	dcache_insert(fs->dcache, parent_inode_num, name, inode_num);
+	return inode_num;
+}
+
+/*
+ * `_lookup_child_locked`, read-locking the directory. Entries only change
+ * under its write lock, so what goes into the dentry cache is never stale.
+ */
+usize _lookup_child(struct fs *fs, usize parent_inode_num, char *name)
+{
+	_lock_inode(fs, parent_inode_num, false);
+	usize inode_num = _lookup_child_locked(fs, parent_inode_num, name);
+	_unlock_inode(fs, parent_inode_num);
+	return inode_num;
+}
+
+/*
+ * Recursively traverses until reaching the parent directory of the end file in
+ * @path, then sets @parent_inode_num to the inode num of said directory.
+ *
+ * Returns false if some directory along the way doesn't exist.
+ */
+bool _get_parent_inode_num(struct fs *fs, char *path, usize *parent_inode_num)
+{
+	usize path_len = strlen(path);
+
+	char path_cpy[path_len + 1];
+	strcpy(path_cpy, path);
+
+	usize inode_num = ROOT_DIR_INODE_NUM;
+	// TODO: unix would allow escaping of '/' with '\/'
+	// `strtok` keeps its place in a static, shared by every thread
+	char *save_ptr;
+	char *sub_dir = strtok_r(path_cpy, PATH_DELIM, &save_ptr);
+	char *next;
+	// read up until the last token (i.e. the parent dir)
+	while ((next = strtok_r(NULL, PATH_DELIM, &save_ptr)) != NULL) {
+		inode_num = _lookup_child(fs, inode_num, sub_dir);
+		if (inode_num == NULL_INODE_NUM) {
+			return false;
+		}
+		sub_dir = next;
+	}
+	*parent_inode_num = inode_num;
+	return true;
+}
+
+/*
+ * Sets @dir_inode_num to the inode num of the file at @dir_path, which need not
+ * be a directory, returning false if it doesn't exist
+ */
+bool _get_dir_inode_num(struct fs *fs, char *dir_path, usize *dir_inode_num)
+{
+	// The parent of a made up entry of the directory
+	usize path_len = strlen(dir_path);
+	char child_path[path_len + 3];
+	memcpy(child_path, dir_path, path_len);
+	strcpy(child_path + path_len, "/_");
+	return _get_parent_inode_num(fs, child_path, dir_inode_num);
+}
+
+/*
+ * Carves a record of @len bytes out of the first one in @dir_blk_num that
+ * leaves at least that much unused, returning its offset, or `NULL_REC` if
+ * there is no room. The new record has no inode yet.
+ */
+usize _alloc_rec(struct fs *fs, usize dir_blk_num, usize len)
+{
+	usize offset = DIR_BLK_RECS_OFFSET;
+	while (offset < fs->layout.blk_size) {
+		struct _dir_rec rec = _get_rec(fs, dir_blk_num, offset);
+		usize used_len = _rec_used_len(rec);
+		if (rec.rec_len - used_len >= len) {
+			struct _dir_rec new_rec = {
+				.inode_num = NULL_INODE_NUM,
+				.rec_len = rec.rec_len - used_len,
+				.next = NULL_REC,
+				.name_len = 0,
+				.inline_len = 0,
+			};
+			if (used_len > 0) {
+				rec.rec_len = used_len;
+				_set_rec(fs, dir_blk_num, offset, rec);
+			}
+			_set_rec(fs, dir_blk_num, offset + used_len, new_rec);
+			return offset + used_len;
+		}
+		offset += rec.rec_len;
+	}
+	return NULL_REC;
+}
+
+/*
+ * Gives the record at @offset, already unlinked from its bucket, back to the
+ * one before it, or marks it free if it is the first
+ */
+void _free_rec(struct fs *fs, usize dir_blk_num, usize offset)
+{
+	struct _dir_rec rec = _get_rec(fs, dir_blk_num, offset);
+	if (offset == DIR_BLK_RECS_OFFSET) {
+		rec.inode_num = NULL_INODE_NUM;
+		_set_rec(fs, dir_blk_num, offset, rec);
+		return;
+	}
+	usize prev_offset = DIR_BLK_RECS_OFFSET;
+	struct _dir_rec prev = _get_rec(fs, dir_blk_num, prev_offset);
+	while (prev_offset + prev.rec_len != offset) {
+		prev_offset += prev.rec_len;
+		prev = _get_rec(fs, dir_blk_num, prev_offset);
+	}
+	prev.rec_len += rec.rec_len;
+	_set_rec(fs, dir_blk_num, prev_offset, prev);
+}
+
+/*
+ * Lays the live records of the directory block image @blk whose names hash to
+ * @split_hash or above (if @upper) or below it (if not) end to end in
+ * @packed, zeroed past its next ptr, with their hash chains and free length
+ */
+void _pack_dir_blk(struct fs *fs, u8 *blk, u8 *packed, u32 split_hash,
+		   bool upper)
+{
+	usize blk_size = fs->layout.blk_size;
+	usize offset = DIR_BLK_RECS_OFFSET;
+	usize end = DIR_BLK_RECS_OFFSET;
+	usize last = NULL_REC;
+	while (offset < blk_size) {
+		struct _dir_rec rec;
+		memcpy(&rec, blk + offset, DIR_REC_HDR_LEN);
+		usize rec_offset = offset;
+		offset += rec.rec_len;
+		usize used_len = _rec_used_len(rec);
+		if (used_len == 0) {
+			continue;
+		}
+		char name[MAX_FILENAME_LEN + 1];
+		memcpy(name, blk + rec_offset + DIR_REC_HDR_LEN, rec.name_len);
+		name[rec.name_len] = '\0';
+		u32 hash = _hash_name(name);
+		if ((hash >= split_hash) != upper) {
+			continue;
+		}
+		u16 *bucket = (u16 *) (packed + _dir_bucket_offset(fs, hash));
+		rec.rec_len = used_len;
+		rec.next = *bucket;
+		*bucket = end;
+		memcpy(packed + end, blk + rec_offset, used_len);
+		memcpy(packed + end, &rec, DIR_REC_HDR_LEN);
+		last = end;
+		end += used_len;
+	}
+	// The last record (or a free first one) takes all that is left
+	if (last == NULL_REC) {
+		last = DIR_BLK_RECS_OFFSET;
+	}
+	struct _dir_rec rec;
+	memcpy(&rec, packed + last, DIR_REC_HDR_LEN);
+	rec.rec_len = blk_size - last;
+	memcpy(packed + last, &rec, DIR_REC_HDR_LEN);
+	u16 free_len = blk_size - end;
+	memcpy(packed + DIR_BLK_FREE_LEN_OFFSET, &free_len, sizeof(free_len));
+}
+
+/*
+ * Slides every record of @dir_blk_num down against the one before it, so that
+ * the space left by deleted and shrunk records comes together at the end of the
+ * block, then rebuilds the hash chains for the new offsets
+ */
+void _compact_dir_blk(struct fs *fs, usize dir_blk_num)
+{
+	usize blk_size = fs->layout.blk_size;
+	u8 *blk = malloc(blk_size);
+	u8 *compacted = calloc(1, blk_size);
+	_seek_to_data_addr(fs, dir_blk_num, 0);
+	_read_bytes(fs, blk_size, blk);
+	memcpy(compacted, blk, DIR_BLK_FREE_LEN_OFFSET);
+	_pack_dir_blk(fs, blk, compacted, 0, true);
+	_seek_to_data_addr(fs, dir_blk_num, 0);
+	_write_bytes(fs, blk_size, compacted);
+	free(compacted);
+	free(blk);
+}
+
+/*
+ * Moves the records of @dir_blk_num whose names hash to @split_hash or above
+ * into @new_blk_num, an empty directory block, compacting both
+ */
+void _split_dir_blk(struct fs *fs, usize dir_blk_num, usize new_blk_num,
+		    u32 split_hash)
+{
+	usize blk_size = fs->layout.blk_size;
+	u8 *blk = malloc(blk_size);
+	u8 *lower = calloc(1, blk_size);
+	u8 *upper = calloc(1, blk_size);
+	_seek_to_data_addr(fs, dir_blk_num, 0);
+	_read_bytes(fs, blk_size, blk);
+	memcpy(lower, blk, DIR_BLK_FREE_LEN_OFFSET);
+	_pack_dir_blk(fs, blk, lower, split_hash, false);
+	_pack_dir_blk(fs, blk, upper, split_hash, true);
+
+	_seek_to_data_addr(fs, dir_blk_num, 0);
+	_write_bytes(fs, blk_size, lower);
+	// The new block keeps its next ptr
+	_seek_to_data_addr(fs, new_blk_num, DIR_BLK_FREE_LEN_OFFSET);
+	_write_bytes(fs, blk_size - DIR_BLK_FREE_LEN_OFFSET,
+		     upper + DIR_BLK_FREE_LEN_OFFSET);
+	free(upper);
+	free(lower);
+	free(blk);
+}
+
+/*
+ * Links a record for @entry_name into @dir_blk_num, which has room for it
+ */
+void _add_rec(struct fs *fs, usize dir_blk_num, char *entry_name,
+	      u32 entry_num)
+{
+	usize name_len = strlen(entry_name);
+	usize len = DIR_REC_HDR_LEN + name_len;
+	usize offset = _alloc_rec(fs, dir_blk_num, len);
+	if (offset == NULL_REC) {
+		_compact_dir_blk(fs, dir_blk_num);
+		offset = _alloc_rec(fs, dir_blk_num, len);
+	}
+	assert(offset != NULL_REC);
+
+	usize bucket_offset = _dir_bucket_offset(fs, _hash_name(entry_name));
+	struct _dir_rec rec = _get_rec(fs, dir_blk_num, offset);
+	rec.inode_num = entry_num;
+	rec.next = _read_dir_u16(fs, dir_blk_num, bucket_offset);
+	rec.name_len = name_len;
+	rec.inline_len = 0;
+	_set_rec(fs, dir_blk_num, offset, rec);
+	_write_str(fs, name_len, entry_name);
+
+	_write_dir_u16(fs, dir_blk_num, bucket_offset, offset);
+	_set_dir_free_len(fs, dir_blk_num,
+			  _get_dir_free_len(fs, dir_blk_num) - len);
+}
+
+/*
+ * Adds a block to the directory whose inode data ptr is @dir_data_ptr,
+ * returning it, or `NULL_DIR_BLK_NUM` if the disk is full. The new block is
+ * an empty block of records, found only once an index entry leads to it.
+ */
+usize _grow_dir(struct fs *fs, usize dir_data_ptr)
+{
+	usize dir_blk_num;
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		usize num_blks = _get_ext_blk_size(fs, dir_data_ptr)
+			/ fs->layout.blk_size;
+		dir_blk_num = _extent_map(fs, dir_data_ptr, num_blks, true,
+					  NULL);
+		if (dir_blk_num == NULL_DATA_BLK_NUM) {
+			return NULL_DIR_BLK_NUM;
+		}
+		_set_ext_blk_size(fs, dir_data_ptr,
+				  (num_blks + 1) * fs->layout.blk_size);
+	} else {
+		// Linked in right after the first block, sparing a walk to
+		// the end of the chain
+		dir_blk_num = _alloc_data_blk(fs, dir_data_ptr);
+		if (dir_blk_num == NULL_DATA_BLK_NUM) {
+			return NULL_DIR_BLK_NUM;
+		}
+		_seek_to_next_blk_ptr(fs, dir_data_ptr);
+		usize next_blk_num = _read_usize(fs);
+		_seek_to_next_blk_ptr(fs, dir_blk_num);
+		_write_usize(fs, next_blk_num);
+		_seek_to_next_blk_ptr(fs, dir_data_ptr);
+		_write_usize(fs, dir_blk_num);
+	}
+	_init_dir_blk(fs, dir_blk_num);
+	return dir_blk_num;
+}
+
+/*
+ * The index blocks passed through on the way down to a block of records, from
+ * the first block of the directory on, and which entry of each led on
+ */
+struct _idx_path {
+	usize blk_nums[MAX_DIR_IDX_DEPTH];
+	usize idxs[MAX_DIR_IDX_DEPTH];
+	usize depth;
+};
+
+/*
+ * Returns the block of records that a name hashed to @hash goes in, in the
+ * directory whose inode data ptr is @dir_data_ptr, setting @path to the way
+ * there
+ */
+usize _dir_blk_of_hash(struct fs *fs, usize dir_data_ptr, u32 hash,
+		       struct _idx_path *path)
+{
+	usize blk_num = _dir_blk_of_data_ptr(fs, dir_data_ptr);
+	path->depth = 0;
+	while (_is_dir_idx(fs, blk_num)) {
+		assert(path->depth < MAX_DIR_IDX_DEPTH);
+		// The first entry is for hashes from 0, so one always matches
+		usize idx = _count_idx_entries(fs, blk_num, hash, true) - 1;
+		path->blk_nums[path->depth] = blk_num;
+		path->idxs[path->depth] = idx;
+		path->depth += 1;
+		blk_num = _get_idx_entry(fs, blk_num, idx).blk_num;
+	}
+	return blk_num;
+}
+
+/*
+ * A block of records, and the range of name hashes the index sends there: from
+ * @lo up to @hi, if @has_hi, or on to the end otherwise
+ */
+struct _dir_leaf {
+	usize blk_num;
+	u32 lo;
+	// No block comes before it
+	bool first;
+	u32 hi;
+	bool has_hi;
+};
+
+/*
+ * Returns the block of records that names hashed to @hash go in, in the
+ * directory whose inode data ptr is @dir_data_ptr, with its range of hashes
+ */
+struct _dir_leaf _dir_leaf_of_hash(struct fs *fs, usize dir_data_ptr,
+				   u32 hash)
+{
+	struct _idx_path path;
+	struct _dir_leaf leaf = {
+		.blk_num = _dir_blk_of_hash(fs, dir_data_ptr, hash, &path),
+		.lo = 0,
+		.first = true,
+		.hi = 0,
+		.has_hi = false,
+	};
+	// The closest entry after the way down bounds the range from above
+	for (usize level = path.depth; level > 0; --level) {
+		usize idx_blk_num = path.blk_nums[level - 1];
+		usize idx = path.idxs[level - 1];
+		if (level == path.depth) {
+			leaf.lo = _get_idx_entry(fs, idx_blk_num, idx).hash;
+		}
+		leaf.first = leaf.first && idx == 0;
+		if (!leaf.has_hi && idx + 1 < _get_idx_len(fs, idx_blk_num)) {
+			leaf.hi = _get_idx_entry(fs, idx_blk_num, idx + 1).hash;
+			leaf.has_hi = true;
+		}
+	}
+	return leaf;
+}
+
+/*
+ * Whether names hashed to @hash, no lower than the hash that led to @leaf, go
+ * in it
+ */
+bool _leaf_holds(struct _dir_leaf *leaf, u32 hash)
+{
+	return !leaf->has_hi || hash < leaf->hi;
+}
+
+/*
+ * Whether a name hashed to @hash may be in the block before @leaf instead,
+ * which happens when a block whose names all hashed the same was split
+ */
+bool _leaf_shares(struct _dir_leaf *leaf, u32 hash)
+{
+	return hash == leaf->lo && !leaf->first;
+}
+
+/*
+ * Inserts @entry as the @idx'th of @idx_blk_num, which has room for it
+ */
+void _insert_idx_entry(struct fs *fs, usize idx_blk_num, usize idx,
+		       struct _idx_entry entry)
+{
+	usize len = _get_idx_len(fs, idx_blk_num);
+	for (usize i = len; i > idx; --i) {
+		_set_idx_entry(fs, idx_blk_num, i,
+			       _get_idx_entry(fs, idx_blk_num, i - 1));
+	}
+	_set_idx_entry(fs, idx_blk_num, idx, entry);
+	_set_idx_len(fs, idx_blk_num, len + 1);
+}
+
+/*
+ * Moves all of the first block of the directory whose inode data ptr is
+ * @dir_data_ptr, records or index entries, to a new block, leaving the first
+ * an index of that one block, so that it has room for more entries
+ *
+ * Returns 1 if the disk is full
+ */
+u8 _deepen_dir_idx(struct fs *fs, usize dir_data_ptr)
+{
+	usize root_blk_num = _dir_blk_of_data_ptr(fs, dir_data_ptr);
+	usize new_blk_num = _grow_dir(fs, dir_data_ptr);
+	if (new_blk_num == NULL_DIR_BLK_NUM) {
+		return 1;
+	}
+	// Both kinds of block address their contents from their start, and
+	// the new block keeps its next ptr
+	usize len = fs->layout.blk_size - DIR_BLK_FREE_LEN_OFFSET;
+	u8 *contents = malloc(len);
+	_seek_to_data_addr(fs, root_blk_num, DIR_BLK_FREE_LEN_OFFSET);
+	_read_bytes(fs, len, contents);
+	_seek_to_data_addr(fs, new_blk_num, DIR_BLK_FREE_LEN_OFFSET);
+	_write_bytes(fs, len, contents);
+	free(contents);
+
+	struct _idx_entry entry = { .hash = 0, .blk_num = new_blk_num };
+	_set_dir_free_len(fs, root_blk_num, DIR_IDX_MARK);
+	_set_idx_len(fs, root_blk_num, 1);
+	_set_idx_entry(fs, root_blk_num, 0, entry);
+	return 0;
+}
+
+/*
+ * Moves the upper half of the entries of the full index block at @level of
+ * @path to a new block, indexed by the block above it
+ *
+ * Returns 1 if the disk is full
+ */
+u8 _split_dir_idx(struct fs *fs, usize dir_data_ptr, struct _idx_path *path,
+		  usize level)
+{
+	usize idx_blk_num = path->blk_nums[level];
+	usize new_blk_num = _grow_dir(fs, dir_data_ptr);
+	if (new_blk_num == NULL_DIR_BLK_NUM) {
+		return 1;
+	}
+	usize len = _get_idx_len(fs, idx_blk_num);
+	usize half = len / 2;
+	for (usize i = half; i < len; ++i) {
+		_set_idx_entry(fs, new_blk_num, i - half,
+			       _get_idx_entry(fs, idx_blk_num, i));
+	}
+	_set_dir_free_len(fs, new_blk_num, DIR_IDX_MARK);
+	_set_idx_len(fs, new_blk_num, len - half);
+	_set_idx_len(fs, idx_blk_num, half);
+
+	struct _idx_entry entry = {
+		.hash = _get_idx_entry(fs, new_blk_num, 0).hash,
+		.blk_num = new_blk_num,
+	};
+	_insert_idx_entry(fs, path->blk_nums[level - 1],
+			  path->idxs[level - 1] + 1, entry);
+	return 0;
+}
+
+/*
+ * A record of a directory block, for `_pick_split_hash`
+ */
+struct _hashed_rec {
+	u32 hash;
+	usize len;
+};
+
+int _cmp_hashed_recs(const void *a, const void *b)
+{
+	const struct _hashed_rec *rec_a = a;
+	const struct _hashed_rec *rec_b = b;
+	return (rec_a->hash > rec_b->hash) - (rec_a->hash < rec_b->hash);
+}
+
+/*
+ * Sets @split_hash to the hash that splits the records of @dir_blk_num, and a
+ * new one of @len bytes whose name hashes to @hash, most evenly by length into
+ * those hashed below it and the rest
+ *
+ * Returns false if their names all hash the same
+ */
+bool _pick_split_hash(struct fs *fs, usize dir_blk_num, u32 hash, usize len,
+		      u32 *split_hash)
+{
+	usize blk_size = fs->layout.blk_size;
+	struct _hashed_rec *recs =
+		malloc((blk_size / DIR_REC_HDR_LEN + 1) * sizeof(*recs));
+	recs[0].hash = hash;
+	recs[0].len = len;
+	usize num_recs = 1;
+	usize total_len = len;
+	usize offset = DIR_BLK_RECS_OFFSET;
+	while (offset < blk_size) {
+		struct _dir_rec rec = _get_rec(fs, dir_blk_num, offset);
+		if (rec.inode_num != NULL_INODE_NUM) {
+			char name[MAX_FILENAME_LEN + 1];
+			_read_str(fs, rec.name_len, name);
+			name[rec.name_len] = '\0';
+			recs[num_recs].hash = _hash_name(name);
+			recs[num_recs].len = _rec_used_len(rec);
+			total_len += recs[num_recs].len;
+			num_recs += 1;
+		}
+		offset += rec.rec_len;
+	}
+	qsort(recs, num_recs, sizeof(*recs), _cmp_hashed_recs);
+
+	bool found = false;
+	usize best_diff = 0;
+	usize below_len = 0;
+	for (usize i = 1; i < num_recs; ++i) {
+		below_len += recs[i - 1].len;
+		if (recs[i].hash == recs[i - 1].hash) {
+			continue;
+		}
+		usize above_len = total_len - below_len;
+		usize diff = below_len > above_len ? below_len - above_len
+						   : above_len - below_len;
+		if (!found || diff < best_diff) {
+			found = true;
+			best_diff = diff;
+			*split_hash = recs[i].hash;
+		}
+	}
+	free(recs);
+	return found;
+}
+
+/*
+ * Splits @dir_blk_num, the block of records at the end of @path, which has no
+ * room for a new record of @len bytes whose name hashes to @hash, moving about
+ * half of its records to a new block indexed right after it
+ *
+ * Returns 1 if the disk is full
+ */
+u8 _split_dir_leaf(struct fs *fs, usize dir_data_ptr, struct _idx_path *path,
+		   usize dir_blk_num, u32 hash, usize len)
+{
+	usize new_blk_num = _grow_dir(fs, dir_data_ptr);
+	if (new_blk_num == NULL_DIR_BLK_NUM) {
+		return 1;
+	}
+	// If every name hashes the same, the new one gets the new block to
+	// itself
+	u32 split_hash = hash;
+	if (_pick_split_hash(fs, dir_blk_num, hash, len, &split_hash)) {
+		_split_dir_blk(fs, dir_blk_num, new_blk_num, split_hash);
+	}
+	struct _idx_entry entry = {
+		.hash = split_hash,
+		.blk_num = new_blk_num,
+	};
+	usize level = path->depth - 1;
+	_insert_idx_entry(fs, path->blk_nums[level], path->idxs[level] + 1,
+			  entry);
+	return 0;
+}
+
+/*
+ * Makes room for @len more bytes in the block of records that names hashed to
+ * @hash go in, in the directory whose inode data ptr is @dir_data_ptr. A block
+ * without room is split, once the index block above it (and so on up) has
+ * room for one more entry.
+ *
+ * Returns that block, or `NULL_DIR_BLK_NUM` if the disk is full
+ */
+usize _make_dir_room(struct fs *fs, usize dir_data_ptr, u32 hash, usize len)
+{
+	while (true) {
+		struct _idx_path path;
+		usize dir_blk_num =
+			_dir_blk_of_hash(fs, dir_data_ptr, hash, &path);
+		// Only the unused byte count of a full block is read
+		if (_get_dir_free_len(fs, dir_blk_num) >= len) {
+			return dir_blk_num;
+		}
+		usize level = path.depth;
+		while (level > 0
+		       && _get_idx_len(fs, path.blk_nums[level - 1])
+				  == DIR_IDX_CAP) {
+			level -= 1;
+		}
+		u8 ret;
+		if (level == path.depth && level > 0) {
+			ret = _split_dir_leaf(fs, dir_data_ptr, &path,
+					      dir_blk_num, hash, len);
+		} else if (level == 0) {
+			ret = _deepen_dir_idx(fs, dir_data_ptr);
+		} else {
+			ret = _split_dir_idx(fs, dir_data_ptr, &path, level);
+		}
+		if (ret) {
+			return NULL_DIR_BLK_NUM;
+		}
+	}
+}
+
+/*
+ * Adds @entry_name to the directory whose inode data ptr is @dir_data_ptr, in
+ * the block of records its hash leads to. The caller has checked that the
+ * name isn't taken.
+ *
+ * Returns 1 if the disk is full
+ */
+u8 _add_dir_entry(struct fs *fs, usize dir_data_ptr, char *entry_name,
+		  usize entry_num)
+{
+	usize dir_blk_num =
+		_make_dir_room(fs, dir_data_ptr, _hash_name(entry_name),
+			       DIR_REC_HDR_LEN + strlen(entry_name));
+	if (dir_blk_num == NULL_DIR_BLK_NUM) {
+		return 1;
+	}
+	_add_rec(fs, dir_blk_num, entry_name, entry_num);
+	return 0;
+}
+
+/*
+ * `_add_dir_entry` of the @num_entries names in @entry_names, sorted by name
+ * hash, with the inode nums in @entry_nums. Each block of records takes every
+ * name in a row that hashes into it while it has room, so it is found and
+ * updated once for all of them.
+ *
+ * Returns how many were added before the disk filled up
+ */
+usize _add_dir_entries(struct fs *fs, usize dir_data_ptr, char **entry_names,
+		       usize *entry_nums, usize num_entries)
+{
+	usize num_added = 0;
+	while (num_added < num_entries) {
+		char *entry_name = entry_names[num_added];
+		u32 hash = _hash_name(entry_name);
+		if (_add_dir_entry(fs, dir_data_ptr, entry_name,
+				   entry_nums[num_added])) {
+			break;
+		}
+		num_added += 1;
+
+		struct _dir_leaf leaf =
+			_dir_leaf_of_hash(fs, dir_data_ptr, hash);
+		while (num_added < num_entries) {
+			entry_name = entry_names[num_added];
+			usize len = DIR_REC_HDR_LEN + strlen(entry_name);
+			if (!_leaf_holds(&leaf, _hash_name(entry_name))
+			    || _get_dir_free_len(fs, leaf.blk_num) < len) {
+				break;
+			}
+			_add_rec(fs, leaf.blk_num, entry_name,
+				 entry_nums[num_added]);
+			num_added += 1;
+		}
+	}
+	return num_added;
+}
+
+/*
+ * Unlinks @entry_name from its hash chain and frees its record. Emptied blocks
+ * stay with the directory, to be filled again.
+ *
+ * Returns the inode num of the removed entry, or `NULL_INODE_NUM` if there is
+ * none
+ */
+u32 _del_dir_entry(struct fs *fs, usize dir_data_ptr, char *entry_name)
+{
+	usize dir_blk_num;
+	usize link_offset;
+	usize offset = _find_dir_rec(fs, dir_data_ptr, entry_name, &dir_blk_num,
+				     &link_offset);
+	if (offset == NULL_REC) {
+		return NULL_INODE_NUM;
+	}
+	struct _dir_rec rec = _get_rec(fs, dir_blk_num, offset);
+	_write_dir_u16(fs, dir_blk_num, link_offset, rec.next);
+	_free_rec(fs, dir_blk_num, offset);
+	_set_dir_free_len(fs, dir_blk_num, _get_dir_free_len(fs, dir_blk_num)
+			  + _rec_used_len(rec));
+	return rec.inode_num;
+}
+
+/*
+ * One of the names given to `fs_create_many` / `fs_delete_many`, with its index
+ * in the caller's array
+ */
+struct _name_ref {
+	char *name;
+	usize idx;
+	u32 hash;
+};
+
+int _cmp_name_refs(const void *a, const void *b)
+{
+	const struct _name_ref *ref_a = a;
+	const struct _name_ref *ref_b = b;
+	int cmp = strcmp(ref_a->name, ref_b->name);
+	if (cmp != 0) {
+		return cmp;
+	}
+	return (ref_a->idx > ref_b->idx) - (ref_a->idx < ref_b->idx);
+}
+
+/*
+ * Orders refs by name hash, the order of the blocks of records they go in
+ */
+int _cmp_ref_hashes(const void *a, const void *b)
+{
+	const struct _name_ref *ref_a = a;
+	const struct _name_ref *ref_b = b;
+	if (ref_a->hash != ref_b->hash) {
+		return (ref_a->hash > ref_b->hash)
+			- (ref_a->hash < ref_b->hash);
+	}
+	return _cmp_name_refs(a, b);
+}
+
+/*
+ * Sorts the usable names among the @num_names in @names into @refs, returning
+ * how many there are. @rets gets 1 for the rest: names that are empty, too
+ * long or contain a '/', and repeats of an earlier name.
+ */
+usize _sort_names(char **names, usize num_names, struct _name_ref *refs,
+		  u8 *rets)
+{
+	usize num_refs = 0;
+	for (usize i = 0; i < num_names; ++i) {
+		usize name_len = strlen(names[i]);
+		rets[i] = name_len == 0 || name_len > MAX_FILENAME_LEN
+			|| strchr(names[i], '/') != NULL;
+		if (!rets[i]) {
+			refs[num_refs].name = names[i];
+			refs[num_refs].idx = i;
+			refs[num_refs].hash = _hash_name(names[i]);
+			num_refs += 1;
+		}
+	}
+	qsort(refs, num_refs, sizeof(*refs), _cmp_name_refs);
+
+	// Repeats sort right after the first of their name
+	usize num_uniq = 0;
+	for (usize i = 0; i < num_refs; ++i) {
+		if (num_uniq > 0
+		    && strcmp(refs[i].name, refs[num_uniq - 1].name) == 0) {
+			rets[refs[i].idx] = 1;
+		} else {
+			refs[num_uniq] = refs[i];
+			num_uniq += 1;
+		}
+	}
+	return num_uniq;
+}
+
+/*
+ * Returns the ref among the @num_refs name-sorted @refs whose name is that of
+ * the live record @rec at @offset in @dir_blk_num, or NULL if there is none
+ */
+struct _name_ref *_match_rec(struct fs *fs, usize dir_blk_num, usize offset,
+			     struct _dir_rec rec, struct _name_ref *refs,
+			     usize num_refs)
+{
+	char name[MAX_FILENAME_LEN + 1];
+	_seek_to_data_addr(fs, dir_blk_num, offset + DIR_REC_HDR_LEN);
+	_read_str(fs, rec.name_len, name);
+	name[rec.name_len] = '\0';
+	// Names are unique by now, so the index that breaks ties is left out
+	for (usize lo = 0, hi = num_refs; lo < hi;) {
+		usize mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(name, refs[mid].name);
+		if (cmp == 0) {
+			return &refs[mid];
+		}
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Sorts the @num_refs @refs by name hash and cuts them into runs that each go
+ * in one block of records of the directory whose inode data ptr is
+ * @dir_data_ptr. Sets @leaf to the block of the run from @first, which is
+ * sorted by name, and returns where the run ends.
+ */
+usize _next_leaf_run(struct fs *fs, usize dir_data_ptr, struct _name_ref *refs,
+		     usize num_refs, usize first, struct _dir_leaf *leaf)
+{
+	if (first == 0) {
+		qsort(refs, num_refs, sizeof(*refs), _cmp_ref_hashes);
+	}
+	*leaf = _dir_leaf_of_hash(fs, dir_data_ptr, refs[first].hash);
+	usize end = first + 1;
+	while (end < num_refs && _leaf_holds(leaf, refs[end].hash)) {
+		end += 1;
+	}
+	qsort(refs + first, end - first, sizeof(*refs), _cmp_name_refs);
+	return end;
+}
+
+/*
+ * Sets @rets to 1 for each of the @num_refs @refs that already names an entry
+ * of the directory whose inode data ptr is @dir_data_ptr. The refs are grouped
+ * by the block of records their names hash to, and each record of those
+ * blocks is read once. @refs is left reordered.
+ */
+void _mark_taken_names(struct fs *fs, usize dir_data_ptr,
+		       struct _name_ref *refs, usize num_refs, u8 *rets)
+{
+	for (usize i = 0; i < num_refs;) {
+		struct _dir_leaf leaf;
+		usize end = _next_leaf_run(fs, dir_data_ptr, refs, num_refs, i,
+					   &leaf);
+		usize offset = DIR_BLK_RECS_OFFSET;
+		while (offset < fs->layout.blk_size) {
+			struct _dir_rec rec =
+				_get_rec(fs, leaf.blk_num, offset);
+			struct _name_ref *ref = rec.inode_num == NULL_INODE_NUM
+				? NULL
+				: _match_rec(fs, leaf.blk_num, offset, rec,
+					     refs + i, end - i);
+			if (ref != NULL) {
+				rets[ref->idx] = 1;
+			}
+			offset += rec.rec_len;
+		}
+		for (; i < end; ++i) {
+			usize dir_blk_num;
+			if (!rets[refs[i].idx]
+			    && _leaf_shares(&leaf, refs[i].hash)
+			    && _find_dir_rec(fs, dir_data_ptr, refs[i].name,
+					     &dir_blk_num, NULL)
+				   != NULL_REC) {
+				rets[refs[i].idx] = 1;
+			}
+		}
+	}
+}
+
+/*
+ * `_del_dir_entry` for each of the @num_refs @refs, from the directory whose
+ * inode data ptr is @dir_data_ptr, in one pass over the records of each block
+ * their names hash to. The inode num of each removed entry goes in
+ * @inode_nums at its ref's index, which is left alone for names that aren't
+ * there. @refs is left reordered.
+ *
+ * Returns how many were removed
+ */
+usize _del_dir_entries(struct fs *fs, usize dir_data_ptr,
+		       struct _name_ref *refs, usize num_refs,
+		       usize *inode_nums)
+{
+	usize num_dels = 0;
+	for (usize i = 0; i < num_refs;) {
+		struct _dir_leaf leaf;
+		usize end = _next_leaf_run(fs, dir_data_ptr, refs, num_refs, i,
+					   &leaf);
+		usize dir_blk_num = leaf.blk_num;
+		usize offset = DIR_BLK_RECS_OFFSET;
+		while (offset < fs->layout.blk_size) {
+			struct _dir_rec rec = _get_rec(fs, dir_blk_num, offset);
+			// Freeing merges the record into the one before it,
+			// which still ends where this one did
+			usize next_offset = offset + rec.rec_len;
+			struct _name_ref *ref = rec.inode_num == NULL_INODE_NUM
+				? NULL
+				: _match_rec(fs, dir_blk_num, offset, rec,
+					     refs + i, end - i);
+			if (ref != NULL) {
+				usize link_offset;
+				_find_rec(fs, dir_blk_num, ref->name,
+					  &link_offset);
+				_write_dir_u16(fs, dir_blk_num, link_offset,
+					       rec.next);
+				_free_rec(fs, dir_blk_num, offset);
+				_set_dir_free_len(
+					fs, dir_blk_num,
+					_get_dir_free_len(fs, dir_blk_num)
+						+ _rec_used_len(rec));
+				inode_nums[ref->idx] = rec.inode_num;
+				num_dels += 1;
+			}
+			offset = next_offset;
+		}
+		for (; i < end; ++i) {
+			usize idx = refs[i].idx;
+			if (inode_nums[idx] != NULL_INODE_NUM
+			    || !_leaf_shares(&leaf, refs[i].hash)) {
+				continue;
+			}
+			inode_nums[idx] = _del_dir_entry(fs, dir_data_ptr,
+							 refs[i].name);
+			num_dels += inode_nums[idx] != NULL_INODE_NUM;
+		}
+	}
+	return num_dels;
+}
+
+/*
+ * Frees every block of the file whose inode data ptr is @data_ptr
+ */
+void _dealloc_file_blks(struct fs *fs, usize data_ptr)
+{
+	if (data_ptr == NULL_DATA_BLK_NUM) {
+		// Kept inline
+		return;
+	}
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		_dealloc_extents(fs, data_ptr);
+	} else {
+		_dealloc_data_blk(fs, data_ptr);
+	}
+}
+
+void _del_inode(struct fs *fs, usize inode_num)
+{
+	struct _inode deleted_inode = _dealloc_inode(fs, inode_num);
+	_dealloc_file_blks(fs, _inode_data_ptr(deleted_inode));
+}
+
+/*
+ * Makes the freshly allocated @data_blk the inode data ptr of an empty
+ * directory, returning 1 if the disk is full
+ */
+u8 _init_dir(struct fs *fs, usize data_blk)
+{
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		// Directories are addressed by their first block, so it must
+		// exist
+		if (_extent_map(fs, data_blk, 0, true, NULL)
+		    == NULL_DATA_BLK_NUM) {
+			return 1;
+		}
+		_set_ext_blk_size(fs, data_blk, fs->layout.blk_size);
+	}
+	_init_dir_blk(fs, _dir_blk_of_data_ptr(fs, data_blk));
+	return 0;
+}
+
+/*
+ * Links @inode in as @filename in the directory @parent_inode_num, whose write
+ * lock is held. A directory with no block yet is first given an empty one;
+ * anything else is linked in as it is, with its blocks left to the caller if
+ * that fails.
+ */
+u8 _create_locked(struct fs *fs, usize parent_inode_num, char *filename,
+		  struct _inode inode)
+{
+	usize parent_data_ptr =
+		_dir_data_ptr_of_inode_num(fs, parent_inode_num);
+	if (parent_data_ptr == NULL_DIR_BLK_NUM
+	    || _lookup_child_locked(fs, parent_inode_num, filename)
+		       != NULL_INODE_NUM) {
+		return 1;
+	}
+
+	usize inode_num = _alloc_inode(fs);
+	if (inode_num == NULL_INODE_NUM) {
+		return 1;
+	}
+	// Regular files start out inline, with no block
+	bool new_dir = _inode_is_dir(inode)
+		&& inode.data_ptr == NULL_DATA_BLK_NUM;
+	if (new_dir) {
+		inode.data_ptr = _alloc_data_blk(fs, NULL_DATA_BLK_NUM);
+		if (inode.data_ptr == NULL_DATA_BLK_NUM) {
+			_dealloc_inode(fs, inode_num);
+			return 1;
+		}
+		if (_init_dir(fs, inode.data_ptr)) {
+			_dealloc_inode(fs, inode_num);
+			_free_data_blk(fs, inode.data_ptr);
+			return 1;
+		}
+	}
+	_set_inode(fs, inode_num, inode);
+	u8 ret = _add_dir_entry(fs, parent_data_ptr, filename, inode_num);
+	if (ret && new_dir) {
+		_del_inode(fs, inode_num);
+	} else if (ret) {
+		_dealloc_inode(fs, inode_num);
+	} else {
+		dcache_insert(fs->dcache, parent_inode_num, filename,
+			      inode_num);
+	}
+	return ret;
+}
+
+/*
+ * `_create_locked` of @inode at @path, locking its parent directory
+ */
+u8 _create(struct fs *fs, char *path, struct _inode inode)
+{
+	assert(path[0] == '/');
+
+	usize parent_inode_num;
+	if (!_get_parent_inode_num(fs, path, &parent_inode_num)) {
+		return 1;
+	}
+	char filename[MAX_FILENAME_LEN + 1];
+	_get_end_filename(path, filename);
+	if (strlen(filename) == 0) {
+		return 1;
+	}
+
+	_lock_inode(fs, parent_inode_num, true);
+	u8 ret = _create_locked(fs, parent_inode_num, filename, inode);
+	_unlock_inode(fs, parent_inode_num);
+	return ret;
+}
+
+/*
+ * Creates an empty file at @path
+ */
+u8 fs_create(fs_t *fs, char *path, bool is_dir, u8 owner)
+{
+	struct _inode inode =
+		_new_inode(is_dir, owner, true, true, NULL_DATA_BLK_NUM);
+	_begin_op(fs);
+	u8 ret = _create(fs, path, inode);
+	return ret | _end_op(fs);
+}
+
+/*
+ * `fs_delete`, within a call already started
+ */
+u8 _delete(struct fs *fs, char *path)
+{
+	assert(path[0] == '/');
+
+	usize parent_inode_num;
+	if (!_get_parent_inode_num(fs, path, &parent_inode_num)) {
+		return 1;
+	}
+	char filename[MAX_FILENAME_LEN + 1];
+	_get_end_filename(path, filename);
+
+	_lock_inode(fs, parent_inode_num, true);
+	usize parent_data_ptr =
+		_dir_data_ptr_of_inode_num(fs, parent_inode_num);
+	usize inode_num = parent_data_ptr == NULL_DIR_BLK_NUM
+		? NULL_INODE_NUM
+		: _del_dir_entry(fs, parent_data_ptr, filename);
+	if (inode_num != NULL_INODE_NUM) {
+		dcache_insert(fs->dcache, parent_inode_num, filename,
+			      NULL_INODE_NUM);
+	}
+	_unlock_inode(fs, parent_inode_num);
+	if (inode_num == NULL_INODE_NUM) {
+		return 1;
+	}
+
+	// Unlinked, so nothing new can reach it; wait out calls already on it
+	_lock_inode(fs, inode_num, true);
+	if (_inode_is_dir(_get_inode(fs, inode_num))) {
+		// Its inode num may be handed out again
+		dcache_purge_parent(fs->dcache, inode_num);
+	}
+	_del_inode(fs, inode_num);
+	_unlock_inode(fs, inode_num);
+	return 0;
+}
+
+/*
+ * Deletes the file at @path
+ */
+u8 fs_delete(fs_t *fs, char *path)
+{
+	_begin_op(fs);
+	u8 ret = _delete(fs, path);
+	return ret | _end_op(fs);
+}
+
+/*
+ * Creates each of the @num_names files in @names in the directory at
+ * @dir_path, setting each of @name_rets, within a call already started
+ */
+u8 _create_batch(struct fs *fs, char *dir_path, char **names, usize num_names,
+		 bool is_dir, u8 owner, u8 *name_rets)
+{
+	assert(dir_path[0] == '/');
+
+	struct _name_ref *refs = malloc(num_names * sizeof(*refs));
+	usize num_refs = _sort_names(names, num_names, refs, name_rets);
+
+	usize dir_inode_num;
+	bool dir_exists = _get_dir_inode_num(fs, dir_path, &dir_inode_num);
+	if (dir_exists) {
+		_lock_inode(fs, dir_inode_num, true);
+	}
+	usize dir_data_ptr = dir_exists
+		? _dir_data_ptr_of_inode_num(fs, dir_inode_num)
+		: NULL_DIR_BLK_NUM;
+	if (dir_data_ptr == NULL_DIR_BLK_NUM) {
+		memset(name_rets, 1, num_names);
+		num_refs = 0;
+	} else {
+		_mark_taken_names(fs, dir_data_ptr, refs, num_refs, name_rets);
+	}
+
+	// The names to create, in hash order, as `_add_dir_entries` takes them
+	qsort(refs, num_refs, sizeof(*refs), _cmp_ref_hashes);
+	char **new_names = malloc(num_refs * sizeof(*new_names));
+	usize *new_idxs = malloc(num_refs * sizeof(*new_idxs));
+	usize num_new = 0;
+	for (usize i = 0; i < num_refs; ++i) {
+		if (!name_rets[refs[i].idx]) {
+			new_names[num_new] = refs[i].name;
+			new_idxs[num_new] = refs[i].idx;
+			num_new += 1;
+		}
+	}
+
+	usize *inode_nums = malloc(num_new * sizeof(*inode_nums));
+	usize *data_blks = malloc(num_new * sizeof(*data_blks));
+	usize num_inodes = _alloc_inodes(fs, num_new, inode_nums);
+	// Regular files start out inline, with no block
+	usize num_ready = num_inodes;
+	if (is_dir) {
+		num_ready = _alloc_data_blks(fs, num_inodes, data_blks);
+		for (usize i = 0; i < num_ready; ++i) {
+			// An extent-mapped directory needs a second block, so
+			// give back reserved ones until there is room for it
+			while (_init_dir(fs, data_blks[i])) {
+				num_ready -= 1;
+				_free_data_blk(fs, data_blks[num_ready]);
+				if (num_ready == i) {
+					break;
+				}
+			}
+		}
+	}
+	for (usize i = num_ready; i < num_inodes; ++i) {
+		_dealloc_inode(fs, inode_nums[i]);
+	}
+	for (usize i = 0; i < num_ready; ++i) {
+		usize data_blk = is_dir ? data_blks[i] : NULL_DATA_BLK_NUM;
+		_set_inode(fs, inode_nums[i],
+			   _new_inode(is_dir, owner, true, true, data_blk));
+	}
+
+	usize num_added = num_ready == 0
+		? 0
+		: _add_dir_entries(fs, dir_data_ptr, new_names, inode_nums,
+				   num_ready);
+	for (usize i = 0; i < num_new; ++i) {
+		if (i < num_added) {
+			dcache_insert(fs->dcache, dir_inode_num, new_names[i],
+				      inode_nums[i]);
+			continue;
+		}
+		if (i < num_ready) {
+			_del_inode(fs, inode_nums[i]);
+		}
+		name_rets[new_idxs[i]] = 1;
+	}
+	if (dir_exists) {
+		_unlock_inode(fs, dir_inode_num);
+	}
+
+	u8 ret = num_added != num_names;
+	free(data_blks);
+	free(inode_nums);
+	free(new_idxs);
+	free(new_names);
+	free(refs);
+	return ret;
+}
+
+/*
+ * Creates each of the @num_names files in @names in the directory at @dir_path,
+ * BATCH_LEN of them per call
+ */
+u8 fs_create_many(fs_t *fs, char *dir_path, char **names, usize num_names,
+		  bool is_dir, u8 owner, u8 *rets)
+{
+	u8 *name_rets = rets != NULL ? rets : malloc(num_names);
+	u8 ret = 0;
+	for (usize i = 0; i < num_names; i += BATCH_LEN) {
+		usize len = num_names - i < BATCH_LEN ? num_names - i
+						      : BATCH_LEN;
+		_begin_op(fs);
+		ret |= _create_batch(fs, dir_path, names + i, len, is_dir,
+				     owner, name_rets + i);
+		ret |= _end_op(fs);
+	}
+	if (rets == NULL) {
+		free(name_rets);
+	}
+	return ret;
+}
+
+/*
+ * Deletes each of the @num_names files in @names from the directory at
+ * @dir_path, setting each of @name_rets, within a call already started
+ */
+u8 _delete_batch(struct fs *fs, char *dir_path, char **names, usize num_names,
+		 u8 *name_rets)
+{
+	assert(dir_path[0] == '/');
+
+	struct _name_ref *refs = malloc(num_names * sizeof(*refs));
+	usize num_refs = _sort_names(names, num_names, refs, name_rets);
+	usize *inode_nums = malloc(num_names * sizeof(*inode_nums));
+	for (usize i = 0; i < num_names; ++i) {
+		inode_nums[i] = NULL_INODE_NUM;
+	}
+
+	usize dir_inode_num;
+	usize num_dels = 0;
+	if (_get_dir_inode_num(fs, dir_path, &dir_inode_num)) {
+		_lock_inode(fs, dir_inode_num, true);
+		usize dir_data_ptr =
+			_dir_data_ptr_of_inode_num(fs, dir_inode_num);
+		if (dir_data_ptr != NULL_DIR_BLK_NUM) {
+			num_dels = _del_dir_entries(fs, dir_data_ptr, refs,
+						    num_refs, inode_nums);
+		}
+		for (usize i = 0; i < num_names; ++i) {
+			if (inode_nums[i] != NULL_INODE_NUM) {
+				dcache_insert(fs->dcache, dir_inode_num,
+					      names[i], NULL_INODE_NUM);
+			}
+		}
+		_unlock_inode(fs, dir_inode_num);
+	}
+
+	for (usize i = 0; i < num_names; ++i) {
+		usize inode_num = inode_nums[i];
+		name_rets[i] = inode_num == NULL_INODE_NUM;
+		if (inode_num == NULL_INODE_NUM) {
+			continue;
+		}
+		// As in `fs_delete`
+		_lock_inode(fs, inode_num, true);
+		if (_inode_is_dir(_get_inode(fs, inode_num))) {
+			dcache_purge_parent(fs->dcache, inode_num);
+		}
+		_del_inode(fs, inode_num);
+		_unlock_inode(fs, inode_num);
+	}
+
+	u8 ret = num_dels != num_names;
+	free(inode_nums);
+	free(refs);
+	return ret;
+}
+
+/*
+ * Deletes each of the @num_names files in @names from the directory at
+ * @dir_path, BATCH_LEN of them per call
+ */
+u8 fs_delete_many(fs_t *fs, char *dir_path, char **names, usize num_names,
+		  u8 *rets)
+{
+	u8 *name_rets = rets != NULL ? rets : malloc(num_names);
+	u8 ret = 0;
+	for (usize i = 0; i < num_names; i += BATCH_LEN) {
+		usize len = num_names - i < BATCH_LEN ? num_names - i
+						      : BATCH_LEN;
+		_begin_op(fs);
+		ret |= _delete_batch(fs, dir_path, names + i, len,
+				     name_rets + i);
+		ret |= _end_op(fs);
+	}
+	if (rets == NULL) {
+		free(name_rets);
+	}
+	return ret;
+}
+
+/*
+ * Opens a file at path, returning info about the opened file, or a descriptor
+ * that fails every call if there is none
+ */
+struct fs_file_desc fs_open(fs_t *fs, char *path)
+{
+	struct fs_file_desc failed = {
+		.path = path,
+		.inode_num = NULL_INODE_NUM,
+		.head_blk_num = NULL_DATA_BLK_NUM,
+		.curr_blk_num = NULL_DATA_BLK_NUM,
+		.blk_map = NULL,
+		.prealloc_blk_num = NULL_DATA_BLK_NUM,
+		.inline_blk_num = NULL_DIR_BLK_NUM,
+	};
+	usize parent_inode_num;
+	if (!_get_parent_inode_num(fs, path, &parent_inode_num)) {
+		return failed;
+	}
+	char filename[MAX_FILENAME_LEN + 1];
+	_get_end_filename(path, filename);
+
+	// Under the directory's lock, an inline file stays inline
+	_lock_inode(fs, parent_inode_num, false);
+	usize inode_num = _lookup_child_locked(fs, parent_inode_num, filename);
+	if (inode_num == NULL_INODE_NUM) {
+		_unlock_inode(fs, parent_inode_num);
+		return failed;
+	}
+	struct _inode inode = _get_inode(fs, inode_num);
+	usize data_blk_num = _inode_data_ptr(inode);
+	bool inline_data = !_inode_is_dir(inode)
+		&& data_blk_num == NULL_DATA_BLK_NUM;
+	_unlock_inode(fs, parent_inode_num);
+
+	usize curr_blk_num = NULL_DATA_BLK_NUM;
+	if (!inline_data) {
+		_lock_inode(fs, inode_num, false);
+		curr_blk_num = fs->layout.features & FEATURE_EXTENTS
+			? _extent_map(fs, data_blk_num, 0, false, NULL)
+			: data_blk_num;
+		_unlock_inode(fs, inode_num);
+	}
+	struct fs_file_desc fd = {
+		.path = path,
+		.inode_num = inode_num,
+		.head_blk_num = data_blk_num,
+		.curr_blk_num = curr_blk_num,
+		.curr_blk_idx = 0,
+		.curr_offset = 0,
+		.blk_map = NULL,
+		.blk_map_len = 0,
+		.blk_map_cap = 0,
+		.prealloc_blk_num = NULL_DATA_BLK_NUM,
+		.prealloc_len = 0,
+		.prealloc_window = 0,
+		.ra_next_idx = 0,
+		.ra_end_idx = 0,
+		.ra_window = 0,
+		.parent_inode_num = parent_inode_num,
+		.inline_blk_num = NULL_DIR_BLK_NUM,
+		.is_dir = _inode_is_dir(inode),
+		.owner = _inode_owner(inode),
+		.has_read = _inode_has_read_perm(inode),
+		.has_write = _inode_has_write_perm(inode),
+	};
+	strcpy(fd.name, filename);
+	return fd;
+}
+
+void _blk_map_push(struct fs_file_desc *fd, usize blk_num)
+{
+	if (fd->blk_map_len == fd->blk_map_cap) {
+		fd->blk_map_cap = fd->blk_map_cap == 0
+			? 16
+			: 2 * fd->blk_map_cap;
+		fd->blk_map = realloc(fd->blk_map,
+				      fd->blk_map_cap * sizeof(*fd->blk_map));
+	}
+	fd->blk_map[fd->blk_map_len] = blk_num;
+	fd->blk_map_len += 1;
+}
+
+/*
+ * Returns the data block holding the chained file's @blk_idx'th block, or
+ * `NULL_DATA_BLK_NUM` if the chain is shorter, in which case @fd's block map
+ * ends up holding the whole chain.
+ *
+ * Next pointers are only followed past the end of @fd's block map, so once a
+ * block has been visited, finding it again costs no I/O.
+ */
+usize _chain_map(struct fs *fs, struct fs_file_desc *fd, usize blk_idx)
+{
+	if (fd->blk_map_len == 0) {
+		_blk_map_push(fd, fd->head_blk_num);
+	}
+	while (fd->blk_map_len <= blk_idx) {
+		usize last_blk = fd->blk_map[fd->blk_map_len - 1];
+		_seek_to_next_blk_ptr(fs, last_blk);
+		usize next_blk = _read_usize(fs);
+		if (next_blk == NULL_DATA_BLK_NUM) {
+			return NULL_DATA_BLK_NUM;
+		}
+		_blk_map_push(fd, next_blk);
+	}
+	return fd->blk_map[blk_idx];
+}
+
+/*
+ * Returns the data block holding @fd's @blk_idx'th block, or
+ * `NULL_DATA_BLK_NUM` if there is none
+ */
+usize _map_blk(struct fs *fs, struct fs_file_desc *fd, usize blk_idx)
+{
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		return _extent_map(fs, fd->head_blk_num, blk_idx, false, NULL);
+	}
+	return _chain_map(fs, fd, blk_idx);
+}
+
+/*
+ * Gives back the blocks reserved for @fd's appends that it never used
+ */
+void _release_prealloc(struct fs *fs, struct fs_file_desc *fd)
+{
+	if (fd->prealloc_len > 0) {
+		_free_data_run(fs, fd->prealloc_blk_num, fd->prealloc_len);
+	}
+	fd->prealloc_len = 0;
+}
+
+/*
+ * Allocates up to @want blocks to append to @fd at @goal, the block right after
+ * its current last one
+ *
+ * They come out of @fd's reservation when that continues the file; otherwise a
+ * new one is taken along with them, twice as long as the last, so a file that
+ * keeps growing stays contiguous on disk.
+ */
+usize _alloc_append_run(struct fs *fs, struct fs_file_desc *fd, usize goal,
+			usize want, usize *got)
+{
+	if (fd->prealloc_len > 0 && fd->prealloc_blk_num == goal) {
+		*got = want < fd->prealloc_len ? want : fd->prealloc_len;
+		fd->prealloc_blk_num += *got;
+		fd->prealloc_len -= *got;
+		return goal;
+	}
+	_release_prealloc(fs, fd);
+
+	usize first_blk =
+		_alloc_data_run(fs, goal, want + fd->prealloc_window, got);
+	if (first_blk == NULL_DATA_BLK_NUM) {
+		return NULL_DATA_BLK_NUM;
+	}
+	if (*got > want) {
+		fd->prealloc_blk_num = first_blk + want;
+		fd->prealloc_len = *got - want;
+		*got = want;
+	}
+	fd->prealloc_window = fd->prealloc_window == 0
+		? MIN_PREALLOC_LEN
+		: 2 * fd->prealloc_window;
+	if (fd->prealloc_window > MAX_PREALLOC_LEN) {
+		fd->prealloc_window = MAX_PREALLOC_LEN;
+	}
+	return first_blk;
+}
+
+/*
+ * Grows the chained file up to its @blk_idx'th block, with room for up to @want
+ * blocks from there on. Returns the block, and sets @got to how many blocks
+ * from @blk_idx were allocated, or returns `NULL_DATA_BLK_NUM` if the disk is
+ * full.
+ *
+ * Blocks from @blk_idx on are left uninitialized for `_init_new_blk`; those
+ * before it fill a gap left by a seek past the end and are zeroed here.
+ */
+usize _chain_grow(struct fs *fs, struct fs_file_desc *fd, usize blk_idx,
+		  usize want, usize *got)
+{
+	usize first_new_idx = fd->blk_map_len;
+	assert(first_new_idx > 0 && first_new_idx <= blk_idx);
+
+	usize total = blk_idx - first_new_idx + want;
+	while (fd->blk_map_len < first_new_idx + total) {
+		usize last_blk = fd->blk_map[fd->blk_map_len - 1];
+		usize run_len;
+		usize left = first_new_idx + total - fd->blk_map_len;
+		usize run = _alloc_append_run(fs, fd, last_blk + 1, left,
+					      &run_len);
+		if (run == NULL_DATA_BLK_NUM) {
+			break;
+		}
+		if (fd->blk_map_len == first_new_idx) {
+			_seek_to_next_blk_ptr(fs, last_blk);
+			_write_usize(fs, run);
+		}
+		for (usize i = 0; i < run_len; ++i) {
+			_blk_map_push(fd, run + i);
+		}
+	}
+
+	usize gap_end = fd->blk_map_len < blk_idx ? fd->blk_map_len : blk_idx;
+	for (usize i = first_new_idx; i < gap_end; ++i) {
+		usize next_blk = i + 1 < fd->blk_map_len
+			? fd->blk_map[i + 1]
+			: NULL_DATA_BLK_NUM;
+		_clear_data_blk(fs, fd->blk_map[i], false);
+		_seek_to_next_blk_ptr(fs, fd->blk_map[i]);
+		_write_usize(fs, next_blk);
+	}
+	if (fd->blk_map_len <= blk_idx) {
+		return NULL_DATA_BLK_NUM;
+	}
+	*got = fd->blk_map_len - blk_idx;
+	return fd->blk_map[blk_idx];
+}
+
+/*
+ * Maps up to @want newly allocated blocks into the extent-mapped file from its
+ * @blk_idx'th block on. Returns the first, and sets @got to how many were
+ * mapped, or returns `NULL_DATA_BLK_NUM` if the disk or extent index is full.
+ *
+ * The blocks are left uninitialized for `_init_new_blk`.
+ */
+usize _extent_grow(struct fs *fs, struct fs_file_desc *fd, usize blk_idx,
+		   usize want, usize *got)
+{
+	usize ext_blk_num = fd->head_blk_num;
+	usize leaf_end;
+	usize leaf = _ext_leaf(fs, ext_blk_num, blk_idx, &leaf_end);
+	usize num_extents = _get_num_extents(fs, leaf);
+	usize ext_num = _find_extent(fs, leaf, blk_idx);
+
+	usize goal = NULL_DATA_BLK_NUM;
+	if (ext_num != num_extents) {
+		struct _extent prev = _get_extent(fs, leaf, ext_num);
+		goal = prev.phys + (blk_idx - prev.logical);
+	}
+	// A hole in the middle of the file must not grow into the next extent,
+	// nor past the range of its leaf
+	usize next_num = ext_num == num_extents ? 0 : ext_num + 1;
+	usize next_logical = next_num < num_extents
+		? _get_extent(fs, leaf, next_num).logical
+		: leaf_end;
+	bool appending = next_logical == (usize) -1;
+	if (!appending && want > next_logical - blk_idx) {
+		want = next_logical - blk_idx;
+	}
+
+	usize phys = appending
+		? _alloc_append_run(fs, fd, goal, want, got)
+		: _alloc_data_run(fs, goal, want, got);
+	if (phys == NULL_DATA_BLK_NUM) {
+		return NULL_DATA_BLK_NUM;
+	}
+	if (_insert_extent(fs, ext_blk_num, blk_idx, phys, *got)) {
+		_free_data_run(fs, phys, *got);
+		return NULL_DATA_BLK_NUM;
+	}
+	return phys;
+}
+
+/*
+ * Allocates @fd's missing @blk_idx'th block along with up to @want - 1 blocks
+ * after it, for a write about to reach them
+ */
+usize _grow_blks(struct fs *fs, struct fs_file_desc *fd, usize blk_idx,
+		 usize want, usize *got)
+{
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		return _extent_grow(fs, fd, blk_idx, want, got);
+	}
+	return _chain_grow(fs, fd, blk_idx, want, got);
+}
+
+/*
+ * Prepares @fd's current block, freshly allocated by this write. If the write
+ * covers all of it (@full), nothing is read or zeroed first.
+ */
+void _init_new_blk(struct fs *fs, struct fs_file_desc *fd, bool full)
+{
+	usize blk_num = fd->curr_blk_num;
+	if (!full) {
+		_clear_data_blk(fs, blk_num, false);
+	}
+	if (!(fs->layout.features & FEATURE_EXTENTS)) {
+		if (full) {
+			// Claim a frame for the next pointer without reading
+			// the block in
+			cache_get(fs->cache,
+				  fs->layout.data_blks_offset + blk_num, false);
+		}
+		usize idx = fd->curr_blk_idx;
+		usize next_blk = idx + 1 < fd->blk_map_len
+			? fd->blk_map[idx + 1]
+			: NULL_DATA_BLK_NUM;
+		_seek_to_next_blk_ptr(fs, blk_num);
+		_write_usize(fs, next_blk);
+	}
+}
+
+/*
+ * Where a chain is expected to go next, for `_chain_keep`
+ */
+struct _chain_ahead {
+	usize data_blks_offset;
+	usize next_blk;
+};
+
+/*
+ * Keeps a block read ahead of a chained file only if the block before it
+ * points at it, so the blocks kept are the file's own
+ */
+bool _chain_keep(void *arg, usize blk_num, const u8 *mem)
+{
+	struct _chain_ahead *ahead = arg;
+	if (blk_num != ahead->next_blk) {
+		return false;
+	}
+	// The end of the chain points at the root directory's block, which
+	// comes before every other
+	usize next_blk;
+	memcpy(&next_blk, mem + DATA_BLK_NEXT_BLK_NUM_OFFSET, sizeof(next_blk));
+	ahead->next_blk = ahead->data_blks_offset + next_blk;
+	return true;
+}
+
+/*
+ * Reads @fd's @num_blks blocks from its @blk_idx'th on into the cache, a run
+ * contiguous on disk at a time, and returns how many of them it got through
+ * before the end of the file (or a hole)
+ *
+ * A chain's blocks are only known by reading them, so each run is guessed to
+ * be as long as the blocks after the first lie on disk, and cut short where the
+ * next pointers read show the chain going elsewhere.
+ */
+usize _prefetch_blks(struct fs *fs, struct fs_file_desc *fd, usize blk_idx,
+		     usize num_blks)
+{
+	bool extents = fs->layout.features & FEATURE_EXTENTS;
+	usize done = 0;
+	while (done < num_blks) {
+		usize run_len = 0;
+		usize blk_num = extents
+			? _extent_map(fs, fd->head_blk_num, blk_idx + done,
+				      false, &run_len)
+			: _chain_map(fs, fd, blk_idx + done);
+		if (blk_num == NULL_DATA_BLK_NUM) {
+			break;
+		}
+		blk_num += fs->layout.data_blks_offset;
+
+		if (extents) {
+			if (run_len > num_blks - done) {
+				run_len = num_blks - done;
+			}
+			cache_prefetch(fs->cache, blk_num, run_len);
+		} else {
+			struct _chain_ahead ahead = {
+				.data_blks_offset = fs->layout.data_blks_offset,
+				.next_blk = blk_num,
+			};
+			run_len = cache_prefetch_if(fs->cache, blk_num,
+						    num_blks - done,
+						    _chain_keep, &ahead);
+			// Nothing read means the block is cached already,
+			// and mapping the next one walks past it
+			if (run_len == 0) {
+				run_len = 1;
+			}
+		}
+		done += run_len;
+	}
+	return done;
+}
+
+/*
+ * Brings the blocks a read of @len bytes from @fd's position spans into the
+ * cache before it copies them. A read picking up where @fd's last one left off
+ * also brings in a window of blocks past it, issued once the reader gets
+ * within half a window of the blocks already brought in, and doubled each
+ * time; any other read closes the window.
+ */
+void _readahead(struct fs *fs, struct fs_file_desc *fd, usize len)
+{
+	usize usable_len = fs->layout.data_blk_usable_len;
+	usize first_idx = fd->curr_blk_idx;
+	usize end_offset = fd->curr_offset + len;
+	usize end_idx = first_idx + (end_offset + usable_len - 1) / usable_len;
+
+	bool sequential = first_idx == fd->ra_next_idx;
+	if (!sequential) {
+		fd->ra_window = 0;
+		fd->ra_end_idx = first_idx;
+	}
+	fd->ra_next_idx = first_idx + end_offset / usable_len;
+
+	usize from = fd->ra_end_idx > first_idx ? fd->ra_end_idx : first_idx;
+	usize to = end_idx;
+	if (sequential && fs->max_readahead > 0
+	    && end_idx + fd->ra_window / 2 >= fd->ra_end_idx) {
+		fd->ra_window = fd->ra_window == 0
+			? MIN_READAHEAD_LEN
+			: 2 * fd->ra_window;
+		if (fd->ra_window > fs->max_readahead) {
+			fd->ra_window = fs->max_readahead;
+		}
+		to += fd->ra_window;
+	}
+	if (to > from + MAX_READAHEAD_LEN) {
+		to = from + MAX_READAHEAD_LEN;
+	}
+	if (to > from) {
+		fd->ra_end_idx = from + _prefetch_blks(fs, fd, from, to - from);
+	}
+}
+
+/*
+ * Moves @fd @num_blks blocks further into its file. The block is only looked
+ * up; it is allocated once something is written to it.
+ */
+void _advance_blk(struct fs *fs, struct fs_file_desc *fd, usize num_blks)
+{
+	fd->curr_blk_idx += num_blks;
+	fd->curr_offset = 0;
+	fd->curr_blk_num = _map_blk(fs, fd, fd->curr_blk_idx);
+}
+
+/*
+ * Moves up to @max_blks whole blocks of @fd, starting at its current one,
+ * between @buf and the backing file without going through the cache, and sets
+ * @num_blks to how many were moved. For extent-mapped files that is as many as
+ * are contiguous on disk; chained blocks each have a next pointer in the way,
+ * so they go one at a time.
+ */
+u8 _transfer_direct(struct fs *fs, struct fs_file_desc *fd, u8 *buf,
+		    usize max_blks, bool writing, usize *num_blks)
+{
+	*num_blks = 1;
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		_extent_map(fs, fd->head_blk_num, fd->curr_blk_idx, false,
+			    num_blks);
+		if (*num_blks > max_blks) {
+			*num_blks = max_blks;
+		}
+	}
+	usize blk_num = fs->layout.data_blks_offset + fd->curr_blk_num;
+	usize offset = fs->layout.data_blk_usable_offset;
+	usize len = *num_blks * fs->layout.data_blk_usable_len;
+	return writing
+		? cache_write_direct(fs->cache, blk_num, offset, len, buf)
+		: cache_read_direct(fs->cache, blk_num, offset, len, buf);
+}
+
+/*
+ * Moves @fd's @len shared blocks from @blk_idx, which lie from @phys on, to
+ * blocks of its own, and sets @num_moved to how many were. Only blocks a write
+ * to bytes [@start, @end) of the file leaves partly untouched are copied.
+ *
+ * Returns 1 if the disk or extent index is full.
+ */
+u8 _unshare_run(struct fs *fs, struct fs_file_desc *fd, usize blk_idx,
+		usize phys, usize len, usize start, usize end,
+		usize *num_moved)
+{
+	usize new_phys = _alloc_data_run(fs, NULL_DATA_BLK_NUM, len,
+					 num_moved);
+	if (new_phys == NULL_DATA_BLK_NUM) {
+		return 1;
+	}
+	usize blk_size = fs->layout.blk_size;
+	for (usize i = 0; i < *num_moved; ++i) {
+		usize blk_start = (blk_idx + i) * blk_size;
+		if (blk_start < start || blk_start + blk_size > end) {
+			_copy_data_blk(fs, phys + i, new_phys + i);
+		}
+	}
+	if (_remap_extent(fs, fd->head_blk_num, blk_idx, *num_moved,
+			  new_phys)) {
+		_free_data_run(fs, new_phys, *num_moved);
+		return 1;
+	}
+	_put_data_run(fs, phys, *num_moved);
+	return 0;
+}
+
+/*
+ * Gives @fd's file blocks of its own in place of any it shares with clones
+ * among those touched by the @len bytes at byte @offset, which are about to be
+ * written. The file's write lock is held.
+ *
+ * Returns 1 if the disk or extent index is full.
+ */
+u8 _unshare(struct fs *fs, struct fs_file_desc *fd, usize offset, usize len)
+{
+	if (fs->refcounts.num_entries == 0 || len == 0) {
+		return 0;
+	}
+	usize blk_size = fs->layout.blk_size;
+	usize blk_idx = offset / blk_size;
+	usize end_idx = (offset + len + blk_size - 1) / blk_size;
+	bool moved = false;
+	while (blk_idx < end_idx) {
+		usize run_len;
+		usize phys = _extent_map(fs, fd->head_blk_num, blk_idx, false,
+					 &run_len);
+		if (phys == NULL_DATA_BLK_NUM) {
+			blk_idx += 1;
+			continue;
+		}
+		if (run_len > end_idx - blk_idx) {
+			run_len = end_idx - blk_idx;
+		}
+		bool shared;
+		pthread_mutex_lock(&fs->alloc_lock);
+		run_len = refcount_run(&fs->refcounts, phys, run_len, &shared);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		if (shared) {
+			if (_unshare_run(fs, fd, blk_idx, phys, run_len, offset,
+					 offset + len, &run_len)) {
+				return 1;
+			}
+			moved = true;
+		}
+		blk_idx += run_len;
+	}
+	if (moved) {
+		fd->curr_blk_num = _map_blk(fs, fd, fd->curr_blk_idx);
+	}
+	return 0;
+}
+
+/*
+ * Applies @func to every stretch of @len bytes from the current position
+ *
+ * @writing allocates any block that is missing; otherwise a missing block reads
+ * as zeros. Long transfers skip the cache for the blocks they cover whole.
+ */
+u8 _traversal_loop(struct fs *fs,
+	           struct fs_file_desc *fd,
+	           u8 *buf,
+	           usize len,
+	           u8 func(struct fs *, u8 *, usize),
+	           bool writing)
+{
+	bool extents = fs->layout.features & FEATURE_EXTENTS;
+	usize usable_len = fs->layout.data_blk_usable_len;
+	bool direct = buf != NULL && len >= MIN_DIRECT_LEN * usable_len;
+	if (!writing && !direct && buf != NULL
+	    && fd->curr_blk_num != NULL_DATA_BLK_NUM) {
+		_readahead(fs, fd, len);
+	}
+	usize start = fd->curr_blk_idx * usable_len + fd->curr_offset;
+	if (writing && buf != NULL && extents
+	    && _unshare(fs, fd, start, len)) {
+		return 1;
+	}
+
+	usize bytes_remaining = len;
+	// Blocks before this index were allocated by this write and not yet
+	// reached
+	usize new_blks_end = 0;
+	while (bytes_remaining > 0) {
+		usize post_write_offset = fd->curr_offset + bytes_remaining;
+		bool overflow = post_write_offset > usable_len;
+
+		usize cpy_len = overflow
+			? usable_len - fd->curr_offset
+			: bytes_remaining;
+
+		if (writing && fd->curr_blk_num == NULL_DATA_BLK_NUM) {
+			// Allocate every block the rest of the write needs at
+			// once
+			usize want = (post_write_offset + usable_len - 1)
+				/ usable_len;
+			usize got;
+			fd->curr_blk_num = _grow_blks(fs, fd, fd->curr_blk_idx,
+						      want, &got);
+			if (fd->curr_blk_num == NULL_DATA_BLK_NUM) {
+				return 1;
+			}
+			new_blks_end = fd->curr_blk_idx + got;
+		}
+		if (writing && fd->curr_blk_idx < new_blks_end) {
+			bool full = buf != NULL && cpy_len == usable_len;
+			_init_new_blk(fs, fd, full);
+		}
+
+		if (direct && fd->curr_offset == 0 && cpy_len == usable_len
+		    && fd->curr_blk_num != NULL_DATA_BLK_NUM) {
+			usize num_blks;
+			if (_transfer_direct(fs, fd, buf,
+					     bytes_remaining / usable_len,
+					     writing, &num_blks)) {
+				return 1;
+			}
+			buf += num_blks * usable_len;
+			bytes_remaining -= num_blks * usable_len;
+			_advance_blk(fs, fd, num_blks);
+			continue;
+		}
+
+		if (buf != NULL) {
+			if (fd->curr_blk_num == NULL_DATA_BLK_NUM) {
+				memset(buf, 0, cpy_len);
+			} else {
+				_seek_to_data_usable_addr(fs, fd->curr_blk_num,
+							  fd->curr_offset);
+				if (func(fs, buf, cpy_len)) {
+					return 1;
+				}
+			}
+			buf += cpy_len;
+		}
+		bytes_remaining -= cpy_len;
+
+		fd->curr_offset += cpy_len;
+		if (fd->curr_offset >= usable_len) {
+			_advance_blk(fs, fd, 1);
+		}
+	}
+
+	if (extents && writing) {
+		usize pos = fd->curr_blk_idx * usable_len
+			+ fd->curr_offset;
+		if (pos > _get_ext_blk_size(fs, fd->head_blk_num)) {
+			_set_ext_blk_size(fs, fd->head_blk_num, pos);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if the cache has failed, as the bytes may not have been written
+ */
+u8 _write_func(struct fs *fs, u8 *buf, usize len)
+{
+	_write_bytes(fs, len, buf);
+	return cache_failed(fs->cache);
+}
+
+/*
+ * Returns 1 if the cache has failed, as the bytes may be zeros in place of
+ * what the file holds
+ */
+u8 _read_func(struct fs *fs, u8 *buf, usize len)
+{
+	_read_bytes(fs, len, buf);
+	return cache_failed(fs->cache);
+}
+
+/*
+ * Whether @fd came from an `fs_open` that found no file. The root directory is
+ * never opened, so its inode number marks it.
+ */
+bool _fd_failed(struct fs_file_desc *fd)
+{
+	return fd->inode_num == NULL_INODE_NUM;
+}
+
+/*
+ * Whether @fd's bytes may still be kept in its directory entry
+ */
+bool _fd_inline(struct fs_file_desc *fd)
+{
+	return !fd->is_dir && fd->head_blk_num == NULL_DATA_BLK_NUM;
+}
+
+usize _fd_pos(struct fs *fs, struct fs_file_desc *fd)
+{
+	return fd->curr_blk_idx * fs->layout.data_blk_usable_len
+		+ fd->curr_offset;
+}
+
+void _seek(struct fs *fs, struct fs_file_desc *fd, usize offset)
+{
+	fd->curr_blk_idx = offset / fs->layout.data_blk_usable_len;
+	fd->curr_offset = offset % fs->layout.data_blk_usable_len;
+	fd->curr_blk_num = _fd_inline(fd)
+		? NULL_DATA_BLK_NUM
+		: _map_blk(fs, fd, fd->curr_blk_idx);
+}
+
+/*
+ * Starts a call on the file opened as @fd, read- or write-locking it. If its
+ * bytes are kept inline, that is its directory's lock and true is returned;
+ * the caller unlocks the directory when done. Otherwise it is the file's own,
+ * and @fd first picks up the blocks given to the file since it was opened, or
+ * since its last call for extent-mapped files, whose blocks are also moved by
+ * writes to shared ones.
+ */
+bool _lock_file(struct fs *fs, struct fs_file_desc *fd, bool write)
+{
+	if (_fd_inline(fd)) {
+		_lock_inode(fs, fd->parent_inode_num, write);
+		struct _inode inode = _get_inode(fs, fd->inode_num);
+		if (_inode_data_ptr(inode) == NULL_DATA_BLK_NUM) {
+			return true;
+		}
+		_unlock_inode(fs, fd->parent_inode_num);
+	}
+	_lock_inode(fs, fd->inode_num, write);
+	if (_fd_inline(fd)) {
+		usize pos = _fd_pos(fs, fd);
+		struct _inode inode = _get_inode(fs, fd->inode_num);
+		fd->head_blk_num = _inode_data_ptr(inode);
+		_seek(fs, fd, pos);
+	} else if (fs->layout.features & FEATURE_EXTENTS) {
+		fd->curr_blk_num = _map_blk(fs, fd, fd->curr_blk_idx);
+	}
+	return false;
+}
+
+/*
+ * Sets @loc to the record of the inline file @fd, which may have moved within
+ * its block since the last call on it. Its directory's lock is held.
+ *
+ * Returns false if @fd's file is no longer in its directory, even if another
+ * file has taken its name since.
+ */
+bool _find_inline(struct fs *fs, struct fs_file_desc *fd,
+		  struct _inline_loc *loc)
+{
+	// The block it was last found in is looked in first, unless that has
+	// since become an index block
+	loc->offset = NULL_REC;
+	if (fd->inline_blk_num != NULL_DIR_BLK_NUM
+	    && !_is_dir_idx(fs, fd->inline_blk_num)) {
+		loc->dir_blk_num = fd->inline_blk_num;
+		loc->offset = _find_rec(fs, loc->dir_blk_num, fd->name, NULL);
+	}
+	if (loc->offset == NULL_REC) {
+		usize dir_data_ptr =
+			_dir_data_ptr_of_inode_num(fs, fd->parent_inode_num);
+		loc->offset = _find_dir_rec(fs, dir_data_ptr, fd->name,
+					    &loc->dir_blk_num, NULL);
+	}
+	if (loc->offset == NULL_REC) {
+		return false;
+	}
+	loc->rec = _get_rec(fs, loc->dir_blk_num, loc->offset);
+	if (loc->rec.inode_num != fd->inode_num) {
+		return false;
+	}
+	fd->inline_blk_num = loc->dir_blk_num;
+	return true;
+}
+
+usize _inline_data_offset(struct _inline_loc *loc)
+{
+	return loc->offset + DIR_REC_HDR_LEN + loc->rec.name_len;
+}
+
+/*
+ * How many bytes the record at @loc has room for
+ */
+usize _inline_cap(struct _inline_loc *loc)
+{
+	usize cap = loc->rec.rec_len - DIR_REC_HDR_LEN - loc->rec.name_len;
+	return cap < MAX_INLINE_LEN ? cap : MAX_INLINE_LEN;
+}
+
+/*
+ * Makes room for @end bytes in the record at @loc of the inline file @fd,
+ * moving it elsewhere in its block if the space after it is too small, and
+ * first splitting the block if that is too full. Returns false if the bytes
+ * have to go to blocks of their own instead.
+ */
+bool _fit_inline(struct fs *fs, struct fs_file_desc *fd,
+		 struct _inline_loc *loc, usize end)
+{
+	if (end <= _inline_cap(loc)) {
+		return true;
+	}
+	if (end > MAX_INLINE_LEN) {
+		return false;
+	}
+	usize extra_len = end - loc->rec.inline_len;
+	if (extra_len > _get_dir_free_len(fs, loc->dir_blk_num)) {
+		// Rather than give the file a block of its own, which would
+		// also break up the directory's run of blocks
+		usize dir_data_ptr =
+			_dir_data_ptr_of_inode_num(fs, fd->parent_inode_num);
+		if (_make_dir_room(fs, dir_data_ptr, _hash_name(fd->name),
+				   extra_len) == NULL_DIR_BLK_NUM
+		    || !_find_inline(fs, fd, loc)) {
+			return false;
+		}
+		// Names hashed the same all stay in one block
+		if (extra_len > _get_dir_free_len(fs, loc->dir_blk_num)) {
+			return false;
+		}
+	}
+	usize name_len = loc->rec.name_len;
+	char filename[MAX_FILENAME_LEN + 1];
+	_seek_to_data_addr(fs, loc->dir_blk_num, loc->offset + DIR_REC_HDR_LEN);
+	_read_str(fs, name_len, filename);
+	filename[name_len] = '\0';
+	usize len = DIR_REC_HDR_LEN + name_len + end;
+	usize new_offset = _alloc_rec(fs, loc->dir_blk_num, len);
+	if (new_offset == NULL_REC) {
+		// Gather the block's free space after the last record, which
+		// may well be this one
+		_compact_dir_blk(fs, loc->dir_blk_num);
+		loc->offset = _find_rec(fs, loc->dir_blk_num, filename, NULL);
+		loc->rec = _get_rec(fs, loc->dir_blk_num, loc->offset);
+		if (end <= _inline_cap(loc)) {
+			return true;
+		}
+		new_offset = _alloc_rec(fs, loc->dir_blk_num, len);
+	}
+	if (new_offset == NULL_REC) {
+		return false;
+	}
+
+	u8 buf[DIR_REC_HDR_LEN + MAX_FILENAME_LEN + MAX_INLINE_LEN];
+	_seek_to_data_addr(fs, loc->dir_blk_num, loc->offset);
+	_read_bytes(fs, _rec_used_len(loc->rec), buf);
+	struct _dir_rec rec = loc->rec;
+	rec.rec_len = _get_rec(fs, loc->dir_blk_num, new_offset).rec_len;
+	memcpy(buf, &rec, DIR_REC_HDR_LEN);
+	_seek_to_data_addr(fs, loc->dir_blk_num, new_offset);
+	_write_bytes(fs, _rec_used_len(rec), buf);
+
+	usize link_offset;
+	_find_rec(fs, loc->dir_blk_num, filename, &link_offset);
+	_write_dir_u16(fs, loc->dir_blk_num, link_offset, new_offset);
+	_free_rec(fs, loc->dir_blk_num, loc->offset);
+
+	// The old record may have been given back to this one
+	loc->offset = new_offset;
+	loc->rec = _get_rec(fs, loc->dir_blk_num, new_offset);
+	return true;
+}
+
+/*
+ * Reads @len bytes at byte @offset of the inline file at @loc; past its end,
+ * they read as zeros
+ */
+void _read_inline(struct fs *fs, struct _inline_loc *loc, usize offset,
+		  u8 *buf, usize len)
+{
+	usize inline_len = loc->rec.inline_len;
+	usize stored_len = 0;
+	if (offset < inline_len) {
+		stored_len = inline_len - offset < len
+			? inline_len - offset
+			: len;
+		_seek_to_data_addr(fs, loc->dir_blk_num,
+				   _inline_data_offset(loc) + offset);
+		_read_bytes(fs, stored_len, buf);
+	}
+	memset(buf + stored_len, 0, len - stored_len);
+}
+
+/*
+ * Writes @len bytes at byte @offset of the inline file at @loc; they must fit
+ */
+void _write_inline(struct fs *fs, struct _inline_loc *loc, usize offset,
+		   u8 *buf, usize len)
+{
+	assert(offset + len <= _inline_cap(loc));
+	if (len == 0) {
+		// Its record may end the block, with nothing past its name
+		return;
+	}
+	usize inline_len = loc->rec.inline_len;
+	usize data_offset = _inline_data_offset(loc);
+	if (offset > inline_len) {
+		// The gap may still hold bytes of an older record
+		_seek_to_data_addr(fs, loc->dir_blk_num,
+				   data_offset + inline_len);
+		_write_bytes(fs, offset - inline_len, fs->zero_blk);
+	}
+	_seek_to_data_addr(fs, loc->dir_blk_num, data_offset + offset);
+	_write_bytes(fs, len, buf);
+	if (offset + len > inline_len) {
+		loc->rec.inline_len = offset + len;
+		_set_rec(fs, loc->dir_blk_num, loc->offset, loc->rec);
+		_set_dir_free_len(fs, loc->dir_blk_num,
+				  _get_dir_free_len(fs, loc->dir_blk_num)
+				  - (offset + len - inline_len));
+	}
+}
+
+/*
+ * Moves the bytes of the inline file @fd, whose record is at @loc, into blocks
+ * of its own, for it to grow past what fits in its directory entry. The
+ * directory stays write-locked throughout, so no other call is on the file.
+ */
+u8 _promote(struct fs *fs, struct fs_file_desc *fd, struct _inline_loc *loc)
+{
+	u8 buf[MAX_INLINE_LEN];
+	usize len = loc->rec.inline_len;
+	_read_inline(fs, loc, 0, buf, len);
+
+	usize head_blk_num = _alloc_data_blk(fs, NULL_DATA_BLK_NUM);
+	if (head_blk_num == NULL_DATA_BLK_NUM) {
+		return 1;
+	}
+	usize pos = _fd_pos(fs, fd);
+	fd->head_blk_num = head_blk_num;
+	_seek(fs, fd, 0);
+	if (_traversal_loop(fs, fd, buf, len, *_write_func, true)) {
+		_release_prealloc(fs, fd);
+		_dealloc_file_blks(fs, head_blk_num);
+		fd->blk_map_len = 0;
+		fd->head_blk_num = NULL_DATA_BLK_NUM;
+		_seek(fs, fd, pos);
+		return 1;
+	}
+	_seek(fs, fd, pos);
+
+	struct _inode inode = _get_inode(fs, fd->inode_num);
+	_set_inode(fs, fd->inode_num,
+		   _new_inode(false, _inode_owner(inode),
+			      _inode_has_read_perm(inode),
+			      _inode_has_write_perm(inode), head_blk_num));
+	// The record shrinks back to its name
+	_set_dir_free_len(fs, loc->dir_blk_num,
+			  _get_dir_free_len(fs, loc->dir_blk_num)
+			  + loc->rec.inline_len);
+	loc->rec.inline_len = 0;
+	_set_rec(fs, loc->dir_blk_num, loc->offset, loc->rec);
+	return 0;
+}
+
+/*
+ * `fs_write`, within a call already started
+ */
+u8 _write(struct fs *fs, struct fs_file_desc *fd, u8 *buf, usize len)
+{
+	if (_lock_file(fs, fd, true)) {
+		usize pos = _fd_pos(fs, fd);
+		struct _inline_loc loc;
+		if (!_find_inline(fs, fd, &loc)) {
+			_unlock_inode(fs, fd->parent_inode_num);
+			return 1;
+		}
+		bool fits = _fit_inline(fs, fd, &loc, pos + len);
+		u8 ret = 0;
+		if (fits) {
+			_write_inline(fs, &loc, pos, buf, len);
+			_seek(fs, fd, pos + len);
+		} else {
+			ret = _promote(fs, fd, &loc);
+		}
+		_unlock_inode(fs, fd->parent_inode_num);
+		if (fits || ret) {
+			return ret;
+		}
+		_lock_file(fs, fd, true);
+	}
+	u8 ret = _traversal_loop(fs, fd, buf, len, *_write_func, true);
+	_unlock_inode(fs, fd->inode_num);
+	return ret;
+}
+
+/*
+ * Writes @len bytes from @buf to the file at the current seek position
+ */
+u8 fs_write(fs_t *fs, struct fs_file_desc *fd, u8 *buf, usize len)
+{
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	_begin_op(fs);
+	u8 ret = _write(fs, fd, buf, len);
+	return ret | _end_op(fs);
+}
+
+/*
+ * Reads @len bytes into @buf from the file at the current seek position
+ */
+u8 fs_read(fs_t *fs, struct fs_file_desc *fd, u8 *buf, usize len)
+{
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	if (_lock_file(fs, fd, false)) {
+		struct _inline_loc loc;
+		u8 ret = !_find_inline(fs, fd, &loc);
+		if (!ret) {
+			usize pos = _fd_pos(fs, fd);
+			_read_inline(fs, &loc, pos, buf, len);
+			_seek(fs, fd, pos + len);
+		}
+		_unlock_inode(fs, fd->parent_inode_num);
+		return ret;
+	}
+	u8 ret = _traversal_loop(fs, fd, buf, len, *_read_func, false);
+	_unlock_inode(fs, fd->inode_num);
+	return ret;
+}
+
+/*
+ * `fs_read_view` of an inline file, whose bytes are viewed in its directory's
+ * block
+ */
+usize _view_inline(struct fs *fs, struct fs_file_desc *fd, usize len,
+		   struct fs_view *views, usize max_views)
+{
+	struct _inline_loc loc;
+	if (!_find_inline(fs, fd, &loc)) {
+		return 0;
+	}
+	usize inline_len = loc.rec.inline_len;
+	usize pos = _fd_pos(fs, fd);
+	usize num_views = 0;
+	while (len > 0 && num_views < max_views) {
+		struct fs_view *view = &views[num_views];
+		if (pos < inline_len) {
+			view->len = inline_len - pos;
+			view->blk_num = fs->layout.data_blks_offset
+				+ loc.dir_blk_num;
+			u8 *blk = cache_pin(fs->cache, view->blk_num);
+			if (blk == NULL) {
+				break;
+			}
+			view->data = blk + _inline_data_offset(&loc) + pos;
+		} else {
+			view->len = fs->layout.blk_size;
+			view->blk_num = NO_VIEW_BLK;
+			view->data = fs->zero_blk;
+		}
+		if (view->len > len) {
+			view->len = len;
+		}
+		num_views += 1;
+		len -= view->len;
+		pos += view->len;
+	}
+	_seek(fs, fd, pos);
+	return num_views;
+}
+
+/*
+ * Maps up to @len bytes from the current position into @views, one per block,
+ * pinning each block in the cache. Returns how many views were made.
+ */
+usize fs_read_view(fs_t *fs, struct fs_file_desc *fd, usize len,
+		   struct fs_view *views, usize max_views)
+{
+	if (_fd_failed(fd)) {
+		return 0;
+	}
+	if (_lock_file(fs, fd, false)) {
+		usize num_views = _view_inline(fs, fd, len, views, max_views);
+		_unlock_inode(fs, fd->parent_inode_num);
+		return num_views;
+	}
+	if (fd->curr_blk_num != NULL_DATA_BLK_NUM) {
+		_readahead(fs, fd, len);
+	}
+
+	usize usable_len = fs->layout.data_blk_usable_len;
+	usize num_views = 0;
+	while (len > 0 && num_views < max_views) {
+		struct fs_view *view = &views[num_views];
+		view->len = usable_len - fd->curr_offset;
+		if (view->len > len) {
+			view->len = len;
+		}
+		if (fd->curr_blk_num == NULL_DATA_BLK_NUM) {
+			view->blk_num = NO_VIEW_BLK;
+			view->data = fs->zero_blk;
+		} else {
+			// Skips the next pointer, if there is one
+			view->blk_num = fs->layout.data_blks_offset
+				+ fd->curr_blk_num;
+			u8 *blk = cache_pin(fs->cache, view->blk_num);
+			if (blk == NULL) {
+				break;
+			}
+			view->data = blk + fs->layout.data_blk_usable_offset
+				+ fd->curr_offset;
+		}
+		num_views += 1;
+		len -= view->len;
+
+		fd->curr_offset += view->len;
+		if (fd->curr_offset >= usable_len) {
+			_advance_blk(fs, fd, 1);
+		}
+	}
+	_unlock_inode(fs, fd->inode_num);
+	return num_views;
+}
+
+void fs_release_views(fs_t *fs, struct fs_view *views, usize num_views)
+{
+	for (usize i = 0; i < num_views; ++i) {
+		if (views[i].blk_num != NO_VIEW_BLK) {
+			cache_unpin(fs->cache, views[i].blk_num);
+		}
+	}
+}
+
+/*
+ * The pieces of a vectored transfer, one per block touched
+ */
+struct _vec_list {
+	struct cache_vec *vecs;
+	usize len;
+	usize cap;
+};
+
+void _vec_list_push(struct _vec_list *list, struct cache_vec vec)
+{
+	if (list->len == list->cap) {
+		list->cap = list->cap == 0 ? 16 : 2 * list->cap;
+		list->vecs = realloc(list->vecs,
+				     list->cap * sizeof(*list->vecs));
+	}
+	list->vecs[list->len] = vec;
+	list->len += 1;
+}
+
+/*
+ * Adds to @list a piece for each block of @fd's file that @vec touches. A
+ * missing block reads as zeros, unless @writing, in which case nothing is
+ * added and false is returned.
+ */
+bool _map_range(struct fs *fs, struct fs_file_desc *fd, struct fs_io_vec *vec,
+		bool writing, struct _vec_list *list)
+{
+	usize usable_len = fs->layout.data_blk_usable_len;
+	usize blk_idx = vec->offset / usable_len;
+	usize blk_offset = vec->offset % usable_len;
+	u8 *buf = vec->buf;
+	usize bytes_remaining = vec->len;
+	usize list_len = list->len;
+	while (bytes_remaining > 0) {
+		usize len = usable_len - blk_offset;
+		if (len > bytes_remaining) {
+			len = bytes_remaining;
+		}
+		usize blk_num = _map_blk(fs, fd, blk_idx);
+		if (blk_num == NULL_DATA_BLK_NUM) {
+			if (writing) {
+				list->len = list_len;
+				return false;
+			}
+			memset(buf, 0, len);
+		} else {
+			struct cache_vec piece = {
+				.blk_num = fs->layout.data_blks_offset
+					+ blk_num,
+				.offset = fs->layout.data_blk_usable_offset
+					+ blk_offset,
+				.len = len,
+				.buf = buf,
+			};
+			_vec_list_push(list, piece);
+		}
+		buf += len;
+		bytes_remaining -= len;
+		blk_idx += 1;
+		blk_offset = 0;
+	}
+	return true;
+}
+
+/*
+ * Writes @vec the way `fs_write` would, leaving the position of @fd where it
+ * was
+ */
+u8 _write_at(struct fs *fs, struct fs_file_desc *fd, struct fs_io_vec *vec)
+{
+	usize pos = _fd_pos(fs, fd);
+	_seek(fs, fd, vec->offset);
+	u8 ret = _traversal_loop(fs, fd, vec->buf, vec->len, *_write_func,
+				 true);
+	_seek(fs, fd, pos);
+	return ret;
+}
+
+/*
+ * Reads each range in @vecs, merging the reads of nearby blocks
+ */
+u8 fs_readv(fs_t *fs, struct fs_file_desc *fd, struct fs_io_vec *vecs,
+	    usize num_vecs)
+{
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	if (_lock_file(fs, fd, false)) {
+		struct _inline_loc loc;
+		u8 ret = !_find_inline(fs, fd, &loc);
+		for (usize i = 0; !ret && i < num_vecs; ++i) {
+			_read_inline(fs, &loc, vecs[i].offset, vecs[i].buf,
+				     vecs[i].len);
+		}
+		_unlock_inode(fs, fd->parent_inode_num);
+		return ret;
+	}
+	struct _vec_list list = { .vecs = NULL, .len = 0, .cap = 0 };
+	for (usize i = 0; i < num_vecs; ++i) {
+		_map_range(fs, fd, &vecs[i], false, &list);
+	}
+	u8 ret = cache_readv(fs->cache, list.vecs, list.len);
+	_unlock_inode(fs, fd->inode_num);
+	free(list.vecs);
+	return ret;
 }
 
 /*
- * Creates or retrieves the next data block
+ * `fs_writev`, within a call already started
  */
-usize _get_next_data_blk_num(usize curr_blk)
+u8 _writev(struct fs *fs, struct fs_file_desc *fd, struct fs_io_vec *vecs,
+	   usize num_vecs)
 {
-	_seek_to_data_addr(curr_blk, 0);
-	usize next_blk_num = _read_usize();
-	if (next_blk_num == 0) {
-		next_blk_num = _alloc_data_blk();
-		_seek_to_data_addr(curr_blk, 0);
-		_write_usize(next_blk_num);
+	bool extents = fs->layout.features & FEATURE_EXTENTS;
+	struct _vec_list list = { .vecs = NULL, .len = 0, .cap = 0 };
+	u8 ret = 0;
+	if (_lock_file(fs, fd, true)) {
+		usize end = 0;
+		for (usize i = 0; i < num_vecs; ++i) {
+			if (vecs[i].offset + vecs[i].len > end) {
+				end = vecs[i].offset + vecs[i].len;
+			}
+		}
+		struct _inline_loc loc;
+		if (!_find_inline(fs, fd, &loc)) {
+			_unlock_inode(fs, fd->parent_inode_num);
+			return 1;
+		}
+		bool fits = _fit_inline(fs, fd, &loc, end);
+		for (usize i = 0; fits && i < num_vecs; ++i) {
+			_write_inline(fs, &loc, vecs[i].offset, vecs[i].buf,
+				      vecs[i].len);
+		}
+		if (!fits) {
+			ret = _promote(fs, fd, &loc);
+		}
+		_unlock_inode(fs, fd->parent_inode_num);
+		if (fits || ret) {
+			return ret;
+		}
+		_lock_file(fs, fd, true);
+	}
+	// Ranges needing new blocks are written (and grow the file) right away
+	usize end = 0;
+	for (usize i = 0; i < num_vecs; ++i) {
+		if (extents
+		    && _unshare(fs, fd, vecs[i].offset, vecs[i].len)) {
+			ret = 1;
+		} else if (!_map_range(fs, fd, &vecs[i], true, &list)) {
+			ret |= _write_at(fs, fd, &vecs[i]);
+		} else if (vecs[i].offset + vecs[i].len > end) {
+			end = vecs[i].offset + vecs[i].len;
+		}
 	}
-	return next_blk_num;
+	ret |= cache_writev(fs->cache, list.vecs, list.len);
+	if (extents && end > _get_ext_blk_size(fs, fd->head_blk_num)) {
+		_set_ext_blk_size(fs, fd->head_blk_num, end);
+	}
+	_unlock_inode(fs, fd->inode_num);
+	free(list.vecs);
+	return ret;
 }
 
-u8 _traversal_loop(struct fs_file_desc *fd,
-	           u8 *buf,
-	           usize len,
-	           u8 func(u8 *, usize))
+/*
+ * Writes each range in @vecs, merging the writes of adjacent blocks
+ */
+u8 fs_writev(fs_t *fs, struct fs_file_desc *fd, struct fs_io_vec *vecs,
+	     usize num_vecs)
 {
-	usize bytes_remaining = len;
-	while (bytes_remaining > 0) {
-		usize post_write_offset = fd->curr_offset + bytes_remaining;
-		bool overflow = post_write_offset > layout.data_blk_usable_len;
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	_begin_op(fs);
+	u8 ret = _writev(fs, fd, vecs, num_vecs);
+	return ret | _end_op(fs);
+}
 
-		usize cpy_len = overflow
-			? layout.data_blk_usable_len - fd->curr_offset
-			: bytes_remaining;
+/*
+ * Zeroes the bytes of @fd's blocks in the @len bytes from @offset, leaving its
+ * holes (and the end of a chain) as they are
+ */
+u8 _zero_range(struct fs *fs, struct fs_file_desc *fd, usize offset, usize len)
+{
+	usize usable_len = fs->layout.data_blk_usable_len;
+	u8 ret = 0;
+	while (len > 0) {
+		usize blk_idx = offset / usable_len;
+		usize blk_offset = offset % usable_len;
+		usize chunk_len = usable_len - blk_offset;
+		if (chunk_len > len) {
+			chunk_len = len;
+		}
+		if (_map_blk(fs, fd, blk_idx) != NULL_DATA_BLK_NUM) {
+			struct fs_io_vec vec = {
+				.offset = offset,
+				.buf = fs->zero_blk,
+				.len = chunk_len,
+			};
+			ret |= _write_at(fs, fd, &vec);
+		} else if (!(fs->layout.features & FEATURE_EXTENTS)) {
+			break;
+		}
+		offset += chunk_len;
+		len -= chunk_len;
+	}
+	return ret;
+}
 
-		_seek_to_data_usable_addr(fd->curr_blk_num, fd->curr_offset);
-		func(buf, cpy_len);
-		bytes_remaining -= cpy_len;
+/*
+ * `fs_punch_hole`, within a call already started
+ */
+u8 _punch_hole(struct fs *fs, struct fs_file_desc *fd, usize offset,
+	       usize len)
+{
+	if (_lock_file(fs, fd, true)) {
+		struct _inline_loc loc;
+		u8 ret = !_find_inline(fs, fd, &loc);
+		usize inline_len = ret ? 0 : loc.rec.inline_len;
+		if (offset < inline_len) {
+			usize zero_len = inline_len - offset;
+			_write_inline(fs, &loc, offset, fs->zero_blk,
+				      zero_len < len ? zero_len : len);
+		}
+		_unlock_inode(fs, fd->parent_inode_num);
+		return ret;
+	}
+	bool extents = fs->layout.features & FEATURE_EXTENTS;
+	usize usable_len = fs->layout.data_blk_usable_len;
+	usize size = extents ? _get_ext_blk_size(fs, fd->head_blk_num) : 0;
+	u8 ret = 0;
+	if (!extents) {
+		ret = _zero_range(fs, fd, offset, len);
+	} else if (offset < size) {
+		// Zeroing past the end would grow the file
+		usize end = len < size - offset ? offset + len : size;
+		usize first_idx = (offset + usable_len - 1) / usable_len;
+		usize end_idx = end / usable_len;
+		if (first_idx >= end_idx) {
+			ret = _zero_range(fs, fd, offset, end - offset);
+		} else {
+			ret |= _zero_range(fs, fd, offset,
+					   first_idx * usable_len - offset);
+			ret |= _zero_range(fs, fd, end_idx * usable_len,
+					   end - end_idx * usable_len);
+			ret |= _unmap_extents(fs, fd->head_blk_num, first_idx,
+					      end_idx);
+		}
+		// @fd's block may be gone
+		_seek(fs, fd, _fd_pos(fs, fd));
+	}
+	_unlock_inode(fs, fd->inode_num);
+	return ret;
+}
 
-		fd->curr_offset += cpy_len;
-		if (fd->curr_offset >= layout.data_blk_usable_len) {
-			fd->curr_blk_num =
-				_get_next_data_blk_num(fd->curr_blk_num);
-			fd->curr_offset = 0;
+/*
+ * Turns the @len bytes from @offset of @fd's file into a hole, keeping its size
+ *
+ * Extent-mapped files let go of the blocks wholly inside the range and zero the
+ * rest of it. Chains can't skip blocks, so chained and inline files are zeroed
+ * in place instead.
+ */
+u8 fs_punch_hole(fs_t *fs, struct fs_file_desc *fd, usize offset, usize len)
+{
+	if (_fd_failed(fd) || fd->is_dir) {
+		return 1;
+	}
+	_begin_op(fs);
+	u8 ret = _punch_hole(fs, fd, offset, len);
+	return ret | _end_op(fs);
+}
+
+/*
+ * Reads every range in @reqs, across files, merging the reads of nearby blocks
+ */
+u8 fs_read_batch(fs_t *fs, struct fs_batch_req *reqs, usize num_reqs)
+{
+	for (usize i = 0; i < num_reqs; ++i) {
+		if (_fd_failed(reqs[i].f)) {
+			return 1;
+		}
+	}
+	// Ranges of inline files are read from their directory entries first.
+	// On the heap, as a batch may hold any number of requests.
+	bool *inline_reqs = calloc(num_reqs + 1, sizeof(*inline_reqs));
+	if (inline_reqs == NULL) {
+		return 1;
+	}
+	u8 inline_ret = 0;
+	for (usize i = 0; i < num_reqs; ++i) {
+		struct fs_file_desc *fd = reqs[i].f;
+		if (!_fd_inline(fd)) {
+			continue;
+		}
+		if (_lock_file(fs, fd, false)) {
+			struct fs_io_vec *vec = &reqs[i].vec;
+			struct _inline_loc loc;
+			if (_find_inline(fs, fd, &loc)) {
+				_read_inline(fs, &loc, vec->offset, vec->buf,
+					     vec->len);
+			} else {
+				inline_ret = 1;
+			}
+			_unlock_inode(fs, fd->parent_inode_num);
+			inline_reqs[i] = true;
+		} else {
+			// Given blocks since it was opened, which @fd now maps
+			_unlock_inode(fs, fd->inode_num);
+		}
+	}
+
+	bool locked[NUM_INODE_LOCKS] = { false };
+	for (usize i = 0; i < num_reqs; ++i) {
+		if (!inline_reqs[i]) {
+			locked[reqs[i].f->inode_num % NUM_INODE_LOCKS] = true;
+		}
+	}
+	// Always in the same order, so batches never wait on each other
+	for (usize i = 0; i < NUM_INODE_LOCKS; ++i) {
+		if (locked[i]) {
+			pthread_rwlock_rdlock(&fs->inode_locks[i]);
+		}
+	}
+
+	struct _vec_list list = { .vecs = NULL, .len = 0, .cap = 0 };
+	for (usize i = 0; i < num_reqs; ++i) {
+		if (!inline_reqs[i]) {
+			_map_range(fs, reqs[i].f, &reqs[i].vec, false, &list);
+		}
+	}
+	u8 ret = inline_ret | cache_readv(fs->cache, list.vecs, list.len);
+
+	for (usize i = 0; i < NUM_INODE_LOCKS; ++i) {
+		if (locked[i]) {
+			pthread_rwlock_unlock(&fs->inode_locks[i]);
 		}
 	}
+	free(list.vecs);
+	free(inline_reqs);
+	return ret;
+}
+
+/*
+ * A request from `fs_submit_read` / `fs_submit_write`
+ */
+struct _aio_req {
+	// First, so the job can be turned back into the request
+	struct workq_job job;
+	struct fs *fs;
+	// A copy of the descriptor as submitted, with its own block map and no
+	// reservation, so requests on the same file don't share either
+	struct fs_file_desc fd;
+	struct fs_io_vec vec;
+	bool writing;
+	void *user_data;
+
+	// The transfers of a request carried by the ring, one per stretch of
+	// uncached blocks, and how many of them are still in flight
+	struct uring_op *ops;
+	usize num_ops;
+	usize ops_cap;
+	usize ops_left;
+	// Set once any of them fails
+	u8 ops_ret;
+};
+
+u8 _run_aio_req(struct workq_job *job)
+{
+	struct _aio_req *req = (struct _aio_req *) job;
+	u8 ret = req->writing
+		? fs_writev(req->fs, &req->fd, &req->vec, 1)
+		: fs_readv(req->fs, &req->fd, &req->vec, 1);
+	// Appends through the copy may have reserved blocks of their own
+	_begin_op(req->fs);
+	_release_prealloc(req->fs, &req->fd);
+	ret |= _end_op(req->fs);
+	free(req->fd.blk_map);
+	return ret;
+}
+
+/*
+ * `cache_split_direct`'s issue for a request on the ring: adds a transfer of
+ * the @len bytes at byte @offset of the backing file to the request @arg.
+ * Returns 1 if there is no memory for it.
+ */
+u8 _add_aio_op(void *arg, usize offset, u8 *buf, usize len, bool write)
+{
+	struct _aio_req *req = arg;
+	if (req->num_ops == req->ops_cap) {
+		usize cap = req->ops_cap == 0 ? 4 : 2 * req->ops_cap;
+		struct uring_op *ops = realloc(req->ops, cap * sizeof(*ops));
+		if (ops == NULL) {
+			return 1;
+		}
+		req->ops = ops;
+		req->ops_cap = cap;
+	}
+	req->ops[req->num_ops] = (struct uring_op) {
+		.write = write,
+		.buf = buf,
+		.len = len,
+		.offset = offset,
+		.arg = req,
+	};
+	req->num_ops += 1;
 	return 0;
 }
 
-u8 _write_func(u8 *buf, usize len)
+/*
+ * Records how the transfer @op of a request went, given what `pread` /
+ * `pwrite` returned for it. Cached copies of the blocks it wrote are brought up
+ * to date, as they may have been read in while it was in flight.
+ */
+void _aio_op_result(struct uring_op *op, ssize_t res)
 {
-	usize num_written = fwrite(buf, sizeof(buf[0]), len, bk_f);
-	return num_written != len;
+	struct _aio_req *req = op->arg;
+	if (res != (ssize_t) op->len) {
+		__atomic_store_n(&req->ops_ret, 1, __ATOMIC_RELAXED);
+	} else if (op->write) {
+		cache_update_clean(req->fs->cache, op->offset, op->buf,
+				   op->len);
+	}
 }
 
-u8 _read_func(u8 *buf, usize len)
+/*
+ * Called on the ring's thread as each transfer of a request finishes; the
+ * last one finishes the request
+ */
+void _aio_op_done(struct uring_op *op, ssize_t res)
 {
-	usize num_read = fread(buf, sizeof(buf[0]), len, bk_f);
-	return num_read != len;
+	struct _aio_req *req = op->arg;
+	_aio_op_result(op, res);
+	if (__atomic_sub_fetch(&req->ops_left, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	free(req->ops);
+	req->job.ret = req->ops_ret;
+	workq_finish(req->fs->aio, &req->job);
 }
 
-u8 _no_op(u8 *buf, usize len)
+/*
+ * Runs the transfers of a request the ring had no room for, on the pool
+ */
+u8 _run_aio_ops(struct workq_job *job)
 {
-	return 0;
+	struct _aio_req *req = (struct _aio_req *) job;
+	int fd = req->fs->bk_fd;
+	for (usize i = 0; i < req->num_ops; ++i) {
+		struct uring_op *op = &req->ops[i];
+		ssize_t res = op->write
+			? pwrite(fd, op->buf, op->len, op->offset)
+			: pread(fd, op->buf, op->len, op->offset);
+		_aio_op_result(op, res);
+	}
+	free(req->ops);
+	return req->ops_ret;
 }
 
 /*
- * Writes @len bytes from @buf to the file at the current seek position
+ * Whether the ring can carry @req: a read of an extent-mapped file, or a
+ * write that only overwrites blocks the file already has to itself. The
+ * file's lock is held.
  */
-u8 fs_write(struct fs_file_desc *fd, u8 *buf, usize len)
+bool _ring_fits(struct fs *fs, struct _aio_req *req)
 {
-	_traversal_loop(fd, buf, len, *_write_func);
-	fflush(bk_f);
-	return 0;
+	struct fs_file_desc *fd = &req->fd;
+	if (!req->writing) {
+		return true;
+	}
+	usize end = req->vec.offset + req->vec.len;
+	if (fs->write_through
+	    || end > _get_ext_blk_size(fs, fd->head_blk_num)) {
+		return false;
+	}
+	usize blk_size = fs->layout.blk_size;
+	usize blk_idx = req->vec.offset / blk_size;
+	usize end_idx = (end + blk_size - 1) / blk_size;
+	while (blk_idx < end_idx) {
+		usize run_len;
+		usize phys = _extent_map(fs, fd->head_blk_num, blk_idx, false,
+					 &run_len);
+		if (phys == NULL_DATA_BLK_NUM) {
+			return false;
+		}
+		if (run_len > end_idx - blk_idx) {
+			run_len = end_idx - blk_idx;
+		}
+		if (fs->refcounts.num_entries > 0) {
+			pthread_mutex_lock(&fs->alloc_lock);
+			u16 max = refcount_max(&fs->refcounts, phys, run_len);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			if (max > 0) {
+				return false;
+			}
+		}
+		blk_idx += run_len;
+	}
+	return true;
 }
 
 /*
- * Reads @len bytes into @buf from the file at the current seek position
+ * Splits @req into transfers of whole extent runs, copying the cached blocks
+ * and the holes at once. Returns 1 if some of it could not be done.
+ */
+u8 _split_aio_req(struct fs *fs, struct _aio_req *req)
+{
+	usize blk_size = fs->layout.blk_size;
+	usize pos = req->vec.offset;
+	usize end = pos + req->vec.len;
+	u8 ret = 0;
+	while (pos < end) {
+		usize blk_idx = pos / blk_size;
+		usize blk_offset = pos % blk_size;
+		u8 *buf = req->vec.buf + (pos - req->vec.offset);
+		usize run_len;
+		usize phys = _extent_map(fs, req->fd.head_blk_num, blk_idx,
+					 false, &run_len);
+		usize len = phys == NULL_DATA_BLK_NUM
+			? blk_size - blk_offset
+			: run_len * blk_size - blk_offset;
+		if (len > end - pos) {
+			len = end - pos;
+		}
+		if (phys == NULL_DATA_BLK_NUM) {
+			memset(buf, 0, len);
+		} else {
+			ret |= cache_split_direct(
+				fs->cache, fs->layout.data_blks_offset + phys,
+				blk_offset, len, buf, req->writing,
+				_add_aio_op, req);
+		}
+		pos += len;
+	}
+	return ret;
+}
+
+/*
+ * Starts @req on the ring, if the load has one and it can carry it. Returns
+ * false, having done nothing, if the request must go through the pool.
+ */
+bool _start_on_ring(struct fs *fs, struct _aio_req *req)
+{
+	struct fs_file_desc *fd = &req->fd;
+	if (fs->ring == NULL || fd->is_dir || _fd_inline(fd)) {
+		return false;
+	}
+	if (req->writing) {
+		_begin_op(fs);
+	}
+	_lock_inode(fs, fd->inode_num, req->writing);
+	bool fits = _ring_fits(fs, req);
+	u8 ret = fits ? _split_aio_req(fs, req) : 0;
+	_unlock_inode(fs, fd->inode_num);
+	if (req->writing) {
+		ret |= _end_op(fs);
+	}
+	if (!fits) {
+		return false;
+	}
+
+	workq_begin(fs->aio);
+	if (ret || req->num_ops == 0) {
+		free(req->ops);
+		req->job.ret = ret;
+		workq_finish(fs->aio, &req->job);
+		return true;
+	}
+	for (usize i = 0; i < req->num_ops; ++i) {
+		req->ops[i].done = _aio_op_done;
+	}
+	req->ops_left = req->num_ops;
+	if (!uring_submit(fs->ring, req->ops, req->num_ops)) {
+		req->job.run = _run_aio_ops;
+		workq_queue(fs->aio, &req->job);
+	}
+	return true;
+}
+
+/*
+ * Starts a request on the ring if it can carry it, and on the pool otherwise.
+ * Returns 1 if there is no memory for it.
  */
-u8 fs_read(struct fs_file_desc *fd, u8 *buf, usize len)
+u8 _submit(struct fs *fs, struct fs_file_desc *fd, struct fs_io_vec vec,
+	   bool writing, void *user_data)
 {
-	_traversal_loop(fd, buf, len, *_read_func);
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	struct _aio_req *req = calloc(1, sizeof(*req));
+	if (req == NULL) {
+		return 1;
+	}
+	req->fs = fs;
+	req->fd = *fd;
+	req->fd.blk_map = NULL;
+	req->vec = vec;
+	req->writing = writing;
+	req->user_data = user_data;
+	if (_start_on_ring(fs, req)) {
+		return 0;
+	}
+
+	req->job.run = _run_aio_req;
+	req->fd.blk_map_cap = fd->blk_map_len;
+	if (fd->blk_map_len > 0) {
+		usize map_size = fd->blk_map_len * sizeof(*fd->blk_map);
+		req->fd.blk_map = malloc(map_size);
+		if (req->fd.blk_map == NULL) {
+			free(req);
+			return 1;
+		}
+		memcpy(req->fd.blk_map, fd->blk_map, map_size);
+	}
+	req->fd.prealloc_len = 0;
+	workq_submit(fs->aio, &req->job);
 	return 0;
 }
 
-u8 fs_seek(struct fs_file_desc *fd, usize offset)
+/*
+ * Queues a read of @vec, returning at once
+ */
+u8 fs_submit_read(fs_t *fs, struct fs_file_desc *fd, struct fs_io_vec vec,
+		  void *user_data)
+{
+	return _submit(fs, fd, vec, false, user_data);
+}
+
+/*
+ * Queues a write of @vec, returning at once
+ */
+u8 fs_submit_write(fs_t *fs, struct fs_file_desc *fd, struct fs_io_vec vec,
+		   void *user_data)
 {
-	fd->curr_blk_num = fd->head_blk_num;
-	fd->curr_offset = 0;
-	_traversal_loop(fd, NULL, offset, *_no_op);
+	return _submit(fs, fd, vec, true, user_data);
+}
+
+/*
+ * Collects finished requests, waiting for @min_complete of them
+ */
+usize fs_reap(fs_t *fs, struct fs_completion *out, usize max,
+	      usize min_complete)
+{
+	struct workq_job *done[REAP_CHUNK];
+	usize num_done = 0;
+	while (num_done < max) {
+		usize chunk = max - num_done;
+		if (chunk > REAP_CHUNK) {
+			chunk = REAP_CHUNK;
+		}
+		// Whatever is waited for is waited for by the first chunk
+		usize min_chunk = num_done < min_complete
+			? min_complete - num_done
+			: 0;
+		usize n = workq_reap(fs->aio, done, chunk, min_chunk);
+		for (usize i = 0; i < n; ++i) {
+			struct _aio_req *req = (struct _aio_req *) done[i];
+			out[num_done + i].user_data = req->user_data;
+			out[num_done + i].ret = req->job.ret;
+			free(req);
+		}
+		num_done += n;
+		if (n < chunk) {
+			break;
+		}
+	}
+	return num_done;
+}
+
+/*
+ * Moves the position of @fd to be @offset bytes into the file. Nothing is
+ * allocated; blocks past the end are created by the next write.
+ */
+u8 fs_seek(fs_t *fs, struct fs_file_desc *fd, usize offset)
+{
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	_lock_inode(fs, fd->inode_num, false);
+	_seek(fs, fd, offset);
+	_unlock_inode(fs, fd->inode_num);
 	return 0;
 }
+
+/*
+ * Returns how many bytes long @fd's file is: the size in its extent block, or
+ * every byte of its chain, which is walked to the end
+ */
+usize _file_len(struct fs *fs, struct fs_file_desc *fd)
+{
+	if (fs->layout.features & FEATURE_EXTENTS) {
+		return _get_ext_blk_size(fs, fd->head_blk_num);
+	}
+	_chain_map(fs, fd, (usize) -1);
+	return fd->blk_map_len * fs->layout.data_blk_usable_len;
+}
+
+/*
+ * Moves the position of @fd to the first byte from @offset on that is stored
+ * in a block (if @data) or is in a hole (if not), and sets @pos to it. Past
+ * the end of the file counts as a hole.
+ */
+u8 _seek_run(struct fs *fs, struct fs_file_desc *fd, usize offset, bool data,
+	     usize *pos)
+{
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	if (_lock_file(fs, fd, false)) {
+		// Inline files have no holes
+		struct _inline_loc loc;
+		u8 ret = !_find_inline(fs, fd, &loc)
+			|| offset >= loc.rec.inline_len;
+		if (!ret) {
+			*pos = data ? offset : loc.rec.inline_len;
+			_seek(fs, fd, *pos);
+		}
+		_unlock_inode(fs, fd->parent_inode_num);
+		return ret;
+	}
+	usize usable_len = fs->layout.data_blk_usable_len;
+	usize len = _file_len(fs, fd);
+	u8 ret = offset >= len;
+	if (!ret) {
+		usize blk_idx = offset / usable_len;
+		usize end_idx = (len + usable_len - 1) / usable_len;
+		// Chained files have no holes either
+		usize found = data ? blk_idx : end_idx;
+		if (fs->layout.features & FEATURE_EXTENTS) {
+			found = _next_extent_blk(fs, fd->head_blk_num, blk_idx,
+						 data, end_idx);
+		}
+		*pos = found == blk_idx ? offset : found * usable_len;
+		*pos = *pos < len ? *pos : len;
+		ret = data && *pos == len;
+	}
+	if (!ret) {
+		_seek(fs, fd, *pos);
+	}
+	_unlock_inode(fs, fd->inode_num);
+	return ret;
+}
+
+u8 fs_seek_data(fs_t *fs, struct fs_file_desc *fd, usize offset, usize *pos)
+{
+	return _seek_run(fs, fd, offset, true, pos);
+}
+
+u8 fs_seek_hole(fs_t *fs, struct fs_file_desc *fd, usize offset, usize *pos)
+{
+	return _seek_run(fs, fd, offset, false, pos);
+}
+
+/*
+ * Makes everything written through @fd durable
+ *
+ * The cache doesn't know which file a block belongs to, so this syncs every
+ * file.
+ */
+u8 fs_fsync(fs_t *fs, struct fs_file_desc *fd)
+{
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	return _sync(fs);
+}
+
+/*
+ * Makes everything written so far durable
+ */
+u8 fs_sync(fs_t *fs)
+{
+	return _sync(fs);
+}
+
+/*
+ * Closes the opened file described by @fd, making what was written through it
+ * durable
+ */
+u8 fs_close(fs_t *fs, struct fs_file_desc *fd)
+{
+	if (_fd_failed(fd)) {
+		return 1;
+	}
+	_begin_op(fs);
+	_release_prealloc(fs, fd);
+	u8 ret = _end_op(fs);
+	free(fd->blk_map);
+	fd->blk_map = NULL;
+	fd->blk_map_len = 0;
+	fd->blk_map_cap = 0;
+	return ret | _sync(fs);
+}
+
+/*
+ * Gives the new file at @dst_path the type and permissions of @inode, an inline
+ * file, and its @len bytes in @buf
+ */
+u8 _clone_inline(struct fs *fs, char *dst_path, struct _inode inode, u8 *buf,
+		 usize len)
+{
+	if (_create(fs, dst_path, inode)) {
+		return 1;
+	}
+	// Another thread may have deleted it already
+	struct fs_file_desc fd = fs_open(fs, dst_path);
+	if (_fd_failed(&fd)) {
+		return 1;
+	}
+	u8 ret = _write(fs, &fd, buf, len);
+	_release_prealloc(fs, &fd);
+	free(fd.blk_map);
+	return ret;
+}
+
+/*
+ * `fs_clone`, within a call already started
+ */
+u8 _clone(struct fs *fs, char *src_path, char *dst_path)
+{
+	assert(src_path[0] == '/');
+
+	usize parent_inode_num;
+	if (!_get_parent_inode_num(fs, src_path, &parent_inode_num)) {
+		return 1;
+	}
+	char filename[MAX_FILENAME_LEN + 1];
+	_get_end_filename(src_path, filename);
+
+	// Under the directory's lock, an inline file stays inline
+	_lock_inode(fs, parent_inode_num, false);
+	usize inode_num = _lookup_child_locked(fs, parent_inode_num, filename);
+	struct _inode inode = {0};
+	bool inline_data = false;
+	if (inode_num != NULL_INODE_NUM) {
+		inode = _get_inode(fs, inode_num);
+		inline_data = !_inode_is_dir(inode)
+			&& _inode_data_ptr(inode) == NULL_DATA_BLK_NUM;
+	}
+	u8 buf[MAX_INLINE_LEN];
+	usize inline_len = 0;
+	if (inline_data) {
+		struct _inline_loc loc;
+		usize dir_data_ptr =
+			_dir_data_ptr_of_inode_num(fs, parent_inode_num);
+		loc.offset = _find_dir_rec(fs, dir_data_ptr, filename,
+					   &loc.dir_blk_num, NULL);
+		loc.rec = _get_rec(fs, loc.dir_blk_num, loc.offset);
+		inline_len = loc.rec.inline_len;
+		_read_inline(fs, &loc, 0, buf, inline_len);
+	}
+	// Locked before the name is let go, so a delete of the file waits for
+	// its blocks to be shared, and the file never moves back inline, so its
+	// extent block stays put
+	bool shared = inode_num != NULL_INODE_NUM && !_inode_is_dir(inode)
+		&& !inline_data;
+	if (shared) {
+		_lock_inode(fs, inode_num, false);
+	}
+	_unlock_inode(fs, parent_inode_num);
+	if (inode_num == NULL_INODE_NUM || _inode_is_dir(inode)) {
+		return 1;
+	}
+	if (inline_data) {
+		return _clone_inline(fs, dst_path, inode, buf, inline_len);
+	}
+
+	inode.data_ptr = _share_extents(fs, _inode_data_ptr(inode));
+	_unlock_inode(fs, inode_num);
+	if (inode.data_ptr == NULL_DATA_BLK_NUM) {
+		return 1;
+	}
+	u8 ret = _create(fs, dst_path, inode);
+	if (ret) {
+		_dealloc_extents(fs, inode.data_ptr);
+	}
+	return ret;
+}
+
+/*
+ * Makes a file at @dst_path that shares all of the blocks of the regular file
+ * at @src_path
+ */
+u8 fs_clone(fs_t *fs, char *src_path, char *dst_path)
+{
+	// A shared block could only have one next pointer
+	if (!(fs->layout.features & FEATURE_EXTENTS)) {
+		return 1;
+	}
+	_begin_op(fs);
+	u8 ret = _clone(fs, src_path, dst_path);
+	return ret | _end_op(fs);
+}
+
+/*
+ * An entry of a directory, as listed by `_list_dir`
+ */
+struct _dir_entry {
+	char name[MAX_FILENAME_LEN + 1];
+	usize inode_num;
+	struct _inode inode;
+};
+
+/*
+ * Returns the entries of the directory @dir_inode_num, to be freed by the
+ * caller, and sets @num_entries to how many there are
+ */
+struct _dir_entry *_list_dir(struct fs *fs, usize dir_inode_num,
+			     usize *num_entries)
+{
+	struct _dir_entry *entries = NULL;
+	usize cap = 0;
+	*num_entries = 0;
+	_lock_inode(fs, dir_inode_num, false);
+	usize dir_data_ptr = _dir_data_ptr_of_inode_num(fs, dir_inode_num);
+	usize dir_blk_num = dir_data_ptr == NULL_DIR_BLK_NUM
+		? NULL_DIR_BLK_NUM
+		: _dir_blk_of_data_ptr(fs, dir_data_ptr);
+	for (usize blk_idx = 0; dir_blk_num != NULL_DIR_BLK_NUM; ++blk_idx) {
+		// Index blocks hold no records
+		usize offset = _is_dir_idx(fs, dir_blk_num)
+			? fs->layout.blk_size
+			: DIR_BLK_RECS_OFFSET;
+		while (offset < fs->layout.blk_size) {
+			struct _dir_rec rec = _get_rec(fs, dir_blk_num, offset);
+			if (rec.inode_num != NULL_INODE_NUM) {
+				if (*num_entries == cap) {
+					cap = cap == 0 ? 16 : 2 * cap;
+					entries = realloc(
+						entries,
+						cap * sizeof(*entries));
+				}
+				struct _dir_entry *entry =
+					&entries[*num_entries];
+				_read_str(fs, rec.name_len, entry->name);
+				entry->name[rec.name_len] = '\0';
+				entry->inode_num = rec.inode_num;
+				*num_entries += 1;
+			}
+			offset += rec.rec_len;
+		}
+		dir_blk_num = _next_dir_blk(fs, dir_data_ptr, dir_blk_num,
+					    blk_idx);
+	}
+	// Unlinking an entry takes this lock, so none of them is deleted yet
+	for (usize i = 0; i < *num_entries; ++i) {
+		entries[i].inode = _get_inode(fs, entries[i].inode_num);
+	}
+	_unlock_inode(fs, dir_inode_num);
+	return entries;
+}
+
+/*
+ * Clones each entry of the directory @src_inode_num at @src_dir into the
+ * directory at @dst_dir, making a directory of the same name for each
+ * subdirectory and filling it the same way. @snap_inode_num, the top of the
+ * copy, is passed over if it turns up in the tree being copied.
+ *
+ * Each entry is copied by a call of its own.
+ */
+u8 _snapshot_dir(struct fs *fs, char *src_dir, usize src_inode_num,
+		 char *dst_dir, usize snap_inode_num)
+{
+	usize num_entries;
+	struct _dir_entry *entries = _list_dir(fs, src_inode_num,
+					       &num_entries);
+	usize src_len = strlen(src_dir);
+	usize dst_len = strlen(dst_dir);
+	char src_path[src_len + MAX_FILENAME_LEN + 2];
+	char dst_path[dst_len + MAX_FILENAME_LEN + 2];
+	memcpy(src_path, src_dir, src_len);
+	memcpy(dst_path, dst_dir, dst_len);
+	src_path[src_len] = '/';
+	dst_path[dst_len] = '/';
+
+	u8 ret = 0;
+	for (usize i = 0; i < num_entries; ++i) {
+		struct _dir_entry *entry = &entries[i];
+		if (entry->inode_num == snap_inode_num) {
+			continue;
+		}
+		strcpy(src_path + src_len + 1, entry->name);
+		strcpy(dst_path + dst_len + 1, entry->name);
+		if (!_inode_is_dir(entry->inode)) {
+			ret |= fs_clone(fs, src_path, dst_path);
+			continue;
+		}
+		// Made empty, with the permissions of the one copied
+		struct _inode inode = entry->inode;
+		inode.data_ptr = NULL_DATA_BLK_NUM;
+		_begin_op(fs);
+		u8 err = _create(fs, dst_path, inode);
+		if (_end_op(fs) || err) {
+			ret = 1;
+			continue;
+		}
+		ret |= _snapshot_dir(fs, src_path, entry->inode_num, dst_path,
+				     snap_inode_num);
+	}
+	free(entries);
+	return ret;
+}
+
+/*
+ * Copies the tree under the directory at @src_dir to a new directory at
+ * @dst_dir, cloning every regular file in it
+ */
+u8 fs_snapshot(fs_t *fs, char *src_dir, char *dst_dir)
+{
+	assert(src_dir[0] == '/');
+
+	usize src_inode_num;
+	if (!(fs->layout.features & FEATURE_EXTENTS)
+	    || !_get_dir_inode_num(fs, src_dir, &src_inode_num)) {
+		return 1;
+	}
+	struct _inode inode = _get_inode(fs, src_inode_num);
+	if (!_inode_is_dir(inode)) {
+		return 1;
+	}
+	inode.data_ptr = NULL_DATA_BLK_NUM;
+	_begin_op(fs);
+	u8 ret = _create(fs, dst_dir, inode);
+	ret |= _end_op(fs);
+	usize snap_inode_num;
+	if (ret || !_get_dir_inode_num(fs, dst_dir, &snap_inode_num)) {
+		return 1;
+	}
+	// A root directory path ends in '/', which its entries add themselves
+	usize src_len = strlen(src_dir);
+	char src_path[src_len + 1];
+	strcpy(src_path, src_dir);
+	while (src_len > 0 && src_path[src_len - 1] == '/') {
+		src_path[--src_len] = '\0';
+	}
+	return _snapshot_dir(fs, src_path, src_inode_num, dst_dir,
+			     snap_inode_num);
+}
+
+/*
+ * Syncs @fs, then releases it
+ */
+u8 fs_unload(fs_t *fs)
+{
+	u8 ret = _sync(fs);
+	_free_fs(fs);
+	return ret;
+}
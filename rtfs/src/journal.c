@@ -0,0 +1,279 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <tberry/types.h>
+
+#include "journal.h"
+
+#define DESC_MAGIC 0x4a524e4c44455343
+#define COMMIT_MAGIC 0x4a524e4c434d4954
+
+// The descriptor is `usize magic`, `usize seq`, `usize num_blks`, then the
+// destination of each block, running on into as many blocks as it takes
+#define DESC_MAGIC_OFFSET 0
+#define DESC_SEQ_OFFSET 1
+#define DESC_NUM_BLKS_OFFSET 2
+#define DESC_BLK_NUMS_OFFSET 3
+
+// The commit block is `usize magic`, `usize seq`, `usize checksum`
+#define COMMIT_MAGIC_OFFSET 0
+#define COMMIT_SEQ_OFFSET 1
+#define COMMIT_CHECKSUM_OFFSET 2
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325
+#define FNV_PRIME 0x100000001b3
+
+struct journal {
+	int fd;
+	usize blk_size;
+	usize first_blk;
+	usize num_blks;
+
+	// Stamped on the next transaction
+	usize seq;
+	// The last transaction's in-place writes may not be synced yet
+	bool live;
+	// Most blocks a transaction holds, with its descriptor and commit block
+	usize capacity;
+
+	// Room for the longest descriptor
+	usize *desc;
+	usize *commit;
+};
+
+usize _div_ceil(usize x, usize y)
+{
+	return (x + y - 1) / y;
+}
+
+/*
+ * Returns how many blocks the descriptor of a transaction of @num_blks blocks
+ * takes
+ */
+usize _num_desc_blks(struct journal *j, usize num_blks)
+{
+	return _div_ceil((DESC_BLK_NUMS_OFFSET + num_blks) * sizeof(usize),
+			 j->blk_size);
+}
+
+usize _checksum(usize sum, u8 *buf, usize len)
+{
+	for (usize i = 0; i < len; ++i) {
+		sum ^= buf[i];
+		sum *= FNV_PRIME;
+	}
+	return sum;
+}
+
+/*
+ * Covers the whole descriptor as well as the blocks, so a stale commit block
+ * from an older transaction never matches
+ */
+usize _checksum_txn(struct journal *j, u8 **blks, usize num_blks)
+{
+	usize sum = _checksum(FNV_OFFSET_BASIS, (u8 *) j->desc,
+			      _num_desc_blks(j, num_blks) * j->blk_size);
+	for (usize i = 0; i < num_blks; ++i) {
+		sum = _checksum(sum, blks[i], j->blk_size);
+	}
+	return sum;
+}
+
+u8 _read_blk(struct journal *j, usize blk_num, void *dest)
+{
+	ssize_t num_read =
+		pread(j->fd, dest, j->blk_size, blk_num * j->blk_size);
+	return num_read != (ssize_t) j->blk_size;
+}
+
+u8 _write_blk(struct journal *j, usize blk_num, void *src)
+{
+	ssize_t num_written =
+		pwrite(j->fd, src, j->blk_size, blk_num * j->blk_size);
+	return num_written != (ssize_t) j->blk_size;
+}
+
+/*
+ * Overwrites the descriptor with one that has no magic, keeping the sequence
+ * number going
+ */
+u8 _clear(struct journal *j)
+{
+	memset(j->desc, 0, j->blk_size);
+	j->desc[DESC_SEQ_OFFSET] = j->seq;
+	return _write_blk(j, j->first_blk, j->desc);
+}
+
+struct journal *journal_new(int fd, usize blk_size, usize first_blk,
+			    usize num_blks)
+{
+	// A descriptor, a commit block and at least one block in between
+	if (num_blks < 3) {
+		return NULL;
+	}
+	struct journal *j = malloc(sizeof(*j));
+	j->fd = fd;
+	j->blk_size = blk_size;
+	j->first_blk = first_blk;
+	j->num_blks = num_blks;
+	j->live = false;
+	j->capacity = num_blks - 2;
+	while (_num_desc_blks(j, j->capacity) + j->capacity + 1 > num_blks) {
+		j->capacity -= 1;
+	}
+	j->desc = malloc(_num_desc_blks(j, j->capacity) * blk_size);
+	j->commit = malloc(blk_size);
+
+	if (_read_blk(j, first_blk, j->desc)) {
+		j->seq = 0;
+	} else {
+		j->seq = j->desc[DESC_SEQ_OFFSET] + 1;
+	}
+	return j;
+}
+
+void journal_free(struct journal *j)
+{
+	free(j->commit);
+	free(j->desc);
+	free(j);
+}
+
+usize journal_capacity(struct journal *j)
+{
+	return j->capacity;
+}
+
+/*
+ * Writes the @num_iov buffers of @iov end to end from byte @offset, as few
+ * `pwritev`s as `IOV_MAX` allows
+ */
+u8 _write_iov(struct journal *j, struct iovec *iov, usize num_iov,
+	      usize offset)
+{
+	usize iov_max = sysconf(_SC_IOV_MAX);
+	while (num_iov > 0) {
+		usize len = num_iov < iov_max ? num_iov : iov_max;
+		usize num_bytes = 0;
+		for (usize i = 0; i < len; ++i) {
+			num_bytes += iov[i].iov_len;
+		}
+		ssize_t num_written = pwritev(j->fd, iov, len, offset);
+		if (num_written != (ssize_t) num_bytes) {
+			return 1;
+		}
+		iov += len;
+		num_iov -= len;
+		offset += num_bytes;
+	}
+	return 0;
+}
+
+u8 journal_commit(struct journal *j, usize *blk_nums, u8 **blks,
+		  usize num_blks)
+{
+	assert(num_blks > 0 && num_blks <= journal_capacity(j));
+
+	// The data the transaction points at, and the last one's in-place
+	// writes, must be on disk before its commit block can be
+	if (fsync(j->fd) != 0) {
+		return 1;
+	}
+
+	usize num_desc_blks = _num_desc_blks(j, num_blks);
+	memset(j->desc, 0, num_desc_blks * j->blk_size);
+	j->desc[DESC_MAGIC_OFFSET] = DESC_MAGIC;
+	j->desc[DESC_SEQ_OFFSET] = j->seq;
+	j->desc[DESC_NUM_BLKS_OFFSET] = num_blks;
+	memcpy(j->desc + DESC_BLK_NUMS_OFFSET, blk_nums,
+	       num_blks * sizeof(*blk_nums));
+
+	memset(j->commit, 0, j->blk_size);
+	j->commit[COMMIT_MAGIC_OFFSET] = COMMIT_MAGIC;
+	j->commit[COMMIT_SEQ_OFFSET] = j->seq;
+	j->commit[COMMIT_CHECKSUM_OFFSET] = _checksum_txn(j, blks, num_blks);
+
+	struct iovec *iov = malloc((num_blks + 2) * sizeof(*iov));
+	iov[0].iov_base = j->desc;
+	iov[0].iov_len = num_desc_blks * j->blk_size;
+	for (usize i = 0; i < num_blks; ++i) {
+		iov[i + 1].iov_base = blks[i];
+		iov[i + 1].iov_len = j->blk_size;
+	}
+	iov[num_blks + 1].iov_base = j->commit;
+	iov[num_blks + 1].iov_len = j->blk_size;
+
+	u8 err = _write_iov(j, iov, num_blks + 2, j->first_blk * j->blk_size);
+	free(iov);
+	if (err || fsync(j->fd) != 0) {
+		return 1;
+	}
+	j->seq += 1;
+	j->live = true;
+	return 0;
+}
+
+u8 journal_checkpoint(struct journal *j)
+{
+	if (fsync(j->fd) != 0) {
+		return 1;
+	}
+	if (!j->live) {
+		return 0;
+	}
+	j->live = false;
+	// Reaches the disk with the next sync; until then a replay only
+	// rewrites what is already in place
+	return _clear(j);
+}
+
+u8 journal_replay(struct journal *j)
+{
+	if (_read_blk(j, j->first_blk, j->desc)
+	    || j->desc[DESC_MAGIC_OFFSET] != DESC_MAGIC) {
+		return 0;
+	}
+	usize num_blks = j->desc[DESC_NUM_BLKS_OFFSET];
+	if (num_blks == 0 || num_blks > journal_capacity(j)) {
+		return _clear(j);
+	}
+
+	u8 ret = 0;
+	usize num_desc_blks = _num_desc_blks(j, num_blks);
+	for (usize i = 1; i < num_desc_blks; ++i) {
+		ret |= _read_blk(j, j->first_blk + i,
+				 (u8 *) j->desc + i * j->blk_size);
+	}
+	usize imgs_start = j->first_blk + num_desc_blks;
+	u8 *imgs = malloc(num_blks * j->blk_size);
+	u8 **blks = malloc(num_blks * sizeof(*blks));
+	for (usize i = 0; i < num_blks; ++i) {
+		blks[i] = imgs + i * j->blk_size;
+		ret |= _read_blk(j, imgs_start + i, blks[i]);
+	}
+	ret |= _read_blk(j, imgs_start + num_blks, j->commit);
+
+	bool complete = ret == 0
+		&& j->commit[COMMIT_MAGIC_OFFSET] == COMMIT_MAGIC
+		&& j->commit[COMMIT_SEQ_OFFSET] == j->desc[DESC_SEQ_OFFSET]
+		&& j->commit[COMMIT_CHECKSUM_OFFSET]
+			== _checksum_txn(j, blks, num_blks);
+	if (complete) {
+		usize *blk_nums = j->desc + DESC_BLK_NUMS_OFFSET;
+		for (usize i = 0; i < num_blks; ++i) {
+			ret |= _write_blk(j, blk_nums[i], blks[i]);
+		}
+		ret |= fsync(j->fd) != 0;
+	}
+	free(blks);
+	free(imgs);
+
+	if (ret) {
+		return ret;
+	}
+	ret = _clear(j);
+	return ret | (fsync(j->fd) != 0);
+}
@@ -0,0 +1,57 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <tberry/types.h>
+
+/*
+ * A write-ahead log of whole metadata blocks, kept in a fixed region of the
+ * backing file. Only one transaction is ever in the region: a descriptor
+ * listing where each block goes (in as many blocks as that takes), the block
+ * images, then a commit block holding a checksum of the rest.
+ *
+ * A transaction is written sequentially with one sync, after which its blocks
+ * may be written to their real locations. Until that has itself been
+ * synced, replaying the journal redoes them.
+ */
+struct journal;
+
+/*
+ * Uses the @num_blks blocks starting at block @first_blk of the file @fd as the
+ * journal
+ *
+ * Returns NULL if the region is too small to hold a transaction.
+ */
+struct journal *journal_new(int fd, usize blk_size, usize first_blk,
+			    usize num_blks);
+
+void journal_free(struct journal *j);
+
+/*
+ * Returns the most blocks a single transaction can hold
+ */
+usize journal_capacity(struct journal *j);
+
+/*
+ * Durably logs the @num_blks blocks in @blks, destined for the block numbers
+ * in @blk_nums. The caller writes them in place afterwards.
+ *
+ * Everything written to the file before the call is synced first: the data the
+ * blocks may point at, and the previous transaction's in-place writes, since
+ * this one overwrites it.
+ */
+u8 journal_commit(struct journal *j, usize *blk_nums, u8 **blks,
+		  usize num_blks);
+
+/*
+ * Syncs the in-place writes of the last transaction, then marks the journal
+ * empty so it is not replayed
+ */
+u8 journal_checkpoint(struct journal *j);
+
+/*
+ * Writes a complete transaction left in the journal to its real locations.
+ * A transaction whose commit block is missing or doesn't match is dropped.
+ */
+u8 journal_replay(struct journal *j);
+
+#endif /* _JOURNAL_H */
@@ -14,15 +14,18 @@ void pause(char *msg)
 
 int main(int argc, char *argv[])
 {
-	fs_load("fs_file");
+	struct fs_load_opts opts = { .mode = FS_LOAD_CACHED };
+	fs_t *fs = fs_load("fs_file", opts);
+	assert(fs != NULL);
 	pause("LOADED FILE");
 
-	fs_create("/tmp", false, 42);
-	struct fs_file_desc fd_tmp = fs_open("/tmp");
+	fs_create(fs, "/tmp", false, 42);
+	struct fs_file_desc fd_tmp = fs_open(fs, "/tmp");
 	pause("CREATED and OPENED /tmp");
 
-	fs_create("/other", false, 42);
-	fs_open("/other");
+	fs_create(fs, "/other", false, 42);
+	struct fs_file_desc fd_other = fs_open(fs, "/other");
+	fs_close(fs, &fd_other);
 	pause("CREATED /other");
 
 	char *msg = "this message is 24 chars";
@@ -30,29 +33,33 @@ int main(int argc, char *argv[])
 	DEBUG("Writing 2400 characters to /tmp (3 blocks)");
 	for (int i = 0; i < 100; ++i) {
 		// add one to write the null char too
-		fs_write(&fd_tmp, (u8 *) msg, 25);
+		fs_write(fs, &fd_tmp, (u8 *) msg, 25);
 	}
 	pause("WROTE to /tmp");
 
-	fs_seek(&fd_tmp, 0);
+	fs_seek(fs, &fd_tmp, 0);
 	char msg_cpy[25];
-	fs_read(&fd_tmp, (u8 *) msg_cpy, 25);
+	fs_read(fs, &fd_tmp, (u8 *) msg_cpy, 25);
 	assert(strcmp(msg, msg_cpy) == 0);
 	pause("ASSERTED that the message can be read back");
 
-	fs_delete("/tmp");
+	fs_close(fs, &fd_tmp);
+	fs_delete(fs, "/tmp");
 	pause("DELETED /tmp");
 
-	fs_create("/tmp2", false, 42);
-	fd_tmp = fs_open("/tmp2");
+	fs_create(fs, "/tmp2", false, 42);
+	fd_tmp = fs_open(fs, "/tmp2");
 	pause("CREATED and OPENED /tmp2 (should take over /tmp's spot)");
 
 	msg = "srahc 42 si egassem siht";
 	DEBUG("Writing 2400 characters to /tmp2 (3 blocks)");
 	for (int i = 0; i < 100; ++i) {
-		fs_write(&fd_tmp, (u8 *) msg, strlen(msg));
+		fs_write(fs, &fd_tmp, (u8 *) msg, strlen(msg));
 	}
 	pause("WROTE to /tmp2 (should have written over /tmp's old blocks)");
 
+	fs_close(fs, &fd_tmp);
+	fs_unload(fs);
+
 	return 0;
 }
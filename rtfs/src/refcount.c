@@ -0,0 +1,107 @@
+#include <assert.h>
+
+#include <tberry/types.h>
+
+#include "refcount.h"
+
+#define ENTRY_LEN sizeof(u16)
+
+/*
+ * Returns the block holding entry @first, and sets @idx to its index in the
+ * block and @chunk_len to how many of the @len entries from it the block holds
+ */
+usize _entry_blk(struct refcount_tbl *tbl, usize first, usize len, usize *idx,
+		 usize *chunk_len)
+{
+	assert(first + len <= tbl->num_entries);
+
+	usize entries_per_blk = tbl->blk_size / ENTRY_LEN;
+	*idx = first % entries_per_blk;
+	*chunk_len = entries_per_blk - *idx;
+	if (*chunk_len > len) {
+		*chunk_len = len;
+	}
+	return tbl->first_blk + first / entries_per_blk;
+}
+
+usize refcount_run(struct refcount_tbl *tbl, usize first, usize len,
+		   bool *shared)
+{
+	usize run_len = 0;
+	while (run_len < len) {
+		usize idx;
+		usize chunk_len;
+		usize blk_num = _entry_blk(tbl, first + run_len, len - run_len,
+					   &idx, &chunk_len);
+		cache_lock(tbl->cache);
+		u16 *blk = (u16 *) cache_get(tbl->cache, blk_num, true);
+		// Entries a failed cache has no frame for count as shared, so
+		// their blocks are never freed
+		if (run_len == 0) {
+			*shared = blk == NULL || blk[idx] != 0;
+		}
+		usize i = 0;
+		while (i < chunk_len
+		       && (blk == NULL || blk[idx + i] != 0) == *shared) {
+			i += 1;
+		}
+		cache_unlock(tbl->cache);
+
+		run_len += i;
+		if (i < chunk_len) {
+			break;
+		}
+	}
+	return run_len;
+}
+
+u16 refcount_max(struct refcount_tbl *tbl, usize first, usize len)
+{
+	u16 max = 0;
+	while (len > 0) {
+		usize idx;
+		usize chunk_len;
+		usize blk_num = _entry_blk(tbl, first, len, &idx, &chunk_len);
+		cache_lock(tbl->cache);
+		u16 *blk = (u16 *) cache_get(tbl->cache, blk_num, true);
+		if (blk == NULL) {
+			max = REFCOUNT_MAX;
+		}
+		for (usize i = 0; blk != NULL && i < chunk_len; ++i) {
+			if (blk[idx + i] > max) {
+				max = blk[idx + i];
+			}
+		}
+		cache_unlock(tbl->cache);
+
+		first += chunk_len;
+		len -= chunk_len;
+	}
+	return max;
+}
+
+void refcount_adjust_range(struct refcount_tbl *tbl, usize first, usize len,
+			   bool inc)
+{
+	while (len > 0) {
+		usize idx;
+		usize chunk_len;
+		usize blk_num = _entry_blk(tbl, first, len, &idx, &chunk_len);
+		cache_lock(tbl->cache);
+		u16 *blk = (u16 *) cache_get(tbl->cache, blk_num, true);
+		for (usize i = 0; blk != NULL && i < chunk_len; ++i) {
+			if (inc) {
+				blk[idx + i] += 1;
+			} else {
+				blk[idx + i] -= 1;
+			}
+		}
+		if (blk != NULL) {
+			cache_mark_meta(tbl->cache, blk_num);
+		}
+		cache_unlock(tbl->cache);
+
+		first += chunk_len;
+		len -= chunk_len;
+	}
+}
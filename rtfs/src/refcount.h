@@ -0,0 +1,42 @@
+#ifndef _REFCOUNT_H
+#define _REFCOUNT_H
+
+#include <tberry/types.h>
+
+#include "cache.h"
+
+// The most owners beyond the first that a block can have
+#define REFCOUNT_MAX 0xFFFF
+
+/*
+ * One `u16` per data block, @num_entries of them stored in consecutive blocks
+ * starting at block @first_blk, read and written through @cache. Entry i counts
+ * the owners of block i beyond the first, so a zeroed table shares nothing.
+ */
+struct refcount_tbl {
+	struct blk_cache *cache;
+	usize first_blk;
+	usize blk_size;
+	usize num_entries;
+};
+
+/*
+ * Returns how many of the @len entries from @first are, like the first of
+ * them, all nonzero (if @shared is set) or all zero (if it isn't)
+ */
+usize refcount_run(struct refcount_tbl *tbl, usize first, usize len,
+		   bool *shared);
+
+/*
+ * Returns the largest of the @len entries from @first
+ */
+u16 refcount_max(struct refcount_tbl *tbl, usize first, usize len);
+
+/*
+ * Adds 1 to (or, if not @inc, takes 1 from) each of the @len entries from
+ * @first
+ */
+void refcount_adjust_range(struct refcount_tbl *tbl, usize first, usize len,
+			   bool inc);
+
+#endif /* _REFCOUNT_H */
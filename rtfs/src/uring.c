@@ -0,0 +1,271 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <tberry/types.h>
+
+#include "uring.h"
+
+// The user data of the no-op that wakes the thread to stop; every transfer's
+// is its `struct uring_op`
+#define WAKE_USER_DATA 0
+
+struct uring {
+	int ring_fd;
+	// The file every transfer is on
+	int fd;
+
+	// The rings shared with the kernel. The submission ring indexes the
+	// array of entries, in entry order here.
+	u8 *sq_map;
+	usize sq_map_len;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	usize sqes_len;
+	u8 *cq_map;
+	usize cq_map_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	usize num_entries;
+
+	// Guards the submission ring and everything below
+	pthread_mutex_t lock;
+	// Submitted and not yet finished. One entry is always left for the
+	// no-op waking the thread, and the completion ring is twice as big as
+	// the submission ring, so it never overflows.
+	usize num_in_flight;
+	bool stopping;
+	pthread_t thread;
+};
+
+int _io_uring_setup(unsigned num_entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, num_entries, p);
+}
+
+/*
+ * Hands the kernel the next @to_submit entries of the submission ring, first
+ * waiting for @min_complete transfers to finish if it is not 0. Returns how
+ * many entries were taken, or -1 on an error.
+ */
+int _io_uring_enter(struct uring *r, unsigned to_submit, unsigned min_complete)
+{
+	unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+	do {
+		ret = (int) syscall(__NR_io_uring_enter, r->ring_fd, to_submit,
+				    min_complete, flags, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+/*
+ * Unmaps the rings and closes the ring's fd, as far as they were set up
+ */
+void _unmap(struct uring *r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+		munmap(r->sqes, r->sqes_len);
+	}
+	if (r->cq_map != NULL && r->cq_map != MAP_FAILED) {
+		munmap(r->cq_map, r->cq_map_len);
+	}
+	if (r->sq_map != NULL && r->sq_map != MAP_FAILED) {
+		munmap(r->sq_map, r->sq_map_len);
+	}
+	close(r->ring_fd);
+}
+
+/*
+ * Maps the rings of the ring set up as @p, returning 1 if any can't be
+ */
+u8 _map(struct uring *r, struct io_uring_params *p)
+{
+	r->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->ring_fd,
+			 IORING_OFF_SQ_RING);
+	r->cq_map_len = p->cq_off.cqes
+		+ p->cq_entries * sizeof(struct io_uring_cqe);
+	r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->ring_fd,
+			 IORING_OFF_CQ_RING);
+	r->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+	if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED
+	    || r->sqes == MAP_FAILED) {
+		return 1;
+	}
+
+	r->sq_tail = (unsigned *) (r->sq_map + p->sq_off.tail);
+	r->sq_mask = (unsigned *) (r->sq_map + p->sq_off.ring_mask);
+	r->sq_array = (unsigned *) (r->sq_map + p->sq_off.array);
+	r->cq_head = (unsigned *) (r->cq_map + p->cq_off.head);
+	r->cq_tail = (unsigned *) (r->cq_map + p->cq_off.tail);
+	r->cq_mask = (unsigned *) (r->cq_map + p->cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (r->cq_map + p->cq_off.cqes);
+	r->num_entries = p->sq_entries;
+	return 0;
+}
+
+/*
+ * Fills in the submission entry at ring position @pos for @op, or for the no-op
+ * waking the thread if @op is NULL. The lock is held.
+ */
+void _prep(struct uring *r, unsigned pos, struct uring_op *op)
+{
+	unsigned idx = pos & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	if (op == NULL) {
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = WAKE_USER_DATA;
+		return;
+	}
+	op->iov.iov_base = op->buf;
+	op->iov.iov_len = op->len;
+	sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = r->fd;
+	sqe->addr = (uint64_t) (uintptr_t) &op->iov;
+	sqe->len = 1;
+	sqe->off = op->offset;
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+}
+
+/*
+ * Queues the @num entries after the tail and hands them to the kernel,
+ * returning how many it took; those it didn't are taken back off the ring. The
+ * lock is held.
+ */
+usize _push(struct uring *r, usize num)
+{
+	unsigned tail = *r->sq_tail;
+	__atomic_store_n(r->sq_tail, tail + num, __ATOMIC_RELEASE);
+	int taken = _io_uring_enter(r, num, 0);
+	if (taken < 0) {
+		taken = 0;
+	}
+	__atomic_store_n(r->sq_tail, tail + taken, __ATOMIC_RELEASE);
+	return taken;
+}
+
+/*
+ * Calls back every transfer that finished, until told to stop and nothing is
+ * left in flight
+ */
+void *_complete(void *arg)
+{
+	struct uring *r = arg;
+	bool woken = false;
+	while (true) {
+		pthread_mutex_lock(&r->lock);
+		bool done = woken && r->num_in_flight == 0;
+		pthread_mutex_unlock(&r->lock);
+		if (done) {
+			break;
+		}
+		_io_uring_enter(r, 0, 1);
+
+		unsigned head = *r->cq_head;
+		unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		usize num_done = 0;
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+			struct uring_op *op =
+				(struct uring_op *) (uintptr_t) cqe->user_data;
+			if (op == NULL) {
+				woken = true;
+				continue;
+			}
+			op->done(op, cqe->res);
+			num_done += 1;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&r->lock);
+		r->num_in_flight -= num_done;
+		pthread_mutex_unlock(&r->lock);
+	}
+	return NULL;
+}
+
+struct uring *uring_new(int fd, usize num_entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int ring_fd = _io_uring_setup(num_entries, &p);
+	if (ring_fd < 0) {
+		return NULL;
+	}
+	struct uring *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		close(ring_fd);
+		return NULL;
+	}
+	r->ring_fd = ring_fd;
+	r->fd = fd;
+	if (_map(r, &p)) {
+		_unmap(r);
+		free(r);
+		return NULL;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	if (pthread_create(&r->thread, NULL, _complete, r) != 0) {
+		pthread_mutex_destroy(&r->lock);
+		_unmap(r);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void uring_free(struct uring *r)
+{
+	// The thread drains what is in flight after the no-op wakes it; the
+	// entry it takes is always free, and the kernel only turns it away
+	// while it is short of memory
+	pthread_mutex_lock(&r->lock);
+	r->stopping = true;
+	do {
+		_prep(r, *r->sq_tail, NULL);
+	} while (_push(r, 1) != 1);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	pthread_mutex_destroy(&r->lock);
+	_unmap(r);
+	free(r);
+}
+
+bool uring_submit(struct uring *r, struct uring_op *ops, usize num_ops)
+{
+	pthread_mutex_lock(&r->lock);
+	if (r->stopping || r->num_in_flight + num_ops >= r->num_entries) {
+		pthread_mutex_unlock(&r->lock);
+		return false;
+	}
+	for (usize i = 0; i < num_ops; ++i) {
+		_prep(r, *r->sq_tail + i, &ops[i]);
+	}
+	usize taken = _push(r, num_ops);
+	r->num_in_flight += taken;
+	pthread_mutex_unlock(&r->lock);
+	if (taken == 0) {
+		return false;
+	}
+	// Only part of them got in, so the rest fail as a transfer would
+	for (usize i = taken; i < num_ops; ++i) {
+		ops[i].done(&ops[i], -EIO);
+	}
+	return true;
+}
@@ -0,0 +1,58 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <tberry/types.h>
+
+/*
+ * Used by `fs_load` for the submission queue of an image's ring
+ */
+#define URING_DEFAULT_ENTRIES 256
+
+/*
+ * An io_uring over one file, set up with the raw system calls, and a thread
+ * waiting on its completions
+ */
+struct uring;
+
+/*
+ * A read or write of @len bytes at byte @offset of the ring's file, to or from
+ * @buf, as `pread` / `pwrite` would do it
+ */
+struct uring_op {
+	bool write;
+	u8 *buf;
+	usize len;
+	usize offset;
+	// Called on the ring's thread once the transfer finished, with what
+	// `pread` / `pwrite` would have returned, or minus the error number
+	void (*done)(struct uring_op *op, ssize_t res);
+	void *arg;
+
+	// The buffer as the kernel is given it, filled in by `uring_submit`
+	struct iovec iov;
+};
+
+/*
+ * Sets up a ring of @num_entries (rounded up to a power of two) over @fd and
+ * starts its thread, returning NULL if the kernel has no io_uring or won't give
+ * one out
+ */
+struct uring *uring_new(int fd, usize num_entries);
+
+/*
+ * Waits for every submitted transfer to finish, then stops the thread and
+ * releases the ring. @fd is left open.
+ */
+void uring_free(struct uring *r);
+
+/*
+ * Starts all @num_ops transfers in @ops, or none of them if the ring doesn't
+ * have room for them all, in which case false is returned. @ops must stay valid
+ * until each one's `done` has been called.
+ */
+bool uring_submit(struct uring *r, struct uring_op *ops, usize num_ops);
+
+#endif /* _URING_H */
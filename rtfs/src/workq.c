@@ -0,0 +1,176 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <tberry/types.h>
+
+#include "workq.h"
+
+/*
+ * A FIFO of jobs linked through `next`
+ */
+struct _job_list {
+	struct workq_job *head;
+	struct workq_job *tail;
+	usize len;
+};
+
+struct workq {
+	pthread_mutex_t lock;
+	// Signalled when a job is queued, or when the threads should stop
+	pthread_cond_t queued;
+	// Signalled when a job finishes
+	pthread_cond_t finished;
+
+	struct _job_list pending;
+	struct _job_list done;
+	// Submitted and not yet finished
+	usize num_running;
+	bool stopping;
+
+	usize num_threads;
+	pthread_t *threads;
+};
+
+void _job_list_push(struct _job_list *list, struct workq_job *job)
+{
+	job->next = NULL;
+	if (list->tail == NULL) {
+		list->head = job;
+	} else {
+		list->tail->next = job;
+	}
+	list->tail = job;
+	list->len += 1;
+}
+
+struct workq_job *_job_list_pop(struct _job_list *list)
+{
+	struct workq_job *job = list->head;
+	list->head = job->next;
+	if (list->head == NULL) {
+		list->tail = NULL;
+	}
+	list->len -= 1;
+	return job;
+}
+
+void *_worker(void *arg)
+{
+	struct workq *wq = arg;
+	pthread_mutex_lock(&wq->lock);
+	while (true) {
+		while (wq->pending.len == 0 && !wq->stopping) {
+			pthread_cond_wait(&wq->queued, &wq->lock);
+		}
+		if (wq->pending.len == 0) {
+			break;
+		}
+		struct workq_job *job = _job_list_pop(&wq->pending);
+		pthread_mutex_unlock(&wq->lock);
+
+		job->ret = job->run(job);
+
+		pthread_mutex_lock(&wq->lock);
+		_job_list_push(&wq->done, job);
+		wq->num_running -= 1;
+		pthread_cond_broadcast(&wq->finished);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+struct workq *workq_new(usize num_threads)
+{
+	if (num_threads == 0) {
+		num_threads = WORKQ_DEFAULT_THREADS;
+	}
+	struct workq *wq = calloc(1, sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->queued, NULL);
+	pthread_cond_init(&wq->finished, NULL);
+	wq->threads = malloc(num_threads * sizeof(*wq->threads));
+	if (wq->threads == NULL) {
+		workq_free(wq);
+		return NULL;
+	}
+	for (; wq->num_threads < num_threads; ++wq->num_threads) {
+		if (pthread_create(&wq->threads[wq->num_threads], NULL,
+				   _worker, wq) != 0) {
+			// Stops the ones already running
+			workq_free(wq);
+			return NULL;
+		}
+	}
+	return wq;
+}
+
+void workq_free(struct workq *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	// The threads drain what is pending before they notice
+	wq->stopping = true;
+	pthread_cond_broadcast(&wq->queued);
+	pthread_mutex_unlock(&wq->lock);
+	for (usize i = 0; i < wq->num_threads; ++i) {
+		pthread_join(wq->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&wq->finished);
+	pthread_cond_destroy(&wq->queued);
+	pthread_mutex_destroy(&wq->lock);
+	free(wq->threads);
+	free(wq);
+}
+
+void workq_submit(struct workq *wq, struct workq_job *job)
+{
+	workq_begin(wq);
+	workq_queue(wq, job);
+}
+
+void workq_begin(struct workq *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	wq->num_running += 1;
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void workq_queue(struct workq *wq, struct workq_job *job)
+{
+	pthread_mutex_lock(&wq->lock);
+	_job_list_push(&wq->pending, job);
+	pthread_cond_signal(&wq->queued);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void workq_finish(struct workq *wq, struct workq_job *job)
+{
+	pthread_mutex_lock(&wq->lock);
+	_job_list_push(&wq->done, job);
+	wq->num_running -= 1;
+	pthread_cond_broadcast(&wq->finished);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+usize workq_reap(struct workq *wq, struct workq_job **done, usize max,
+		 usize min_done)
+{
+	if (min_done > max) {
+		min_done = max;
+	}
+	pthread_mutex_lock(&wq->lock);
+	// Stop waiting early if nothing else is coming
+	while (wq->done.len < min_done && wq->num_running > 0) {
+		pthread_cond_wait(&wq->finished, &wq->lock);
+	}
+	usize num_done = 0;
+	while (num_done < max && wq->done.len > 0) {
+		done[num_done] = _job_list_pop(&wq->done);
+		num_done += 1;
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return num_done;
+}
@@ -0,0 +1,72 @@
+#ifndef _WORKQ_H
+#define _WORKQ_H
+
+#include <tberry/types.h>
+
+/*
+ * Used when `fs_load` is asked for 0 threads
+ */
+#define WORKQ_DEFAULT_THREADS 4
+
+/*
+ * A pool of threads running submitted jobs, and a queue of the jobs they have
+ * finished for the submitter to reap
+ */
+struct workq;
+
+/*
+ * Embedded at the start of whatever the job needs, so `run` can get back to it
+ */
+struct workq_job {
+	// Called on one of the pool's threads; its result is kept in `ret`
+	u8 (*run)(struct workq_job *job);
+	u8 ret;
+	// Links the job into whichever queue holds it
+	struct workq_job *next;
+};
+
+/*
+ * Starts @num_threads threads, or `WORKQ_DEFAULT_THREADS` if 0, returning NULL
+ * if they couldn't all be started
+ */
+struct workq *workq_new(usize num_threads);
+
+/*
+ * Waits for every submitted job to finish, then stops the threads. Finished
+ * jobs that weren't reaped are left to their owner.
+ */
+void workq_free(struct workq *wq);
+
+/*
+ * Queues @job to be run, returning at once. @job must stay valid until it is
+ * reaped.
+ */
+void workq_submit(struct workq *wq, struct workq_job *job);
+
+/*
+ * Counts a job that is about to be run somewhere other than the pool as
+ * running, so `workq_reap` waits for it. It is then either queued with
+ * `workq_queue` or finished with `workq_finish`.
+ */
+void workq_begin(struct workq *wq);
+
+/*
+ * Queues @job, counted by `workq_begin` already, to be run
+ */
+void workq_queue(struct workq *wq, struct workq_job *job);
+
+/*
+ * Marks @job, counted by `workq_begin` and run elsewhere, as finished with the
+ * result already in its `ret`, for it to be reaped
+ */
+void workq_finish(struct workq *wq, struct workq_job *job);
+
+/*
+ * Moves up to @max finished jobs into @done, in the order they finished, first
+ * waiting until at least @min_done (capped at @max) have finished. Returns how
+ * many were moved.
+ */
+usize workq_reap(struct workq *wq, struct workq_job **done, usize max,
+		 usize min_done);
+
+#endif /* _WORKQ_H */
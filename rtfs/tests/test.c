@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test.h"
+
+// Set by the Makefile to the one it builds
+#ifndef MKFS
+#define MKFS "mkfs.ext4holdtheextra"
+#endif
+
+void test_fail(char *file, int line, char *cond)
+{
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+	exit(1);
+}
+
+void test_format(char *args)
+{
+	char cmd[512];
+	snprintf(cmd, sizeof(cmd), "rm -f %s && %s %s %s >/dev/null 2>&1",
+		 TEST_IMAGE, MKFS, args, TEST_IMAGE);
+	CHECK(system(cmd) == 0);
+}
+
+fs_t *test_load(enum fs_load_mode mode)
+{
+	struct fs_load_opts opts = { .mode = mode };
+	fs_t *fs = fs_load(TEST_IMAGE, opts);
+	CHECK(fs != NULL);
+	return fs;
+}
+
+void test_fill(u8 *buf, usize offset, usize len, usize seed)
+{
+	for (usize i = 0; i < len; ++i) {
+		usize pos = offset + i;
+		buf[i] = (u8) (pos * 31 + pos / 251 + seed * 7 + 1);
+	}
+}
+
+void test_write_file(fs_t *fs, char *path, usize len, usize seed)
+{
+	u8 *buf = malloc(len + 1);
+	test_fill(buf, 0, len, seed);
+	CHECK(fs_create(fs, path, false, 1) == 0);
+	struct fs_file_desc fd = fs_open(fs, path);
+	CHECK(fs_write(fs, &fd, buf, len) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	free(buf);
+}
+
+void test_check_file(fs_t *fs, char *path, usize len, usize seed)
+{
+	u8 *buf = malloc(len + 1);
+	u8 *want = malloc(len + 1);
+	test_fill(want, 0, len, seed);
+	struct fs_file_desc fd = fs_open(fs, path);
+	CHECK(fs_read(fs, &fd, buf, len) == 0);
+	CHECK(memcmp(buf, want, len) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	free(want);
+	free(buf);
+}
+
+void test_crash_after(u8 (*body)(void))
+{
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		_exit(body());
+	}
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
@@ -0,0 +1,62 @@
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <stdbool.h>
+
+#include <tberry/types.h>
+
+#include "fs.h"
+
+// Every test formats and loads this image, in the directory it runs in
+#define TEST_IMAGE "test.img"
+
+/*
+ * Fails the test, saying where, unless @cond holds
+ */
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			test_fail(__FILE__, __LINE__, #cond);		\
+		}							\
+	} while (0)
+
+/*
+ * Prints which check failed and exits with 1
+ */
+void test_fail(char *file, int line, char *cond);
+
+/*
+ * Makes a fresh `TEST_IMAGE` with `mkfs.ext4holdtheextra`, passing it @args
+ * (e.g. "-b 1024 -s 4194304 -e")
+ */
+void test_format(char *args);
+
+/*
+ * Loads `TEST_IMAGE` in @mode, with the other options at their defaults
+ */
+fs_t *test_load(enum fs_load_mode mode);
+
+/*
+ * Fills @buf with @len bytes that depend on @seed and on where each lands in
+ * a file written from @offset, so misplaced bytes are told apart
+ */
+void test_fill(u8 *buf, usize offset, usize len, usize seed);
+
+/*
+ * Creates @path and writes @len bytes of `test_fill` with @seed to it
+ */
+void test_write_file(fs_t *fs, char *path, usize len, usize seed);
+
+/*
+ * Checks that @path starts with the @len bytes `test_write_file` wrote with
+ * @seed
+ */
+void test_check_file(fs_t *fs, char *path, usize len, usize seed);
+
+/*
+ * Runs @body in a child process that exits without unloading, as if the
+ * machine crashed right after, and checks that it returned 0
+ */
+void test_crash_after(u8 (*body)(void));
+
+#endif /* _TEST_H */
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define REC_LEN 512
+#define NUM_RECS 256
+#define LEN (REC_LEN * NUM_RECS)
+#define NUM_READS 300
+#define READ_LEN 600
+
+/*
+ * Reaps until @num_reqs requests have finished, checking each succeeded and
+ * counting it in @seen by its user data, an index below @num_reqs
+ */
+void _reap_all(fs_t *fs, usize num_reqs, usize *seen)
+{
+	struct fs_completion done[64];
+	usize num_done = 0;
+	while (num_done < num_reqs) {
+		usize n = fs_reap(fs, done, 64, 1);
+		CHECK(n > 0);
+		for (usize i = 0; i < n; ++i) {
+			CHECK(done[i].ret == 0);
+			seen[(usize) done[i].user_data] += 1;
+		}
+		num_done += n;
+	}
+	for (usize i = 0; i < num_reqs; ++i) {
+		CHECK(seen[i] == 1);
+	}
+	CHECK(fs_reap(fs, done, 64, 10) == 0);
+}
+
+/*
+ * Submits reads of the whole of "/a" and of a stretch across its hole and past
+ * its end, and a write that grows it, on a freshly loaded image where only
+ * some of its blocks are cached
+ */
+void _mixed(struct fs_load_opts opts, u8 *want)
+{
+	fs_t *fs = fs_load(TEST_IMAGE, opts);
+	CHECK(fs != NULL);
+	u8 *buf = malloc(2 * LEN);
+	struct fs_file_desc fd = fs_open(fs, "/a");
+	CHECK(fs_seek(fs, &fd, LEN / 3) == 0);
+	CHECK(fs_read(fs, &fd, buf, REC_LEN) == 0);
+
+	// Beyond the end of "/a" lies a hole, then a record
+	CHECK(fs_seek(fs, &fd, 3 * LEN / 2) == 0);
+	CHECK(fs_write(fs, &fd, want, REC_LEN) == 0);
+	struct fs_io_vec vecs[] = {
+		{ .offset = 0, .buf = buf, .len = LEN },
+		{ .offset = LEN - 100, .buf = buf + LEN, .len = LEN / 2 + 200 },
+	};
+	CHECK(fs_submit_read(fs, &fd, vecs[0], (void *) 0) == 0);
+	CHECK(fs_submit_read(fs, &fd, vecs[1], (void *) 1) == 0);
+	usize seen[3] = { 0 };
+	_reap_all(fs, 2, seen);
+	CHECK(memcmp(buf, want, LEN) == 0);
+	CHECK(memcmp(buf + LEN, want + LEN - 100, 100) == 0);
+	for (usize i = 100; i < LEN / 2 + 100; ++i) {
+		CHECK(buf[LEN + i] == 0);
+	}
+	CHECK(memcmp(buf + LEN + LEN / 2 + 100, want, 100) == 0);
+
+	// Filling the hole and writing past the end both need new blocks
+	struct fs_io_vec grow[] = {
+		{ .offset = LEN, .buf = want, .len = LEN / 2 },
+		{ .offset = 2 * LEN - REC_LEN, .buf = want, .len = REC_LEN },
+	};
+	CHECK(fs_submit_write(fs, &fd, grow[0], (void *) 0) == 0);
+	CHECK(fs_submit_write(fs, &fd, grow[1], (void *) 1) == 0);
+	memset(seen, 0, sizeof(seen));
+	_reap_all(fs, 2, seen);
+	CHECK(fs_seek(fs, &fd, LEN) == 0);
+	CHECK(fs_read(fs, &fd, buf, LEN) == 0);
+	CHECK(memcmp(buf, want, LEN / 2) == 0);
+	CHECK(memcmp(buf + LEN / 2, want, REC_LEN) == 0);
+	CHECK(memcmp(buf + LEN - REC_LEN, want, REC_LEN) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	CHECK(fs_unload(fs) == 0);
+	free(buf);
+}
+
+int main(void)
+{
+	char *formats[] = {
+		"-b 1024 -s 4194304",
+		"-b 1024 -s 4194304 -e",
+		"-b 1024 -s 4194304 -e",
+	};
+	u8 *want = malloc(LEN);
+	u8 *bufs = malloc(NUM_READS * READ_LEN);
+	usize offsets[NUM_READS];
+	usize seen[NUM_READS];
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		// The second extents image is served by the threads alone
+		struct fs_load_opts opts = {
+			.aio_threads = 3,
+			.no_io_uring = i == 2,
+		};
+		fs_t *fs = fs_load(TEST_IMAGE, opts);
+		CHECK(fs != NULL);
+		test_write_file(fs, "/a", LEN, 1);
+		test_fill(want, 0, LEN, 2);
+		// Writes of every record, submitted out of order, through a
+		// descriptor closed straight away
+		struct fs_file_desc fd = fs_open(fs, "/a");
+		for (usize j = 0; j < NUM_RECS; ++j) {
+			usize k = (j * 97) % NUM_RECS;
+			struct fs_io_vec vec = {
+				.offset = k * REC_LEN,
+				.buf = want + k * REC_LEN,
+				.len = REC_LEN,
+			};
+			CHECK(fs_submit_write(fs, &fd, vec, (void *) j) == 0);
+		}
+		CHECK(fs_close(fs, &fd) == 0);
+		memset(seen, 0, sizeof(seen));
+		_reap_all(fs, NUM_RECS, seen);
+		test_check_file(fs, "/a", LEN, 2);
+
+		// Reads landing in buffers of their own
+		fd = fs_open(fs, "/a");
+		srand(i);
+		for (usize j = 0; j < NUM_READS; ++j) {
+			offsets[j] = (usize) rand() % (LEN - READ_LEN);
+			struct fs_io_vec vec = {
+				.offset = offsets[j],
+				.buf = bufs + j * READ_LEN,
+				.len = READ_LEN,
+			};
+			CHECK(fs_submit_read(fs, &fd, vec, (void *) j) == 0);
+		}
+		memset(seen, 0, sizeof(seen));
+		_reap_all(fs, NUM_READS, seen);
+		for (usize j = 0; j < NUM_READS; ++j) {
+			CHECK(memcmp(bufs + j * READ_LEN, want + offsets[j],
+				     READ_LEN) == 0);
+		}
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		test_check_file(fs, "/a", LEN, 2);
+		CHECK(fs_unload(fs) == 0);
+		_mixed(opts, want);
+	}
+	free(bufs);
+	free(want);
+	return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NUM_NAMES 12000
+#define NUM_TWINS 3
+
+/*
+ * Returns the length of the data file @i holds in its entry, if any
+ */
+usize _small_len(usize i)
+{
+	return i % 7 == 0 ? 20 + i % 80 : 0;
+}
+
+/*
+ * Checks whether @path names a file, without leaving one behind
+ */
+bool _exists(fs_t *fs, char *path)
+{
+	if (fs_create(fs, path, false, 1) == 0) {
+		CHECK(fs_delete(fs, path) == 0);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Sets @path to "/c/" followed by a name as long as they come, ending in
+ * @suffix
+ */
+void _twin_path(char *path, char *suffix)
+{
+	usize suffix_len = strlen(suffix);
+	strcpy(path, "/c/");
+	memset(path + 3, 'p', MAX_FILENAME_LEN - suffix_len);
+	strcpy(path + 3 + MAX_FILENAME_LEN - suffix_len, suffix);
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 512 -s 16777216", "-b 1024 -s 16777216 -e" };
+	// Pairs of names 32 bit FNV-1a hashes the same
+	char *twins[NUM_TWINS][2] = {
+		{ "329599", "532382" },
+		{ "329598", "532383" },
+		{ "329593", "532388" },
+	};
+	char path[MAX_FILENAME_LEN + 8];
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		struct fs_load_opts opts = { .dcache_len = 4 };
+		fs_t *fs = fs_load(TEST_IMAGE, opts);
+		CHECK(fs != NULL);
+		CHECK(fs_create(fs, "/d", true, 1) == 0);
+
+		// A file made first, held open while its entry is moved to
+		// other blocks as the directory grows
+		test_write_file(fs, "/d/early", 10, 1);
+		struct fs_file_desc early = fs_open(fs, "/d/early");
+		// Enough names for the index to need more than one level
+		for (usize j = 0; j < NUM_NAMES; ++j) {
+			sprintf(path, "/d/f_%lu", j);
+			test_write_file(fs, path, _small_len(j), j);
+		}
+		CHECK(fs_create(fs, "/d/f_5", false, 1) == 1);
+		u8 more[10];
+		test_fill(more, 10, 10, 1);
+		CHECK(fs_seek(fs, &early, 10) == 0);
+		CHECK(fs_write(fs, &early, more, 10) == 0);
+		CHECK(fs_close(fs, &early) == 0);
+		test_check_file(fs, "/d/early", 20, 1);
+
+		for (usize j = 0; j < NUM_NAMES; j += 2) {
+			sprintf(path, "/d/f_%lu", j);
+			CHECK(fs_delete(fs, path) == 0);
+		}
+
+		CHECK(fs_create(fs, "/c", true, 1) == 0);
+		for (usize j = 0; j < NUM_TWINS; ++j) {
+			_twin_path(path, twins[j][0]);
+			test_write_file(fs, path, 6, 2 * j);
+			_twin_path(path, twins[j][1]);
+			test_write_file(fs, path, 6, 2 * j + 1);
+		}
+		for (usize j = 0; j < 200; ++j) {
+			sprintf(path, "/c/g%lu", j);
+			CHECK(fs_create(fs, path, false, 1) == 0);
+		}
+		CHECK(fs_unload(fs) == 0);
+
+		fs = fs_load(TEST_IMAGE, opts);
+		CHECK(fs != NULL);
+		for (usize j = 0; j < NUM_NAMES; ++j) {
+			sprintf(path, "/d/f_%lu", j);
+			CHECK(_exists(fs, path) == (j % 2 == 1));
+			if (j % 2 == 1) {
+				test_check_file(fs, path, _small_len(j), j);
+			}
+		}
+		test_check_file(fs, "/d/early", 20, 1);
+
+		// Each of a colliding pair is found and removed on its own
+		for (usize j = 0; j < NUM_TWINS; ++j) {
+			_twin_path(path, twins[j][0]);
+			test_check_file(fs, path, 6, 2 * j);
+			_twin_path(path, twins[j][1]);
+			test_check_file(fs, path, 6, 2 * j + 1);
+		}
+		_twin_path(path, twins[0][0]);
+		CHECK(fs_delete(fs, path) == 0);
+		CHECK(!_exists(fs, path));
+		_twin_path(path, twins[0][1]);
+		test_check_file(fs, path, 6, 1);
+
+		// Freed room is taken again, and an emptied directory goes
+		for (usize j = 0; j < NUM_NAMES; j += 2) {
+			sprintf(path, "/d/f_%lu", j);
+			CHECK(fs_create(fs, path, false, 1) == 0);
+		}
+		for (usize j = 0; j < NUM_NAMES; ++j) {
+			sprintf(path, "/d/f_%lu", j);
+			CHECK(fs_delete(fs, path) == 0);
+		}
+		CHECK(fs_delete(fs, "/d/early") == 0);
+		CHECK(fs_delete(fs, "/d") == 0);
+		CHECK(fs_create(fs, "/d", true, 1) == 0);
+		CHECK(fs_create(fs, "/d/f_0", false, 1) == 0);
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+
+#include "test.h"
+
+#define LEN 100000
+
+/*
+ * Writes files of `LEN` bytes until the disk is full, checks them, then
+ * deletes them all, returning how many fit
+ */
+usize _fill_disk(fs_t *fs)
+{
+	char path[32];
+	usize num_files = 0;
+	u8 buf[LEN];
+	for (;; ++num_files) {
+		sprintf(path, "/f%lu", num_files);
+		if (fs_create(fs, path, false, 1)) {
+			break;
+		}
+		test_fill(buf, 0, LEN, num_files);
+		struct fs_file_desc fd = fs_open(fs, path);
+		u8 ret = fs_write(fs, &fd, buf, LEN);
+		CHECK(fs_close(fs, &fd) == 0);
+		if (ret) {
+			// The blocks it did get are given back with it
+			CHECK(fs_delete(fs, path) == 0);
+			break;
+		}
+	}
+	for (usize i = 0; i < num_files; ++i) {
+		sprintf(path, "/f%lu", i);
+		test_check_file(fs, path, LEN, i);
+		CHECK(fs_delete(fs, path) == 0);
+	}
+	return num_files;
+}
+
+/*
+ * Makes empty files until there are no inodes left, then deletes them all,
+ * returning how many there were
+ */
+usize _use_inodes(fs_t *fs)
+{
+	char path[32];
+	usize num_files = 0;
+	for (;; ++num_files) {
+		sprintf(path, "/i%lu", num_files);
+		if (fs_create(fs, path, num_files % 2 == 0, 1)) {
+			break;
+		}
+	}
+	for (usize i = 0; i < num_files; ++i) {
+		sprintf(path, "/i%lu", i);
+		CHECK(fs_delete(fs, path) == 0);
+	}
+	return num_files;
+}
+
+int main(void)
+{
+	char *formats[] = {
+		"-b 1024 -s 4194304 -i 16384",
+		"-b 1024 -s 4194304 -i 16384 -e",
+	};
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+		// Everything freed can be had again, so each round fits as much
+		usize num_files = _fill_disk(fs);
+		usize num_inodes = _use_inodes(fs);
+		CHECK(num_files > 10);
+		CHECK(num_inodes > 100);
+		for (usize round = 0; round < 2; ++round) {
+			CHECK(_fill_disk(fs) == num_files);
+			CHECK(_use_inodes(fs) == num_inodes);
+		}
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		CHECK(_fill_disk(fs) == num_files);
+		CHECK(_use_inodes(fs) == num_inodes);
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NUM_NAMES 2000
+// Names after the good ones that can't be made
+#define NUM_BAD 4
+#define NUM_DIRS 40
+
+/*
+ * Checks whether the entry @name of "/bulk" exists, without leaving one
+ * behind
+ */
+bool _in_bulk(fs_t *fs, char *name)
+{
+	char path[MAX_FILENAME_LEN + 8];
+	sprintf(path, "/bulk/%s", name);
+	if (fs_create(fs, path, false, 1) == 0) {
+		CHECK(fs_delete(fs, path) == 0);
+		return false;
+	}
+	return true;
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 8388608", "-b 1024 -s 8388608 -e" };
+	char *names[NUM_NAMES + NUM_BAD];
+	for (usize i = 0; i < NUM_NAMES; ++i) {
+		names[i] = malloc(16);
+		sprintf(names[i], "e_%lu", i);
+	}
+	char too_long[MAX_FILENAME_LEN + 2];
+	memset(too_long, 'x', MAX_FILENAME_LEN + 1);
+	too_long[MAX_FILENAME_LEN + 1] = '\0';
+	names[NUM_NAMES] = "e_3";
+	names[NUM_NAMES + 1] = "";
+	names[NUM_NAMES + 2] = "a/b";
+	names[NUM_NAMES + 3] = too_long;
+	char *dir_names[NUM_DIRS];
+	for (usize i = 0; i < NUM_DIRS; ++i) {
+		dir_names[i] = malloc(16);
+		sprintf(dir_names[i], "d%lu", i);
+	}
+	u8 rets[NUM_NAMES + NUM_BAD];
+	char *del_names[NUM_NAMES / 2 + 2];
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+		CHECK(fs_create(fs, "/bulk", true, 1) == 0);
+		CHECK(fs_create(fs, "/bulk/e_7", false, 1) == 0);
+
+		// Each name fails on its own: one already there, a repeat
+		// within the call, and names that can't be
+		CHECK(fs_create_many(fs, "/bulk", names, NUM_NAMES + NUM_BAD,
+				     false, 1, rets) == 1);
+		for (usize j = 0; j < NUM_NAMES + NUM_BAD; ++j) {
+			CHECK(rets[j] == (j == 7 || j >= NUM_NAMES));
+		}
+		CHECK(fs_create_many(fs, "/bulk", names, NUM_NAMES, false, 1,
+				     NULL) == 1);
+		CHECK(fs_create_many(fs, "/bulk", names, 0, false, 1, NULL)
+		      == 0);
+
+		// A missing directory, or a file, holds none of them
+		CHECK(fs_create_many(fs, "/none", names, 3, false, 1, rets)
+		      == 1);
+		CHECK(rets[0] == 1 && rets[1] == 1 && rets[2] == 1);
+		CHECK(fs_create_many(fs, "/bulk/e_1", names, 3, false, 1, rets)
+		      == 1);
+		CHECK(rets[0] == 1 && rets[1] == 1 && rets[2] == 1);
+
+		// Directories made together are each usable
+		CHECK(fs_create_many(fs, "/bulk/", dir_names, NUM_DIRS, true, 1,
+				     NULL) == 0);
+		CHECK(fs_create_many(fs, "/", dir_names, 5, true, 1, NULL)
+		      == 0);
+		test_write_file(fs, "/bulk/d3/inner", 100, 1);
+		test_write_file(fs, "/d4/inner", 100, 2);
+		for (usize j = 0; j < NUM_NAMES; j += 9) {
+			char path[32];
+			sprintf(path, "/bulk/e_%lu", j);
+			CHECK(fs_delete(fs, path) == 0);
+			test_write_file(fs, path, j % 300, j);
+		}
+
+		// Every other name goes, along with one that isn't there and
+		// one gone already
+		usize num_del = 0;
+		for (usize j = 0; j < NUM_NAMES; j += 2) {
+			del_names[num_del++] = names[j];
+		}
+		del_names[num_del++] = "missing";
+		del_names[num_del++] = "e_0";
+		CHECK(fs_delete_many(fs, "/bulk", del_names, num_del, rets)
+		      == 1);
+		for (usize j = 0; j < num_del - 2; ++j) {
+			CHECK(rets[j] == 0);
+		}
+		CHECK(rets[num_del - 2] == 1 && rets[num_del - 1] == 1);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_MMAP);
+		for (usize j = 0; j < NUM_NAMES; ++j) {
+			CHECK(_in_bulk(fs, names[j]) == (j % 2 == 1));
+		}
+		for (usize j = 9; j < NUM_NAMES; j += 18) {
+			char path[32];
+			sprintf(path, "/bulk/e_%lu", j);
+			test_check_file(fs, path, j % 300, j);
+		}
+		test_check_file(fs, "/bulk/d3/inner", 100, 1);
+		test_check_file(fs, "/d4/inner", 100, 2);
+		// Directories go together too, leaving the others
+		CHECK(fs_delete_many(fs, "/bulk", dir_names + 5, NUM_DIRS - 5,
+				     NULL) == 0);
+		CHECK(!_in_bulk(fs, "d5"));
+		CHECK(_in_bulk(fs, "d4"));
+		test_check_file(fs, "/bulk/d3/inner", 100, 1);
+		CHECK(fs_unload(fs) == 0);
+	}
+	for (usize i = 0; i < NUM_DIRS; ++i) {
+		free(dir_names[i]);
+	}
+	for (usize i = 0; i < NUM_NAMES; ++i) {
+		free(names[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,241 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "journal.h"
+#include "test.h"
+
+#define BLK_SIZE 512
+#define NUM_BLKS 1024
+#define NUM_FRAMES 4
+#define JOURNAL_BLK 1
+#define NUM_JOURNAL_BLKS 64
+// Blocks written through the cache, past the journal
+#define FIRST_BLK 100
+#define NUM_DIRTY 300
+#define NUM_FILES 12
+#define FILE_LEN 30000
+#define STEP 700
+
+/*
+ * Returns the byte block @blk_num is filled with in round @round
+ */
+u8 _blk_byte(usize blk_num, usize round)
+{
+	return (u8) (blk_num * 7 + round * 13 + 1);
+}
+
+/*
+ * Checks that block @blk_num of @fd is all @byte
+ */
+void _check_blk(int fd, usize blk_num, u8 byte)
+{
+	u8 buf[BLK_SIZE];
+	CHECK(pread(fd, buf, BLK_SIZE, blk_num * BLK_SIZE) == BLK_SIZE);
+	for (usize i = 0; i < BLK_SIZE; ++i) {
+		CHECK(buf[i] == byte);
+	}
+}
+
+/*
+ * Fills block @blk_num through @c with @byte, marking it dirty as data or, if
+ * @meta, as metadata
+ */
+void _dirty_blk(struct blk_cache *c, usize blk_num, u8 byte, bool meta)
+{
+	cache_lock(c);
+	u8 *mem = cache_get(c, blk_num, false);
+	CHECK(mem != NULL);
+	memset(mem, byte, BLK_SIZE);
+	if (meta) {
+		cache_mark_meta(c, blk_num);
+	} else {
+		cache_mark_dirty(c, blk_num);
+	}
+	cache_unlock(c);
+}
+
+/*
+ * Checks that block @blk_num reads through @c as all @byte
+ */
+void _check_cached(struct blk_cache *c, usize blk_num, u8 byte)
+{
+	u8 buf[BLK_SIZE];
+	cache_lock(c);
+	u8 *mem = cache_get(c, blk_num, true);
+	CHECK(mem != NULL);
+	memcpy(buf, mem, BLK_SIZE);
+	cache_unlock(c);
+	for (usize i = 0; i < BLK_SIZE; ++i) {
+		CHECK(buf[i] == byte);
+	}
+}
+
+/*
+ * Writes file @i of the fs test a few hundred bytes at a time, so every write
+ * goes through the cache
+ */
+void _write_small(fs_t *fs, usize i, usize seed)
+{
+	char path[32];
+	sprintf(path, "/d%lu/f%lu", i % 3, i);
+	u8 buf[FILE_LEN];
+	test_fill(buf, 0, FILE_LEN, seed);
+	struct fs_file_desc fd = fs_open(fs, path);
+	for (usize offset = 0; offset < FILE_LEN; offset += STEP) {
+		usize len = FILE_LEN - offset < STEP ? FILE_LEN - offset : STEP;
+		CHECK(fs_write(fs, &fd, buf + offset, len) == 0);
+	}
+	CHECK(fs_close(fs, &fd) == 0);
+}
+
+/*
+ * Checks every file of the fs test holds what `_write_small` wrote, with the
+ * seed of the files at odd @i bumped by @odd_seed
+ */
+void _check_files(fs_t *fs, usize odd_seed)
+{
+	char path[32];
+	for (usize i = 0; i < NUM_FILES; ++i) {
+		sprintf(path, "/d%lu/f%lu", i % 3, i);
+		test_check_file(fs, path, FILE_LEN, i + (i % 2 ? odd_seed : 0));
+	}
+}
+
+int main(void)
+{
+	int fd = open(TEST_IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0);
+	CHECK(ftruncate(fd, NUM_BLKS * BLK_SIZE) == 0);
+
+	// Far more blocks dirtied than there are frames: each one evicted is
+	// written back in place, and reads back after it
+	struct blk_cache *c = cache_new(fd, BLK_SIZE, NUM_FRAMES);
+	CHECK(c != NULL);
+	for (usize i = 0; i < NUM_DIRTY; ++i) {
+		_dirty_blk(c, FIRST_BLK + i, _blk_byte(i, 1), false);
+	}
+	CHECK(cache_num_frames(c) == NUM_FRAMES);
+	for (usize i = 0; i + NUM_FRAMES < NUM_DIRTY; ++i) {
+		_check_blk(fd, FIRST_BLK + i, _blk_byte(i, 1));
+	}
+	for (usize i = 0; i < NUM_DIRTY; ++i) {
+		_check_cached(c, FIRST_BLK + i, _blk_byte(i, 1));
+	}
+	// Again, backwards and every other block, then flushed
+	for (usize i = NUM_DIRTY; i > 0; i -= 2) {
+		_dirty_blk(c, FIRST_BLK + i - 1, _blk_byte(i - 1, 2), false);
+	}
+	CHECK(cache_flush(c) == 0);
+	for (usize i = 0; i < NUM_DIRTY; ++i) {
+		usize round = i % 2 ? 2 : 1;
+		_check_blk(fd, FIRST_BLK + i, _blk_byte(i, round));
+		_check_cached(c, FIRST_BLK + i, _blk_byte(i, round));
+	}
+	cache_free(c);
+
+	// Pinned blocks stay put, and the cache grows rather than evict them
+	c = cache_new(fd, BLK_SIZE, NUM_FRAMES);
+	CHECK(c != NULL);
+	u8 *pinned[NUM_FRAMES + 1];
+	for (usize i = 0; i < NUM_FRAMES + 1; ++i) {
+		pinned[i] = cache_pin(c, FIRST_BLK + i);
+		CHECK(pinned[i] != NULL);
+	}
+	CHECK(cache_num_frames(c) > NUM_FRAMES);
+	for (usize i = 0; i < NUM_DIRTY; ++i) {
+		_dirty_blk(c, FIRST_BLK + NUM_FRAMES + 1 + i, _blk_byte(i, 3),
+			   false);
+	}
+	for (usize i = 0; i < NUM_FRAMES + 1; ++i) {
+		usize round = i % 2 ? 2 : 1;
+		for (usize j = 0; j < BLK_SIZE; ++j) {
+			CHECK(pinned[i][j] == _blk_byte(i, round));
+		}
+		cache_unpin(c, FIRST_BLK + i);
+	}
+	cache_free(c);
+	for (usize i = 0; i < NUM_DIRTY; ++i) {
+		_check_blk(fd, FIRST_BLK + NUM_FRAMES + 1 + i, _blk_byte(i, 3));
+	}
+
+	// Metadata held for the journal stays out of place, however much data
+	// is evicted around it, until a flush commits it
+	struct journal *j =
+		journal_new(fd, BLK_SIZE, JOURNAL_BLK, NUM_JOURNAL_BLKS);
+	CHECK(j != NULL);
+	c = cache_new(fd, BLK_SIZE, NUM_FRAMES);
+	CHECK(c != NULL);
+	cache_set_journal(c, j);
+	_dirty_blk(c, FIRST_BLK, _blk_byte(0, 4), true);
+	_dirty_blk(c, FIRST_BLK + 1, _blk_byte(1, 4), true);
+	for (usize i = 2; i < NUM_DIRTY; ++i) {
+		_dirty_blk(c, FIRST_BLK + i, _blk_byte(i, 4), false);
+	}
+	_check_blk(fd, FIRST_BLK, _blk_byte(0, 1));
+	_check_blk(fd, FIRST_BLK + 1, _blk_byte(1, 2));
+	_check_blk(fd, FIRST_BLK + 2, _blk_byte(2, 4));
+	CHECK(cache_flush(c) == 0);
+	CHECK(journal_checkpoint(j) == 0);
+	for (usize i = 0; i < NUM_DIRTY; ++i) {
+		_check_blk(fd, FIRST_BLK + i, _blk_byte(i, 4));
+	}
+	cache_free(c);
+	journal_free(j);
+
+	// A mapped cache tracks more dirty blocks than it starts with frames
+	// for, and writes none of them before a flush
+	c = cache_new_mmap(fd, BLK_SIZE, NUM_BLKS * BLK_SIZE);
+	CHECK(c != NULL);
+	for (usize i = 0; i < NUM_DIRTY; ++i) {
+		_dirty_blk(c, FIRST_BLK + i, _blk_byte(i, 5), false);
+	}
+	_check_blk(fd, FIRST_BLK, _blk_byte(0, 4));
+	CHECK(cache_flush(c) == 0);
+	for (usize i = 0; i < NUM_DIRTY; ++i) {
+		_check_blk(fd, FIRST_BLK + i, _blk_byte(i, 5));
+	}
+	CHECK(!cache_failed(c));
+	cache_free(c);
+	close(fd);
+
+	// A whole image through a handful of frames, reloaded both ways
+	char *formats[] = { "-b 1024 -s 4194304", "-b 1024 -s 4194304 -e" };
+	struct fs_load_opts small = { .cache_len = NUM_FRAMES };
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = fs_load(TEST_IMAGE, small);
+		CHECK(fs != NULL);
+		char path[32];
+		for (usize k = 0; k < 3; ++k) {
+			sprintf(path, "/d%lu", k);
+			CHECK(fs_create(fs, path, true, 1) == 0);
+		}
+		for (usize k = 0; k < NUM_FILES; ++k) {
+			sprintf(path, "/d%lu/f%lu", k % 3, k);
+			CHECK(fs_create(fs, path, false, 1) == 0);
+			_write_small(fs, k, k);
+		}
+		_check_files(fs, 0);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = fs_load(TEST_IMAGE, small);
+		CHECK(fs != NULL);
+		_check_files(fs, 0);
+		for (usize k = 1; k < NUM_FILES; k += 2) {
+			_write_small(fs, k, k + 100);
+		}
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		_check_files(fs, 100);
+		CHECK(fs_unload(fs) == 0);
+		fs = test_load(FS_LOAD_MMAP);
+		_check_files(fs, 100);
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
@@ -0,0 +1,191 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LEN (1 << 20)
+#define CHUNK (1 << 16)
+#define RACE_LEN 20000
+#define NUM_RACES 2000
+
+volatile bool stop;
+
+/*
+ * Checks @path holds the @len bytes at @want
+ */
+void _check_buf(fs_t *fs, char *path, u8 *want, usize len)
+{
+	u8 *buf = malloc(len);
+	struct fs_file_desc fd = fs_open(fs, path);
+	CHECK(fs_read(fs, &fd, buf, len) == 0);
+	CHECK(memcmp(buf, want, len) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	free(buf);
+}
+
+/*
+ * Returns how many bytes can be written to a new file, a chunk at a time,
+ * deleting it again
+ */
+usize _free_bytes(fs_t *fs)
+{
+	u8 *chunk = calloc(1, CHUNK);
+	CHECK(fs_create(fs, "/fill", false, 1) == 0);
+	struct fs_file_desc fd = fs_open(fs, "/fill");
+	usize total = 0;
+	while (fs_write(fs, &fd, chunk, CHUNK) == 0) {
+		total += CHUNK;
+	}
+	CHECK(fs_close(fs, &fd) == 0);
+	CHECK(fs_delete(fs, "/fill") == 0);
+	free(chunk);
+	return total;
+}
+
+/*
+ * Replaces "/src" with a file of one repeated byte, over and over, until told
+ * to stop
+ */
+void *_replace_src(void *arg)
+{
+	fs_t *fs = arg;
+	u8 buf[RACE_LEN];
+	for (usize round = 0; !stop; ++round) {
+		fs_delete(fs, "/src");
+		memset(buf, (u8) round, RACE_LEN);
+		CHECK(fs_create(fs, "/src", false, 1) == 0);
+		struct fs_file_desc fd = fs_open(fs, "/src");
+		CHECK(fs_write(fs, &fd, buf, RACE_LEN) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	u8 *want = malloc(LEN);
+	u8 *want_clone = malloc(LEN);
+	u8 *zeros = calloc(1, LEN);
+
+	// Only images with extents share blocks
+	test_format("-b 4096 -s 16777216");
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	test_write_file(fs, "/a", LEN, 1);
+	CHECK(fs_clone(fs, "/a", "/b") == 1);
+	CHECK(fs_snapshot(fs, "/", "/snap") == 1);
+	CHECK(fs_unload(fs) == 0);
+
+	test_format("-b 4096 -s 16777216 -e");
+	fs = test_load(FS_LOAD_CACHED);
+	test_write_file(fs, "/a", LEN, 1);
+	test_fill(want, 0, LEN, 1);
+	usize free_before = _free_bytes(fs);
+	CHECK(fs_clone(fs, "/a", "/b") == 0);
+	// The clone costs an extent block, not a copy
+	CHECK(free_before - _free_bytes(fs) <= CHUNK);
+	_check_buf(fs, "/b", want, LEN);
+	CHECK(fs_clone(fs, "/a", "/b") == 1);
+	CHECK(fs_clone(fs, "/none", "/c") == 1);
+	CHECK(fs_clone(fs, "/", "/c") == 1);
+
+	// Writes to either side are the writer's own
+	memcpy(want_clone, want, LEN);
+	test_fill(want_clone + 5000, 5000, 100, 2);
+	struct fs_file_desc fd = fs_open(fs, "/b");
+	CHECK(fs_seek(fs, &fd, 5000) == 0);
+	CHECK(fs_write(fs, &fd, want_clone + 5000, 100) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	test_fill(want + CHUNK - 3, CHUNK - 3, 2 * CHUNK, 3);
+	fd = fs_open(fs, "/a");
+	CHECK(fs_seek(fs, &fd, CHUNK - 3) == 0);
+	CHECK(fs_write(fs, &fd, want + CHUNK - 3, 2 * CHUNK) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	_check_buf(fs, "/a", want, LEN);
+	_check_buf(fs, "/b", want_clone, LEN);
+
+	// A hole punched in the clone, through shared blocks, is its own
+	fd = fs_open(fs, "/b");
+	CHECK(fs_punch_hole(fs, &fd, 300000, 100000) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	memset(want_clone + 300000, 0, 100000);
+	_check_buf(fs, "/a", want, LEN);
+	_check_buf(fs, "/b", want_clone, LEN);
+
+	// A clone outlives its source, and clones of clones share too
+	CHECK(fs_clone(fs, "/b", "/c") == 0);
+	CHECK(fs_delete(fs, "/b") == 0);
+	_check_buf(fs, "/c", want_clone, LEN);
+	test_write_file(fs, "/small", 11, 4);
+	CHECK(fs_clone(fs, "/small", "/small2") == 0);
+	CHECK(fs_delete(fs, "/small") == 0);
+	test_check_file(fs, "/small2", 11, 4);
+
+	// A snapshot copies the tree, leaving itself out
+	CHECK(fs_create(fs, "/d", true, 1) == 0);
+	CHECK(fs_create(fs, "/d/e", true, 1) == 0);
+	test_write_file(fs, "/d/e/f", 200000, 5);
+	CHECK(fs_snapshot(fs, "/", "/snap") == 0);
+	_check_buf(fs, "/snap/a", want, LEN);
+	_check_buf(fs, "/snap/c", want_clone, LEN);
+	test_check_file(fs, "/snap/small2", 11, 4);
+	test_check_file(fs, "/snap/d/e/f", 200000, 5);
+	CHECK(fs_delete(fs, "/snap/snap") == 1);
+	fd = fs_open(fs, "/d/e/f");
+	CHECK(fs_write(fs, &fd, zeros, 1000) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	test_check_file(fs, "/snap/d/e/f", 200000, 5);
+	CHECK(fs_unload(fs) == 0);
+
+	fs = test_load(FS_LOAD_MMAP);
+	_check_buf(fs, "/a", want, LEN);
+	_check_buf(fs, "/c", want_clone, LEN);
+	_check_buf(fs, "/snap/a", want, LEN);
+	// Blocks are only freed once their last owner goes
+	char *paths[] = {
+		"/a", "/c", "/small2", "/snap/a", "/snap/c", "/snap/small2",
+		"/snap/d/e/f", "/snap/d/e", "/snap/d", "/snap", "/d/e/f",
+		"/d/e", "/d",
+	};
+	for (usize i = 0; i < sizeof(paths) / sizeof(*paths); ++i) {
+		CHECK(fs_delete(fs, paths[i]) == 0);
+	}
+	CHECK(_free_bytes(fs) >= free_before + LEN);
+
+	// Cloning while the source is deleted and made again gives either
+	// nothing or a whole copy of one of its versions
+	CHECK(fs_create(fs, "/src", false, 1) == 0);
+	fd = fs_open(fs, "/src");
+	CHECK(fs_write(fs, &fd, zeros, RACE_LEN) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	pthread_t thread;
+	stop = false;
+	CHECK(pthread_create(&thread, NULL, _replace_src, fs) == 0);
+	u8 buf[RACE_LEN];
+	usize num_cloned = 0;
+	for (usize i = 0; i < NUM_RACES; ++i) {
+		if (fs_clone(fs, "/src", "/copy")) {
+			continue;
+		}
+		num_cloned += 1;
+		fd = fs_open(fs, "/copy");
+		CHECK(fs_read(fs, &fd, buf, RACE_LEN) == 0);
+		for (usize j = 1; j < RACE_LEN; ++j) {
+			CHECK(buf[j] == buf[0]);
+		}
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_delete(fs, "/copy") == 0);
+	}
+	stop = true;
+	CHECK(pthread_join(thread, NULL) == 0);
+	CHECK(num_cloned > 0);
+	CHECK(fs_delete(fs, "/src") == 0);
+	CHECK(fs_unload(fs) == 0);
+	fs = test_load(FS_LOAD_CACHED);
+	CHECK(_free_bytes(fs) >= free_before + LEN);
+	CHECK(fs_unload(fs) == 0);
+	free(zeros);
+	free(want_clone);
+	free(want);
+	return 0;
+}
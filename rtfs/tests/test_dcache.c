@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define DEPTH 8
+
+/*
+ * Makes the directories /d0/d1/.../d(@depth - 1), writing the path of the
+ * deepest to @path
+ */
+void _make_dirs(fs_t *fs, char *path, usize depth)
+{
+	path[0] = '\0';
+	for (usize i = 0; i < depth; ++i) {
+		sprintf(path + strlen(path), "/d%lu", i);
+		CHECK(fs_create(fs, path, true, 1) == 0);
+	}
+}
+
+int main(void)
+{
+	usize dcache_lens[] = { 0, 1, 4 };
+	for (usize i = 0; i < sizeof(dcache_lens) / sizeof(*dcache_lens); ++i) {
+		test_format("-b 1024 -s 4194304");
+		struct fs_load_opts opts = { .dcache_len = dcache_lens[i] };
+		fs_t *fs = fs_load(TEST_IMAGE, opts);
+		CHECK(fs != NULL);
+
+		// A name missing once is found after it is made
+		CHECK(fs_delete(fs, "/a/x") == 1);
+		CHECK(fs_create(fs, "/a", true, 1) == 0);
+		CHECK(fs_delete(fs, "/a/x") == 1);
+		test_write_file(fs, "/a/x", 10, 1);
+		test_check_file(fs, "/a/x", 10, 1);
+
+		// A directory made again in the place of a deleted one, likely
+		// under the same inode num, has none of the old one's entries
+		CHECK(fs_delete(fs, "/a/x") == 0);
+		CHECK(fs_delete(fs, "/a") == 0);
+		CHECK(fs_create(fs, "/a", true, 1) == 0);
+		CHECK(fs_delete(fs, "/a/x") == 1);
+		test_write_file(fs, "/a/x", 20, 2);
+
+		// Deep paths, with far more components than a small cache holds
+		char path[DEPTH * 8 + 16];
+		_make_dirs(fs, path, DEPTH);
+		char file[sizeof(path) + 8];
+		for (usize j = 0; j < 20; ++j) {
+			sprintf(file, "%s/f%lu", path, j);
+			test_write_file(fs, file, j, j);
+		}
+		for (usize j = 0; j < 20; ++j) {
+			sprintf(file, "%s/f%lu", path, j);
+			test_check_file(fs, file, j, j);
+			test_check_file(fs, "/a/x", 20, 2);
+		}
+		CHECK(fs_unload(fs) == 0);
+
+		fs = fs_load(TEST_IMAGE, opts);
+		CHECK(fs != NULL);
+		sprintf(file, "%s/f%d", path, 7);
+		test_check_file(fs, file, 7, 7);
+		CHECK(fs_delete(fs, file) == 0);
+		CHECK(fs_delete(fs, file) == 1);
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
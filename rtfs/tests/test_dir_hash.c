@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NUM_NAMES 60
+
+/*
+ * Sets @path to "/d/" followed by @len characters: @c repeated, then @suffix
+ */
+void _long_path(char *path, usize len, char c, char *suffix)
+{
+	usize suffix_len = strlen(suffix);
+	strcpy(path, "/d/");
+	memset(path + 3, c, len - suffix_len);
+	strcpy(path + 3 + len - suffix_len, suffix);
+}
+
+int main(void)
+{
+	test_format("-b 4096 -s 4194304");
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	CHECK(fs_create(fs, "/d", true, 1) == 0);
+
+	// Names that only differ at the end, or are prefixes of each other
+	char path[MAX_FILENAME_LEN + 8];
+	for (usize i = 0; i < NUM_NAMES; ++i) {
+		sprintf(path, "/d/name%lu", i);
+		CHECK(fs_create(fs, path, i % 2 == 0, 1) == 0);
+	}
+	for (usize i = 0; i < NUM_NAMES; ++i) {
+		sprintf(path, "/d/name%lu", i);
+		CHECK(fs_create(fs, path, false, 1) == 1);
+	}
+	CHECK(fs_delete(fs, "/d/name") == 1);
+	CHECK(fs_delete(fs, "/d/name600") == 1);
+
+	// Unlinking from the middle of a bucket's chain leaves the rest of it
+	for (usize i = 0; i < NUM_NAMES; i += 3) {
+		sprintf(path, "/d/name%lu", i);
+		CHECK(fs_delete(fs, path) == 0);
+	}
+	for (usize i = 0; i < NUM_NAMES; ++i) {
+		sprintf(path, "/d/name%lu", i);
+		if (i % 3 == 0) {
+			CHECK(fs_delete(fs, path) == 1);
+		} else {
+			CHECK(fs_create(fs, path, false, 1) == 1);
+		}
+	}
+
+	// 32 bit FNV-1a gives both of these the same hash
+	char twin[MAX_FILENAME_LEN + 8];
+	_long_path(path, MAX_FILENAME_LEN, 'p', "329599");
+	_long_path(twin, MAX_FILENAME_LEN, 'p', "532382");
+	test_write_file(fs, path, 6, 1);
+	test_write_file(fs, twin, 6, 2);
+	test_check_file(fs, path, 6, 1);
+	test_check_file(fs, twin, 6, 2);
+	CHECK(fs_delete(fs, path) == 0);
+	CHECK(fs_create(fs, twin, false, 1) == 1);
+	test_check_file(fs, twin, 6, 2);
+
+	// The longest name there can be
+	_long_path(path, MAX_FILENAME_LEN, 'x', "");
+	CHECK(fs_create(fs, path, false, 1) == 0);
+	CHECK(fs_unload(fs) == 0);
+
+	fs = test_load(FS_LOAD_CACHED);
+	_long_path(path, MAX_FILENAME_LEN, 'x', "");
+	CHECK(fs_delete(fs, path) == 0);
+	test_check_file(fs, twin, 6, 2);
+	CHECK(fs_delete(fs, "/d/name1") == 0);
+	CHECK(fs_delete(fs, "/d/name3") == 1);
+	CHECK(fs_unload(fs) == 0);
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NUM_NAMES 300
+#define MAX_NAME 255
+
+/*
+ * Makes the path of name @i under /d in @path, @len bytes long after the
+ * "/d/"
+ */
+void _name(char *path, usize i, usize len)
+{
+	int n = sprintf(path, "/d/%lu_", i);
+	for (usize j = (usize) n - 3; j < len; ++j) {
+		path[n++] = (char) ('a' + (i + j) % 26);
+	}
+	path[n] = '\0';
+}
+
+/*
+ * The length of name @i the first time round
+ */
+usize _name_len(usize i)
+{
+	return 6 + (i * 37) % (MAX_NAME - 6);
+}
+
+/*
+ * The length of name @i when it comes back: longer, unless it can't be
+ */
+usize _refill_len(usize i)
+{
+	return _name_len(i) + (MAX_NAME - _name_len(i)) / 2;
+}
+
+/*
+ * The length of name @i once every other one has come back
+ */
+usize _final_len(usize i)
+{
+	return i % 2 == 0 ? _refill_len(i) : _name_len(i);
+}
+
+/*
+ * The length of the file at name @i: small enough to stay in the entry
+ */
+usize _data_len(usize i)
+{
+	return i % 4 == 0 ? 0 : 1 + (i * 13) % 200;
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 8388608", "-b 4096 -s 8388608 -e" };
+	char path[MAX_NAME + 8];
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+		CHECK(fs_create(fs, "/d", true, 1) == 0);
+
+		// Names from a few bytes to the longest allowed, each only
+		// taking the room it needs
+		for (usize j = 0; j < NUM_NAMES; ++j) {
+			_name(path, j, _name_len(j));
+			CHECK(fs_create(fs, path, false, 1) == 0);
+			CHECK(fs_create(fs, path, false, 1) == 1);
+		}
+		// Every other one goes, and longer ones take the freed room
+		for (usize j = 0; j < NUM_NAMES; j += 2) {
+			_name(path, j, _name_len(j));
+			CHECK(fs_delete(fs, path) == 0);
+		}
+		for (usize j = 0; j < NUM_NAMES; j += 2) {
+			_name(path, j, _refill_len(j));
+			test_write_file(fs, path, _data_len(j), j);
+		}
+		// The rest grow data of their own in place, moving their
+		// neighbours along
+		for (usize j = 1; j < NUM_NAMES; j += 2) {
+			_name(path, j, _name_len(j));
+			struct fs_file_desc fd = fs_open(fs, path);
+			u8 buf[MAX_NAME];
+			test_fill(buf, 0, _data_len(j), j);
+			CHECK(fs_write(fs, &fd, buf, _data_len(j)) == 0);
+			CHECK(fs_close(fs, &fd) == 0);
+		}
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_MMAP);
+		for (usize j = 0; j < NUM_NAMES; ++j) {
+			usize len = _final_len(j);
+			_name(path, j, len);
+			test_check_file(fs, path, _data_len(j), j);
+			if (j % 2 == 0 && _name_len(j) != len) {
+				_name(path, j, _name_len(j));
+				CHECK(fs_delete(fs, path) == 1);
+			}
+		}
+		// Once emptied, the directory takes every name again
+		for (usize j = 0; j < NUM_NAMES; ++j) {
+			_name(path, j, _final_len(j));
+			CHECK(fs_delete(fs, path) == 0);
+		}
+		for (usize j = 0; j < NUM_NAMES; ++j) {
+			_name(path, j, _name_len(j));
+			CHECK(fs_create(fs, path, false, 1) == 0);
+		}
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define BLK_SIZE 1024
+// Far more single-block appends than one extent block has extents for, so they
+// only fit merged into the extents before them
+#define NUM_APPENDS 600
+#define LEN (NUM_APPENDS * BLK_SIZE)
+// Blocks written one apart, each an extent of its own, many times more than
+// one extent block holds at either block size
+#define NUM_FRAGS 400
+#define CHUNK (1 << 16)
+
+/*
+ * Checks that @path holds the @len bytes of @want
+ */
+void _check(fs_t *fs, char *path, u8 *want, usize len)
+{
+	u8 *buf = malloc(len);
+	struct fs_file_desc fd = fs_open(fs, path);
+	CHECK(fs_read(fs, &fd, buf, len) == 0);
+	CHECK(memcmp(buf, want, len) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	free(buf);
+}
+
+/*
+ * Returns how many bytes can be written to a new file, a chunk at a time,
+ * deleting it again
+ */
+usize _free_bytes(fs_t *fs)
+{
+	u8 *chunk = calloc(1, CHUNK);
+	CHECK(fs_create(fs, "/fill", false, 1) == 0);
+	struct fs_file_desc fd = fs_open(fs, "/fill");
+	usize total = 0;
+	while (fs_write(fs, &fd, chunk, CHUNK) == 0) {
+		total += CHUNK;
+	}
+	CHECK(fs_close(fs, &fd) == 0);
+	CHECK(fs_delete(fs, "/fill") == 0);
+	free(chunk);
+	return total;
+}
+
+/*
+ * Writes the @blk_size bytes of block @blk_idx of @want to the file @fd
+ */
+void _write_frag(fs_t *fs, struct fs_file_desc *fd, u8 *want, usize blk_size,
+		usize blk_idx)
+{
+	CHECK(fs_seek(fs, fd, blk_idx * blk_size) == 0);
+	CHECK(fs_write(fs, fd, want + blk_idx * blk_size, blk_size) == 0);
+}
+
+/*
+ * Fragments a file into far more extents than its extent block holds, then
+ * fills, punches, seeks, clones and deletes it
+ */
+void _fragment(char *format, usize blk_size)
+{
+	usize len = 2 * NUM_FRAGS * blk_size;
+	u8 *want = calloc(1, len);
+	test_format(format);
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	usize free_before = _free_bytes(fs);
+
+	// Every other block, front to back, then some of the holes between
+	// them out of order
+	test_fill(want, 0, len, 5);
+	for (usize i = 0; i < NUM_FRAGS; ++i) {
+		memset(want + (2 * i + 1) * blk_size, 0, blk_size);
+	}
+	CHECK(fs_create(fs, "/f", false, 1) == 0);
+	struct fs_file_desc fd = fs_open(fs, "/f");
+	for (usize i = 0; i < NUM_FRAGS; ++i) {
+		_write_frag(fs, &fd, want, blk_size, 2 * i);
+	}
+	for (usize i = 0; i < NUM_FRAGS / 4; ++i) {
+		usize blk_idx = 2 * (i * 7 % NUM_FRAGS) + 1;
+		test_fill(want + blk_idx * blk_size, blk_idx * blk_size,
+			  blk_size, 6);
+		_write_frag(fs, &fd, want, blk_size, blk_idx);
+	}
+	CHECK(fs_close(fs, &fd) == 0);
+	_check(fs, "/f", want, len);
+
+	// Holes are found past any number of extents
+	fd = fs_open(fs, "/f");
+	usize pos;
+	for (usize i = 0; i < NUM_FRAGS; i += 37) {
+		usize hole = (2 * i + 1) * blk_size;
+		bool filled = want[hole] != 0 || want[hole + 1] != 0;
+		CHECK(fs_seek_hole(fs, &fd, 2 * i * blk_size, &pos) == 0);
+		CHECK(filled ? pos > hole : pos == hole);
+		CHECK(fs_seek_data(fs, &fd, hole, &pos) == 0);
+		CHECK(pos == (filled ? hole : hole + blk_size));
+	}
+
+	// Punching across many leaves, and within single blocks
+	usize from = NUM_FRAGS / 3 * blk_size + 10;
+	CHECK(fs_punch_hole(fs, &fd, from, len / 3) == 0);
+	memset(want + from, 0, len / 3);
+	CHECK(fs_seek_data(fs, &fd, from + blk_size, &pos) == 0);
+	CHECK(pos >= from + len / 3 - blk_size);
+	CHECK(fs_close(fs, &fd) == 0);
+	_check(fs, "/f", want, len);
+
+	// A clone gets leaves of its own, which its writes split
+	u8 *want_clone = malloc(len);
+	memcpy(want_clone, want, len);
+	CHECK(fs_clone(fs, "/f", "/g") == 0);
+	fd = fs_open(fs, "/g");
+	for (usize i = 0; i < NUM_FRAGS; i += 3) {
+		test_fill(want_clone + 2 * i * blk_size, 2 * i * blk_size,
+			  blk_size, 7);
+		_write_frag(fs, &fd, want_clone, blk_size, 2 * i);
+	}
+	CHECK(fs_close(fs, &fd) == 0);
+	_check(fs, "/f", want, len);
+	_check(fs, "/g", want_clone, len);
+	CHECK(fs_unload(fs) == 0);
+
+	fs = test_load(FS_LOAD_MMAP);
+	_check(fs, "/f", want, len);
+	_check(fs, "/g", want_clone, len);
+	// Every block comes back, leaves and all
+	CHECK(fs_delete(fs, "/f") == 0);
+	CHECK(fs_delete(fs, "/g") == 0);
+	CHECK(_free_bytes(fs) == free_before);
+	CHECK(fs_unload(fs) == 0);
+	free(want_clone);
+	free(want);
+}
+
+int main(void)
+{
+	u8 *a = malloc(LEN);
+	u8 *b = malloc(LEN);
+	test_fill(a, 0, LEN, 1);
+	test_fill(b, 0, LEN, 2);
+	test_format("-b 1024 -s 8388608 -e");
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+
+	// Two files growing a block at a time, side by side
+	CHECK(fs_create(fs, "/a", false, 1) == 0);
+	CHECK(fs_create(fs, "/b", false, 1) == 0);
+	struct fs_file_desc fa = fs_open(fs, "/a");
+	struct fs_file_desc fb = fs_open(fs, "/b");
+	for (usize i = 0; i < NUM_APPENDS; ++i) {
+		CHECK(fs_write(fs, &fa, a + i * BLK_SIZE, BLK_SIZE) == 0);
+		CHECK(fs_write(fs, &fb, b + i * BLK_SIZE, BLK_SIZE) == 0);
+	}
+	CHECK(fs_close(fs, &fa) == 0);
+	CHECK(fs_close(fs, &fb) == 0);
+	_check(fs, "/a", a, LEN);
+	_check(fs, "/b", b, LEN);
+
+	// Writes straddling blocks, and appends of several blocks at once
+	fa = fs_open(fs, "/a");
+	srand(1);
+	for (usize i = 0; i < 200; ++i) {
+		usize offset = (usize) rand() % (LEN - 3000);
+		usize len = 1 + (usize) rand() % 3000;
+		test_fill(a + offset, offset, len, 3 + i);
+		CHECK(fs_seek(fs, &fa, offset) == 0);
+		CHECK(fs_write(fs, &fa, a + offset, len) == 0);
+	}
+	CHECK(fs_close(fs, &fa) == 0);
+	CHECK(fs_create(fs, "/c", false, 1) == 0);
+	struct fs_file_desc fc = fs_open(fs, "/c");
+	CHECK(fs_write(fs, &fc, b, BLK_SIZE) == 0);
+	CHECK(fs_write(fs, &fc, b + BLK_SIZE, 3 * BLK_SIZE) == 0);
+	CHECK(fs_write(fs, &fc, b + 4 * BLK_SIZE, 10 * BLK_SIZE + 5) == 0);
+	CHECK(fs_close(fs, &fc) == 0);
+	CHECK(fs_unload(fs) == 0);
+
+	fs = test_load(FS_LOAD_CACHED);
+	_check(fs, "/a", a, LEN);
+	_check(fs, "/b", b, LEN);
+	_check(fs, "/c", b, 14 * BLK_SIZE + 5);
+
+	// Deleting gives every block back, extent block included, or the disk
+	// would fill up long before the last round
+	for (usize round = 0; round < 20; ++round) {
+		CHECK(fs_delete(fs, "/a") == 0);
+		test_write_file(fs, "/a", LEN, round);
+		test_check_file(fs, "/a", LEN, round);
+	}
+	CHECK(fs_unload(fs) == 0);
+
+	_fragment("-b 1024 -s 8388608 -e", 1024);
+	_fragment("-b 4096 -s 16777216 -e", 4096);
+	free(b);
+	free(a);
+	return 0;
+}
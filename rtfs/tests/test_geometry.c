@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "test.h"
+
+#define LEN (1 << 20)
+#define SPARSE_SIZE (16ul << 30)
+
+/*
+ * Returns how many files can be made in the root directory before the inodes
+ * run out, deleting them again
+ */
+usize _count_inodes(fs_t *fs)
+{
+	char path[32];
+	usize num_files = 0;
+	for (;; ++num_files) {
+		sprintf(path, "/f%lu", num_files);
+		if (fs_create(fs, path, false, 1)) {
+			break;
+		}
+	}
+	for (usize i = 0; i < num_files; ++i) {
+		sprintf(path, "/f%lu", i);
+		CHECK(fs_delete(fs, path) == 0);
+	}
+	return num_files;
+}
+
+/*
+ * Runs `mkfs.ext4holdtheextra` on `TEST_IMAGE` with @args, returning whether
+ * it succeeded
+ */
+bool _mkfs(char *args)
+{
+	char cmd[512];
+	snprintf(cmd, sizeof(cmd), "rm -f %s && %s %s %s >/dev/null 2>&1",
+		 TEST_IMAGE, MKFS, args, TEST_IMAGE);
+	return system(cmd) == 0;
+}
+
+int main(void)
+{
+	// One inode per block unless asked for fewer, and the count holds
+	// across loads
+	test_format("-b 1024 -s 4194304 -i 65536");
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	usize num_inodes = _count_inodes(fs);
+	CHECK(num_inodes > 0 && num_inodes < 4194304 / 65536);
+	test_write_file(fs, "/big", LEN, 1);
+	CHECK(fs_unload(fs) == 0);
+	fs = test_load(FS_LOAD_MMAP);
+	CHECK(_count_inodes(fs) == num_inodes - 1);
+	test_check_file(fs, "/big", LEN, 1);
+	CHECK(fs_unload(fs) == 0);
+	test_format("-b 1024 -s 4194304");
+	fs = test_load(FS_LOAD_CACHED);
+	CHECK(_count_inodes(fs) > 1000);
+	CHECK(fs_unload(fs) == 0);
+
+	// An image past what 21 bit block nums could reach takes up next to
+	// nothing on the host until written to
+	char *formats[] = { "-b 4096 -s 16g -i 16m", "-b 4096 -s 16g -e" };
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		struct stat st;
+		CHECK(stat(TEST_IMAGE, &st) == 0);
+		CHECK((usize) st.st_size == SPARSE_SIZE);
+		CHECK((usize) st.st_blocks * 512 < SPARSE_SIZE / 1024);
+		fs = test_load(FS_LOAD_CACHED);
+		test_write_file(fs, "/big", LEN, 2);
+		CHECK(fs_create(fs, "/d", true, 1) == 0);
+		test_write_file(fs, "/d/small", 100, 3);
+		CHECK(fs_unload(fs) == 0);
+		fs = test_load(FS_LOAD_CACHED);
+		test_check_file(fs, "/big", LEN, 2);
+		test_check_file(fs, "/d/small", 100, 3);
+		CHECK(fs_unload(fs) == 0);
+	}
+
+	// Geometry mkfs can't make, or rtfs can't use
+	CHECK(!_mkfs("-b 0 -s 1048576"));
+	CHECK(!_mkfs("-b 131072 -s 1048576"));
+	CHECK(!_mkfs("-b 1024 -i 512 -s 1048576"));
+	CHECK(_mkfs("-b 128 -s 1048576"));
+	struct fs_load_opts opts = { 0 };
+	CHECK(fs_load(TEST_IMAGE, opts) == NULL);
+	return 0;
+}
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LEN (1 << 20)
+#define CHUNK (1 << 16)
+#define FAR (12 << 20)
+
+/*
+ * Checks @path holds the @len bytes at @want
+ */
+void _check_buf(fs_t *fs, char *path, u8 *want, usize len)
+{
+	u8 *buf = malloc(len);
+	memset(buf, 0xee, len);
+	struct fs_file_desc fd = fs_open(fs, path);
+	CHECK(fs_read(fs, &fd, buf, len) == 0);
+	CHECK(memcmp(buf, want, len) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	free(buf);
+}
+
+/*
+ * Returns how many bytes can be written to a new file, a chunk at a time,
+ * deleting it again
+ */
+usize _free_bytes(fs_t *fs)
+{
+	u8 *chunk = calloc(1, CHUNK);
+	CHECK(fs_create(fs, "/fill", false, 1) == 0);
+	struct fs_file_desc fd = fs_open(fs, "/fill");
+	usize total = 0;
+	while (fs_write(fs, &fd, chunk, CHUNK) == 0) {
+		total += CHUNK;
+	}
+	CHECK(fs_close(fs, &fd) == 0);
+	CHECK(fs_delete(fs, "/fill") == 0);
+	free(chunk);
+	return total;
+}
+
+/*
+ * Rounds @offset up to a multiple of @blk_size
+ */
+usize _round_up(usize offset, usize blk_size)
+{
+	return (offset + blk_size - 1) / blk_size * blk_size;
+}
+
+int main(void)
+{
+	u8 *want = malloc(LEN);
+	u8 buf[16];
+	usize pos;
+	// Chained images zero punched bytes in place
+	test_format("-b 4096 -s 16777216");
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	test_write_file(fs, "/a", LEN, 1);
+	test_fill(want, 0, LEN, 1);
+	struct fs_file_desc fd = fs_open(fs, "/a");
+	CHECK(fs_punch_hole(fs, &fd, 5000, 100000) == 0);
+	memset(want + 5000, 0, 100000);
+	CHECK(fs_seek_data(fs, &fd, 0, &pos) == 0 && pos == 0);
+	CHECK(fs_seek_hole(fs, &fd, 0, &pos) == 0 && pos >= LEN);
+	CHECK(fs_close(fs, &fd) == 0);
+	_check_buf(fs, "/a", want, LEN);
+	CHECK(fs_unload(fs) == 0);
+
+	char *formats[] = {
+		"-b 1024 -s 16777216 -e",
+		"-b 4096 -s 16777216 -e",
+	};
+	usize blk_sizes[] = { 1024, 4096 };
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		usize blk_size = blk_sizes[i];
+		test_format(formats[i]);
+		fs = test_load(i % 2 ? FS_LOAD_MMAP : FS_LOAD_CACHED);
+		test_write_file(fs, "/a", LEN, 1);
+		test_fill(want, 0, LEN, 1);
+		usize free_before = _free_bytes(fs);
+
+		// A whole file is one run of data, ended by its end
+		fd = fs_open(fs, "/a");
+		CHECK(fs_seek_data(fs, &fd, 0, &pos) == 0 && pos == 0);
+		CHECK(fs_seek_hole(fs, &fd, 0, &pos) == 0 && pos == LEN);
+		CHECK(fs_seek_data(fs, &fd, LEN, &pos) == 1);
+		CHECK(fs_seek_hole(fs, &fd, LEN, &pos) == 1);
+
+		// Only whole blocks become holes; the ends are zeroed
+		CHECK(fs_punch_hole(fs, &fd, 5000, 100000) == 0);
+		memset(want + 5000, 0, 100000);
+		usize hole = _round_up(5000, blk_size);
+		usize data = 105000 / blk_size * blk_size;
+		CHECK(fs_seek_hole(fs, &fd, 0, &pos) == 0 && pos == hole);
+		// Seeking moves the position
+		CHECK(fs_read(fs, &fd, buf, 16) == 0);
+		CHECK(memcmp(buf, want + hole, 16) == 0);
+		CHECK(fs_seek_data(fs, &fd, hole, &pos) == 0 && pos == data);
+		CHECK(fs_seek_data(fs, &fd, 3000, &pos) == 0 && pos == 3000);
+		CHECK(fs_seek_hole(fs, &fd, data, &pos) == 0 && pos == LEN);
+		// Splitting an extent, past the end, and at the start
+		CHECK(fs_punch_hole(fs, &fd, 300000, 20 * blk_size) == 0);
+		memset(want + 300000, 0, 20 * blk_size);
+		CHECK(fs_punch_hole(fs, &fd, LEN - 10, 1000) == 0);
+		memset(want + LEN - 10, 0, 10);
+		CHECK(fs_punch_hole(fs, &fd, LEN + 10, 1000) == 0);
+		CHECK(fs_punch_hole(fs, &fd, 0, 3) == 0);
+		memset(want, 0, 3);
+		CHECK(fs_close(fs, &fd) == 0);
+		_check_buf(fs, "/a", want, LEN);
+		CHECK(_free_bytes(fs) >= free_before + 2 * CHUNK);
+
+		// Writing into a hole fills it in again
+		memset(want + 50000, 0x33, 7000);
+		fd = fs_open(fs, "/a");
+		CHECK(fs_seek(fs, &fd, 50000) == 0);
+		CHECK(fs_write(fs, &fd, want + 50000, 7000) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		_check_buf(fs, "/a", want, LEN);
+
+		// Seeking far past the end leaves a hole, not zeroed blocks
+		free_before = _free_bytes(fs);
+		CHECK(fs_create(fs, "/s", false, 1) == 0);
+		fd = fs_open(fs, "/s");
+		CHECK(fs_seek(fs, &fd, FAR) == 0);
+		CHECK(fs_write(fs, &fd, (u8 *) "tail", 4) == 0);
+		CHECK(fs_seek_data(fs, &fd, 0, &pos) == 0 && pos == FAR);
+		CHECK(fs_seek_hole(fs, &fd, 0, &pos) == 0 && pos == 0);
+		CHECK(fs_seek_hole(fs, &fd, FAR, &pos) == 0 && pos == FAR + 4);
+		CHECK(fs_seek(fs, &fd, FAR - 8) == 0);
+		CHECK(fs_read(fs, &fd, buf, 12) == 0);
+		CHECK(memcmp(buf, "\0\0\0\0\0\0\0\0tail", 12) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(_free_bytes(fs) + 2 * CHUNK >= free_before);
+
+		// Files kept in their entry are zeroed in place, directories
+		// can't be punched
+		CHECK(fs_create(fs, "/small", false, 1) == 0);
+		fd = fs_open(fs, "/small");
+		CHECK(fs_write(fs, &fd, (u8 *) "hello there", 11) == 0);
+		CHECK(fs_punch_hole(fs, &fd, 2, 100) == 0);
+		CHECK(fs_seek_hole(fs, &fd, 0, &pos) == 0 && pos == 11);
+		CHECK(fs_seek_data(fs, &fd, 11, &pos) == 1);
+		CHECK(fs_close(fs, &fd) == 0);
+		_check_buf(fs, "/small", (u8 *) "he\0\0\0\0\0\0\0\0\0", 11);
+		CHECK(fs_create(fs, "/dir", true, 1) == 0);
+		fd = fs_open(fs, "/dir");
+		CHECK(fs_punch_hole(fs, &fd, 0, 10) == 1);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		_check_buf(fs, "/a", want, LEN);
+		fd = fs_open(fs, "/s");
+		CHECK(fs_seek_data(fs, &fd, 0, &pos) == 0 && pos == FAR);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+	}
+	free(want);
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NUM_FILES 12
+#define STEP 20
+#define SMALL_LEN 240
+#define BIG_LEN 3000
+
+/*
+ * Appends @len bytes of `test_fill` with @seed to @path, which holds @offset
+ * bytes, checking a descriptor opened beforehand sees them too
+ */
+void _append(fs_t *fs, char *path, usize offset, usize len, usize seed)
+{
+	u8 buf[BIG_LEN];
+	u8 got[BIG_LEN];
+	struct fs_file_desc before = fs_open(fs, path);
+	struct fs_file_desc fd = fs_open(fs, path);
+	test_fill(buf, offset, len, seed);
+	CHECK(fs_seek(fs, &fd, offset) == 0);
+	CHECK(fs_write(fs, &fd, buf, len) == 0);
+	CHECK(fs_seek(fs, &before, offset) == 0);
+	CHECK(fs_read(fs, &before, got, len) == 0);
+	CHECK(memcmp(buf, got, len) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+	CHECK(fs_close(fs, &before) == 0);
+}
+
+/*
+ * Checks file i of `NUM_FILES` holds @lens[i] bytes of `test_fill` with i
+ */
+void _check_all(fs_t *fs, usize *lens)
+{
+	char path[32];
+	for (usize i = 0; i < NUM_FILES; ++i) {
+		sprintf(path, "/d/s%lu", i);
+		test_check_file(fs, path, lens[i], i);
+	}
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 4194304", "-b 1024 -s 4194304 -e" };
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+		CHECK(fs_create(fs, "/d", true, 1) == 0);
+
+		// Files sharing a directory block grow a little at a time, so
+		// their entries keep moving to make room
+		char path[32];
+		usize lens[NUM_FILES] = { 0 };
+		for (usize j = 0; j < NUM_FILES; ++j) {
+			sprintf(path, "/d/s%lu", j);
+			CHECK(fs_create(fs, path, false, 1) == 0);
+		}
+		for (usize len = 0; len < SMALL_LEN; len += STEP) {
+			for (usize j = 0; j < NUM_FILES; ++j) {
+				sprintf(path, "/d/s%lu", j);
+				_append(fs, path, len, STEP, j);
+				lens[j] += STEP;
+			}
+			_check_all(fs, lens);
+		}
+
+		// Growing past what fits in an entry moves a file out to
+		// blocks of its own, keeping what it held
+		for (usize j = 0; j < NUM_FILES; j += 3) {
+			sprintf(path, "/d/s%lu", j);
+			_append(fs, path, lens[j], BIG_LEN - lens[j], j);
+			lens[j] = BIG_LEN;
+		}
+		_check_all(fs, lens);
+
+		// A descriptor outlives its file, and isn't taken over by a
+		// new file of the same name
+		test_write_file(fs, "/gone", 100, 1);
+		struct fs_file_desc fd = fs_open(fs, "/gone");
+		u8 buf[100];
+		CHECK(fs_delete(fs, "/gone") == 0);
+		CHECK(fs_read(fs, &fd, buf, 10) == 1);
+		CHECK(fs_write(fs, &fd, buf, 10) == 1);
+		test_write_file(fs, "/gone", 50, 2);
+		CHECK(fs_seek(fs, &fd, 0) == 0);
+		CHECK(fs_read(fs, &fd, buf, 10) == 1);
+		CHECK(fs_write(fs, &fd, buf, 10) == 1);
+		CHECK(fs_close(fs, &fd) == 0);
+		test_check_file(fs, "/gone", 50, 2);
+
+		// A freed entry's bytes don't show up in the next file
+		CHECK(fs_delete(fs, "/d/s1") == 0);
+		CHECK(fs_create(fs, "/d/s1", false, 1) == 0);
+		lens[1] = 0;
+		u8 zeros[100] = { 0 };
+		fd = fs_open(fs, "/d/s1");
+		CHECK(fs_read(fs, &fd, buf, 100) == 0);
+		CHECK(memcmp(buf, zeros, 100) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_MMAP);
+		_check_all(fs, lens);
+		test_check_file(fs, "/gone", 50, 2);
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
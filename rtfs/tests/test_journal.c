@@ -0,0 +1,194 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "test.h"
+
+#define BLK_SIZE 512
+#define NUM_BLKS 1024
+#define JOURNAL_BLK 2
+#define NUM_JOURNAL_BLKS 200
+// Where the logged blocks go, past the journal
+#define DEST_BLK 300
+#define DATA_LEN 50000
+
+/*
+ * Checks that block @blk_num of @fd is all @byte
+ */
+void _check_blk(int fd, usize blk_num, u8 byte)
+{
+	u8 buf[BLK_SIZE];
+	CHECK(pread(fd, buf, BLK_SIZE, blk_num * BLK_SIZE) == BLK_SIZE);
+	for (usize i = 0; i < BLK_SIZE; ++i) {
+		CHECK(buf[i] == byte);
+	}
+}
+
+/*
+ * Overwrites block @blk_num of @fd with junk
+ */
+void _tear(int fd, usize blk_num)
+{
+	u8 junk[BLK_SIZE];
+	memset(junk, 0x77, BLK_SIZE);
+	CHECK(pwrite(fd, junk, BLK_SIZE, blk_num * BLK_SIZE) == BLK_SIZE);
+}
+
+/*
+ * Logs @num_blks blocks, block i all (@byte + i), without writing them in
+ * place, and lets go of the journal as a crash would
+ */
+void _log_blks(int fd, usize num_blks, u8 byte)
+{
+	struct journal *j =
+		journal_new(fd, BLK_SIZE, JOURNAL_BLK, NUM_JOURNAL_BLKS);
+	CHECK(j != NULL);
+	usize *blk_nums = malloc(num_blks * sizeof(*blk_nums));
+	u8 **blks = malloc(num_blks * sizeof(*blks));
+	for (usize i = 0; i < num_blks; ++i) {
+		blk_nums[i] = DEST_BLK + i;
+		blks[i] = malloc(BLK_SIZE);
+		memset(blks[i], byte + i, BLK_SIZE);
+	}
+	CHECK(journal_commit(j, blk_nums, blks, num_blks) == 0);
+	for (usize i = 0; i < num_blks; ++i) {
+		free(blks[i]);
+	}
+	free(blks);
+	free(blk_nums);
+	journal_free(j);
+}
+
+/*
+ * Replays whatever the journal holds, as loading after a crash would
+ */
+void _replay_journal(int fd)
+{
+	struct journal *j =
+		journal_new(fd, BLK_SIZE, JOURNAL_BLK, NUM_JOURNAL_BLKS);
+	CHECK(j != NULL);
+	CHECK(journal_replay(j) == 0);
+	journal_free(j);
+}
+
+/*
+ * Each 32 names of `fs_create_many` commit as a whole, whatever else is lost
+ */
+u8 _create_batches(void)
+{
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	char bufs[96][16];
+	char *names[96];
+	for (usize i = 0; i < 96; ++i) {
+		sprintf(bufs[i], "n%lu", i);
+		names[i] = bufs[i];
+	}
+	CHECK(fs_create_many(fs, "/", names, 32, false, 1, NULL) == 0);
+	CHECK(fs_sync(fs) == 0);
+	CHECK(fs_create_many(fs, "/", names + 32, 64, false, 1, NULL) == 0);
+	return 0;
+}
+
+/*
+ * Writes a new file and part of an old one with every call written through,
+ * the first of those commits coming right after a sync, so each transaction
+ * points at file contents written in the same flush, then crashes
+ */
+u8 _write_after_sync(void)
+{
+	struct fs_load_opts opts = { .write_through = true };
+	fs_t *fs = fs_load(TEST_IMAGE, opts);
+	CHECK(fs != NULL);
+	test_write_file(fs, "/old", DATA_LEN, 1);
+	CHECK(fs_create(fs, "/new", false, 1) == 0);
+	struct fs_file_desc fd = fs_open(fs, "/new");
+	CHECK(fs_sync(fs) == 0);
+	u8 *buf = malloc(DATA_LEN);
+	test_fill(buf, 0, DATA_LEN, 2);
+	CHECK(fs_write(fs, &fd, buf, DATA_LEN) == 0);
+	fd = fs_open(fs, "/old");
+	test_fill(buf, 0, DATA_LEN, 3);
+	CHECK(fs_write(fs, &fd, buf, DATA_LEN / 2) == 0);
+	free(buf);
+	return 0;
+}
+
+int main(void)
+{
+	int fd = open(TEST_IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0);
+	CHECK(ftruncate(fd, NUM_BLKS * BLK_SIZE) == 0);
+	struct journal *j =
+		journal_new(fd, BLK_SIZE, JOURNAL_BLK, NUM_JOURNAL_BLKS);
+	usize capacity = journal_capacity(j);
+	journal_free(j);
+	// Big enough for the descriptor to take several blocks
+	CHECK(capacity > BLK_SIZE / sizeof(usize));
+
+	// A committed transaction is redone
+	_log_blks(fd, capacity, 1);
+	_replay_journal(fd);
+	for (usize i = 0; i < capacity; ++i) {
+		_check_blk(fd, DEST_BLK + i, 1 + i);
+	}
+
+	// One torn in its second descriptor block, or in a logged block, is
+	// dropped whole
+	_log_blks(fd, capacity, 100);
+	_tear(fd, JOURNAL_BLK + 1);
+	_replay_journal(fd);
+	_log_blks(fd, capacity, 100);
+	_tear(fd, JOURNAL_BLK + 10);
+	_replay_journal(fd);
+	for (usize i = 0; i < capacity; ++i) {
+		_check_blk(fd, DEST_BLK + i, 1 + i);
+	}
+
+	// A short transaction after a long one is not mixed up with it
+	_log_blks(fd, 3, 200);
+	_replay_journal(fd);
+	_check_blk(fd, DEST_BLK + 2, 202);
+	_check_blk(fd, DEST_BLK + 3, 4);
+	_replay_journal(fd);
+	_check_blk(fd, DEST_BLK + 2, 202);
+	close(fd);
+
+	test_format("-b 1024 -s 4194304");
+	test_crash_after(_create_batches);
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	char path[32];
+	for (usize batch = 0; batch < 3; ++batch) {
+		sprintf(path, "/n%lu", batch * 32);
+		bool made = fs_create(fs, path, false, 1) == 1;
+		CHECK(batch != 0 || made);
+		for (usize i = batch * 32 + 1; i < (batch + 1) * 32; ++i) {
+			sprintf(path, "/n%lu", i);
+			CHECK(fs_create(fs, path, false, 1) == made);
+		}
+	}
+	CHECK(fs_unload(fs) == 0);
+
+	// New blocks and the metadata pointing at them come back together
+	char *formats[] = { "-b 1024 -s 4194304", "-b 1024 -s 4194304 -e" };
+	u8 *want = malloc(DATA_LEN);
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		test_crash_after(_write_after_sync);
+		fs = test_load(FS_LOAD_CACHED);
+		test_check_file(fs, "/new", DATA_LEN, 2);
+		test_fill(want, 0, DATA_LEN, 1);
+		test_fill(want, 0, DATA_LEN / 2, 3);
+		u8 *buf = malloc(DATA_LEN);
+		struct fs_file_desc fd = fs_open(fs, "/old");
+		CHECK(fs_read(fs, &fd, buf, DATA_LEN) == 0);
+		CHECK(memcmp(buf, want, DATA_LEN) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		free(buf);
+		CHECK(fs_unload(fs) == 0);
+	}
+	free(want);
+	return 0;
+}
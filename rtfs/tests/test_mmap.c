@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LEN 10000
+
+/*
+ * Writes and syncs a file through the mapping, then changes it and makes more
+ * files without syncing
+ */
+u8 _sync_then_change(void)
+{
+	fs_t *fs = test_load(FS_LOAD_MMAP);
+	test_write_file(fs, "/kept", LEN, 1);
+	CHECK(fs_sync(fs) == 0);
+
+	u8 buf[LEN];
+	test_fill(buf, 0, LEN, 2);
+	struct fs_file_desc fd = fs_open(fs, "/kept");
+	CHECK(fs_write(fs, &fd, buf, LEN) == 0);
+	CHECK(fs_create(fs, "/lost", true, 1) == 0);
+	return 0;
+}
+
+/*
+ * Checks that the file is all one version or the other: a write may reach the
+ * file in place, but never half of one
+ */
+void _check_whole(fs_t *fs)
+{
+	u8 buf[LEN];
+	u8 old[LEN];
+	u8 new[LEN];
+	test_fill(old, 0, LEN, 1);
+	test_fill(new, 0, LEN, 2);
+	struct fs_file_desc fd = fs_open(fs, "/kept");
+	CHECK(fs_read(fs, &fd, buf, LEN) == 0);
+	CHECK(memcmp(buf, old, LEN) == 0 || memcmp(buf, new, LEN) == 0);
+	CHECK(fs_close(fs, &fd) == 0);
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 4194304", "-b 4096 -s 8388608 -e" };
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		// What one mode writes, the other reads
+		test_format(formats[i]);
+		fs_t *fs = test_load(FS_LOAD_MMAP);
+		CHECK(fs_create(fs, "/dir", true, 1) == 0);
+		test_write_file(fs, "/dir/big", 100000, 3);
+		test_write_file(fs, "/small", 100, 4);
+		CHECK(fs_unload(fs) == 0);
+		fs = test_load(FS_LOAD_CACHED);
+		test_check_file(fs, "/dir/big", 100000, 3);
+		test_check_file(fs, "/small", 100, 4);
+		test_write_file(fs, "/dir/other", 50000, 5);
+		CHECK(fs_unload(fs) == 0);
+		fs = test_load(FS_LOAD_MMAP);
+		test_check_file(fs, "/dir/other", 50000, 5);
+		CHECK(fs_unload(fs) == 0);
+
+		// The mapping is private: only syncs reach the file
+		test_crash_after(_sync_then_change);
+		fs = test_load(FS_LOAD_CACHED);
+		_check_whole(fs);
+		CHECK(fs_create(fs, "/lost", false, 1) == 0);
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
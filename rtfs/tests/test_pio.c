@@ -0,0 +1,87 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LEN (1 << 20)
+#define NUM_READERS 4
+
+u8 *want;
+
+/*
+ * Reads the shared file at random offsets through a descriptor of its own
+ */
+void *_read_file(void *arg)
+{
+	fs_t *fs = arg;
+	struct fs_file_desc fd = fs_open(fs, "/f");
+	u8 *buf = malloc(LEN);
+	unsigned int seed = (unsigned int) (usize) &fd;
+	for (usize i = 0; i < 200; ++i) {
+		usize offset = (usize) rand_r(&seed) % LEN;
+		usize len = (usize) rand_r(&seed) % (LEN - offset);
+		CHECK(fs_seek(fs, &fd, offset) == 0);
+		CHECK(fs_read(fs, &fd, buf, len) == 0);
+		CHECK(memcmp(buf, want + offset, len) == 0);
+	}
+	free(buf);
+	CHECK(fs_close(fs, &fd) == 0);
+	return NULL;
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 8388608", "-b 4096 -s 8388608 -e" };
+	want = malloc(LEN);
+	u8 *buf = malloc(LEN);
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		// A cache far smaller than the transfers, so long ones go
+		// around it while short ones go through it
+		struct fs_load_opts opts = { .cache_len = 8 };
+		fs_t *fs = fs_load(TEST_IMAGE, opts);
+		CHECK(fs != NULL);
+		test_fill(want, 0, LEN, 1);
+		test_write_file(fs, "/f", LEN, 1);
+		struct fs_file_desc fd = fs_open(fs, "/f");
+		srand(i);
+		for (usize j = 0; j < 300; ++j) {
+			usize offset = (usize) rand() % LEN;
+			usize len = j % 2 == 0
+				? (usize) rand() % (LEN - offset)
+				: (usize) rand() % 100;
+			len = len < LEN - offset ? len : LEN - offset;
+			test_fill(want + offset, offset, len, j);
+			CHECK(fs_seek(fs, &fd, offset) == 0);
+			CHECK(fs_write(fs, &fd, want + offset, len) == 0);
+			if (j % 10 == 0) {
+				CHECK(fs_seek(fs, &fd, 0) == 0);
+				CHECK(fs_read(fs, &fd, buf, LEN) == 0);
+				CHECK(memcmp(buf, want, LEN) == 0);
+			}
+		}
+		CHECK(fs_close(fs, &fd) == 0);
+
+		// Readers share no file position
+		pthread_t threads[NUM_READERS];
+		for (usize j = 0; j < NUM_READERS; ++j) {
+			CHECK(pthread_create(&threads[j], NULL, _read_file, fs)
+			      == 0);
+		}
+		for (usize j = 0; j < NUM_READERS; ++j) {
+			CHECK(pthread_join(threads[j], NULL) == 0);
+		}
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		fd = fs_open(fs, "/f");
+		CHECK(fs_read(fs, &fd, buf, LEN) == 0);
+		CHECK(memcmp(buf, want, LEN) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+	}
+	free(buf);
+	free(want);
+	return 0;
+}
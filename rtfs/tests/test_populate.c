@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "test.h"
+
+// The host tree, made next to `TEST_IMAGE`
+#define HOST_DIR "pop"
+#define BIG_LEN (1536 * 1024)
+#define MID_LEN 20000
+#define NUM_MANY 1500
+#define APPEND_LEN 10000
+
+/*
+ * Writes @len bytes of `test_fill` with @seed to the host file @path
+ */
+void _host_file(char *path, usize len, usize seed)
+{
+	u8 *buf = malloc(len + 1);
+	test_fill(buf, 0, len, seed);
+	FILE *file = fopen(path, "wb");
+	CHECK(file != NULL);
+	CHECK(fwrite(buf, 1, len, file) == len);
+	CHECK(fclose(file) == 0);
+	free(buf);
+}
+
+/*
+ * Makes the host tree: nested directories, one of them empty and one with
+ * many entries, files from empty to bigger than a megabyte, some small enough
+ * to be kept inline, and a symlink, which isn't copied
+ */
+void _make_host_tree(void)
+{
+	CHECK(system("rm -rf " HOST_DIR) == 0);
+	CHECK(mkdir(HOST_DIR, 0755) == 0);
+	CHECK(mkdir(HOST_DIR "/a", 0755) == 0);
+	CHECK(mkdir(HOST_DIR "/a/b", 0755) == 0);
+	CHECK(mkdir(HOST_DIR "/a/b/c", 0755) == 0);
+	CHECK(mkdir(HOST_DIR "/many", 0755) == 0);
+	_host_file(HOST_DIR "/empty", 0, 1);
+	_host_file(HOST_DIR "/small", 2, 2);
+	_host_file(HOST_DIR "/a/i255", 255, 3);
+	_host_file(HOST_DIR "/a/i256", 256, 4);
+	_host_file(HOST_DIR "/a/mid", MID_LEN, 5);
+	_host_file(HOST_DIR "/a/b/big", BIG_LEN, 6);
+	char path[64];
+	for (usize i = 0; i < NUM_MANY; ++i) {
+		sprintf(path, HOST_DIR "/many/file_number_%lu", i);
+		_host_file(path, i % 40, i);
+	}
+	CHECK(symlink("small", HOST_DIR "/link") == 0);
+}
+
+/*
+ * Checks @fs holds the host tree
+ */
+void _check_tree(fs_t *fs)
+{
+	test_check_file(fs, "/empty", 0, 1);
+	test_check_file(fs, "/small", 2, 2);
+	test_check_file(fs, "/a/i255", 255, 3);
+	test_check_file(fs, "/a/i256", 256, 4);
+	test_check_file(fs, "/a/mid", MID_LEN, 5);
+	test_check_file(fs, "/a/b/big", BIG_LEN, 6);
+	char path[64];
+	for (usize i = 0; i < NUM_MANY; ++i) {
+		sprintf(path, "/many/file_number_%lu", i);
+		test_check_file(fs, path, i % 40, i);
+		CHECK(fs_create(fs, path, false, 1) == 1);
+	}
+	// Directories, including the empty one, take new entries
+	CHECK(fs_create(fs, "/a/b/c/new", false, 1) == 0);
+	CHECK(fs_delete(fs, "/a/b/c/new") == 0);
+	CHECK(fs_create(fs, "/link", false, 1) == 0);
+	CHECK(fs_delete(fs, "/link") == 0);
+}
+
+int main(void)
+{
+	char *formats[] = {
+		"-b 512 -s 33554432 -p " HOST_DIR,
+		"-b 4096 -s 33554432 -p " HOST_DIR,
+		"-b 512 -s 33554432 -e -p " HOST_DIR,
+		"-b 4096 -s 33554432 -e --populate " HOST_DIR,
+	};
+	_make_host_tree();
+	u8 *buf = malloc(APPEND_LEN);
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = test_load(i % 2 ? FS_LOAD_MMAP : FS_LOAD_CACHED);
+		_check_tree(fs);
+
+		// The image carries on from there: new files, files growing
+		// past where they were copied to, and deletes
+		test_write_file(fs, "/new", BIG_LEN, 7);
+		test_fill(buf, BIG_LEN, APPEND_LEN, 6);
+		struct fs_file_desc fd = fs_open(fs, "/a/b/big");
+		CHECK(fs_seek(fs, &fd, BIG_LEN) == 0);
+		CHECK(fs_write(fs, &fd, buf, APPEND_LEN) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		for (usize j = 1; j < NUM_MANY; j += 3) {
+			char path[64];
+			sprintf(path, "/many/file_number_%lu", j);
+			CHECK(fs_delete(fs, path) == 0);
+		}
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		test_check_file(fs, "/new", BIG_LEN, 7);
+		test_check_file(fs, "/a/b/big", BIG_LEN + APPEND_LEN, 6);
+		test_check_file(fs, "/a/mid", MID_LEN, 5);
+		CHECK(fs_create(fs, "/many/file_number_1", false, 1) == 0);
+		CHECK(fs_create(fs, "/many/file_number_2", false, 1) == 1);
+		CHECK(fs_unload(fs) == 0);
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define NUM_FILES 6
+#define CHUNK 700
+#define NUM_CHUNKS 300
+#define FILL_LEN 50000
+
+/*
+ * Returns how many files of `FILL_LEN` bytes fit on the disk, deleting them
+ * again
+ */
+usize _count_free(fs_t *fs)
+{
+	char path[32];
+	usize num_files = 0;
+	u8 buf[FILL_LEN] = { 0 };
+	for (;; ++num_files) {
+		sprintf(path, "/fill%lu", num_files);
+		if (fs_create(fs, path, false, 1)) {
+			break;
+		}
+		struct fs_file_desc fd = fs_open(fs, path);
+		u8 ret = fs_write(fs, &fd, buf, FILL_LEN);
+		CHECK(fs_close(fs, &fd) == 0);
+		if (ret) {
+			CHECK(fs_delete(fs, path) == 0);
+			break;
+		}
+	}
+	for (usize i = 0; i < num_files; ++i) {
+		sprintf(path, "/fill%lu", i);
+		CHECK(fs_delete(fs, path) == 0);
+	}
+	return num_files;
+}
+
+/*
+ * Grows `NUM_FILES` files together, a chunk at a time, then closes them
+ */
+void _append_together(fs_t *fs)
+{
+	struct fs_file_desc fds[NUM_FILES];
+	char path[32];
+	for (usize j = 0; j < NUM_FILES; ++j) {
+		sprintf(path, "/a%lu", j);
+		CHECK(fs_create(fs, path, false, 1) == 0);
+		fds[j] = fs_open(fs, path);
+	}
+	u8 buf[CHUNK];
+	for (usize k = 0; k < NUM_CHUNKS; ++k) {
+		for (usize j = 0; j < NUM_FILES; ++j) {
+			test_fill(buf, k * CHUNK, CHUNK, j);
+			CHECK(fs_write(fs, &fds[j], buf, CHUNK) == 0);
+		}
+	}
+	for (usize j = 0; j < NUM_FILES; ++j) {
+		CHECK(fs_close(fs, &fds[j]) == 0);
+	}
+}
+
+/*
+ * Checks the files `_append_together` made, then deletes them
+ */
+void _check_and_delete(fs_t *fs)
+{
+	char path[32];
+	for (usize j = 0; j < NUM_FILES; ++j) {
+		sprintf(path, "/a%lu", j);
+		test_check_file(fs, path, CHUNK * NUM_CHUNKS, j);
+		CHECK(fs_delete(fs, path) == 0);
+	}
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 4194304", "-b 1024 -s 4194304 -e" };
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+		usize num_free = _count_free(fs);
+
+		// Appenders taking turns each keep their own run going, and the
+		// blocks reserved past their ends go back on close
+		_append_together(fs);
+		_check_and_delete(fs);
+		CHECK(_count_free(fs) == num_free);
+		_append_together(fs);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		_check_and_delete(fs);
+		CHECK(_count_free(fs) == num_free);
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
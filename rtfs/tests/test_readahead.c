@@ -0,0 +1,141 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LEN (3 * 1024 * 1024)
+#define NUM_STREAMS 4
+
+u8 *want;
+u8 *want_other;
+volatile bool stop;
+
+/*
+ * Reads @len bytes of @fd from where it is, @step at a time, checking them
+ * against @expect
+ */
+void _stream(fs_t *fs, struct fs_file_desc *fd, u8 *expect, usize offset,
+	     usize len, usize step)
+{
+	u8 *buf = malloc(step);
+	for (usize done = 0; done < len; done += step) {
+		usize n = len - done < step ? len - done : step;
+		CHECK(fs_read(fs, fd, buf, n) == 0);
+		CHECK(memcmp(buf, expect + offset + done, n) == 0);
+	}
+	free(buf);
+}
+
+/*
+ * Rewrites "/y", whose blocks sit between those of "/x", until told to stop
+ */
+void *_rewrite(void *arg)
+{
+	fs_t *fs = arg;
+	struct fs_file_desc fd = fs_open(fs, "/y");
+	u8 *buf = malloc(LEN);
+	for (usize round = 0; !stop; ++round) {
+		for (usize i = 0; i < LEN; ++i) {
+			buf[i] = (u8) (want_other[i] + round);
+		}
+		CHECK(fs_seek(fs, &fd, 0) == 0);
+		CHECK(fs_write(fs, &fd, buf, LEN) == 0);
+	}
+	free(buf);
+	CHECK(fs_close(fs, &fd) == 0);
+	return NULL;
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 16777216", "-b 1024 -s 16777216 -e" };
+	want = malloc(LEN);
+	want_other = malloc(LEN);
+	test_fill(want, 0, LEN, 1);
+	test_fill(want_other, 0, LEN, 2);
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		// Far fewer blocks cached than read ahead at the widest
+		struct fs_load_opts opts = { .cache_len = 8 };
+		fs_t *fs = fs_load(TEST_IMAGE, opts);
+		CHECK(fs != NULL);
+
+		// Appends taking turns, so each file's blocks are scattered
+		CHECK(fs_create(fs, "/x", false, 1) == 0);
+		CHECK(fs_create(fs, "/y", false, 1) == 0);
+		struct fs_file_desc x = fs_open(fs, "/x");
+		struct fs_file_desc y = fs_open(fs, "/y");
+		srand(i);
+		for (usize offset = 0; offset < LEN;) {
+			usize len = 1 + (usize) rand() % 7000;
+			len = len < LEN - offset ? len : LEN - offset;
+			CHECK(fs_write(fs, &x, want + offset, len) == 0);
+			CHECK(fs_write(fs, &y, want_other + offset, len) == 0);
+			offset += len;
+		}
+		CHECK(fs_close(fs, &x) == 0);
+		CHECK(fs_close(fs, &y) == 0);
+		CHECK(fs_sync(fs) == 0);
+
+		// Front to back, in small reads and in big ones
+		x = fs_open(fs, "/x");
+		_stream(fs, &x, want, 0, LEN, 200);
+		CHECK(fs_seek(fs, &x, 0) == 0);
+		_stream(fs, &x, want, 0, LEN, 40000);
+
+		// Jumping about, sometimes carrying on a little way
+		for (usize j = 0; j < 2000; ++j) {
+			usize offset = (usize) rand() % LEN;
+			usize len = 1 + (usize) rand() % 3000;
+			len = len < LEN - offset ? len : LEN - offset;
+			usize more = j % 3 == 0 ? 1500 : 0;
+			more = more < LEN - offset - len ? more : 0;
+			CHECK(fs_seek(fs, &x, offset) == 0);
+			_stream(fs, &x, want, offset, len + more, 300);
+		}
+
+		// Bytes already read ahead are replaced by a write through
+		// another descriptor
+		CHECK(fs_seek(fs, &x, 0) == 0);
+		_stream(fs, &x, want, 0, LEN / 2, 1000);
+		struct fs_file_desc writer = fs_open(fs, "/x");
+		test_fill(want + LEN / 2, LEN / 2, 100000, 3);
+		CHECK(fs_seek(fs, &writer, LEN / 2) == 0);
+		CHECK(fs_write(fs, &writer, want + LEN / 2, 100000) == 0);
+		CHECK(fs_close(fs, &writer) == 0);
+		_stream(fs, &x, want, LEN / 2, LEN / 2, 1000);
+		CHECK(fs_close(fs, &x) == 0);
+
+		// Several streams over one file while another is rewritten
+		pthread_t thread;
+		stop = false;
+		CHECK(pthread_create(&thread, NULL, _rewrite, fs) == 0);
+		struct fs_file_desc streams[NUM_STREAMS];
+		for (usize j = 0; j < NUM_STREAMS; ++j) {
+			streams[j] = fs_open(fs, "/x");
+		}
+		for (usize offset = 0; offset < LEN; offset += 50000) {
+			usize len = 50000 < LEN - offset ? 50000 : LEN - offset;
+			for (usize j = 0; j < NUM_STREAMS; ++j) {
+				_stream(fs, &streams[j], want, offset, len,
+					500 * (j + 1));
+			}
+		}
+		for (usize j = 0; j < NUM_STREAMS; ++j) {
+			CHECK(fs_close(fs, &streams[j]) == 0);
+		}
+		stop = true;
+		CHECK(pthread_join(thread, NULL) == 0);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		x = fs_open(fs, "/x");
+		_stream(fs, &x, want, 0, LEN, LEN);
+		CHECK(fs_close(fs, &x) == 0);
+		CHECK(fs_unload(fs) == 0);
+	}
+	free(want_other);
+	free(want);
+	return 0;
+}
@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LEN 300000
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 4194304", "-b 1024 -s 4194304 -e" };
+	u8 *want = malloc(LEN);
+	test_fill(want, 0, LEN, 1);
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+		test_write_file(fs, "/f", LEN, 1);
+
+		// Jumping around, backwards as well as forwards
+		struct fs_file_desc fd = fs_open(fs, "/f");
+		u8 buf[2000];
+		srand(i);
+		for (usize j = 0; j < 500; ++j) {
+			usize offset = (usize) rand() % (LEN - sizeof(buf));
+			usize len = 1 + (usize) rand() % sizeof(buf);
+			CHECK(fs_seek(fs, &fd, offset) == 0);
+			CHECK(fs_read(fs, &fd, buf, len) == 0);
+			CHECK(memcmp(buf, want + offset, len) == 0);
+		}
+
+		// A descriptor opened earlier sees blocks appended through
+		// another one
+		struct fs_file_desc appender = fs_open(fs, "/f");
+		CHECK(fs_seek(fs, &appender, LEN) == 0);
+		u8 tail[5000];
+		test_fill(tail, LEN, sizeof(tail), 1);
+		CHECK(fs_write(fs, &appender, tail, sizeof(tail)) == 0);
+		CHECK(fs_close(fs, &appender) == 0);
+		CHECK(fs_seek(fs, &fd, LEN + 1000) == 0);
+		CHECK(fs_read(fs, &fd, buf, sizeof(buf)) == 0);
+		CHECK(memcmp(buf, tail + 1000, sizeof(buf)) == 0);
+
+		// Seeking past the end leaves a gap that reads as zeros
+		usize end = LEN + sizeof(tail);
+		usize gap = 10000;
+		CHECK(fs_seek(fs, &fd, end + gap) == 0);
+		CHECK(fs_write(fs, &fd, tail, 100) == 0);
+		CHECK(fs_seek(fs, &fd, end) == 0);
+		u8 zeros[10000] = { 0 };
+		u8 got[10000 + 100];
+		CHECK(fs_read(fs, &fd, got, sizeof(got)) == 0);
+		CHECK(memcmp(got, zeros, gap) == 0);
+		CHECK(memcmp(got + gap, tail, 100) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+	}
+	free(want);
+	return 0;
+}
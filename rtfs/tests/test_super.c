@@ -0,0 +1,68 @@
+#include <stdio.h>
+
+#include "test.h"
+
+#define NUM_FILES 40
+#define LEN 6000
+
+/*
+ * Makes half the files and syncs, then makes the rest and crashes
+ */
+u8 _sync_half(void)
+{
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	char path[32];
+	for (usize i = 0; i < NUM_FILES; ++i) {
+		sprintf(path, "/f%lu", i);
+		test_write_file(fs, path, LEN, i);
+		if (i == NUM_FILES / 2 - 1) {
+			CHECK(fs_sync(fs) == 0);
+		}
+	}
+	return 0;
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 4194304", "-b 1024 -s 4194304 -e" };
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+
+		// Where allocation left off is kept across loads
+		char path[32];
+		for (usize round = 0; round < 3; ++round) {
+			fs_t *fs = test_load(FS_LOAD_CACHED);
+			for (usize j = 0; j < 5; ++j) {
+				sprintf(path, "/r%lu_%lu", round, j);
+				test_write_file(fs, path, LEN, round + j);
+			}
+			CHECK(fs_unload(fs) == 0);
+		}
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+		for (usize round = 0; round < 3; ++round) {
+			for (usize j = 0; j < 5; ++j) {
+				sprintf(path, "/r%lu_%lu", round, j);
+				test_check_file(fs, path, LEN, round + j);
+			}
+		}
+		CHECK(fs_unload(fs) == 0);
+
+		// After a crash, nothing synced is handed out again
+		test_crash_after(_sync_half);
+		fs = test_load(FS_LOAD_CACHED);
+		for (usize j = 0; j < NUM_FILES; ++j) {
+			sprintf(path, "/new%lu", j);
+			test_write_file(fs, path, LEN, 100 + j);
+		}
+		for (usize j = 0; j < NUM_FILES / 2; ++j) {
+			sprintf(path, "/f%lu", j);
+			test_check_file(fs, path, LEN, j);
+		}
+		for (usize j = 0; j < NUM_FILES; ++j) {
+			sprintf(path, "/new%lu", j);
+			test_check_file(fs, path, LEN, 100 + j);
+		}
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
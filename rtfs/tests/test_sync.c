@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "test.h"
+
+#define LEN 20000
+
+/*
+ * Writes "/synced" a byte at a time, then fsyncs it without closing it
+ */
+u8 _fsync_without_close(void)
+{
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	CHECK(fs_create(fs, "/synced", false, 1) == 0);
+	struct fs_file_desc fd = fs_open(fs, "/synced");
+	u8 buf[LEN];
+	test_fill(buf, 0, LEN, 1);
+	for (usize i = 0; i < LEN; ++i) {
+		CHECK(fs_write(fs, &fd, buf + i, 1) == 0);
+	}
+	CHECK(fs_fsync(fs, &fd) == 0);
+	return 0;
+}
+
+/*
+ * Closes "/closed" without syncing anything else
+ */
+u8 _close(void)
+{
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	test_write_file(fs, "/closed", LEN, 2);
+	return 0;
+}
+
+/*
+ * Makes "/through" with every call written through, then never syncs
+ */
+u8 _write_through(void)
+{
+	struct fs_load_opts opts = { .write_through = true };
+	fs_t *fs = fs_load(TEST_IMAGE, opts);
+	CHECK(fs != NULL);
+	CHECK(fs_create(fs, "/dir", true, 1) == 0);
+	CHECK(fs_create(fs, "/dir/through", false, 1) == 0);
+	struct fs_file_desc fd = fs_open(fs, "/dir/through");
+	u8 buf[LEN];
+	test_fill(buf, 0, LEN, 3);
+	CHECK(fs_write(fs, &fd, buf, LEN / 2) == 0);
+	CHECK(fs_write(fs, &fd, buf + LEN / 2, LEN / 2) == 0);
+	return 0;
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 4194304", "-b 1024 -s 4194304 -e" };
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		test_crash_after(_fsync_without_close);
+		test_crash_after(_close);
+		test_crash_after(_write_through);
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+		test_check_file(fs, "/synced", LEN, 1);
+		test_check_file(fs, "/closed", LEN, 2);
+		test_check_file(fs, "/dir/through", LEN, 3);
+
+		// Small writes gathered in the cache read back in place
+		struct fs_file_desc fd = fs_open(fs, "/closed");
+		u8 want[LEN];
+		test_fill(want, 0, LEN, 2);
+		for (usize j = 0; j < LEN; j += 97) {
+			CHECK(fs_seek(fs, &fd, j) == 0);
+			want[j] = (u8) j;
+			CHECK(fs_write(fs, &fd, want + j, 1) == 0);
+		}
+		u8 buf[LEN];
+		CHECK(fs_seek(fs, &fd, 0) == 0);
+		CHECK(fs_read(fs, &fd, buf, LEN) == 0);
+		CHECK(memcmp(buf, want, LEN) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		fd = fs_open(fs, "/closed");
+		CHECK(fs_read(fs, &fd, buf, LEN) == 0);
+		CHECK(memcmp(buf, want, LEN) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+	}
+	return 0;
+}
@@ -0,0 +1,185 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define OTHER_IMAGE "other.img"
+#define NUM_THREADS 4
+#define NUM_ROUNDS 30
+#define LEN 9000
+#define NUM_OPENS 2000
+
+volatile bool stop;
+
+struct _worker_args {
+	fs_t *fs;
+	usize id;
+};
+
+/*
+ * Rewrites files of its own, in a directory every worker makes files in
+ */
+void *_work(void *arg)
+{
+	struct _worker_args *args = arg;
+	char path[64];
+	u8 buf[LEN];
+	u8 got[LEN];
+	for (usize round = 0; round < NUM_ROUNDS; ++round) {
+		sprintf(path, "/d/f%lu_%lu", args->id, round % 3);
+		fs_delete(args->fs, path);
+		CHECK(fs_create(args->fs, path, false, 1) == 0);
+		struct fs_file_desc fd = fs_open(args->fs, path);
+		test_fill(buf, 0, LEN, args->id * NUM_ROUNDS + round);
+		CHECK(fs_write(args->fs, &fd, buf, LEN) == 0);
+		CHECK(fs_seek(args->fs, &fd, 0) == 0);
+		CHECK(fs_read(args->fs, &fd, got, LEN) == 0);
+		CHECK(memcmp(buf, got, LEN) == 0);
+		CHECK(fs_close(args->fs, &fd) == 0);
+	}
+	return NULL;
+}
+
+/*
+ * Runs `NUM_THREADS` workers on @fs at once
+ */
+void _run_workers(fs_t *fs)
+{
+	pthread_t threads[NUM_THREADS];
+	struct _worker_args args[NUM_THREADS];
+	for (usize i = 0; i < NUM_THREADS; ++i) {
+		args[i] = (struct _worker_args) { .fs = fs, .id = i };
+		CHECK(pthread_create(&threads[i], NULL, _work, &args[i]) == 0);
+	}
+	for (usize i = 0; i < NUM_THREADS; ++i) {
+		CHECK(pthread_join(threads[i], NULL) == 0);
+	}
+}
+
+/*
+ * Checks the files the workers left last
+ */
+void _check_workers(fs_t *fs)
+{
+	char path[64];
+	usize first_round = NUM_ROUNDS - 3;
+	for (usize id = 0; id < NUM_THREADS; ++id) {
+		for (usize round = first_round; round < NUM_ROUNDS; ++round) {
+			sprintf(path, "/d/f%lu_%lu", id, round % 3);
+			test_check_file(fs, path, LEN, id * NUM_ROUNDS + round);
+		}
+	}
+}
+
+/*
+ * Deletes and makes "/r" again, over and over, until told to stop
+ */
+void *_recreate(void *arg)
+{
+	fs_t *fs = arg;
+	while (!stop) {
+		fs_delete(fs, "/r");
+		test_write_file(fs, "/r", LEN, 2);
+	}
+	return NULL;
+}
+
+/*
+ * Overwrites the super block word at byte @offset of `TEST_IMAGE` with @word
+ */
+void _set_super_word(usize offset, usize word)
+{
+	int fd = open(TEST_IMAGE, O_RDWR);
+	CHECK(fd >= 0);
+	CHECK(pwrite(fd, &word, sizeof(word), offset) == sizeof(word));
+	close(fd);
+}
+
+int main(void)
+{
+	// Two images loaded at once, each used from several threads
+	test_format("-b 1024 -s 4194304 -e");
+	CHECK(rename(TEST_IMAGE, OTHER_IMAGE) == 0);
+	test_format("-b 4096 -s 8388608");
+	struct fs_load_opts opts = { 0 };
+	fs_t *fs = test_load(FS_LOAD_CACHED);
+	fs_t *other = fs_load(OTHER_IMAGE, opts);
+	CHECK(other != NULL);
+	CHECK(fs_create(fs, "/d", true, 1) == 0);
+	CHECK(fs_create(other, "/d", true, 1) == 0);
+	test_write_file(other, "/only_other", 100, 1);
+	_run_workers(fs);
+	_run_workers(other);
+	CHECK(fs_delete(fs, "/only_other") == 1);
+	CHECK(fs_unload(other) == 0);
+	CHECK(fs_unload(fs) == 0);
+	fs = test_load(FS_LOAD_MMAP);
+	_check_workers(fs);
+	CHECK(fs_unload(fs) == 0);
+	other = fs_load(OTHER_IMAGE, opts);
+	CHECK(other != NULL);
+	_check_workers(other);
+	test_check_file(other, "/only_other", 100, 1);
+	CHECK(fs_unload(other) == 0);
+
+	// Files that aren't there open as descriptors every call fails on
+	fs = test_load(FS_LOAD_CACHED);
+	char *missing[] = { "/none", "/none/f", "/d/none", "/d/f0_0/f", "/" };
+	for (usize i = 0; i < sizeof(missing) / sizeof(*missing); ++i) {
+		struct fs_file_desc fd = fs_open(fs, missing[i]);
+		u8 buf[16] = { 0 };
+		struct fs_io_vec vec = { .offset = 0, .buf = buf, .len = 16 };
+		struct fs_view view;
+		usize pos;
+		CHECK(fs_write(fs, &fd, buf, 16) == 1);
+		CHECK(fs_read(fs, &fd, buf, 16) == 1);
+		CHECK(fs_writev(fs, &fd, &vec, 1) == 1);
+		CHECK(fs_readv(fs, &fd, &vec, 1) == 1);
+		CHECK(fs_read_view(fs, &fd, 16, &view, 1) == 0);
+		CHECK(fs_seek(fs, &fd, 0) == 1);
+		CHECK(fs_seek_data(fs, &fd, 0, &pos) == 1);
+		CHECK(fs_punch_hole(fs, &fd, 0, 16) == 1);
+		CHECK(fs_submit_read(fs, &fd, vec, NULL) == 1);
+		CHECK(fs_fsync(fs, &fd) == 1);
+		CHECK(fs_close(fs, &fd) == 1);
+	}
+	CHECK(fs_delete(fs, "/none") == 1);
+
+	// Opening a file as it is deleted either finds it or fails cleanly
+	test_write_file(fs, "/r", LEN, 2);
+	pthread_t thread;
+	stop = false;
+	CHECK(pthread_create(&thread, NULL, _recreate, fs) == 0);
+	usize num_opened = 0;
+	for (usize i = 0; i < NUM_OPENS; ++i) {
+		struct fs_file_desc fd = fs_open(fs, "/r");
+		if (fd.inode_num == 0) {
+			CHECK(fs_close(fs, &fd) == 1);
+			continue;
+		}
+		num_opened += 1;
+		u8 buf[LEN];
+		fs_read(fs, &fd, buf, LEN);
+		fs_close(fs, &fd);
+	}
+	stop = true;
+	CHECK(pthread_join(thread, NULL) == 0);
+	CHECK(num_opened > 0);
+	CHECK(fs_unload(fs) == 0);
+
+	// Images that can't be loaded give NULL rather than a crash
+	CHECK(fs_load("missing.img", opts) == NULL);
+	test_format("-b 1024 -s 4194304");
+	_set_super_word(sizeof(usize), 64);
+	CHECK(fs_load(TEST_IMAGE, opts) == NULL);
+	test_format("-b 1024 -s 4194304");
+	CHECK(truncate(TEST_IMAGE, 40) == 0);
+	CHECK(fs_load(TEST_IMAGE, opts) == NULL);
+	CHECK(truncate(TEST_IMAGE, 0) == 0);
+	CHECK(fs_load(TEST_IMAGE, opts) == NULL);
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LEN 200000
+#define NUM_VECS 64
+#define NUM_FILES 4
+#define SMALL_LEN 100
+// More requests than a batch could keep track of on the stack
+#define NUM_REQS 100000
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 8388608", "-b 1024 -s 8388608 -e" };
+	u8 *want = malloc(LEN);
+	u8 *buf = malloc(LEN);
+	for (usize i = 0; i < sizeof(formats) / sizeof(*formats); ++i) {
+		test_format(formats[i]);
+		fs_t *fs = test_load(FS_LOAD_CACHED);
+
+		// Ranges in no particular order, the last ones past the end
+		test_fill(want, 0, LEN, 1);
+		test_write_file(fs, "/v", LEN / 2, 1);
+		struct fs_file_desc fd = fs_open(fs, "/v");
+		struct fs_io_vec vecs[NUM_VECS];
+		usize piece = LEN / NUM_VECS;
+		for (usize j = 0; j < NUM_VECS; ++j) {
+			usize k = (j * 37) % NUM_VECS;
+			vecs[j] = (struct fs_io_vec) {
+				.offset = k * piece,
+				.buf = want + k * piece,
+				.len = piece,
+			};
+		}
+		CHECK(fs_writev(fs, &fd, vecs, NUM_VECS) == 0);
+		for (usize j = 0; j < NUM_VECS; ++j) {
+			vecs[j].buf = buf + vecs[j].offset;
+		}
+		memset(buf, 0, LEN);
+		CHECK(fs_readv(fs, &fd, vecs, NUM_VECS) == 0);
+		CHECK(memcmp(buf, want, piece * NUM_VECS) == 0);
+		// Neither moved the position
+		CHECK(fs_read(fs, &fd, buf, 10) == 0);
+		CHECK(memcmp(buf, want, 10) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+
+		// A batch across files, some of them small enough to be kept
+		// in their directory entries
+		struct fs_file_desc fds[NUM_FILES];
+		char path[32];
+		for (usize j = 0; j < NUM_FILES; ++j) {
+			sprintf(path, "/b%lu", j);
+			test_write_file(fs, path, j % 2 ? SMALL_LEN : LEN, j);
+			fds[j] = fs_open(fs, path);
+		}
+		struct fs_batch_req *reqs = malloc(NUM_REQS * sizeof(*reqs));
+		u8 *got = malloc(NUM_REQS);
+		srand(i);
+		for (usize j = 0; j < NUM_REQS; ++j) {
+			usize k = (usize) rand() % NUM_FILES;
+			usize len = k % 2 ? SMALL_LEN : LEN;
+			reqs[j] = (struct fs_batch_req) {
+				.f = &fds[k],
+				.vec = {
+					.offset = (usize) rand() % len,
+					.buf = got + j,
+					.len = 1,
+				},
+			};
+		}
+		CHECK(fs_read_batch(fs, reqs, NUM_REQS) == 0);
+		for (usize j = 0; j < NUM_REQS; ++j) {
+			u8 byte;
+			usize k = reqs[j].f - fds;
+			test_fill(&byte, reqs[j].vec.offset, 1, k);
+			CHECK(got[j] == byte);
+		}
+		CHECK(fs_read_batch(fs, reqs, 0) == 0);
+		for (usize j = 0; j < NUM_FILES; ++j) {
+			CHECK(fs_close(fs, &fds[j]) == 0);
+		}
+		free(got);
+		free(reqs);
+		CHECK(fs_unload(fs) == 0);
+
+		fs = test_load(FS_LOAD_CACHED);
+		test_check_file(fs, "/v", LEN, 1);
+		CHECK(fs_unload(fs) == 0);
+	}
+	free(buf);
+	free(want);
+	return 0;
+}
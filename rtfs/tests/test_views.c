@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define LEN 40000
+#define MAX_VIEWS 4
+#define SMALL_LEN 100
+
+/*
+ * Views @len bytes of @fd from @offset, a few blocks at a time, checking them
+ * against @want as they come
+ */
+void _check_views(fs_t *fs, struct fs_file_desc *fd, u8 *want, usize offset,
+		  usize len)
+{
+	struct fs_view views[MAX_VIEWS];
+	CHECK(fs_seek(fs, fd, offset) == 0);
+	usize done = 0;
+	while (done < len) {
+		usize n = fs_read_view(fs, fd, len - done, views, MAX_VIEWS);
+		CHECK(n > 0 && n <= MAX_VIEWS);
+		for (usize i = 0; i < n; ++i) {
+			CHECK(memcmp(views[i].data, want + offset + done,
+				     views[i].len) == 0);
+			done += views[i].len;
+		}
+		fs_release_views(fs, views, n);
+	}
+	CHECK(done == len);
+}
+
+int main(void)
+{
+	char *formats[] = { "-b 1024 -s 4194304", "-b 1024 -s 4194304 -e" };
+	enum fs_load_mode modes[] = { FS_LOAD_CACHED, FS_LOAD_MMAP };
+	u8 *want = malloc(LEN);
+	u8 *buf = malloc(LEN);
+	// Each format, loaded each way
+	for (usize i = 0; i < 4; ++i) {
+		test_format(formats[i % 2]);
+		struct fs_load_opts opts = { .mode = modes[i / 2],
+					     .cache_len = 16 };
+		fs_t *fs = fs_load(TEST_IMAGE, opts);
+		CHECK(fs != NULL);
+		test_write_file(fs, "/v", LEN, 1);
+		test_write_file(fs, "/small", SMALL_LEN, 2);
+		test_fill(want, 0, LEN, 1);
+
+		struct fs_file_desc fd = fs_open(fs, "/v");
+		srand(i);
+		for (usize j = 0; j < 200; ++j) {
+			usize offset = (usize) rand() % LEN;
+			usize len = 1 + (usize) rand() % (LEN - offset);
+			_check_views(fs, &fd, want, offset, len);
+		}
+
+		// Held views keep their blocks while the rest of the file goes
+		// through the cache, and show writes made meanwhile
+		struct fs_view views[MAX_VIEWS];
+		CHECK(fs_seek(fs, &fd, 0) == 0);
+		usize n = fs_read_view(fs, &fd, LEN, views, MAX_VIEWS);
+		CHECK(n == MAX_VIEWS);
+		struct fs_file_desc other = fs_open(fs, "/v");
+		CHECK(fs_read(fs, &other, buf, LEN) == 0);
+		CHECK(memcmp(buf, want, LEN) == 0);
+		u8 byte = (u8) ~want[5];
+		CHECK(fs_seek(fs, &other, 5) == 0);
+		CHECK(fs_write(fs, &other, &byte, 1) == 0);
+		want[5] = byte;
+		CHECK(fs_close(fs, &other) == 0);
+		usize done = 0;
+		for (usize j = 0; j < n; ++j) {
+			CHECK(memcmp(views[j].data, want + done, views[j].len)
+			      == 0);
+			done += views[j].len;
+		}
+		fs_release_views(fs, views, n);
+		// The position moved past what was viewed
+		CHECK(fs_read(fs, &fd, buf, 10) == 0);
+		CHECK(memcmp(buf, want + done, 10) == 0);
+		CHECK(fs_close(fs, &fd) == 0);
+
+		// A small file is viewed in its directory entry
+		u8 small[SMALL_LEN];
+		test_fill(small, 0, SMALL_LEN, 2);
+		fd = fs_open(fs, "/small");
+		_check_views(fs, &fd, small, 0, SMALL_LEN);
+		_check_views(fs, &fd, small, 50, 30);
+		CHECK(fs_close(fs, &fd) == 0);
+		CHECK(fs_unload(fs) == 0);
+	}
+	free(buf);
+	free(want);
+	return 0;
+}